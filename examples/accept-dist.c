@@ -0,0 +1,613 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Connection distribution benchmark. Compares two ways of spreading new
+ * TCP connections over a set of worker threads, each with its own ring:
+ *
+ *   ring	A single acceptor ring runs a multishot direct accept, and
+ *		hands each new connection to a worker by passing the direct
+ *		descriptor to the worker ring with MSG_RING. The socket never
+ *		gets a normal file descriptor. The worker is picked either
+ *		round-robin, or as the one with the fewest connections open.
+ *
+ *   reuseport	Each worker has its own SO_REUSEPORT listening socket and
+ *		runs a multishot direct accept on it, the kernel picks the
+ *		worker by hashing the connection.
+ *
+ * Workers echo what they receive until the client closes. Load comes from
+ * client threads in the same process, which each loop over connecting,
+ * sending a small request, waiting for the echo and closing the
+ * connection. Connections are closed with a RST, so no TIME_WAIT sockets
+ * pile up.
+ *
+ * Prints a single line of key=value pairs: connections per second, the
+ * connection setup latency percentiles, from calling connect(2) to the
+ * echo of the first request arriving, and the number of connections each
+ * worker served.
+ *
+ * Usage: ./accept-dist [-m ring|reuseport] [-P rr|least] [-w workers]
+ *			[-c clients] [-t seconds] [-p port]
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+#define MAX_WORKERS	64
+#define MAX_CONNS	4096
+#define MSG_SIZE	32
+#define BUF_SIZE	64
+#define QD		256
+
+enum {
+	OP_ACCEPT = 1,
+	OP_PASS,
+	OP_NEWCONN,
+	OP_RECV,
+	OP_SEND,
+	OP_CLOSE,
+};
+
+enum {
+	MODE_RING,
+	MODE_REUSEPORT,
+};
+
+enum {
+	POLICY_RR,
+	POLICY_LEAST,
+};
+
+struct worker {
+	pthread_t thread;
+	int idx;
+	struct io_uring ring;
+	int listen_fd;
+	/* connections currently open, for the least-connections policy */
+	int active;
+	unsigned long served;
+	char *bufs;
+};
+
+static int mode = MODE_RING;
+static int policy = POLICY_RR;
+static int nr_workers = 4;
+static int nr_clients = 8;
+static int runtime = 5;
+static int port = 9300;
+
+static struct worker workers[MAX_WORKERS];
+static pthread_barrier_t setup_barrier;
+/* clients are stopped first, so they don't wait on stopped workers */
+static volatile int stop_clients, stop;
+static int failed;
+
+/* rejected by a full worker file table, or failed to pass */
+static unsigned long dropped;
+
+struct client {
+	pthread_t thread;
+	unsigned long conns;
+	unsigned long errors;
+	/* each client thread keeps its own */
+	struct lat_hist lat;
+};
+
+static struct client *clients;
+
+static uint64_t encode(int op, int idx)
+{
+	return ((uint64_t) op << 32) | (uint32_t) idx;
+}
+
+static struct io_uring_sqe *get_sqe(struct io_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(ring);
+	if (!sqe) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+	}
+	return sqe;
+}
+
+static int setup_listen(int reuseport)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int fd, val = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	if (reuseport &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
+		perror("SO_REUSEPORT");
+		close(fd);
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(fd, 4096)) {
+		perror("bind/listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int setup_ring(struct io_uring *ring)
+{
+	struct io_uring_params p = { };
+	int ret;
+
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+		  IORING_SETUP_SUBMIT_ALL;
+	ret = io_uring_queue_init_params(QD, ring, &p);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return ret;
+	}
+	ret = io_uring_register_files_sparse(ring, MAX_CONNS);
+	if (ret) {
+		fprintf(stderr, "register_files_sparse: %s\n", strerror(-ret));
+		io_uring_queue_exit(ring);
+	}
+	return ret;
+}
+
+static void add_accept(struct io_uring *ring, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ring);
+	io_uring_prep_multishot_accept_direct(sqe, fd, NULL, NULL, 0);
+	io_uring_sqe_set_data64(sqe, encode(OP_ACCEPT, 0));
+}
+
+static void add_close(struct io_uring *ring, int slot)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ring);
+	io_uring_prep_close_direct(sqe, slot);
+	sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+	io_uring_sqe_set_data64(sqe, encode(OP_CLOSE, slot));
+}
+
+static void worker_recv(struct worker *w, int slot)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(&w->ring);
+	io_uring_prep_recv(sqe, slot, w->bufs + slot * BUF_SIZE, BUF_SIZE, 0);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data64(sqe, encode(OP_RECV, slot));
+}
+
+static void worker_close(struct worker *w, int slot)
+{
+	add_close(&w->ring, slot);
+	__atomic_fetch_sub(&w->active, 1, __ATOMIC_RELAXED);
+}
+
+static void worker_newconn(struct worker *w, int slot)
+{
+	if (slot < 0) {
+		if (slot != -ENFILE)
+			fprintf(stderr, "worker %d: new conn: %s\n", w->idx,
+				strerror(-slot));
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&w->active, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	w->served++;
+	worker_recv(w, slot);
+}
+
+static void worker_cqe(void *data, struct io_uring_cqe *cqe)
+{
+	struct worker *w = data;
+	int op = cqe->user_data >> 32;
+	int slot = cqe->user_data & 0xffffffff;
+	struct io_uring_sqe *sqe;
+
+	switch (op) {
+	case OP_ACCEPT:
+		/* in reuseport mode, the worker does its own accepting */
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			add_accept(&w->ring, w->listen_fd);
+		if (cqe->res < 0) {
+			if (cqe->res != -ENFILE)
+				fprintf(stderr, "accept: %s\n",
+					strerror(-cqe->res));
+			break;
+		}
+		__atomic_fetch_add(&w->active, 1, __ATOMIC_RELAXED);
+		worker_newconn(w, cqe->res);
+		break;
+	case OP_NEWCONN:
+		worker_newconn(w, cqe->res);
+		break;
+	case OP_RECV:
+		if (cqe->res <= 0) {
+			worker_close(w, slot);
+			break;
+		}
+		sqe = get_sqe(&w->ring);
+		io_uring_prep_send(sqe, slot, w->bufs + slot * BUF_SIZE,
+				   cqe->res, MSG_NOSIGNAL);
+		sqe->flags |= IOSQE_FIXED_FILE;
+		io_uring_sqe_set_data64(sqe, encode(OP_SEND, slot));
+		break;
+	case OP_SEND:
+		if (cqe->res < 0)
+			worker_close(w, slot);
+		else
+			worker_recv(w, slot);
+		break;
+	case OP_CLOSE:
+		break;
+	}
+}
+
+static void run_ring(struct io_uring *ring, void (*fn)(void *,
+		     struct io_uring_cqe *), void *data)
+{
+	struct __kernel_timespec ts = { .tv_nsec = 100000000 };
+
+	while (!stop) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, count = 0;
+		int ret;
+
+		ret = io_uring_submit_and_wait_timeout(ring, &cqe, 1, &ts, NULL);
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			failed = 1;
+			stop = 1;
+			break;
+		}
+		io_uring_for_each_cqe(ring, head, cqe) {
+			fn(data, cqe);
+			count++;
+		}
+		io_uring_cq_advance(ring, count);
+	}
+}
+
+static void *worker_fn(void *data)
+{
+	struct worker *w = data;
+	int ret;
+
+	/* DEFER_TASKRUN rings must be set up by the thread using them */
+	ret = setup_ring(&w->ring);
+	if (!ret && mode == MODE_REUSEPORT) {
+		w->listen_fd = setup_listen(1);
+		if (w->listen_fd < 0)
+			ret = 1;
+		else
+			add_accept(&w->ring, w->listen_fd);
+	}
+	if (ret)
+		failed = 1;
+	pthread_barrier_wait(&setup_barrier);
+	if (ret)
+		return NULL;
+
+	run_ring(&w->ring, worker_cqe, w);
+	io_uring_queue_exit(&w->ring);
+	if (mode == MODE_REUSEPORT)
+		close(w->listen_fd);
+	return NULL;
+}
+
+static int pick_worker(void)
+{
+	static unsigned int next;
+	int i, best, best_active;
+
+	if (policy == POLICY_RR)
+		return next++ % nr_workers;
+
+	best = 0;
+	best_active = __atomic_load_n(&workers[0].active, __ATOMIC_RELAXED);
+	for (i = 1; i < nr_workers; i++) {
+		int active = __atomic_load_n(&workers[i].active,
+					     __ATOMIC_RELAXED);
+
+		if (active < best_active) {
+			best = i;
+			best_active = active;
+		}
+	}
+	return best;
+}
+
+struct acceptor {
+	struct io_uring ring;
+	int listen_fd;
+};
+
+/*
+ * Pass the accepted direct descriptor to the worker ring, and close our
+ * slot once that is done. If passing it fails, the linked close is
+ * cancelled and the failed pass closes the slot instead.
+ */
+static void acceptor_cqe(void *data, struct io_uring_cqe *cqe)
+{
+	struct acceptor *a = data;
+	int op = cqe->user_data >> 32;
+	int idx = cqe->user_data & 0xffffffff;
+	struct io_uring_sqe *sqe;
+	struct worker *w;
+	int slot;
+
+	switch (op) {
+	case OP_ACCEPT:
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			add_accept(&a->ring, a->listen_fd);
+		if (cqe->res < 0) {
+			if (cqe->res != -ENFILE)
+				fprintf(stderr, "accept: %s\n",
+					strerror(-cqe->res));
+			break;
+		}
+		slot = cqe->res;
+		w = &workers[pick_worker()];
+		__atomic_fetch_add(&w->active, 1, __ATOMIC_RELAXED);
+
+		sqe = get_sqe(&a->ring);
+		io_uring_prep_msg_ring_fd_alloc(sqe, w->ring.ring_fd, slot,
+						encode(OP_NEWCONN, 0), 0);
+		sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data64(sqe, encode(OP_PASS,
+						(w->idx << 16) | slot));
+		add_close(&a->ring, slot);
+		break;
+	case OP_PASS:
+		fprintf(stderr, "msg_ring: %s\n", strerror(-cqe->res));
+		w = &workers[idx >> 16];
+		__atomic_fetch_sub(&w->active, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		add_close(&a->ring, idx & 0xffff);
+		break;
+	case OP_CLOSE:
+		/* cancelled link after a failed pass */
+		break;
+	}
+}
+
+static void *acceptor_fn(void *data)
+{
+	struct acceptor *a = data;
+	int ret = 1;
+
+	a->listen_fd = setup_listen(0);
+	if (a->listen_fd >= 0) {
+		ret = setup_ring(&a->ring);
+		if (ret)
+			close(a->listen_fd);
+	}
+	if (ret)
+		failed = 1;
+	pthread_barrier_wait(&setup_barrier);
+	if (ret)
+		return NULL;
+
+	add_accept(&a->ring, a->listen_fd);
+	run_ring(&a->ring, acceptor_cqe, a);
+	io_uring_queue_exit(&a->ring);
+	close(a->listen_fd);
+	return NULL;
+}
+
+static void *client_fn(void *data)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	struct timeval tv = { .tv_sec = 1 };
+	struct client *c = data;
+	char buf[MSG_SIZE] = { };
+
+	while (!stop_clients) {
+		uint64_t start = now_ns(), lat;
+		int fd, val = 1, got = 0;
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			perror("socket");
+			break;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+		    write(fd, buf, MSG_SIZE) != MSG_SIZE)
+			goto err;
+		while (got < MSG_SIZE) {
+			int ret = read(fd, buf, MSG_SIZE - got);
+
+			if (ret <= 0)
+				goto err;
+			got += ret;
+		}
+		lat = now_ns() - start;
+		close(fd);
+
+		c->conns++;
+		lat_add(&c->lat, lat);
+		continue;
+err:
+		close(fd);
+		c->errors++;
+	}
+	return NULL;
+}
+
+static void show_results(uint64_t nsec)
+{
+	struct client all = { };
+	unsigned long min = -1UL, max = 0;
+	int i;
+
+	for (i = 0; i < nr_clients; i++) {
+		struct client *c = &clients[i];
+
+		all.conns += c->conns;
+		all.errors += c->errors;
+		lat_merge(&all.lat, &c->lat);
+	}
+
+	printf("mode=%s policy=%s workers=%d clients=%d conns=%lu cps=%.0f "
+		"p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f errors=%lu "
+		"dropped=%lu", mode == MODE_RING ? "ring" : "reuseport",
+		mode == MODE_REUSEPORT ? "hash" :
+		policy == POLICY_RR ? "rr" : "least",
+		nr_workers, nr_clients, all.conns, all.conns / (nsec / 1e9),
+		lat_percentile(&all.lat, 50.0) / 1000.0,
+		lat_percentile(&all.lat, 99.0) / 1000.0,
+		lat_percentile(&all.lat, 99.9) / 1000.0, all.lat.max / 1000.0,
+		all.errors, dropped);
+	printf(" served=");
+	for (i = 0; i < nr_workers; i++) {
+		printf("%s%lu", i ? "/" : "", workers[i].served);
+		if (workers[i].served < min)
+			min = workers[i].served;
+		if (workers[i].served > max)
+			max = workers[i].served;
+	}
+	printf(" imbalance=%.2f\n", min ? (double) max / min : 0.0);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m ring|reuseport] [-P rr|least] "
+			"[-w workers] [-c clients] [-t seconds] [-p port]\n",
+			name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct acceptor a = { };
+	pthread_t acceptor_thread;
+	uint64_t start, nsec = 0;
+	int opt, i, have_acceptor = 0;
+
+	while ((opt = getopt(argc, argv, "m:P:w:c:t:p:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (!strcmp(optarg, "ring"))
+				mode = MODE_RING;
+			else if (!strcmp(optarg, "reuseport"))
+				mode = MODE_REUSEPORT;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'P':
+			if (!strcmp(optarg, "rr"))
+				policy = POLICY_RR;
+			else if (!strcmp(optarg, "least"))
+				policy = POLICY_LEAST;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'w':
+			nr_workers = atoi(optarg);
+			break;
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nr_workers < 1 || nr_workers > MAX_WORKERS || nr_clients < 1 ||
+	    runtime < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	clients = calloc(nr_clients, sizeof(*clients));
+	if (!clients) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	/* workers first, the acceptor needs their ring fds */
+	pthread_barrier_init(&setup_barrier, NULL, nr_workers + 1);
+	for (i = 0; i < nr_workers; i++) {
+		struct worker *w = &workers[i];
+
+		w->idx = i;
+		w->bufs = malloc(MAX_CONNS * BUF_SIZE);
+		if (!w->bufs) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		pthread_create(&w->thread, NULL, worker_fn, w);
+	}
+	pthread_barrier_wait(&setup_barrier);
+	pthread_barrier_destroy(&setup_barrier);
+
+	if (!failed && mode == MODE_RING) {
+		pthread_barrier_init(&setup_barrier, NULL, 2);
+		pthread_create(&acceptor_thread, NULL, acceptor_fn, &a);
+		pthread_barrier_wait(&setup_barrier);
+		have_acceptor = 1;
+	}
+
+	if (!failed) {
+		start = now_ns();
+		for (i = 0; i < nr_clients; i++)
+			pthread_create(&clients[i].thread, NULL, client_fn,
+				       &clients[i]);
+		sleep(runtime);
+		stop_clients = 1;
+		for (i = 0; i < nr_clients; i++)
+			pthread_join(clients[i].thread, NULL);
+		nsec = now_ns() - start;
+	}
+	stop = 1;
+
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+	if (have_acceptor)
+		pthread_join(acceptor_thread, NULL);
+	if (failed)
+		return 1;
+	show_results(nsec);
+	return 0;
+}
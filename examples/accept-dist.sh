@@ -0,0 +1,34 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Runs accept-dist for MSG_RING distribution, round-robin and least
+# connections, and for SO_REUSEPORT sharding, at each worker count.
+# Prints one key=value result line per run.
+#
+# Usage: ./accept-dist.sh [seconds per run]
+#
+# WORKERS is the list of worker counts, and extra accept-dist options for
+# all runs can be passed in BENCH_ARGS, eg BENCH_ARGS="-c32".
+
+runtime=${1:-5}
+worker_counts=${WORKERS:-"1 2 4 8"}
+bench_args=${BENCH_ARGS:-}
+port=9500
+
+bench="$(dirname "$0")/accept-dist"
+
+if [ ! -x "$bench" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+for workers in $worker_counts; do
+	for mode in "-m ring -P rr" "-m ring -P least" "-m reuseport"; do
+		# fresh port for each run, so lingering sockets don't get in the way
+		port=$((port + 1))
+		if ! timeout $((runtime + 10)) $bench $bench_args $mode \
+			-w $workers -t $runtime -p $port; then
+			echo "$mode workers=$workers failed"
+		fi
+	done
+done
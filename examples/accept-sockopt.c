@@ -0,0 +1,457 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Connection churn benchmark for setting socket options on accepted
+ * connections. The server runs a multishot accept, and for each new
+ * connection sets a number of socket options before echoing what it
+ * receives until the client closes. The options can be set:
+ *
+ *   none	not at all, as the baseline
+ *   sync	with a setsockopt(2) call per option after the accept
+ *		completion, on a normal file descriptor
+ *   ring	as SOCKET_URING_OP_SETSOCKOPT commands on the direct
+ *		descriptor, linked in front of the first recv. They are
+ *		queued for all connections accepted in one pass over the
+ *		completions, and go out with the same submit.
+ *
+ * Client threads in the same process loop over connecting, sending a small
+ * request, waiting for the echo and closing the connection with a RST.
+ * Prints a single line of key=value pairs: connections per second, the
+ * setup latency percentiles from connect(2) to the echo arriving, and the
+ * server's CPU time and syscalls per connection.
+ *
+ * Usage: ./accept-sockopt [-m none|sync|ring] [-o nr options] [-c clients]
+ *			   [-t seconds] [-p port]
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+#define MAX_CONNS	4096
+#define MSG_SIZE	32
+#define BUF_SIZE	64
+#define QD		1024
+
+enum {
+	OP_ACCEPT = 1,
+	OP_SOCKOPT,
+	OP_RECV,
+	OP_SEND,
+	OP_CLOSE,
+};
+
+enum {
+	MODE_NONE,
+	MODE_SYNC,
+	MODE_RING,
+};
+
+static const char *mode_names[] = { "none", "sync", "ring" };
+
+/* the options set on each connection, the first 'nr_opts' are used */
+static const struct sockopt_val opts[] = {
+	{ IPPROTO_TCP,	TCP_NODELAY,	1 },
+	{ SOL_SOCKET,	SO_KEEPALIVE,	1 },
+	{ IPPROTO_TCP,	TCP_KEEPIDLE,	60 },
+	{ SOL_SOCKET,	SO_SNDBUF,	65536 },
+	{ SOL_SOCKET,	SO_RCVBUF,	65536 },
+	{ IPPROTO_TCP,	TCP_KEEPINTVL,	10 },
+};
+#define MAX_OPTS	(sizeof(opts) / sizeof(opts[0]))
+
+static int mode = MODE_RING;
+static int nr_opts = 3;
+static int nr_clients = 8;
+static int runtime = 5;
+static int port = 9600;
+
+static volatile int stop_clients, stop;
+static int failed;
+
+static struct io_uring ring;
+static int listen_fd;
+static char *bufs;
+static unsigned long server_conns;
+static unsigned long server_syscalls;
+static uint64_t server_cpu;
+
+struct client {
+	pthread_t thread;
+	unsigned long conns;
+	unsigned long errors;
+	/* each client thread keeps its own */
+	struct lat_hist lat;
+};
+
+static struct client *clients;
+
+static uint64_t clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t encode(int op, int fd)
+{
+	return ((uint64_t) op << 32) | (uint32_t) fd;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe) {
+		server_syscalls++;
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+	}
+	return sqe;
+}
+
+static void add_accept(void)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (mode == MODE_RING)
+		io_uring_prep_multishot_accept_direct(sqe, listen_fd, NULL,
+						      NULL, 0);
+	else
+		io_uring_prep_multishot_accept(sqe, listen_fd, NULL, NULL, 0);
+	io_uring_sqe_set_data64(sqe, encode(OP_ACCEPT, 0));
+}
+
+static void add_recv(int fd)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_recv(sqe, fd, bufs + fd * BUF_SIZE, BUF_SIZE, 0);
+	if (mode == MODE_RING)
+		sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data64(sqe, encode(OP_RECV, fd));
+}
+
+static void add_send(int fd, int len)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_send(sqe, fd, bufs + fd * BUF_SIZE, len, MSG_NOSIGNAL);
+	if (mode == MODE_RING)
+		sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data64(sqe, encode(OP_SEND, fd));
+}
+
+static void add_close(int fd)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (mode == MODE_RING)
+		io_uring_prep_close_direct(sqe, fd);
+	else
+		io_uring_prep_close(sqe, fd);
+	sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+	io_uring_sqe_set_data64(sqe, encode(OP_CLOSE, fd));
+}
+
+static void handle_accept(int fd)
+{
+	int i, ret;
+
+	if (fd >= MAX_CONNS) {
+		fprintf(stderr, "fd %d out of range\n", fd);
+		add_close(fd);
+		return;
+	}
+	server_conns++;
+
+	switch (mode) {
+	case MODE_NONE:
+		break;
+	case MODE_SYNC:
+		for (i = 0; i < nr_opts; i++) {
+			server_syscalls++;
+			if (setsockopt(fd, opts[i].level, opts[i].optname,
+				       &opts[i].val, sizeof(int)) < 0) {
+				perror("setsockopt");
+				failed = stop = 1;
+			}
+		}
+		break;
+	case MODE_RING:
+		/* options first, then the recv linked behind them */
+		ret = prep_sockopt_chain(&ring, fd, true, opts, nr_opts, 1,
+					 encode(OP_SOCKOPT, fd));
+		if (ret < 0) {
+			fprintf(stderr, "sockopt chain: %s\n", strerror(-ret));
+			failed = stop = 1;
+			return;
+		}
+		break;
+	}
+	add_recv(fd);
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe)
+{
+	int op = cqe->user_data >> 32;
+	int fd = cqe->user_data & 0xffffffff;
+
+	switch (op) {
+	case OP_ACCEPT:
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			add_accept();
+		if (cqe->res < 0) {
+			fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+			break;
+		}
+		handle_accept(cqe->res);
+		break;
+	case OP_SOCKOPT:
+		/* only failures post a completion */
+		fprintf(stderr, "setsockopt command: %s\n", strerror(-cqe->res));
+		failed = stop = 1;
+		break;
+	case OP_RECV:
+		if (cqe->res <= 0)
+			add_close(fd);
+		else
+			add_send(fd, cqe->res);
+		break;
+	case OP_SEND:
+		if (cqe->res < 0)
+			add_close(fd);
+		else
+			add_recv(fd);
+		break;
+	case OP_CLOSE:
+		break;
+	}
+}
+
+static void *server_fn(void *data)
+{
+	struct io_uring_params p = { };
+	pthread_barrier_t *barrier = data;
+	uint64_t cpu_start;
+	int ret;
+
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+		  IORING_SETUP_SUBMIT_ALL;
+	ret = io_uring_queue_init_params(QD, &ring, &p);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		failed = 1;
+	} else if (mode == MODE_RING) {
+		ret = io_uring_register_files_sparse(&ring, MAX_CONNS);
+		if (ret) {
+			fprintf(stderr, "register_files_sparse: %s\n",
+				strerror(-ret));
+			failed = 1;
+		}
+	}
+	pthread_barrier_wait(barrier);
+	if (failed)
+		return NULL;
+
+	add_accept();
+	cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	while (!stop) {
+		struct __kernel_timespec ts = { .tv_nsec = 100000000 };
+		struct io_uring_cqe *cqe;
+		unsigned int head, count = 0;
+
+		/* an enter is only skipped with nothing to submit or wait for */
+		if (io_uring_sq_ready(&ring) || !io_uring_cq_ready(&ring))
+			server_syscalls++;
+		ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			failed = stop = 1;
+			break;
+		}
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			handle_cqe(cqe);
+			count++;
+		}
+		io_uring_cq_advance(&ring, count);
+
+		/* stop counting once the clients are done */
+		if (stop_clients && !server_cpu)
+			server_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+	}
+	io_uring_queue_exit(&ring);
+	return NULL;
+}
+
+static void *client_fn(void *data)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	struct timeval tv = { .tv_sec = 1 };
+	struct client *c = data;
+	char buf[MSG_SIZE] = { };
+
+	while (!stop_clients) {
+		uint64_t start = now_ns(), lat;
+		int fd, got = 0;
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			perror("socket");
+			break;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+		    write(fd, buf, MSG_SIZE) != MSG_SIZE)
+			goto err;
+		while (got < MSG_SIZE) {
+			int ret = read(fd, buf, MSG_SIZE - got);
+
+			if (ret <= 0)
+				goto err;
+			got += ret;
+		}
+		lat = now_ns() - start;
+		close(fd);
+
+		c->conns++;
+		lat_add(&c->lat, lat);
+		continue;
+err:
+		close(fd);
+		c->errors++;
+	}
+	return NULL;
+}
+
+static void show_results(uint64_t nsec)
+{
+	struct client all = { };
+	int i;
+
+	for (i = 0; i < nr_clients; i++) {
+		struct client *c = &clients[i];
+
+		all.conns += c->conns;
+		all.errors += c->errors;
+		lat_merge(&all.lat, &c->lat);
+	}
+
+	printf("mode=%s opts=%d clients=%d conns=%lu cps=%.0f p50_us=%.1f "
+		"p99_us=%.1f max_us=%.1f errors=%lu srv_cpu_us_per_conn=%.2f "
+		"srv_syscalls_per_conn=%.2f\n", mode_names[mode],
+		mode == MODE_NONE ? 0 : nr_opts, nr_clients, all.conns,
+		all.conns / (nsec / 1e9),
+		lat_percentile(&all.lat, 50.0) / 1000.0,
+		lat_percentile(&all.lat, 99.0) / 1000.0, all.lat.max / 1000.0,
+		all.errors,
+		server_conns ? server_cpu / 1000.0 / server_conns : 0.0,
+		server_conns ? (double) server_syscalls / server_conns : 0.0);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m none|sync|ring] [-o nr options] "
+			"[-c clients] [-t seconds] [-p port]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_barrier_t barrier;
+	pthread_t server;
+	uint64_t start, nsec;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "m:o:c:t:p:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (i = 0; i <= MODE_RING; i++)
+				if (!strcmp(optarg, mode_names[i]))
+					break;
+			if (i > MODE_RING) {
+				usage(argv[0]);
+				return 1;
+			}
+			mode = i;
+			break;
+		case 'o':
+			nr_opts = atoi(optarg);
+			break;
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nr_opts < 1 || nr_opts > MAX_OPTS || nr_clients < 1 ||
+	    runtime < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (mode == MODE_NONE)
+		nr_opts = 0;
+
+	clients = calloc(nr_clients, sizeof(*clients));
+	bufs = malloc(MAX_CONNS * BUF_SIZE);
+	if (!clients || !bufs) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	listen_fd = setup_listening_socket(port, 0);
+	if (listen_fd < 0)
+		return 1;
+
+	pthread_barrier_init(&barrier, NULL, 2);
+	pthread_create(&server, NULL, server_fn, &barrier);
+	pthread_barrier_wait(&barrier);
+	if (failed) {
+		pthread_join(server, NULL);
+		return 1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr_clients; i++)
+		pthread_create(&clients[i].thread, NULL, client_fn, &clients[i]);
+	sleep(runtime);
+	stop_clients = 1;
+	for (i = 0; i < nr_clients; i++)
+		pthread_join(clients[i].thread, NULL);
+	nsec = now_ns() - start;
+
+	/* let the server see the clients are done before stopping it */
+	usleep(200000);
+	stop = 1;
+	pthread_join(server, NULL);
+	close(listen_fd);
+	if (failed)
+		return 1;
+	show_results(nsec);
+	return 0;
+}
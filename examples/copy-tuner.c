@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Block size and queue depth tuning for io_uring-cp and link-cp, see
+ * copy-tuner.h.
+ */
+#include <string.h>
+
+#include "copy-tuner.h"
+#include "helpers.h"
+
+static void copy_tuner_step(struct copy_tuner *t)
+{
+	t->bytes = t->lat_ns = t->nr = 0;
+	t->start_ns = now_ns();
+}
+
+void copy_tuner_init(struct copy_tuner *t, unsigned int max_bs,
+		     unsigned int max_qd, unsigned long long step)
+{
+	memset(t, 0, sizeof(*t));
+	t->max_bs = max_bs;
+	t->max_qd = max_qd;
+	t->step = step;
+	t->bs = 4096;
+	t->qd = max_qd < 8 ? max_qd : 8;
+	t->state = TUNE_BS;
+	copy_tuner_step(t);
+}
+
+/*
+ * A step ends once 'step' bytes issued since it started have been copied.
+ * The block size keeps doubling until throughput drops by more than 5%,
+ * and settles on the best one seen. The depth keeps doubling from 1 only
+ * while that improves throughput by at least 10%, and latency grows no
+ * more than throughput does. So it settles on the lowest depth that gets
+ * the throughput, rather than trading latency for less than its worth.
+ */
+bool copy_tuner_done(struct copy_tuner *t, unsigned int bytes,
+		     unsigned long long start_ns)
+{
+	unsigned long long now;
+	double rate, lat_us;
+
+	if (t->state == TUNE_DONE || start_ns < t->start_ns)
+		return false;
+	now = now_ns();
+	t->bytes += bytes;
+	t->lat_ns += now - start_ns;
+	t->nr++;
+	if (t->bytes < t->step)
+		return false;
+
+	rate = t->bytes * 1e9 / (now - t->start_ns);
+	lat_us = t->lat_ns / 1000.0 / t->nr;
+	if (t->state == TUNE_BS) {
+		if (rate > t->rate) {
+			t->rate = rate;
+			t->lat_us = lat_us;
+			t->best = t->bs;
+		}
+		if (rate >= t->rate * 0.95 && t->bs * 2 <= t->max_bs) {
+			t->bs *= 2;
+		} else {
+			t->bs = t->best;
+			t->state = TUNE_QD;
+			t->qd = t->best = 1;
+			t->rate = 0;
+		}
+	} else {
+		if (!t->rate || (rate > t->rate * 1.1 &&
+				 lat_us / t->lat_us <= rate / t->rate)) {
+			t->rate = rate;
+			t->lat_us = lat_us;
+			t->best = t->qd;
+		}
+		if (t->best == t->qd && t->qd * 2 <= t->max_qd) {
+			t->qd *= 2;
+		} else {
+			t->qd = t->best;
+			t->state = TUNE_DONE;
+		}
+	}
+	copy_tuner_step(t);
+	return true;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef LIBURING_EX_COPY_TUNER_H
+#define LIBURING_EX_COPY_TUNER_H
+
+#include <stdbool.h>
+
+/*
+ * Picks a block size and queue depth for a copy while it runs, first
+ * doubling the block size from 4k at a depth of 8, then the depth from 1,
+ * for as long as throughput keeps improving. A deeper queue must also keep
+ * latency growth in line with its throughput gain. Call copy_tuner_done()
+ * for every chunk copied, with its size and when it was issued, and use
+ * 'bs' and 'qd' for the next ones. It returns true when those change.
+ */
+enum {
+	TUNE_BS,
+	TUNE_QD,
+	TUNE_DONE,
+};
+
+struct copy_tuner {
+	unsigned int bs;
+	unsigned int qd;
+	int state;
+	/* of the best step in the current phase, in bytes/sec and usec */
+	double rate;
+	double lat_us;
+	unsigned int best;
+
+	unsigned int max_bs;
+	unsigned int max_qd;
+	unsigned long long step;
+	unsigned long long bytes;
+	unsigned long long lat_ns;
+	unsigned long long nr;
+	unsigned long long start_ns;
+};
+
+void copy_tuner_init(struct copy_tuner *t, unsigned int max_bs,
+		     unsigned int max_qd, unsigned long long step);
+bool copy_tuner_done(struct copy_tuner *t, unsigned int bytes,
+		     unsigned long long start_ns);
+
+#endif
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Benchmarks the coroutine runtime in coro.c, printing a line of key=value
+ * pairs per test:
+ *
+ *   yield	coroutines yielding to each other through the scheduler,
+ *		two context switches per yield
+ *   ucontext	the same number of switches with swapcontext(3) between two
+ *		contexts, as ucontext-cp.c does, for comparison
+ *   await	coroutines awaiting IORING_OP_NOP requests, one switch out
+ *		and one back in per request, and a submit and wait whenever
+ *		all of them are waiting
+ *
+ * Usage: ./coro-bench [-n iterations] [-c coroutines]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "liburing.h"
+#include "coro.h"
+#include "helpers.h"
+
+static unsigned long iterations = 10000000;
+static unsigned int nr_coros = 64;
+
+static void report(const char *test, unsigned long switches,
+		   unsigned long long nsec)
+{
+	printf("test=%s switches=%lu switches_per_sec=%.0f ns_per_switch=%.1f\n",
+		test, switches, switches / (nsec / 1e9),
+		(double) nsec / switches);
+}
+
+static void yielder(void *arg)
+{
+	unsigned long i, n = *(unsigned long *) arg;
+
+	for (i = 0; i < n; i++)
+		coro_yield();
+}
+
+static void awaiter(void *arg)
+{
+	unsigned long i, n = *(unsigned long *) arg;
+
+	for (i = 0; i < n; i++) {
+		struct io_uring_sqe *sqe = coro_get_sqe();
+
+		io_uring_prep_nop(sqe);
+		if (coro_await_io(sqe) < 0) {
+			fprintf(stderr, "nop failed\n");
+			exit(1);
+		}
+	}
+}
+
+static int run_test(const char *test, coro_fn fn, unsigned long per_coro)
+{
+	struct coro_sched *s;
+	unsigned long long start;
+	unsigned int i;
+	int ret;
+
+	s = coro_sched_create(nr_coros * 2, 0);
+	if (!s) {
+		perror("coro_sched_create");
+		return 1;
+	}
+	for (i = 0; i < nr_coros; i++) {
+		if (!coro_spawn(s, fn, &per_coro)) {
+			perror("coro_spawn");
+			return 1;
+		}
+	}
+	start = now_ns();
+	ret = coro_sched_run(s);
+	if (ret) {
+		fprintf(stderr, "coro_sched_run: %s\n", strerror(-ret));
+		return 1;
+	}
+	/* a switch in and one out each time the scheduler resumes one */
+	report(test, coro_sched_switches(s) * 2, now_ns() - start);
+	coro_sched_destroy(s);
+	return 0;
+}
+
+static ucontext_t uc_main, uc_other;
+static unsigned long uc_left;
+
+static void uc_fn(void)
+{
+	while (uc_left--)
+		swapcontext(&uc_other, &uc_main);
+}
+
+static int run_ucontext(void)
+{
+	static char stack[64 * 1024];
+	unsigned long long start;
+	unsigned long n = iterations;
+
+	getcontext(&uc_other);
+	uc_other.uc_stack.ss_sp = stack;
+	uc_other.uc_stack.ss_size = sizeof(stack);
+	uc_other.uc_link = &uc_main;
+	makecontext(&uc_other, uc_fn, 0);
+
+	uc_left = n;
+	start = now_ns();
+	while (uc_left)
+		swapcontext(&uc_main, &uc_other);
+	report("ucontext", n * 2, now_ns() - start);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long per_coro;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:c:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			nr_coros = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations] "
+					"[-c coroutines]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!iterations || !nr_coros)
+		return 1;
+	per_coro = (iterations + nr_coros - 1) / nr_coros;
+
+	if (run_test("yield", yielder, per_coro))
+		return 1;
+	if (run_ucontext())
+		return 1;
+	/* a request per iteration costs more, do fewer */
+	per_coro = (per_coro + 9) / 10;
+	if (run_test("await", awaiter, per_coro))
+		return 1;
+	return 0;
+}
@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Compares the C++20 coroutine layer in liburing/coro.hpp with the same
+ * work done against the C API directly. Both keep 'qd' requests in flight
+ * and submit and wait the same way, the C loop requeues a request per CQE
+ * where the C++ one has 'qd' coroutines each awaiting requests in a loop.
+ * Each is run 'rounds' times, alternating between the two, and the best
+ * round of each is printed as a line of key=value pairs, the C++ one with
+ * its overhead over C:
+ *
+ *   nop	IORING_OP_NOP requests, so the overhead of the layer dominates
+ *   read	reads of 'bs' bytes from offset 0 of 'file', /dev/zero by
+ *		default, a page cached file is closer to real use
+ *
+ * Usage: ./coro-cpp-bench [-n requests] [-q queue depth] [-b block size]
+ *			   [-f file] [-r rounds]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "liburing.h"
+#include "liburing/coro.hpp"
+
+enum test {
+	TEST_NOP,
+	TEST_READ,
+};
+
+static const char *test_names[] = { "nop", "read" };
+
+static unsigned long nr_reqs = 4000000;
+static unsigned int qd = 32;
+static unsigned int bs = 4096;
+static unsigned int rounds = 3;
+static const char *file = "/dev/zero";
+static int fd = -1;
+static char *bufs;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void prep_req(struct io_uring_sqe *sqe, enum test test, unsigned int i)
+{
+	if (test == TEST_NOP)
+		io_uring_prep_nop(sqe);
+	else
+		io_uring_prep_read(sqe, fd, bufs + i * bs, bs, 0);
+	io_uring_sqe_set_data64(sqe, i);
+}
+
+static int run_c(enum test test, unsigned long n)
+{
+	struct io_uring ring;
+	struct io_uring_cqe *cqe;
+	unsigned long issued = 0, done = 0;
+	unsigned int i, head, nr;
+	int ret;
+
+	ret = io_uring_queue_init(qd, &ring, 0);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+	for (i = 0; i < qd && issued < n; i++, issued++)
+		prep_req(io_uring_get_sqe(&ring), test, i);
+
+	while (done < n) {
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			return 1;
+		}
+		nr = 0;
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			if (cqe->res < 0) {
+				fprintf(stderr, "%s: %s\n", test_names[test],
+					strerror(-cqe->res));
+				return 1;
+			}
+			done++;
+			if (issued < n) {
+				prep_req(io_uring_get_sqe(&ring), test,
+					 cqe->user_data);
+				issued++;
+			}
+			nr++;
+		}
+		io_uring_cq_advance(&ring, nr);
+	}
+	io_uring_queue_exit(&ring);
+	return 0;
+}
+
+static bool failed;
+
+static liburing::task<> worker(liburing::ring &r, enum test test,
+			       unsigned int i, unsigned long n)
+{
+	unsigned long j;
+	int ret;
+
+	for (j = 0; j < n; j++) {
+		if (test == TEST_NOP)
+			ret = co_await liburing::nop(r);
+		else
+			ret = co_await liburing::read(r, fd, bufs + i * bs, bs,
+						      0);
+		if (ret < 0) {
+			fprintf(stderr, "%s: %s\n", test_names[test],
+				strerror(-ret));
+			failed = true;
+			co_return;
+		}
+	}
+}
+
+static int run_cxx(enum test test, unsigned long n)
+{
+	liburing::ring r(qd);
+	unsigned int i;
+
+	for (i = 0; i < qd; i++)
+		liburing::spawn(worker(r, test, i, n / qd));
+	if (r.run()) {
+		fprintf(stderr, "run failed\n");
+		return 1;
+	}
+	return failed;
+}
+
+static int run_test(enum test test)
+{
+	unsigned long long c_ns = -1ULL, cxx_ns = -1ULL, start;
+	/* a multiple of the queue depth, the same count for both */
+	unsigned long n = nr_reqs / qd * qd;
+	unsigned int i;
+
+	for (i = 0; i < rounds; i++) {
+		start = now_ns();
+		if (run_c(test, n))
+			return 1;
+		c_ns = std::min(c_ns, now_ns() - start);
+
+		start = now_ns();
+		if (run_cxx(test, n))
+			return 1;
+		cxx_ns = std::min(cxx_ns, now_ns() - start);
+	}
+	printf("test=%s api=c reqs=%lu reqs_per_sec=%.0f ns_per_req=%.1f\n",
+		test_names[test], n, n / (c_ns / 1e9), (double) c_ns / n);
+	printf("test=%s api=cxx reqs=%lu reqs_per_sec=%.0f ns_per_req=%.1f "
+		"overhead_pct=%.1f\n", test_names[test], n,
+		n / (cxx_ns / 1e9), (double) cxx_ns / n,
+		100.0 * ((double) cxx_ns - c_ns) / c_ns);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:q:b:f:r:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_reqs = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			qd = atoi(optarg);
+			break;
+		case 'b':
+			bs = atoi(optarg);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n requests] [-q queue depth] "
+					"[-b block size] [-f file] [-r rounds]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+	if (!qd || !bs || !rounds || nr_reqs < qd) {
+		fprintf(stderr, "need rounds > 0 and requests >= queue depth > 0\n");
+		return 1;
+	}
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		perror(file);
+		return 1;
+	}
+	bufs = static_cast<char *>(malloc((size_t) qd * bs));
+	if (!bufs)
+		return 1;
+
+	if (run_test(TEST_NOP) || run_test(TEST_READ))
+		return 1;
+	close(fd);
+	free(bufs);
+	return 0;
+}
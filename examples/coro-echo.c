@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Echo server written with the coroutine runtime in coro.c, the code for a
+ * connection reads like the blocking version would. Each thread has its
+ * own scheduler and SO_REUSEPORT listener, with an acceptor coroutine that
+ * starts a coroutine per connection. Compatible with echo-client.c.
+ *
+ * Usage: ./coro-echo [-p port] [-t threads] [-s stack size]
+ *        Default port: 8000
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "coro.h"
+#include "helpers.h"
+
+#define DEFAULT_PORT	8000
+#define BUF_SIZE	4096
+
+static int port = DEFAULT_PORT;
+static size_t stack_size;
+
+static int coro_recv(int fd, void *buf, size_t len)
+{
+	struct io_uring_sqe *sqe = coro_get_sqe();
+
+	io_uring_prep_recv(sqe, fd, buf, len, 0);
+	return coro_await_io(sqe);
+}
+
+static int coro_send_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		struct io_uring_sqe *sqe = coro_get_sqe();
+		int ret;
+
+		io_uring_prep_send(sqe, fd, buf, len, 0);
+		ret = coro_await_io(sqe);
+		if (ret <= 0)
+			return ret ? ret : -EPIPE;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void connection(void *arg)
+{
+	int fd = (int) (long) arg;
+	struct io_uring_sqe *sqe;
+	char buf[BUF_SIZE];
+
+	for (;;) {
+		int ret = coro_recv(fd, buf, sizeof(buf));
+
+		if (ret <= 0 || coro_send_all(fd, buf, ret))
+			break;
+	}
+
+	sqe = coro_get_sqe();
+	io_uring_prep_close(sqe, fd);
+	coro_await_io(sqe);
+}
+
+static void acceptor(void *arg)
+{
+	int listen_fd = (int) (long) arg;
+
+	for (;;) {
+		struct io_uring_sqe *sqe = coro_get_sqe();
+		int fd;
+
+		io_uring_prep_accept(sqe, listen_fd, NULL, NULL, 0);
+		fd = coro_await_io(sqe);
+		if (fd < 0) {
+			if (fd != -EINTR && fd != -ECONNABORTED)
+				fprintf(stderr, "accept: %s\n", strerror(-fd));
+			continue;
+		}
+		if (!coro_spawn(coro_sched_self(), connection, (void *) (long) fd))
+			close(fd);
+	}
+}
+
+static void *server_thread(void *arg)
+{
+	struct coro_sched *s;
+	int listen_fd, ret, val;
+
+	(void) arg;
+	s = coro_sched_create(256, stack_size);
+	if (!s) {
+		perror("coro_sched_create");
+		exit(1);
+	}
+	listen_fd = setup_reuseport_listening_socket(port, 0);
+	if (listen_fd < 0)
+		exit(1);
+	/*
+	 * Echoes larger than a read go out as several sends, which Nagle would
+	 * hold back behind the client's delayed ACK. Accepted sockets inherit
+	 * this.
+	 */
+	val = 1;
+	if (setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)))
+		perror("setsockopt TCP_NODELAY");
+	coro_spawn(s, acceptor, (void *) (long) listen_fd);
+
+	ret = coro_sched_run(s);
+	fprintf(stderr, "coro_sched_run: %s\n", strerror(-ret));
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int nr_threads = 1, i;
+	pthread_t *threads;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:t:s:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			stack_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p port] [-t threads] "
+					"[-s stack size]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!nr_threads)
+		return 1;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return 1;
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, server_thread, NULL);
+	printf("echo server listening on port %d, %u threads\n", port,
+		nr_threads);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	return 0;
+}
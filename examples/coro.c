@@ -0,0 +1,405 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Stackful coroutines on io_uring, see coro.h.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "liburing.h"
+#include "coro.h"
+
+#define CORO_STACK_SIZE	(64 * 1024)
+
+#if defined(__x86_64__) || defined(__aarch64__)
+/* the stack pointer of a suspended context, its registers are on the stack */
+struct coro_ctx {
+	void *sp;
+};
+
+void coro_switch(struct coro_ctx *from, struct coro_ctx *to);
+void coro_trampoline(void);
+#else
+#include <ucontext.h>
+
+struct coro_ctx {
+	ucontext_t uc;
+};
+#endif
+
+struct coro {
+	struct coro_ctx ctx;
+	struct coro_sched *sched;
+	coro_fn fn;
+	void *arg;
+	/* the usable stack, the guard page is below it */
+	void *stack;
+	int res;
+	bool done;
+	/* on the run queue, or the free list once done */
+	struct coro *next;
+};
+
+struct coro_sched {
+	struct io_uring ring;
+	struct coro_ctx ctx;
+	struct coro *current;
+	struct coro *runq_head, *runq_tail;
+	struct coro *free;
+	unsigned int live;
+	size_t stack_size;
+	size_t page_size;
+	unsigned long switches;
+};
+
+static __thread struct coro_sched *this_sched;
+
+#if defined(__x86_64__)
+/*
+ * rbx, rbp and r12-r15 are callee-saved. A new coroutine's stack is set up
+ * as if it had switched away from the start of coro_trampoline(), with the
+ * coroutine in r12.
+ */
+__asm__(
+	"	.text\n"
+	"	.globl coro_switch\n"
+	"	.hidden coro_switch\n"
+	"	.type coro_switch, @function\n"
+	"coro_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size coro_switch, .-coro_switch\n"
+	"	.globl coro_trampoline\n"
+	"	.hidden coro_trampoline\n"
+	"	.type coro_trampoline, @function\n"
+	"coro_trampoline:\n"
+	"	movq %r12, %rdi\n"
+	"	call coro_main\n"
+	"	ud2\n"
+	"	.size coro_trampoline, .-coro_trampoline\n"
+);
+
+static void coro_ctx_init(struct coro *co, void *top)
+{
+	uint64_t *sp = (uint64_t *) ((uintptr_t) top & ~15UL);
+
+	/*
+	 * Six registers and the return address, on top of 16 bytes keeping
+	 * the stack aligned when coro_trampoline() calls coro_main().
+	 */
+	sp -= 9;
+	memset(sp, 0, 9 * sizeof(*sp));
+	sp[3] = (uint64_t) (uintptr_t) co;
+	sp[6] = (uint64_t) (uintptr_t) coro_trampoline;
+	co->ctx.sp = sp;
+}
+#elif defined(__aarch64__)
+/*
+ * x19-x29, the link register x30 and d8-d15 are callee-saved. A new
+ * coroutine starts in coro_trampoline(), with itself in x19.
+ */
+__asm__(
+	"	.text\n"
+	"	.globl coro_switch\n"
+	"	.hidden coro_switch\n"
+	"	.type coro_switch, %function\n"
+	"coro_switch:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x2, sp\n"
+	"	str x2, [x0]\n"
+	"	ldr x2, [x1]\n"
+	"	mov sp, x2\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	"	.size coro_switch, .-coro_switch\n"
+	"	.globl coro_trampoline\n"
+	"	.hidden coro_trampoline\n"
+	"	.type coro_trampoline, %function\n"
+	"coro_trampoline:\n"
+	"	mov x0, x19\n"
+	"	bl coro_main\n"
+	"	brk #0\n"
+	"	.size coro_trampoline, .-coro_trampoline\n"
+);
+
+static void coro_ctx_init(struct coro *co, void *top)
+{
+	uint64_t *sp = (uint64_t *) ((uintptr_t) top & ~15UL);
+
+	sp -= 20;
+	memset(sp, 0, 20 * sizeof(*sp));
+	sp[0] = (uint64_t) (uintptr_t) co;
+	sp[11] = (uint64_t) (uintptr_t) coro_trampoline;
+	co->ctx.sp = sp;
+}
+#endif
+
+void coro_main(struct coro *co) __attribute__((noreturn, visibility("hidden")));
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+static void coro_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	swapcontext(&from->uc, &to->uc);
+}
+
+static void coro_uc_entry(unsigned int hi, unsigned int lo)
+{
+	coro_main((struct coro *) (((uintptr_t) hi << 16 << 16) | lo));
+}
+
+static void coro_ctx_init(struct coro *co, void *top)
+{
+	size_t size = co->sched->stack_size;
+	uintptr_t p = (uintptr_t) co;
+
+	getcontext(&co->ctx.uc);
+	co->ctx.uc.uc_stack.ss_sp = (char *) top - size;
+	co->ctx.uc.uc_stack.ss_size = size;
+	co->ctx.uc.uc_link = NULL;
+	makecontext(&co->ctx.uc, (void (*)(void)) coro_uc_entry, 2,
+		    (unsigned int) (p >> 16 >> 16), (unsigned int) p);
+}
+#endif
+
+static void runq_push(struct coro_sched *s, struct coro *co)
+{
+	co->next = NULL;
+	if (s->runq_tail)
+		s->runq_tail->next = co;
+	else
+		s->runq_head = co;
+	s->runq_tail = co;
+}
+
+static struct coro *runq_pop(struct coro_sched *s)
+{
+	struct coro *co = s->runq_head;
+
+	if (co) {
+		s->runq_head = co->next;
+		if (!s->runq_head)
+			s->runq_tail = NULL;
+	}
+	return co;
+}
+
+/* switch from the running coroutine back to the scheduler */
+static void coro_suspend(struct coro_sched *s)
+{
+	struct coro *co = s->current;
+
+	coro_switch(&co->ctx, &s->ctx);
+}
+
+void coro_main(struct coro *co)
+{
+	co->fn(co->arg);
+	co->done = true;
+	coro_suspend(co->sched);
+	__builtin_unreachable();
+}
+
+struct coro_sched *coro_sched_create(unsigned int entries, size_t stack_size)
+{
+	struct coro_sched *s;
+	int ret;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	/* the scheduler is bound to this thread, so is its ring */
+	ret = io_uring_queue_init(entries, &s->ring,
+				  IORING_SETUP_SINGLE_ISSUER |
+				  IORING_SETUP_DEFER_TASKRUN);
+	if (ret) {
+		free(s);
+		errno = -ret;
+		return NULL;
+	}
+	s->page_size = sysconf(_SC_PAGESIZE);
+	if (!stack_size)
+		stack_size = CORO_STACK_SIZE;
+	s->stack_size = (stack_size + s->page_size - 1) & ~(s->page_size - 1);
+	this_sched = s;
+	return s;
+}
+
+void coro_sched_destroy(struct coro_sched *s)
+{
+	struct coro *co;
+
+	while ((co = s->free) != NULL) {
+		s->free = co->next;
+		munmap((char *) co->stack - s->page_size,
+		       s->stack_size + s->page_size);
+		free(co);
+	}
+	io_uring_queue_exit(&s->ring);
+	if (this_sched == s)
+		this_sched = NULL;
+	free(s);
+}
+
+struct coro_sched *coro_sched_self(void)
+{
+	return this_sched;
+}
+
+struct io_uring *coro_ring(void)
+{
+	return &this_sched->ring;
+}
+
+unsigned long coro_sched_switches(struct coro_sched *s)
+{
+	return s->switches;
+}
+
+struct coro *coro_spawn(struct coro_sched *s, coro_fn fn, void *arg)
+{
+	struct coro *co = s->free;
+
+	if (co) {
+		s->free = co->next;
+	} else {
+		char *mem;
+
+		co = calloc(1, sizeof(*co));
+		if (!co)
+			return NULL;
+		mem = mmap(NULL, s->stack_size + s->page_size,
+			   PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if (mem == MAP_FAILED) {
+			free(co);
+			return NULL;
+		}
+		/* stacks grow down, an overflow faults on the guard page */
+		mprotect(mem, s->page_size, PROT_NONE);
+		co->stack = mem + s->page_size;
+	}
+
+	co->sched = s;
+	co->fn = fn;
+	co->arg = arg;
+	co->done = false;
+	coro_ctx_init(co, (char *) co->stack + s->stack_size);
+	s->live++;
+	runq_push(s, co);
+	return co;
+}
+
+static void coro_resume(struct coro_sched *s, struct coro *co)
+{
+	s->current = co;
+	s->switches++;
+	coro_switch(&s->ctx, &co->ctx);
+	s->current = NULL;
+
+	/* it's off its stack now, which can go to the next coroutine */
+	if (co->done) {
+		co->next = s->free;
+		s->free = co;
+		s->live--;
+	}
+}
+
+int coro_sched_run(struct coro_sched *s)
+{
+	struct io_uring_cqe *cqe;
+	struct coro *co;
+	unsigned int head, nr;
+	int ret;
+
+	while (s->live) {
+		while ((co = runq_pop(s)) != NULL)
+			coro_resume(s, co);
+		if (!s->live)
+			break;
+
+		/* nothing runnable, submit what they queued and wait */
+		ret = io_uring_submit_and_wait(&s->ring, 1);
+		if (ret < 0 && ret != -EINTR && ret != -ETIME)
+			return ret;
+
+		nr = 0;
+		io_uring_for_each_cqe(&s->ring, head, cqe) {
+			co = io_uring_cqe_get_data(cqe);
+			if (co) {
+				co->res = cqe->res;
+				runq_push(s, co);
+			}
+			nr++;
+		}
+		io_uring_cq_advance(&s->ring, nr);
+	}
+	return 0;
+}
+
+void coro_yield(void)
+{
+	struct coro_sched *s = this_sched;
+
+	runq_push(s, s->current);
+	coro_suspend(s);
+}
+
+struct io_uring_sqe *coro_get_sqe(void)
+{
+	struct io_uring *ring = &this_sched->ring;
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(ring);
+	if (!sqe) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+	}
+	return sqe;
+}
+
+int coro_await_io(struct io_uring_sqe *sqe)
+{
+	struct coro_sched *s = this_sched;
+	struct coro *co = s->current;
+
+	io_uring_sqe_set_data(sqe, co);
+	coro_suspend(s);
+	return co->res;
+}
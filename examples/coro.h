@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef LIBURING_EX_CORO_H
+#define LIBURING_EX_CORO_H
+
+/*
+ * A small stackful coroutine runtime on top of io_uring, grown out of
+ * ucontext-cp.c. Each thread that wants to run coroutines creates its own
+ * scheduler, which owns a ring. Coroutines queue requests and suspend
+ * until their completion arrives with coro_await_io(), the scheduler
+ * submits everything queued and waits whenever nothing is runnable.
+ *
+ * Stacks are mmap'ed with a guard page below them, and kept on a free list
+ * for reuse when their coroutine finishes. Switching between a coroutine
+ * and the scheduler saves and restores the callee-saved registers only,
+ * in assembly on x86-64 and aarch64, and with swapcontext(3) elsewhere.
+ * The floating point control state is not switched, coroutines shouldn't
+ * change it.
+ *
+ * Coroutines must not block the thread, and must not migrate to another
+ * thread's scheduler.
+ */
+#include <stddef.h>
+
+struct io_uring;
+struct io_uring_sqe;
+struct coro;
+struct coro_sched;
+
+typedef void (*coro_fn)(void *arg);
+
+/*
+ * Create a scheduler for the calling thread, with a ring of 'entries' and
+ * coroutine stacks of 'stack_size' bytes, 0 for the default of 64k.
+ * Returns NULL on failure, with errno set.
+ */
+struct coro_sched *coro_sched_create(unsigned int entries, size_t stack_size);
+void coro_sched_destroy(struct coro_sched *s);
+
+/* the calling thread's scheduler, and its ring */
+struct coro_sched *coro_sched_self(void);
+struct io_uring *coro_ring(void);
+
+/*
+ * Run coroutines until all have finished. Returns 0, or -errno if waiting
+ * for completions failed.
+ */
+int coro_sched_run(struct coro_sched *s);
+
+/* context switches done by the scheduler so far */
+unsigned long coro_sched_switches(struct coro_sched *s);
+
+/*
+ * Start 'fn(arg)' as a coroutine on scheduler 's'. It first runs once the
+ * scheduler gets to it, not from within this call. Returns NULL on
+ * failure.
+ */
+struct coro *coro_spawn(struct coro_sched *s, coro_fn fn, void *arg);
+
+/* let other runnable coroutines run first */
+void coro_yield(void);
+
+/*
+ * Get an SQE on the current scheduler's ring, submitting what's queued if
+ * the SQ ring is full.
+ */
+struct io_uring_sqe *coro_get_sqe(void);
+
+/*
+ * Suspend the current coroutine until the request prepared in 'sqe'
+ * completes, and return its result. The request must post exactly one
+ * completion, so no multishot requests or CQE_SKIP_SUCCESS. Its user_data
+ * is set here.
+ */
+int coro_await_io(struct io_uring_sqe *sqe);
+
+#endif
@@ -0,0 +1,71 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Loopback comparison of echo-server configurations. For each, the server
+# is started, echo-client drives it, and then the server is stopped with
+# SIGINT so it prints its totals. Prints the client's RPS and latency, and
+# both sides' estimates of the io_uring_enter(2) calls per request.
+#
+# Usage: ./echo-bench.sh [seconds per run]
+#
+# Client options can be passed in CLIENT_ARGS, eg CLIENT_ARGS="-c64 -d8",
+# and the server configurations to compare in CONFIGS, separated by ','.
+
+runtime=${1:-5}
+client_args=${CLIENT_ARGS:--c16 -d4 -s64}
+configs=${CONFIGS:-"-t defer,-t coop,-b,-f,-z,-b -f"}
+port=9200
+
+dir=$(dirname "$0")
+server="$dir/echo-server"
+client="$dir/echo-client"
+
+if [ ! -x "$server" ] || [ ! -x "$client" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+# value of key $2 in the key=value output $1
+get() {
+	echo "$1" | sed -n "s/.*\b$2=\([0-9.]*\).*/\1/p"
+}
+
+printf "%-12s %10s %9s %9s %9s %13s %13s\n" "config" "rps" "p50_us" \
+	"p99_us" "p999_us" "cli_est/req" "srv_est/req"
+
+IFS=','
+for config in $configs; do
+	unset IFS
+	log=$(mktemp)
+
+	# fresh port for each run, so lingering sockets don't get in the way
+	port=$((port + 1))
+	$server $config -p $port > $log 2>&1 &
+	server_pid=$!
+	sleep 1
+
+	out=$(timeout $((runtime + 20)) $client $client_args -p $port \
+		-t $runtime 2>/dev/null)
+
+	kill -INT $server_pid > /dev/null 2>&1
+	wait $server_pid > /dev/null 2>&1
+
+	requests=$(get "$out" requests)
+	size=$(get "$out" size)
+	srv_sys=$(get "$(cat $log)" est_syscalls)
+	srv_bytes=$(get "$(cat $log)" bytes)
+	rm -f $log
+
+	if [ -z "$requests" ] || [ "$requests" = "0" ] || [ -z "$srv_bytes" ]; then
+		printf "%-12s %10s\n" "$config" "failed"
+		IFS=','
+		continue
+	fi
+	# server totals include the warmup, count its requests from the bytes
+	printf "%-12s %10s %9s %9s %9s %13s %13s\n" "$config" \
+		"$(get "$out" rps)" "$(get "$out" p50_us)" \
+		"$(get "$out" p99_us)" "$(get "$out" p999_us)" \
+		"$(get "$out" est_syscalls_per_req)" \
+		"$(awk "BEGIN { printf \"%.3f\", $srv_sys * $size / $srv_bytes }")"
+	IFS=','
+done
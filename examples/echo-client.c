@@ -0,0 +1,347 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Closed-loop load generator for echo-server.c. Opens a number of TCP
+ * connections, keeps 'depth' requests of a given size in flight on each,
+ * and sends a new request whenever the echo of an earlier one has fully
+ * arrived. All of it is driven from a single DEFER_TASKRUN ring.
+ *
+ * After an optional warmup, it runs for the given time and prints a single
+ * line of key=value pairs:
+ *
+ *   requests, rps		completed requests, and per second
+ *   p50_us .. max_us		request latency, from the request being
+ *				submitted to all of its echo having arrived
+ *   est_syscalls_per_req	io_uring_enter(2) calls made by the client,
+ *				per request. An estimate from when liburing
+ *				needs to enter the kernel, not a count taken
+ *				at the syscall itself.
+ *
+ * Usage: ./echo-client [-H host] [-p port] [-c conns] [-d depth] [-s size]
+ *			[-t seconds] [-w warmup seconds]
+ *
+ * Example, 16 connections with 4 pipelined 64 byte requests each:
+ *
+ *	./echo-server &
+ *	./echo-client -c16 -d4 -s64
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+enum {
+	OP_SEND = 1,
+	OP_RECV,
+};
+
+struct conn {
+	int fd;
+	/* bytes of the oldest outstanding echo received so far */
+	int rx_bytes;
+	/* submit time of each request in flight */
+	uint64_t *ts;
+	unsigned int ts_head, ts_tail;
+	char *rbuf;
+};
+
+static const char *host = "127.0.0.1";
+static int port = 8000;
+static int nr_conns = 8;
+static int depth = 1;
+static int msg_size = 64;
+static int runtime = 5;
+static int warmup = 1;
+
+static struct io_uring ring;
+static struct conn *conns;
+static char *sbuf;
+static int error;
+/* counting is only done while measuring */
+static int measuring;
+
+static unsigned long requests;
+static unsigned long enters;
+static struct lat_hist latency;
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe) {
+		if (measuring)
+			enters++;
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+	}
+	return sqe;
+}
+
+/*
+ * The request payload is never modified, so all sends go out of the same
+ * buffer and a send completion only needs the connection and length to
+ * resubmit whatever was left.
+ */
+static uint64_t encode_userdata(int op, int idx, int len)
+{
+	return ((uint64_t) op << 56) | ((uint64_t) idx << 32) | len;
+}
+
+static void add_send(int idx, int len)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	io_uring_prep_send(sqe, conns[idx].fd, sbuf, len, MSG_NOSIGNAL);
+	io_uring_sqe_set_data64(sqe, encode_userdata(OP_SEND, idx, len));
+}
+
+static void add_recv(int idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	io_uring_prep_recv(sqe, conns[idx].fd, conns[idx].rbuf,
+			   msg_size * depth, 0);
+	io_uring_sqe_set_data64(sqe, encode_userdata(OP_RECV, idx, 0));
+}
+
+static void add_request(int idx)
+{
+	struct conn *c = &conns[idx];
+
+	c->ts[c->ts_tail++ % depth] = now_ns();
+	add_send(idx, msg_size);
+}
+
+static void handle_recv(int idx, int res)
+{
+	struct conn *c = &conns[idx];
+
+	if (res <= 0) {
+		fprintf(stderr, "recv: %s\n", res ? strerror(-res) : "EOF");
+		error = 1;
+		return;
+	}
+
+	c->rx_bytes += res;
+	while (c->rx_bytes >= msg_size) {
+		uint64_t lat = now_ns() - c->ts[c->ts_head++ % depth];
+
+		c->rx_bytes -= msg_size;
+		if (measuring) {
+			lat_add(&latency, lat);
+			requests++;
+		}
+		add_request(idx);
+	}
+	add_recv(idx);
+}
+
+static void handle_send(int idx, int len, int res)
+{
+	if (res < 0) {
+		fprintf(stderr, "send: %s\n", strerror(-res));
+		error = 1;
+		return;
+	}
+	if (res < len)
+		add_send(idx, len - res);
+}
+
+/*
+ * liburing skips the io_uring_enter(2) call if there's nothing to submit
+ * and completions are already waiting, only count the ones that happen.
+ */
+static int submit_and_wait(void)
+{
+	struct __kernel_timespec ts = { .tv_nsec = 100000000 };
+	struct io_uring_cqe *cqe;
+
+	if (measuring && (io_uring_sq_ready(&ring) || !io_uring_cq_ready(&ring)))
+		enters++;
+	return io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+}
+
+static int run(void)
+{
+	uint64_t start, end, measure_start = 0;
+	int i, j, ret;
+
+	for (i = 0; i < nr_conns; i++) {
+		add_recv(i);
+		for (j = 0; j < depth; j++)
+			add_request(i);
+	}
+
+	start = now_ns();
+	end = start + (warmup + runtime) * 1000000000ULL;
+	if (!warmup) {
+		measuring = 1;
+		measure_start = start;
+	}
+
+	while (!error) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, count = 0;
+		uint64_t now = now_ns();
+
+		if (now >= end)
+			break;
+		if (!measuring && now >= start + warmup * 1000000000ULL) {
+			measuring = 1;
+			measure_start = now;
+		}
+
+		ret = submit_and_wait();
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			return 1;
+		}
+
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			int op = cqe->user_data >> 56;
+			int idx = (cqe->user_data >> 32) & 0xffffff;
+			int len = cqe->user_data & 0xffffffff;
+
+			if (op == OP_RECV)
+				handle_recv(idx, cqe->res);
+			else
+				handle_send(idx, len, cqe->res);
+			count++;
+		}
+		io_uring_cq_advance(&ring, count);
+	}
+	if (error)
+		return 1;
+
+	end = now_ns() - measure_start;
+	printf("conns=%d depth=%d size=%d secs=%.2f requests=%lu rps=%.0f "
+		"p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f "
+		"est_syscalls_per_req=%.3f\n", nr_conns, depth, msg_size,
+		end / 1e9, requests, requests / (end / 1e9),
+		lat_percentile(&latency, 50.0) / 1000.0,
+		lat_percentile(&latency, 90.0) / 1000.0,
+		lat_percentile(&latency, 99.0) / 1000.0,
+		lat_percentile(&latency, 99.9) / 1000.0, latency.max / 1000.0,
+		requests ? (double) enters / requests : 0.0);
+	return 0;
+}
+
+static int setup_conns(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+	};
+	int i, val = 1;
+
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		fprintf(stderr, "bad host %s\n", host);
+		return 1;
+	}
+
+	for (i = 0; i < nr_conns; i++) {
+		struct conn *c = &conns[i];
+
+		c->fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (c->fd < 0) {
+			perror("socket");
+			return 1;
+		}
+		if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			perror("connect");
+			return 1;
+		}
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+		c->ts = calloc(depth, sizeof(uint64_t));
+		c->rbuf = malloc(msg_size * depth);
+		if (!c->ts || !c->rbuf) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-H host] [-p port] [-c conns] [-d depth] "
+			"[-s size] [-t seconds] [-w warmup seconds]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct io_uring_params params = { };
+	int ret, opt, entries;
+
+	while ((opt = getopt(argc, argv, "H:p:c:d:s:t:w:h")) != -1) {
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			nr_conns = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nr_conns < 1 || nr_conns > 65535 || depth < 1 || msg_size < 1 ||
+	    runtime < 1 || warmup < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	conns = calloc(nr_conns, sizeof(struct conn));
+	sbuf = calloc(1, msg_size);
+	if (!conns || !sbuf) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	if (setup_conns())
+		return 1;
+
+	entries = nr_conns * (depth + 1);
+	if (entries > 4096)
+		entries = 4096;
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+		       IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+	ret = io_uring_queue_init_params(entries, &ring, &params);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	ret = run();
+	io_uring_queue_exit(&ring);
+	return ret;
+}
@@ -12,7 +12,20 @@
  * DEFER_TASKRUN (kernel >= 6.1) is used when available, with automatic
  * fallback to COOP_TASKRUN on older kernels.
  *
- * Usage: ./echo-server [port]
+ * For benchmarking, a few alternatives can be switched on:
+ *
+ *   -b  Recv bundles, a single recv CQE can carry many buffers
+ *   -f  Fixed files, accept straight into the registered file table
+ *   -z  Zero copy sends, from a registered buffer
+ *   -t  Task running mode, defer (DEFER_TASKRUN) or coop (COOP_TASKRUN)
+ *
+ * On SIGINT, the server prints what it did as key=value pairs, including
+ * an estimate of the io_uring_enter(2) calls made, est_syscalls. It's
+ * derived from when liburing needs to enter the kernel, not counted at the
+ * syscall itself. See echo-client.c for a matching
+ * load generator, and echo-bench.sh for comparing the above.
+ *
+ * Usage: ./echo-server [-b] [-f] [-z] [-t defer|coop] [-p port] [port]
  *        Default port: 8000
  *
  * Test with: nc localhost 8000
@@ -22,7 +35,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
 #include "liburing.h"
 #include "helpers.h"
@@ -38,11 +55,24 @@ enum event_type {
 	EVENT_ACCEPT = 1,
 	EVENT_RECV   = 2,
 	EVENT_SEND   = 3,
+	EVENT_CLOSE  = 4,
 };
 
 struct conn {
 	int fd;
 	bool need_recv_rearm;
+	/* the client is done sending, close once the echoes are out */
+	bool closing;
+	/*
+	 * Echoes must go out in the order they came in, so only one chain
+	 * of sends is in flight at the time. Buffers received meanwhile
+	 * wait in a queue linked through send_next[]. A closed connection
+	 * keeps its descriptor until the chain is done, so it can't be
+	 * reused under it.
+	 */
+	int sends;
+	int queue_head;
+	int queue_tail;
 };
 
 static struct io_uring ring;
@@ -51,6 +81,43 @@ static unsigned char *bufs;
 static struct conn conns[MAX_CONNS];
 static int listen_fd;
 
+/* benchmark options */
+static bool use_bundle;
+static bool use_fixed;
+static bool use_zc;
+static bool use_coop;
+
+/*
+ * Recv bundles hand us a number of buffers in one CQE, the one in the CQE
+ * and the ones after it in the buffer ring, rather than consecutive buffer
+ * IDs. Keep track of which buffer ID went into each ring entry, and which
+ * entry each buffer ID went into last, so we know what a bundle holds.
+ */
+static int ring_bids[BUFFERS];
+static unsigned int ring_pos[BUFFERS];
+static unsigned int ring_tail;
+
+static int send_next[BUFFERS];
+static int send_len[BUFFERS];
+
+/*
+ * Connections whose multishot recv ran out of buffers are re-armed once
+ * any buffer comes back, not just one of their own. They may not have any
+ * sends in flight to wait for.
+ */
+static int nr_need_rearm;
+static bool bufs_recycled;
+
+static struct {
+	unsigned long enters;
+	unsigned long recvs;
+	unsigned long recv_bufs;
+	unsigned long sends;
+	unsigned long bytes;
+} stats;
+
+static volatile sig_atomic_t stop;
+
 /*
  * Encode event type, buffer ID, and file descriptor into a single 64-bit
  * user_data value:
@@ -91,6 +158,7 @@ static struct io_uring_sqe *get_sqe(void)
 
 	sqe = io_uring_get_sqe(&ring);
 	if (!sqe) {
+		stats.enters++;
 		io_uring_submit(&ring);
 		sqe = io_uring_get_sqe(&ring);
 	}
@@ -131,8 +199,30 @@ static int setup_buffer_ring(void)
 	for (i = 0; i < BUFFERS; i++) {
 		io_uring_buf_ring_add(buf_ring, bufs + i * BUF_SIZE, BUF_SIZE,
 				      i, io_uring_buf_ring_mask(BUFFERS), i);
+		ring_bids[i] = i;
+		ring_pos[i] = i;
 	}
 	io_uring_buf_ring_advance(buf_ring, BUFFERS);
+	ring_tail = BUFFERS;
+
+	/*
+	 * Zero copy sends are done from the same buffers. Register them all
+	 * as a single buffer, so the kernel doesn't need to pin the pages
+	 * for every send.
+	 */
+	if (use_zc) {
+		struct iovec iov = {
+			.iov_base = bufs,
+			.iov_len = BUF_SIZE * BUFFERS,
+		};
+
+		ret = io_uring_register_buffers(&ring, &iov, 1);
+		if (ret) {
+			fprintf(stderr, "buffer registration failed: %s\n",
+					strerror(-ret));
+			return 1;
+		}
+	}
 
 	return 0;
 }
@@ -154,6 +244,9 @@ static void recycle_buffer(int bid)
 	io_uring_buf_ring_add(buf_ring, bufs + bid * BUF_SIZE, BUF_SIZE,
 			      bid, io_uring_buf_ring_mask(BUFFERS), 0);
 	io_uring_buf_ring_advance(buf_ring, 1);
+	ring_pos[bid] = ring_tail;
+	ring_bids[ring_tail++ & io_uring_buf_ring_mask(BUFFERS)] = bid;
+	bufs_recycled = true;
 }
 
 /*
@@ -167,7 +260,16 @@ static void add_multishot_accept(void)
 	struct io_uring_sqe *sqe;
 
 	sqe = get_sqe();
-	io_uring_prep_multishot_accept(sqe, listen_fd, NULL, NULL, 0);
+	/*
+	 * With fixed files, the new connections are installed straight
+	 * into the registered file table, and the CQE holds the index
+	 * rather than a normal file descriptor.
+	 */
+	if (use_fixed)
+		io_uring_prep_multishot_accept_direct(sqe, listen_fd, NULL,
+						      NULL, 0);
+	else
+		io_uring_prep_multishot_accept(sqe, listen_fd, NULL, NULL, 0);
 	io_uring_sqe_set_data64(sqe, encode_userdata(EVENT_ACCEPT, 0,
 						     listen_fd));
 }
@@ -186,29 +288,143 @@ static void add_recv(int fd)
 	io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
 	sqe->flags |= IOSQE_BUFFER_SELECT;
 	sqe->buf_group = BGID;
+	if (use_bundle)
+		sqe->ioprio |= IORING_RECVSEND_BUNDLE;
+	if (use_fixed)
+		sqe->flags |= IOSQE_FIXED_FILE;
 	io_uring_sqe_set_data64(sqe, encode_userdata(EVENT_RECV, 0, fd));
 }
 
 /*
  * Submit a send echoing data back to the client. The buffer ID is encoded
  * in user_data so we can recycle the buffer when the send completes.
+ * MSG_WAITALL makes io_uring retry short sends until all of it is sent,
+ * and 'link' holds the next send in the chain back until then.
  */
-static void add_send(int fd, int bid, int len)
+static void add_send(int fd, int bid, int len, bool link)
 {
 	struct io_uring_sqe *sqe;
+	int flags = MSG_WAITALL | MSG_NOSIGNAL;
 
 	sqe = get_sqe();
-	io_uring_prep_send(sqe, fd, bufs + bid * BUF_SIZE, len, 0);
+	if (use_zc)
+		io_uring_prep_send_zc_fixed(sqe, fd, bufs + bid * BUF_SIZE,
+					    len, flags, 0, 0);
+	else
+		io_uring_prep_send(sqe, fd, bufs + bid * BUF_SIZE, len, flags);
+	if (use_fixed)
+		sqe->flags |= IOSQE_FIXED_FILE;
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
 	io_uring_sqe_set_data64(sqe, encode_userdata(EVENT_SEND, bid, fd));
+	stats.sends++;
+}
+
+static void queue_send(int fd, int bid, int len)
+{
+	struct conn *c = &conns[fd];
+
+	send_len[bid] = len;
+	send_next[bid] = -1;
+	if (c->queue_tail == -1)
+		c->queue_head = bid;
+	else
+		send_next[c->queue_tail] = bid;
+	c->queue_tail = bid;
+}
+
+/*
+ * Send what's queued for a connection as one linked chain, unless the
+ * previous one is still in flight. A chain split over two submissions
+ * would be two chains, so submit first if it doesn't fit the SQ ring, and
+ * leave whatever is over a full ring for the next chain.
+ */
+static void flush_sends(int fd)
+{
+	struct conn *c = &conns[fd];
+	int bid, n = 0;
+
+	if (c->sends || c->queue_head == -1)
+		return;
+
+	for (bid = c->queue_head; bid != -1 && n < QD; bid = send_next[bid])
+		n++;
+	if (io_uring_sq_space_left(&ring) < (unsigned int) n) {
+		stats.enters++;
+		io_uring_submit(&ring);
+	}
+
+	while (c->sends < n) {
+		bid = c->queue_head;
+		c->queue_head = send_next[bid];
+		c->sends++;
+		add_send(fd, bid, send_len[bid], c->sends < n);
+	}
+	if (c->queue_head == -1)
+		c->queue_tail = -1;
+}
+
+static void release_fd(int fd)
+{
+	if (use_fixed) {
+		struct io_uring_sqe *sqe = get_sqe();
+
+		io_uring_prep_close_direct(sqe, fd);
+		io_uring_sqe_set_data64(sqe, encode_userdata(EVENT_CLOSE, 0, fd));
+		return;
+	}
+	close(fd);
 }
 
 static void close_conn(int fd)
 {
-	if (fd >= 0 && fd < MAX_CONNS) {
-		conns[fd].fd = -1;
+	struct conn *c;
+	int bid;
+
+	if (fd < 0 || fd >= MAX_CONNS) {
+		release_fd(fd);
+		return;
+	}
+
+	c = &conns[fd];
+	/* already closed by an earlier CQE */
+	if (c->fd == -1)
+		return;
+	c->fd = -1;
+	if (c->need_recv_rearm) {
+		c->need_recv_rearm = false;
+		nr_need_rearm--;
+	}
+
+	/* echoes not sent yet won't be */
+	for (bid = c->queue_head; bid != -1; bid = send_next[bid])
+		recycle_buffer(bid);
+	c->queue_head = c->queue_tail = -1;
+
+	/* the last send completion releases it */
+	if (!c->sends)
+		release_fd(fd);
+}
+
+static void need_rearm(int fd)
+{
+	if (!conns[fd].need_recv_rearm) {
+		conns[fd].need_recv_rearm = true;
+		nr_need_rearm++;
+	}
+}
+
+static void rearm_recvs(void)
+{
+	int fd;
+
+	for (fd = 0; fd < MAX_CONNS && nr_need_rearm; fd++) {
+		if (conns[fd].fd == -1 || !conns[fd].need_recv_rearm)
+			continue;
 		conns[fd].need_recv_rearm = false;
+		nr_need_rearm--;
+		add_recv(fd);
 	}
-	close(fd);
 }
 
 /*
@@ -242,6 +458,9 @@ static void handle_accept(struct io_uring_cqe *cqe)
 
 	conns[fd].fd = fd;
 	conns[fd].need_recv_rearm = false;
+	conns[fd].closing = false;
+	conns[fd].sends = 0;
+	conns[fd].queue_head = conns[fd].queue_tail = -1;
 	add_recv(fd);
 }
 
@@ -253,21 +472,27 @@ static void handle_accept(struct io_uring_cqe *cqe)
  * The buffer lifecycle:
  *   1. Kernel picks a buffer from the ring (buffer leaves the ring)
  *   2. We receive data in that buffer via this CQE
- *   3. We submit a send using the same buffer
+ *   3. We queue a send using the same buffer
  *   4. When the send completes, we recycle the buffer back to the ring
  *
  * If ENOBUFS is returned, all buffers are in-flight (consumed by recv
  * but not yet recycled after send). The multishot terminates and will be
- * re-armed when the send handler recycles a buffer.
+ * re-armed once a buffer is recycled.
  */
 static void handle_recv(struct io_uring_cqe *cqe)
 {
 	int fd = decode_fd(cqe->user_data);
 	int bid;
 
-	/* EOF: client disconnected */
+	/*
+	 * EOF: client disconnected, or only shut down its side. Echo what
+	 * it sent before closing.
+	 */
 	if (cqe->res == 0) {
-		close_conn(fd);
+		if (conns[fd].fd != -1 && conns[fd].sends)
+			conns[fd].closing = true;
+		else
+			close_conn(fd);
 		return;
 	}
 
@@ -275,10 +500,11 @@ static void handle_recv(struct io_uring_cqe *cqe)
 		if (cqe->res == -ENOBUFS) {
 			/*
 			 * All provided buffers are in use. The multishot
-			 * recv is terminated. We'll re-arm it from the
-			 * send handler once a buffer is recycled.
+			 * recv is terminated. We'll re-arm it once a
+			 * buffer is recycled.
 			 */
-			conns[fd].need_recv_rearm = true;
+			if (conns[fd].fd != -1)
+				need_rearm(fd);
 			return;
 		}
 		/* Connection error */
@@ -297,10 +523,42 @@ static void handle_recv(struct io_uring_cqe *cqe)
 	}
 
 	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	stats.recvs++;
+	stats.bytes += cqe->res;
 
-	/* Echo the data back to the client */
-	/* TODO: handle short sends for production use */
-	add_send(fd, bid, cqe->res);
+	/*
+	 * Echo the data back to the client. A bundle may have filled more
+	 * than one buffer, those are the next ones in the ring after the
+	 * one in the CQE. Each gets its own send, and is recycled when that
+	 * send is done. If the connection was closed while the recv was
+	 * still armed, the buffers go straight back.
+	 */
+	if (use_bundle) {
+		unsigned int mask = io_uring_buf_ring_mask(BUFFERS);
+		unsigned int pos = ring_pos[bid];
+		int left = cqe->res;
+
+		while (left) {
+			int len = left < BUF_SIZE ? left : BUF_SIZE;
+
+			bid = ring_bids[pos++ & mask];
+			if (conns[fd].fd == -1)
+				recycle_buffer(bid);
+			else
+				queue_send(fd, bid, len);
+			stats.recv_bufs++;
+			left -= len;
+		}
+	} else {
+		if (conns[fd].fd == -1)
+			recycle_buffer(bid);
+		else
+			queue_send(fd, bid, cqe->res);
+		stats.recv_bufs++;
+	}
+	if (conns[fd].fd == -1)
+		return;
+	flush_sends(fd);
 
 	/*
 	 * If IORING_CQE_F_MORE is not set, the multishot recv has
@@ -308,37 +566,80 @@ static void handle_recv(struct io_uring_cqe *cqe)
 	 * above). Mark for re-arm.
 	 */
 	if (!(cqe->flags & IORING_CQE_F_MORE))
-		conns[fd].need_recv_rearm = true;
+		need_rearm(fd);
 }
 
 /*
  * Handle a CQE from a send. Recycle the buffer unconditionally (even on
- * error), and check if the connection's multishot recv needs re-arming.
+ * error), and send what was queued behind the chain once it's done.
+ *
+ * A zero copy send posts two CQEs: the send result with IORING_CQE_F_MORE
+ * set, and a notification with IORING_CQE_F_NOTIF once the kernel is done
+ * with the buffer. Only then can it be recycled, but the data is already
+ * queued on the socket, so the next send can go with the result.
  */
 static void handle_send(struct io_uring_cqe *cqe)
 {
 	int bid = decode_bid(cqe->user_data);
 	int fd = decode_fd(cqe->user_data);
+	struct conn *c = &conns[fd];
+
+	if (cqe->flags & IORING_CQE_F_NOTIF) {
+		recycle_buffer(bid);
+		return;
+	}
 
 	/* Always recycle the buffer, regardless of send success */
-	recycle_buffer(bid);
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		recycle_buffer(bid);
 
-	if (cqe->res < 0) {
-		close_conn(fd);
+	c->sends--;
+	if (c->fd == -1) {
+		if (!c->sends)
+			release_fd(fd);
 		return;
 	}
 
 	/*
-	 * Re-arm multishot recv if it was terminated due to ENOBUFS
-	 * or another non-fatal reason. Check that the connection is
-	 * still alive first -- it may have been closed by an earlier
-	 * CQE in this batch.
+	 * With MSG_WAITALL, a send only comes back short if the connection
+	 * failed. The rest of the chain is then cancelled.
 	 */
-	if (fd < MAX_CONNS && conns[fd].fd != -1 &&
-	    conns[fd].need_recv_rearm) {
-		conns[fd].need_recv_rearm = false;
-		add_recv(fd);
+	if (cqe->res != send_len[bid]) {
+		close_conn(fd);
+		return;
 	}
+
+	flush_sends(fd);
+	if (!c->sends && c->closing)
+		close_conn(fd);
+}
+
+/*
+ * liburing skips the io_uring_enter(2) call if there's nothing to submit
+ * and completions are already waiting. Don't count those, this is where
+ * the est_syscalls estimate comes from.
+ */
+static int submit_and_wait(void)
+{
+	struct __kernel_timespec ts = { .tv_sec = 1 };
+	struct io_uring_cqe *cqe;
+
+	if (io_uring_sq_ready(&ring) || !io_uring_cq_ready(&ring))
+		stats.enters++;
+	return io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+}
+
+static void show_stats(void)
+{
+	printf("recvs=%lu recv_bufs=%lu sends=%lu bytes=%lu est_syscalls=%lu\n",
+		stats.recvs, stats.recv_bufs, stats.sends, stats.bytes,
+		stats.enters);
+}
+
+static void sig_int(int sig)
+{
+	(void) sig;
+	stop = 1;
 }
 
 static int event_loop(void)
@@ -349,9 +650,9 @@ static int event_loop(void)
 
 	add_multishot_accept();
 
-	while (1) {
-		ret = io_uring_submit_and_wait(&ring, 1);
-		if (ret == -EINTR)
+	while (!stop) {
+		ret = submit_and_wait();
+		if (ret == -EINTR || ret == -ETIME)
 			continue;
 		if (ret < 0) {
 			fprintf(stderr, "submit_and_wait: %s\n",
@@ -371,6 +672,8 @@ static int event_loop(void)
 			case EVENT_SEND:
 				handle_send(cqe);
 				break;
+			case EVENT_CLOSE:
+				break;
 			default:
 				fprintf(stderr, "unexpected event type %d\n",
 					decode_type(cqe->user_data));
@@ -379,19 +682,65 @@ static int event_loop(void)
 			count++;
 		}
 		io_uring_cq_advance(&ring, count);
+
+		/*
+		 * Re-arm multishot recvs that were terminated due to
+		 * ENOBUFS or another non-fatal reason.
+		 */
+		if (nr_need_rearm && bufs_recycled)
+			rearm_recvs();
+		bufs_recycled = false;
 	}
 
 	return 0;
 }
 
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-b] [-f] [-z] [-t defer|coop] [-p port] "
+			"[port]\n", name);
+	fprintf(stderr, "\t-b: use recv bundles\n");
+	fprintf(stderr, "\t-f: use fixed files\n");
+	fprintf(stderr, "\t-z: use zero copy sends\n");
+	fprintf(stderr, "\t-t: DEFER_TASKRUN (defer) or COOP_TASKRUN (coop)\n");
+}
+
 int main(int argc, char *argv[])
 {
 	struct io_uring_params params;
+	struct sigaction sa = { };
 	int port = DEFAULT_PORT;
-	int ret, i;
+	int ret, i, opt, val;
 
-	if (argc > 1)
-		port = atoi(argv[1]);
+	while ((opt = getopt(argc, argv, "bfzt:p:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			use_bundle = true;
+			break;
+		case 'f':
+			use_fixed = true;
+			break;
+		case 'z':
+			use_zc = true;
+			break;
+		case 't':
+			if (!strcmp(optarg, "coop")) {
+				use_coop = true;
+			} else if (strcmp(optarg, "defer")) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		port = atoi(argv[optind]);
 
 	for (i = 0; i < MAX_CONNS; i++)
 		conns[i].fd = -1;
@@ -399,6 +748,14 @@ int main(int argc, char *argv[])
 	listen_fd = setup_listening_socket(port, 0);
 	if (listen_fd < 0)
 		return 1;
+	/*
+	 * Echoes larger than a buffer go out as several sends, which Nagle
+	 * would hold back behind the client's delayed ACK. Accepted sockets
+	 * inherit this, direct descriptors included.
+	 */
+	val = 1;
+	if (setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)))
+		perror("setsockopt TCP_NODELAY");
 
 	/*
 	 * DEFER_TASKRUN: completions are only processed when the
@@ -417,7 +774,10 @@ int main(int argc, char *argv[])
 		       IORING_SETUP_SINGLE_ISSUER |
 		       IORING_SETUP_DEFER_TASKRUN;
 
-	ret = io_uring_queue_init_params(QD, &ring, &params);
+	if (use_coop)
+		ret = -EINVAL;
+	else
+		ret = io_uring_queue_init_params(QD, &ring, &params);
 	if (ret == -EINVAL) {
 		/* Kernel < 6.1, fall back to COOP_TASKRUN */
 		params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE |
@@ -430,15 +790,43 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (use_bundle && !(params.features & IORING_FEAT_RECVSEND_BUNDLE)) {
+		fprintf(stderr, "recv bundles not supported\n");
+		io_uring_queue_exit(&ring);
+		close(listen_fd);
+		return 1;
+	}
+
+	/*
+	 * Fixed files need a file table to accept into. Reserve a slot for
+	 * every possible connection, accept allocates them as needed.
+	 */
+	if (use_fixed) {
+		ret = io_uring_register_files_sparse(&ring, MAX_CONNS);
+		if (ret) {
+			fprintf(stderr, "file registration: %s\n",
+					strerror(-ret));
+			io_uring_queue_exit(&ring);
+			close(listen_fd);
+			return 1;
+		}
+	}
+
 	if (setup_buffer_ring()) {
 		io_uring_queue_exit(&ring);
 		close(listen_fd);
 		return 1;
 	}
 
+	/* no SA_RESTART, SIGINT should break us out of waiting */
+	sa.sa_handler = sig_int;
+	sigaction(SIGINT, &sa, NULL);
+
 	printf("echo server listening on port %d\n", port);
+	fflush(stdout);
 
 	event_loop();
+	show_stats();
 
 	cleanup_buffer_ring();
 	close(listen_fd);
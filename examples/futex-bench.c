@@ -0,0 +1,352 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Contention benchmark for the futex primitives in futex-sync.c, against
+ * their pthread counterparts. Each test runs with three implementations:
+ *
+ *   pthread	threads using pthread mutexes, condition variables,
+ *		semaphores and barriers
+ *   fx		threads using the blocking futex-sync.c calls
+ *   ring	as fx, but one participant is an io_uring loop using the
+ *		async calls, waiting on CQEs instead of blocking
+ *
+ * and prints a line of key=value pairs for each. The tests are:
+ *
+ *   mutex	'threads' participants each lock, bump a counter and unlock
+ *		'iterations' times
+ *   sem	two participants hand a token back and forth over two
+ *		semaphores, an op is a round trip
+ *   cond	the same with a mutex, a condition variable and whose turn
+ *		it is
+ *   barrier	'threads' participants go through a barrier 'iterations'
+ *		times
+ *
+ * Usage: ./futex-bench [-t test] [-T threads] [-n iterations]
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "liburing.h"
+#include "futex-sync.h"
+#include "helpers.h"
+
+enum impl {
+	IMPL_PTHREAD,
+	IMPL_FX,
+	IMPL_RING,
+};
+
+static const char *impl_names[] = { "pthread", "fx", "ring" };
+
+enum test {
+	TEST_MUTEX,
+	TEST_SEM,
+	TEST_COND,
+	TEST_BARRIER,
+	NR_TESTS,
+};
+
+static const char *test_names[] = { "mutex", "sem", "cond", "barrier" };
+
+static unsigned long iterations = 200000;
+static unsigned int nr_threads = 4;
+
+static enum impl impl;
+static enum test test;
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	sem_t sem[2];
+	pthread_barrier_t barrier;
+
+	struct fx_mutex fx_mutex;
+	struct fx_cond fx_cond;
+	struct fx_sem fx_sem[2];
+	struct fx_barrier fx_barrier;
+
+	unsigned long counter;
+	int turn;
+	unsigned long serial;
+} sh;
+
+/* participant 0 is the ring loop, for IMPL_RING */
+struct participant {
+	int id;
+	pthread_t thread;
+	struct io_uring ring;
+	struct fx_op op;
+	bool use_ring;
+};
+
+/* run the ring until the async call that returned 'ret' completes */
+static void ring_finish(struct participant *p, int ret)
+{
+	struct io_uring_cqe *cqe;
+
+	while (!ret) {
+		ret = io_uring_submit_and_wait(&p->ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			exit(1);
+		}
+		ret = io_uring_peek_cqe(&p->ring, &cqe);
+		if (ret) {
+			ret = 0;
+			continue;
+		}
+		ret = fx_op_complete(&p->ring, &p->op, cqe);
+		io_uring_cqe_seen(&p->ring, cqe);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "futex wait: %s\n", strerror(-ret));
+		exit(1);
+	}
+}
+
+static void lock(struct participant *p)
+{
+	if (impl == IMPL_PTHREAD)
+		pthread_mutex_lock(&sh.mutex);
+	else if (p->use_ring)
+		ring_finish(p, fx_mutex_lock_async(&p->ring, &sh.fx_mutex,
+						   &p->op));
+	else
+		fx_mutex_lock(&sh.fx_mutex);
+}
+
+static void unlock(struct participant *p)
+{
+	if (impl == IMPL_PTHREAD)
+		pthread_mutex_unlock(&sh.mutex);
+	else
+		fx_mutex_unlock(&sh.fx_mutex);
+}
+
+static void cond_wait(struct participant *p)
+{
+	if (impl == IMPL_PTHREAD)
+		pthread_cond_wait(&sh.cond, &sh.mutex);
+	else if (p->use_ring)
+		ring_finish(p, fx_cond_wait_async(&p->ring, &sh.fx_cond,
+						  &sh.fx_mutex, &p->op));
+	else
+		fx_cond_wait(&sh.fx_cond, &sh.fx_mutex);
+}
+
+static void cond_signal(struct participant *p)
+{
+	if (impl == IMPL_PTHREAD)
+		pthread_cond_signal(&sh.cond);
+	else
+		fx_cond_signal(&sh.fx_cond);
+}
+
+static void sem_down(struct participant *p, int i)
+{
+	if (impl == IMPL_PTHREAD)
+		sem_wait(&sh.sem[i]);
+	else if (p->use_ring)
+		ring_finish(p, fx_sem_wait_async(&p->ring, &sh.fx_sem[i],
+						 &p->op));
+	else
+		fx_sem_wait(&sh.fx_sem[i]);
+}
+
+static void sem_up(struct participant *p, int i)
+{
+	if (impl == IMPL_PTHREAD)
+		sem_post(&sh.sem[i]);
+	else
+		fx_sem_post(&sh.fx_sem[i]);
+}
+
+static bool barrier(struct participant *p)
+{
+	if (impl == IMPL_PTHREAD)
+		return pthread_barrier_wait(&sh.barrier) ==
+			PTHREAD_BARRIER_SERIAL_THREAD;
+	if (p->use_ring) {
+		ring_finish(p, fx_barrier_wait_async(&p->ring, &sh.fx_barrier,
+						     &p->op));
+		return p->op.serial;
+	}
+	return fx_barrier_wait(&sh.fx_barrier);
+}
+
+static void *participant_fn(void *data)
+{
+	struct participant *p = data;
+	unsigned long i;
+	int ret;
+
+	if (p->use_ring) {
+		/* the ring is only ever used from this thread */
+		ret = io_uring_queue_init(8, &p->ring,
+					  IORING_SETUP_SINGLE_ISSUER |
+					  IORING_SETUP_DEFER_TASKRUN);
+		if (ret) {
+			fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < iterations; i++) {
+		switch (test) {
+		case TEST_MUTEX:
+			lock(p);
+			sh.counter++;
+			unlock(p);
+			break;
+		case TEST_SEM:
+			if (p->id) {
+				sem_down(p, 1);
+				sem_up(p, 0);
+			} else {
+				sem_up(p, 1);
+				sem_down(p, 0);
+			}
+			break;
+		case TEST_COND:
+			lock(p);
+			while (sh.turn != p->id)
+				cond_wait(p);
+			sh.turn = !p->id;
+			sh.counter++;
+			cond_signal(p);
+			unlock(p);
+			break;
+		case TEST_BARRIER:
+			if (barrier(p))
+				__atomic_fetch_add(&sh.serial, 1,
+						   __ATOMIC_RELAXED);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (p->use_ring)
+		io_uring_queue_exit(&p->ring);
+	return NULL;
+}
+
+static int run(void)
+{
+	unsigned int i, nr = nr_threads;
+	struct participant *parts;
+	unsigned long long start, nsec;
+	unsigned long ops, count, expected;
+
+	/* the handoff tests are between two */
+	if (test == TEST_SEM || test == TEST_COND)
+		nr = 2;
+
+	memset(&sh, 0, sizeof(sh));
+	pthread_mutex_init(&sh.mutex, NULL);
+	pthread_cond_init(&sh.cond, NULL);
+	sem_init(&sh.sem[0], 0, 0);
+	sem_init(&sh.sem[1], 0, 0);
+	pthread_barrier_init(&sh.barrier, NULL, nr);
+	fx_barrier_init(&sh.fx_barrier, nr);
+
+	parts = calloc(nr, sizeof(*parts));
+	if (!parts)
+		return 1;
+	start = now_ns();
+	for (i = 0; i < nr; i++) {
+		parts[i].id = i;
+		parts[i].use_ring = impl == IMPL_RING && !i;
+		pthread_create(&parts[i].thread, NULL, participant_fn,
+			       &parts[i]);
+	}
+	for (i = 0; i < nr; i++)
+		pthread_join(parts[i].thread, NULL);
+	nsec = now_ns() - start;
+	free(parts);
+
+	ops = iterations;
+	count = sh.counter;
+	switch (test) {
+	case TEST_MUTEX:
+		ops = iterations * nr;
+		expected = ops;
+		break;
+	case TEST_COND:
+		/* every participant takes its turn 'iterations' times */
+		expected = iterations * 2;
+		break;
+	case TEST_BARRIER:
+		count = sh.serial;
+		expected = iterations;
+		break;
+	default:
+		/* a lost handoff would have hung */
+		expected = count;
+		break;
+	}
+	if (count != expected) {
+		fprintf(stderr, "%s/%s: counted %lu, expected %lu\n",
+			test_names[test], impl_names[impl], count, expected);
+		return 1;
+	}
+
+	printf("test=%s impl=%s participants=%u ops=%lu ops_per_sec=%.0f "
+		"ns_per_op=%.1f\n", test_names[test], impl_names[impl], nr,
+		ops, ops / (nsec / 1e9), (double) nsec / ops);
+
+	pthread_barrier_destroy(&sh.barrier);
+	sem_destroy(&sh.sem[0]);
+	sem_destroy(&sh.sem[1]);
+	pthread_cond_destroy(&sh.cond);
+	pthread_mutex_destroy(&sh.mutex);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, only = -1;
+
+	while ((opt = getopt(argc, argv, "t:T:n:h")) != -1) {
+		switch (opt) {
+		case 't':
+			for (only = 0; only < NR_TESTS; only++)
+				if (!strcmp(optarg, test_names[only]))
+					break;
+			if (only == NR_TESTS) {
+				fprintf(stderr, "unknown test %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'T':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t mutex|sem|cond|barrier] "
+					"[-T threads] [-n iterations]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+	if (nr_threads < 2 || !iterations) {
+		fprintf(stderr, "need at least 2 threads and 1 iteration\n");
+		return 1;
+	}
+
+	for (test = 0; test < NR_TESTS; test++) {
+		if (only >= 0 && test != (enum test) only)
+			continue;
+		for (impl = IMPL_PTHREAD; impl <= IMPL_RING; impl++) {
+			if (run())
+				return 1;
+		}
+	}
+	return 0;
+}
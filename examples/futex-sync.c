@@ -0,0 +1,278 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Futex based synchronization for threads and io_uring loops, see
+ * futex-sync.h.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "liburing.h"
+#include "futex-sync.h"
+
+#ifndef FUTEX2_SIZE_U32
+#define FUTEX2_SIZE_U32		0x02
+#define FUTEX2_PRIVATE		FUTEX_PRIVATE_FLAG
+#endif
+
+static void futex_wait(uint32_t *uaddr, uint32_t val)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *uaddr, int nr)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+/*
+ * Queue a wait for '*uaddr' to change from 'val', matching the private
+ * futex the syscalls above use.
+ */
+static int queue_wait(struct io_uring *ring, struct fx_op *op,
+		      uint32_t *uaddr, uint32_t val)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(ring);
+	if (!sqe) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+		if (!sqe)
+			return -EBUSY;
+	}
+	io_uring_prep_futex_wait(sqe, uaddr, val, FUTEX_BITSET_MATCH_ANY,
+				 FUTEX2_SIZE_U32 | FUTEX2_PRIVATE, 0);
+	io_uring_sqe_set_data(sqe, op);
+	return 0;
+}
+
+bool fx_mutex_trylock(struct fx_mutex *m)
+{
+	uint32_t c = 0;
+
+	return __atomic_compare_exchange_n(&m->state, &c, 1, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/*
+ * Once it's been contended, the lock is taken as 2, as there might be
+ * others waiting that the unlock has to wake.
+ */
+static bool mutex_lock_contended(struct fx_mutex *m)
+{
+	return !__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+}
+
+void fx_mutex_lock(struct fx_mutex *m)
+{
+	if (fx_mutex_trylock(m))
+		return;
+	while (!mutex_lock_contended(m))
+		futex_wait(&m->state, 2);
+}
+
+void fx_mutex_unlock(struct fx_mutex *m)
+{
+	if (__atomic_fetch_sub(&m->state, 1, __ATOMIC_RELEASE) != 1) {
+		__atomic_store_n(&m->state, 0, __ATOMIC_RELEASE);
+		futex_wake(&m->state, 1);
+	}
+}
+
+static int mutex_lock_async_contended(struct io_uring *ring,
+				      struct fx_mutex *m, struct fx_op *op)
+{
+	if (mutex_lock_contended(m))
+		return 1;
+	return queue_wait(ring, op, &m->state, 2);
+}
+
+int fx_mutex_lock_async(struct io_uring *ring, struct fx_mutex *m,
+			struct fx_op *op)
+{
+	op->type = FX_MUTEX_LOCK;
+	op->obj = m;
+	if (fx_mutex_trylock(m))
+		return 1;
+	return mutex_lock_async_contended(ring, m, op);
+}
+
+/*
+ * Waiters are counted so signals without any can skip the syscall. A
+ * waiter counts itself before reading the sequence, and a signal bumps the
+ * sequence before reading the count, so either the signal sees the waiter
+ * or the waiter sees the new sequence and doesn't wait for that signal.
+ */
+void fx_cond_wait(struct fx_cond *c, struct fx_mutex *m)
+{
+	uint32_t seq;
+
+	__atomic_fetch_add(&c->waiters, 1, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&c->seq, __ATOMIC_SEQ_CST);
+	fx_mutex_unlock(m);
+	futex_wait(&c->seq, seq);
+	__atomic_fetch_sub(&c->waiters, 1, __ATOMIC_RELAXED);
+
+	/* woken with others maybe, so lock as contended */
+	while (!mutex_lock_contended(m))
+		futex_wait(&m->state, 2);
+}
+
+void fx_cond_signal(struct fx_cond *c)
+{
+	__atomic_fetch_add(&c->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&c->seq, 1);
+}
+
+void fx_cond_broadcast(struct fx_cond *c)
+{
+	__atomic_fetch_add(&c->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&c->seq, INT_MAX);
+}
+
+int fx_cond_wait_async(struct io_uring *ring, struct fx_cond *c,
+		       struct fx_mutex *m, struct fx_op *op)
+{
+	op->type = FX_COND_WAIT;
+	op->obj = c;
+	op->mutex = m;
+	op->relock = false;
+	__atomic_fetch_add(&c->waiters, 1, __ATOMIC_SEQ_CST);
+	op->seq = __atomic_load_n(&c->seq, __ATOMIC_SEQ_CST);
+	fx_mutex_unlock(m);
+	return queue_wait(ring, op, &c->seq, op->seq);
+}
+
+bool fx_sem_trywait(struct fx_sem *s)
+{
+	uint32_t v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+
+	while (v) {
+		if (__atomic_compare_exchange_n(&s->value, &v, v - 1, false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+/* the same counting of waiters as for the condition variable */
+void fx_sem_wait(struct fx_sem *s)
+{
+	while (!fx_sem_trywait(s)) {
+		__atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+		futex_wait(&s->value, 0);
+		__atomic_fetch_sub(&s->waiters, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void fx_sem_post(struct fx_sem *s)
+{
+	__atomic_fetch_add(&s->value, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&s->value, 1);
+}
+
+static int sem_wait_async_slow(struct io_uring *ring, struct fx_sem *s,
+			       struct fx_op *op)
+{
+	__atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+	return queue_wait(ring, op, &s->value, 0);
+}
+
+int fx_sem_wait_async(struct io_uring *ring, struct fx_sem *s,
+		      struct fx_op *op)
+{
+	op->type = FX_SEM_WAIT;
+	op->obj = s;
+	if (fx_sem_trywait(s))
+		return 1;
+	return sem_wait_async_slow(ring, s, op);
+}
+
+void fx_barrier_init(struct fx_barrier *b, unsigned int count)
+{
+	b->count = count;
+	b->arrived = 0;
+	b->seq = 0;
+}
+
+/*
+ * The sequence is read before arriving, so it's the one the last to
+ * arrive bumps. That one resets the count first, anyone seeing the bump
+ * starts the next round from zero.
+ */
+static bool barrier_arrive(struct fx_barrier *b, uint32_t *seq)
+{
+	*seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+	if (__atomic_add_fetch(&b->arrived, 1, __ATOMIC_ACQ_REL) != b->count)
+		return false;
+
+	__atomic_store_n(&b->arrived, 0, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&b->seq, 1, __ATOMIC_RELEASE);
+	futex_wake(&b->seq, INT_MAX);
+	return true;
+}
+
+bool fx_barrier_wait(struct fx_barrier *b)
+{
+	uint32_t seq;
+
+	if (barrier_arrive(b, &seq))
+		return true;
+	while (__atomic_load_n(&b->seq, __ATOMIC_ACQUIRE) == seq)
+		futex_wait(&b->seq, seq);
+	return false;
+}
+
+int fx_barrier_wait_async(struct io_uring *ring, struct fx_barrier *b,
+			  struct fx_op *op)
+{
+	op->type = FX_BARRIER_WAIT;
+	op->obj = b;
+	op->serial = barrier_arrive(b, &op->seq);
+	if (op->serial)
+		return 1;
+	return queue_wait(ring, op, &b->seq, op->seq);
+}
+
+int fx_op_complete(struct io_uring *ring, struct fx_op *op,
+		   struct io_uring_cqe *cqe)
+{
+	struct fx_barrier *b;
+	struct fx_cond *c;
+	struct fx_sem *s;
+
+	/* woken, or the value had already changed when the wait was issued */
+	if (cqe->res < 0 && cqe->res != -EAGAIN)
+		return cqe->res;
+
+	switch (op->type) {
+	case FX_MUTEX_LOCK:
+		return mutex_lock_async_contended(ring, op->obj, op);
+	case FX_COND_WAIT:
+		if (!op->relock) {
+			c = op->obj;
+			__atomic_fetch_sub(&c->waiters, 1, __ATOMIC_RELAXED);
+			op->relock = true;
+		}
+		return mutex_lock_async_contended(ring, op->mutex, op);
+	case FX_SEM_WAIT:
+		s = op->obj;
+		__atomic_fetch_sub(&s->waiters, 1, __ATOMIC_RELAXED);
+		if (fx_sem_trywait(s))
+			return 1;
+		return sem_wait_async_slow(ring, s, op);
+	case FX_BARRIER_WAIT:
+		b = op->obj;
+		if (__atomic_load_n(&b->seq, __ATOMIC_ACQUIRE) != op->seq)
+			return 1;
+		return queue_wait(ring, op, &b->seq, op->seq);
+	}
+	return -EINVAL;
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef LIBURING_EX_FUTEX_SYNC_H
+#define LIBURING_EX_FUTEX_SYNC_H
+
+/*
+ * Mutex, condition variable, semaphore and barrier built on futexes, that
+ * threads can use with blocking calls, and an io_uring event loop can use
+ * without blocking, through IORING_OP_FUTEX_WAIT. Both sides wait on and
+ * wake the same private 32-bit futex words, so a ring loop can hand off to
+ * or wait for a thread pool directly.
+ *
+ * Each async call takes an fx_op owned by the caller. It returns 1 if it
+ * completed right away, like an uncontended lock, 0 if it queued a futex
+ * wait SQE with the fx_op as user_data, or -errno if it couldn't. Pass
+ * the CQE of that wait to fx_op_complete(), which returns 1 once the
+ * operation has completed, or 0 if it lost a race and queued another wait,
+ * whose CQE goes to fx_op_complete() again. Waking is done with the futex
+ * syscall right away, which doesn't block.
+ *
+ * All initializers are zero, except for the barrier's count.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+struct io_uring;
+struct io_uring_cqe;
+
+/* 0 unlocked, 1 locked, 2 locked and maybe contended */
+struct fx_mutex {
+	uint32_t state;
+};
+
+/* bumped by every signal, waiters wait for it to change */
+struct fx_cond {
+	uint32_t seq;
+	uint32_t waiters;
+};
+
+struct fx_sem {
+	uint32_t value;
+	uint32_t waiters;
+};
+
+/* 'count' participants, 'seq' is bumped each time they've all arrived */
+struct fx_barrier {
+	uint32_t count;
+	uint32_t arrived;
+	uint32_t seq;
+};
+
+enum fx_op_type {
+	FX_MUTEX_LOCK,
+	FX_COND_WAIT,
+	FX_SEM_WAIT,
+	FX_BARRIER_WAIT,
+};
+
+/* an async operation in progress, its address is the SQE user_data */
+struct fx_op {
+	enum fx_op_type type;
+	void *obj;
+	/* the mutex of a condition variable wait */
+	struct fx_mutex *mutex;
+	/* condition or barrier sequence being waited out */
+	uint32_t seq;
+	/* condition variable wait is relocking the mutex */
+	bool relock;
+	/* the last one through the barrier, like PTHREAD_BARRIER_SERIAL_THREAD */
+	bool serial;
+};
+
+void fx_mutex_lock(struct fx_mutex *m);
+bool fx_mutex_trylock(struct fx_mutex *m);
+void fx_mutex_unlock(struct fx_mutex *m);
+int fx_mutex_lock_async(struct io_uring *ring, struct fx_mutex *m,
+			struct fx_op *op);
+
+/*
+ * Waits unlock 'm', wait for a signal and lock 'm' again. Wakeups can be
+ * spurious, check the condition in a loop.
+ */
+void fx_cond_wait(struct fx_cond *c, struct fx_mutex *m);
+void fx_cond_signal(struct fx_cond *c);
+void fx_cond_broadcast(struct fx_cond *c);
+int fx_cond_wait_async(struct io_uring *ring, struct fx_cond *c,
+		       struct fx_mutex *m, struct fx_op *op);
+
+void fx_sem_wait(struct fx_sem *s);
+bool fx_sem_trywait(struct fx_sem *s);
+void fx_sem_post(struct fx_sem *s);
+int fx_sem_wait_async(struct io_uring *ring, struct fx_sem *s,
+		      struct fx_op *op);
+
+void fx_barrier_init(struct fx_barrier *b, unsigned int count);
+/* returns true for the last one to arrive */
+bool fx_barrier_wait(struct fx_barrier *b);
+int fx_barrier_wait_async(struct io_uring *ring, struct fx_barrier *b,
+			  struct fx_op *op);
+
+/*
+ * Handle a CQE for 'op'. Returns 1 if the operation completed, 0 if another
+ * wait was queued, or -errno if the futex wait failed.
+ */
+int fx_op_complete(struct io_uring *ring, struct fx_op *op,
+		   struct io_uring_cqe *cqe);
+
+#endif
@@ -8,9 +8,12 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <errno.h>
 
+#include "liburing.h"
 #include "helpers.h"
 
 #ifndef CONFIG_HAVE_MEMFD_CREATE
@@ -21,7 +24,7 @@ int memfd_create(const char *name, unsigned int flags)
 }
 #endif
 
-int setup_listening_socket(int port, int ipv6)
+static int __setup_listening_socket(int port, int ipv6, int reuseport)
 {
 	struct sockaddr_in srv_addr = { };
 	struct sockaddr_in6 srv_addr6 = { };
@@ -45,6 +48,14 @@ int setup_listening_socket(int port, int ipv6)
 		return -1;
 	}
 
+	if (reuseport) {
+		ret = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+		if (ret < 0) {
+			perror("setsockopt(SO_REUSEPORT)");
+			return -1;
+		}
+	}
+
 	if (ipv6) {
 		srv_addr6.sin6_family = AF_INET6;
 		srv_addr6.sin6_port = htons(port);
@@ -70,6 +81,198 @@ int setup_listening_socket(int port, int ipv6)
 	return fd;
 }
 
+int setup_listening_socket(int port, int ipv6)
+{
+	return __setup_listening_socket(port, ipv6, 0);
+}
+
+/*
+ * Like setup_listening_socket(), but sets SO_REUSEPORT so that several
+ * sockets can listen on the same port, with the kernel spreading incoming
+ * connections between them.
+ */
+int setup_reuseport_listening_socket(int port, int ipv6)
+{
+	return __setup_listening_socket(port, ipv6, 1);
+}
+
+/*
+ * Queue a SOCKET_URING_OP_SETSOCKOPT command for each of the 'nr' options
+ * in 'opts' on 'fd', a direct descriptor if 'fixed' is set, linked in
+ * order. The commands only post a completion if they fail, with 'data' as
+ * the user_data. If 'extra' is non-zero, the last command is linked to the
+ * next SQE too, and room is left for 'extra' more SQEs so the caller can
+ * add them without the chain being split across submits. Note that if one
+ * of the commands fails, nothing linked behind it posts a completion, not
+ * even the -ECANCELED ones.
+ *
+ * The option values are read when the commands run, so 'opts' must stay
+ * valid until then. Returns the number of SQEs queued, or -EBUSY if the
+ * SQ ring is too small for the chain.
+ */
+int prep_sockopt_chain(struct io_uring *ring, int fd, bool fixed,
+		       const struct sockopt_val *opts, int nr, int extra,
+		       unsigned long long data)
+{
+	int i;
+
+	if (io_uring_sq_space_left(ring) < (unsigned) (nr + extra)) {
+		io_uring_submit(ring);
+		if (io_uring_sq_space_left(ring) < (unsigned) (nr + extra))
+			return -EBUSY;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+		io_uring_prep_cmd_sock(sqe, SOCKET_URING_OP_SETSOCKOPT, fd,
+				       opts[i].level, opts[i].optname,
+				       (void *) &opts[i].val, sizeof(int));
+		sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+		if (fixed)
+			sqe->flags |= IOSQE_FIXED_FILE;
+		if (i < nr - 1 || extra)
+			sqe->flags |= IOSQE_IO_LINK;
+		io_uring_sqe_set_data64(sqe, data);
+	}
+	return nr;
+}
+
+/*
+ * Queue a linked socket -> setsockopt -> bind -> listen chain, creating a
+ * TCP listening socket for 'addr' in direct descriptor 'slot'. 'opts' are
+ * set before the bind, and like 'addr' must stay valid until the chain
+ * has run. 'extra' works as for prep_sockopt_chain(), eg an extra of 1
+ * allows linking a multishot accept on 'slot' behind the listen.
+ *
+ * The chain posts exactly one completion: the listen's, with 'listen_data'
+ * and 0 if the socket is listening, or that of the step that failed before
+ * it, with 'data'. In the latter case, whatever is linked behind the listen
+ * is cancelled without a completion too.
+ * Returns the number of SQEs queued, or -EBUSY if the SQ ring is too small
+ * for the chain.
+ */
+int prep_listener_chain(struct io_uring *ring, const struct sockaddr *addr,
+			unsigned int addrlen, int slot,
+			const struct sockopt_val *opts, int nr_opts,
+			int backlog, int extra, unsigned long long data,
+			unsigned long long listen_data)
+{
+	unsigned int need = nr_opts + 3 + extra;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	if (io_uring_sq_space_left(ring) < need) {
+		io_uring_submit(ring);
+		if (io_uring_sq_space_left(ring) < need)
+			return -EBUSY;
+	}
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_socket_direct(sqe, addr->sa_family, SOCK_STREAM, 0, slot,
+				    0);
+	sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	io_uring_sqe_set_data64(sqe, data);
+
+	ret = prep_sockopt_chain(ring, slot, true, opts, nr_opts, 2 + extra,
+				 data);
+	if (ret < 0)
+		return ret;
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_bind(sqe, slot, addr, addrlen);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	io_uring_sqe_set_data64(sqe, data);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_listen(sqe, slot, backlog);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	if (extra)
+		sqe->flags |= IOSQE_IO_LINK;
+	io_uring_sqe_set_data64(sqe, listen_data);
+
+	return nr_opts + 3;
+}
+
+unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int lat_bucket(uint64_t val)
+{
+	int msb;
+
+	if (val < LAT_SUB)
+		return val;
+	msb = 63 - __builtin_clzll(val);
+	return (msb - 2) * LAT_SUB + ((val >> (msb - 3)) & (LAT_SUB - 1));
+}
+
+/* the lowest value in bucket 'b' */
+static uint64_t lat_bucket_val(int b)
+{
+	if (b < LAT_SUB)
+		return b;
+	return (uint64_t) (LAT_SUB + (b % LAT_SUB)) << (b / LAT_SUB - 1);
+}
+
+void lat_add(struct lat_hist *h, uint64_t val)
+{
+	h->buckets[lat_bucket(val)]++;
+	h->nr++;
+	h->sum += val;
+	if (val > h->max)
+		h->max = val;
+}
+
+void lat_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+	int i;
+
+	for (i = 0; i < LAT_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->nr += src->nr;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+uint64_t lat_percentile(const struct lat_hist *h, double pct)
+{
+	unsigned long want, seen = 0;
+	int i;
+
+	want = (unsigned long) (h->nr * pct / 100.0);
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > want)
+			return lat_bucket_val(i);
+	}
+	return h->max;
+}
+
+unsigned long long parse_size(const char *str)
+{
+	char *end;
+	unsigned long long val = strtoull(str, &end, 10);
+
+	switch (*end) {
+	case 'g': case 'G':
+		val <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		val <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		val <<= 10;
+	}
+	return val;
+}
+
 void *t_aligned_alloc(size_t alignment, size_t size)
 {
 	void *ret;
@@ -2,11 +2,60 @@
 #ifndef LIBURING_EX_HELPERS_H
 #define LIBURING_EX_HELPERS_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define T_ALIGN_UP(v, align) (((v) + (align) - 1) & ~((align) - 1))
 
 int setup_listening_socket(int port, int ipv6);
+int setup_reuseport_listening_socket(int port, int ipv6);
+
+struct io_uring;
+
+/* an integer socket option, as set with setsockopt(2) */
+struct sockopt_val {
+	int level;
+	int optname;
+	int val;
+};
+
+int prep_sockopt_chain(struct io_uring *ring, int fd, bool fixed,
+		       const struct sockopt_val *opts, int nr, int extra,
+		       unsigned long long data);
+
+struct sockaddr;
+int prep_listener_chain(struct io_uring *ring, const struct sockaddr *addr,
+			unsigned int addrlen, int slot,
+			const struct sockopt_val *opts, int nr_opts,
+			int backlog, int extra, unsigned long long data,
+			unsigned long long listen_data);
+
+/* CLOCK_MONOTONIC, in nsecs */
+unsigned long long now_ns(void);
+
+/*
+ * Log-linear latency histogram, each power of two range is split in LAT_SUB
+ * buckets, so percentiles are off by at most 1/LAT_SUB. Values are in
+ * whatever unit they are added in, nsecs or cycles. Threads keep their own
+ * and lat_merge() them at the end.
+ */
+#define LAT_SUB		8
+#define LAT_BUCKETS	(64 * LAT_SUB)
+
+struct lat_hist {
+	unsigned long buckets[LAT_BUCKETS];
+	unsigned long nr;
+	uint64_t sum;
+	uint64_t max;
+};
+
+void lat_add(struct lat_hist *h, uint64_t val);
+void lat_merge(struct lat_hist *dst, const struct lat_hist *src);
+uint64_t lat_percentile(const struct lat_hist *h, double pct);
+
+/* a size with an optional k, m or g suffix, in bytes */
+unsigned long long parse_size(const char *str);
 
 /*
  * Some Android versions lack aligned_alloc in stdlib.h.
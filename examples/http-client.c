@@ -0,0 +1,513 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Closed-loop HTTP/1.1 load generator for http-server.c. Opens a number of
+ * keep-alive connections, and keeps 'depth' pipelined GET requests in
+ * flight on each. Whenever responses arrive, as many new requests go out
+ * in a single send. Responses are received with multishot recv bundles
+ * from a provided buffer ring, and parsed in place. All of it is driven
+ * from a single DEFER_TASKRUN ring.
+ *
+ * After an optional warmup, it runs for the given time and prints a single
+ * line of key=value pairs:
+ *
+ *   requests, rps		completed requests, and per second
+ *   mb_per_sec			response bytes received, in MB/s
+ *   p50_us .. max_us		request latency, from the request being
+ *				queued to all of its response having arrived
+ *   syscalls_per_req		io_uring_enter(2) calls made by the client,
+ *				per request
+ *   errors			responses that were not a 200
+ *
+ * Usage: ./http-client [-H host] [-p port] [-c conns] [-d depth] [-u path]
+ *			[-t seconds] [-w warmup seconds]
+ *
+ * Example, 64 connections with 16 pipelined requests each:
+ *
+ *	./http-server &
+ *	./http-client -c64 -d16 -u /plaintext
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+#define RECV_BGID	0
+#define RECV_BUFS	1024		/* must be power of 2 */
+#define RECV_BUF_SIZE	4096
+#define LINE_MAX	128
+
+enum {
+	OP_SEND = 1,
+	OP_RECV,
+};
+
+struct conn {
+	int fd;
+	bool recv_armed;
+	bool send_pending;
+	/* requests waiting for the send in flight to finish */
+	unsigned int to_send;
+	/* queue time of each request in flight */
+	uint64_t *ts;
+	unsigned int ts_head, ts_tail;
+
+	/* response parser, bytes of the current line seen so far */
+	unsigned int line_len;
+	bool in_headers;
+	unsigned long content_len;
+	unsigned long body_left;
+	char line[LINE_MAX];
+};
+
+static const char *host = "127.0.0.1";
+static int port = 8080;
+static int nr_conns = 8;
+static int depth = 1;
+static const char *path = "/plaintext";
+static int runtime = 5;
+static int warmup = 1;
+
+static struct io_uring ring;
+static struct io_uring_buf_ring *recv_br;
+static char *recv_bufs;
+static struct conn *conns;
+/* 'depth' copies of the request */
+static char *sbuf;
+static int req_len;
+static int error;
+/* counting is only done while measuring */
+static int measuring;
+
+static unsigned long requests;
+static unsigned long bytes;
+static unsigned long enters;
+static unsigned long bad_status;
+static struct lat_hist latency;
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe) {
+		if (measuring)
+			enters++;
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+	}
+	return sqe;
+}
+
+static uint64_t encode_userdata(int op, int idx, int len)
+{
+	return ((uint64_t) op << 56) | ((uint64_t) idx << 32) | len;
+}
+
+/* send all requests queued on the connection, if none are in flight */
+static void flush_requests(int idx)
+{
+	struct conn *c = &conns[idx];
+	struct io_uring_sqe *sqe;
+	int len;
+
+	if (c->send_pending || !c->to_send)
+		return;
+	len = c->to_send * req_len;
+	c->to_send = 0;
+	c->send_pending = true;
+
+	sqe = get_sqe();
+	io_uring_prep_send(sqe, c->fd, sbuf, len, MSG_WAITALL | MSG_NOSIGNAL);
+	io_uring_sqe_set_data64(sqe, encode_userdata(OP_SEND, idx, len));
+}
+
+static void queue_request(int idx)
+{
+	struct conn *c = &conns[idx];
+
+	c->ts[c->ts_tail++ % depth] = now_ns();
+	c->to_send++;
+}
+
+static void add_recv(int idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	io_uring_prep_recv_multishot(sqe, conns[idx].fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BGID;
+	sqe->ioprio |= IORING_RECVSEND_BUNDLE;
+	io_uring_sqe_set_data64(sqe, encode_userdata(OP_RECV, idx, 0));
+	conns[idx].recv_armed = true;
+}
+
+static void response_done(int idx)
+{
+	struct conn *c = &conns[idx];
+	uint64_t lat = now_ns() - c->ts[c->ts_head++ % depth];
+
+	if (measuring) {
+		lat_add(&latency, lat);
+		requests++;
+	}
+	queue_request(idx);
+}
+
+/* a complete status or header line is in c->line */
+static void parse_line(int idx)
+{
+	struct conn *c = &conns[idx];
+	unsigned int len = c->line_len;
+
+	if (len > LINE_MAX)
+		return;
+	if (len && c->line[len - 1] == '\r')
+		len--;
+
+	if (!c->in_headers) {
+		if (!len)
+			return;
+		if (len < 12 || memcmp(c->line, "HTTP/1.1 200", 12)) {
+			if (measuring)
+				bad_status++;
+		}
+		c->in_headers = true;
+		c->content_len = 0;
+	} else if (!len) {
+		c->in_headers = false;
+		c->body_left = c->content_len;
+		if (!c->body_left)
+			response_done(idx);
+	} else if (len > 15 && !strncasecmp(c->line, "content-length:", 15)) {
+		c->line[len] = '\0';
+		c->content_len = strtoul(c->line + 15, NULL, 10);
+	}
+}
+
+/*
+ * Feed received data to the parser. Lines are only copied to find the
+ * status and Content-Length, the body is skipped over.
+ */
+static void parse(int idx, const char *p, unsigned int len)
+{
+	struct conn *c = &conns[idx];
+	const char *end = p + len;
+
+	while (p < end) {
+		const char *nl;
+		unsigned int n;
+
+		if (c->body_left) {
+			n = end - p;
+			if (n > c->body_left)
+				n = c->body_left;
+			c->body_left -= n;
+			p += n;
+			if (!c->body_left)
+				response_done(idx);
+			continue;
+		}
+
+		nl = memchr(p, '\n', end - p);
+		n = (nl ? nl : end) - p;
+		/* too long to be of interest, parse_line() skips it */
+		if (c->line_len + n >= LINE_MAX) {
+			c->line_len = LINE_MAX + 1;
+			n = 0;
+		}
+		memcpy(c->line + c->line_len, p, n);
+		c->line_len += n;
+		if (!nl)
+			break;
+		p = nl + 1;
+		parse_line(idx);
+		c->line_len = 0;
+	}
+}
+
+static void handle_recv(int idx, struct io_uring_cqe *cqe)
+{
+	unsigned int mask = io_uring_buf_ring_mask(RECV_BUFS);
+	struct conn *c = &conns[idx];
+	int left = cqe->res, bid, nr = 0;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		c->recv_armed = false;
+	if (cqe->res == -ENOBUFS) {
+		add_recv(idx);
+		return;
+	}
+	if (cqe->res <= 0) {
+		fprintf(stderr, "recv: %s\n", cqe->res ? strerror(-cqe->res) :
+			"EOF");
+		error = 1;
+		return;
+	}
+
+	/* buffers are put back in order, a bundle is consecutive IDs */
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	while (left) {
+		int len = left < RECV_BUF_SIZE ? left : RECV_BUF_SIZE;
+		char *buf = recv_bufs + bid * RECV_BUF_SIZE;
+
+		parse(idx, buf, len);
+		io_uring_buf_ring_add(recv_br, buf, RECV_BUF_SIZE, bid, mask,
+				      nr++);
+		bid = (bid + 1) & mask;
+		left -= len;
+	}
+	io_uring_buf_ring_advance(recv_br, nr);
+	if (measuring)
+		bytes += cqe->res;
+
+	flush_requests(idx);
+	if (!c->recv_armed)
+		add_recv(idx);
+}
+
+static void handle_send(int idx, int len, int res)
+{
+	if (res != len) {
+		fprintf(stderr, "send: %s\n", res < 0 ? strerror(-res) :
+			"short send");
+		error = 1;
+		return;
+	}
+	conns[idx].send_pending = false;
+	flush_requests(idx);
+}
+
+/*
+ * liburing skips the io_uring_enter(2) call if there's nothing to submit
+ * and completions are already waiting, only count the ones that happen.
+ */
+static int submit_and_wait(void)
+{
+	struct __kernel_timespec ts = { .tv_nsec = 100000000 };
+	struct io_uring_cqe *cqe;
+
+	if (measuring && (io_uring_sq_ready(&ring) || !io_uring_cq_ready(&ring)))
+		enters++;
+	return io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+}
+
+static int run(void)
+{
+	uint64_t start, end, measure_start = 0;
+	int i, j, ret;
+
+	for (i = 0; i < nr_conns; i++) {
+		add_recv(i);
+		for (j = 0; j < depth; j++)
+			queue_request(i);
+		flush_requests(i);
+	}
+
+	start = now_ns();
+	end = start + (warmup + runtime) * 1000000000ULL;
+	if (!warmup) {
+		measuring = 1;
+		measure_start = start;
+	}
+
+	while (!error) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, count = 0;
+		uint64_t now = now_ns();
+
+		if (now >= end)
+			break;
+		if (!measuring && now >= start + warmup * 1000000000ULL) {
+			measuring = 1;
+			measure_start = now;
+		}
+
+		ret = submit_and_wait();
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			return 1;
+		}
+
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			int op = cqe->user_data >> 56;
+			int idx = (cqe->user_data >> 32) & 0xffffff;
+			int len = cqe->user_data & 0xffffffff;
+
+			if (op == OP_RECV)
+				handle_recv(idx, cqe);
+			else
+				handle_send(idx, len, cqe->res);
+			count++;
+		}
+		io_uring_cq_advance(&ring, count);
+	}
+	if (error)
+		return 1;
+
+	end = now_ns() - measure_start;
+	printf("conns=%d depth=%d path=%s secs=%.2f requests=%lu rps=%.0f "
+		"mb_per_sec=%.1f p50_us=%.1f p90_us=%.1f p99_us=%.1f "
+		"p999_us=%.1f max_us=%.1f syscalls_per_req=%.3f errors=%lu\n",
+		nr_conns, depth, path, end / 1e9, requests,
+		requests / (end / 1e9), bytes / 1e6 / (end / 1e9),
+		lat_percentile(&latency, 50.0) / 1000.0,
+		lat_percentile(&latency, 90.0) / 1000.0,
+		lat_percentile(&latency, 99.0) / 1000.0,
+		lat_percentile(&latency, 99.9) / 1000.0, latency.max / 1000.0,
+		requests ? (double) enters / requests : 0.0, bad_status);
+	return 0;
+}
+
+static int setup_conns(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+	};
+	int i, val = 1;
+
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		fprintf(stderr, "bad host %s\n", host);
+		return 1;
+	}
+
+	for (i = 0; i < nr_conns; i++) {
+		struct conn *c = &conns[i];
+
+		c->fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (c->fd < 0) {
+			perror("socket");
+			return 1;
+		}
+		if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			perror("connect");
+			return 1;
+		}
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+		c->ts = calloc(depth, sizeof(uint64_t));
+		if (!c->ts) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int setup_buffers(void)
+{
+	unsigned int mask = io_uring_buf_ring_mask(RECV_BUFS);
+	int i, ret;
+
+	req_len = snprintf(NULL, 0, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+			   path, host);
+	sbuf = malloc(req_len * depth + 1);
+	recv_bufs = t_aligned_alloc(4096, RECV_BUFS * RECV_BUF_SIZE);
+	if (!sbuf || !recv_bufs) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < depth; i++)
+		sprintf(sbuf + i * req_len, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+			path, host);
+
+	recv_br = io_uring_setup_buf_ring(&ring, RECV_BUFS, RECV_BGID, 0, &ret);
+	if (!recv_br) {
+		fprintf(stderr, "recv buffer ring: %s\n", strerror(-ret));
+		return 1;
+	}
+	for (i = 0; i < RECV_BUFS; i++)
+		io_uring_buf_ring_add(recv_br, recv_bufs + i * RECV_BUF_SIZE,
+				      RECV_BUF_SIZE, i, mask, i);
+	io_uring_buf_ring_advance(recv_br, RECV_BUFS);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-H host] [-p port] [-c conns] [-d depth] "
+			"[-u path] [-t seconds] [-w warmup seconds]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct io_uring_params params = { };
+	int ret, opt, entries;
+
+	while ((opt = getopt(argc, argv, "H:p:c:d:u:t:w:h")) != -1) {
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			nr_conns = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'u':
+			path = optarg;
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nr_conns < 1 || nr_conns > 65535 || depth < 1 || runtime < 1 ||
+	    warmup < 0 || path[0] != '/') {
+		usage(argv[0]);
+		return 1;
+	}
+
+	conns = calloc(nr_conns, sizeof(struct conn));
+	if (!conns) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	if (setup_conns())
+		return 1;
+
+	entries = nr_conns * 2;
+	if (entries > 4096)
+		entries = 4096;
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+		       IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+	ret = io_uring_queue_init_params(entries, &ring, &params);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+	if (!(params.features & IORING_FEAT_RECVSEND_BUNDLE)) {
+		fprintf(stderr, "recv bundles not supported\n");
+		return 1;
+	}
+	if (setup_buffers())
+		return 1;
+
+	ret = run();
+	io_uring_queue_exit(&ring);
+	return ret;
+}
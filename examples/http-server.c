@@ -0,0 +1,718 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * HTTP/1.1 benchmark server, serving a few fixed responses over keep-alive
+ * connections with any amount of request pipelining. It uses:
+ *
+ *   - Multishot accept straight into the registered file table, the
+ *     connections only ever exist as direct descriptors
+ *   - Multishot recv bundles from a shared provided buffer ring, a single
+ *     CQE can carry many buffers worth of requests
+ *   - Send bundles. Every response is rendered once at startup, and a
+ *     request is answered by adding an entry pointing at its response to
+ *     a buffer ring owned by the connection. One send then goes out with
+ *     all the responses queued up to that point.
+ *
+ * Requests are parsed in place in the recv buffers, without copying them
+ * or allocating anything, and the buffers go straight back to the ring.
+ * Only the request line is looked at, headers are skipped and request
+ * bodies are not supported. HTTP/1.0 requests and bad requests get their
+ * response, and the connection is closed after it.
+ *
+ * Paths served: /, /plaintext and /json, the TechEmpower style responses,
+ * and /16k, a 16KB body. Anything else is a 404.
+ *
+ * On SIGINT, prints what it did as key=value pairs, including the number
+ * of io_uring_enter(2) calls. See http-client.c for a matching load
+ * generator.
+ *
+ * Usage: ./http-server [-p port] [-c max conns]
+ *
+ * Test with: curl http://localhost:8080/json
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+#define QD		256
+#define RECV_BGID	0
+#define RECV_BUFS	1024		/* must be power of 2 */
+#define RECV_BUF_SIZE	4096
+/* max responses handed to the kernel per connection, must be power of 2 */
+#define SEND_ENTRIES	256
+/* max pipelined requests per connection, must be power of 2 */
+#define QUEUE_MAX	4096
+#define HDR_LINE_MAX	128
+#define DEFAULT_PORT	8080
+
+enum {
+	OP_ACCEPT = 1,
+	OP_RECV,
+	OP_SEND,
+	OP_SHUTDOWN,
+	OP_CLOSE,
+};
+
+enum {
+	RESP_PLAINTEXT,
+	RESP_JSON,
+	RESP_16K,
+	RESP_NOT_FOUND,
+	RESP_BAD_METHOD,
+	RESP_BAD_REQUEST,
+	NR_RESP,
+};
+
+static const struct {
+	const char *path;
+	int resp;
+} routes[] = {
+	{ "/",		RESP_PLAINTEXT },
+	{ "/plaintext",	RESP_PLAINTEXT },
+	{ "/json",	RESP_JSON },
+	{ "/16k",	RESP_16K },
+};
+
+static const struct {
+	const char *status;
+	const char *type;
+	const char *body;
+	int fill;
+	bool close;
+} resp_defs[NR_RESP] = {
+	[RESP_PLAINTEXT]   = { "200 OK", "text/plain", "Hello, World!" },
+	[RESP_JSON]	   = { "200 OK", "application/json",
+			       "{\"message\":\"Hello, World!\"}" },
+	[RESP_16K]	   = { "200 OK", "application/octet-stream", NULL,
+			       16384 },
+	[RESP_NOT_FOUND]   = { "404 Not Found", "text/plain", "Not Found" },
+	[RESP_BAD_METHOD]  = { "405 Method Not Allowed", "text/plain",
+			       "Method Not Allowed" },
+	[RESP_BAD_REQUEST] = { "400 Bad Request", "text/plain",
+			       "Bad Request", 0, true },
+};
+
+/* the rendered responses, headers and body */
+static struct {
+	char *buf;
+	unsigned int len;
+} resps[NR_RESP];
+
+struct conn {
+	/* responses to send, as buffer group 'slot + 1' */
+	struct io_uring_buf_ring *sbr;
+	/* responses sent, handed to the kernel through sbr, and queued */
+	unsigned int q_head, q_pub, q_tail;
+	unsigned char q_resp[QUEUE_MAX];
+
+	/* parser state, bytes of the current line seen so far */
+	unsigned int line_len;
+	bool in_headers;
+	bool first_cr;
+	int resp;
+	bool resp_close;
+	char line[HDR_LINE_MAX];
+
+	bool recv_armed;
+	bool send_pending;
+	bool send_failed;
+	/* close once the queued responses are sent */
+	bool close_after;
+	bool closing;
+	bool close_issued;
+};
+
+static struct io_uring ring;
+static struct io_uring_buf_ring *recv_br;
+static char *recv_bufs;
+static struct conn *conns;
+static int max_conns = 1024;
+static int listen_fd;
+
+static struct {
+	unsigned long enters;
+	unsigned long conns;
+	unsigned long requests;
+	unsigned long recvs;
+	unsigned long recv_bufs;
+	unsigned long sends;
+	unsigned long errors;
+} stats;
+
+static volatile sig_atomic_t stop;
+
+static __u64 encode_userdata(int op, int slot)
+{
+	return ((__u64) op << 32) | (unsigned int) slot;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe) {
+		stats.enters++;
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+	}
+	if (!sqe) {
+		fprintf(stderr, "cannot get sqe\n");
+		exit(1);
+	}
+	return sqe;
+}
+
+static int render_responses(void)
+{
+	size_t total = 0;
+	char *p;
+	int i;
+
+	for (i = 0; i < NR_RESP; i++)
+		total += 256 + (resp_defs[i].body ? strlen(resp_defs[i].body) :
+				resp_defs[i].fill);
+	p = t_aligned_alloc(4096, total);
+	if (!p)
+		return 1;
+
+	for (i = 0; i < NR_RESP; i++) {
+		int body_len, hdr_len;
+
+		body_len = resp_defs[i].body ? strlen(resp_defs[i].body) :
+			   resp_defs[i].fill;
+		hdr_len = sprintf(p, "HTTP/1.1 %s\r\nServer: liburing\r\n"
+				  "Content-Type: %s\r\nContent-Length: %d\r\n"
+				  "%s\r\n", resp_defs[i].status,
+				  resp_defs[i].type, body_len,
+				  resp_defs[i].close ? "Connection: close\r\n" : "");
+		if (resp_defs[i].body)
+			memcpy(p + hdr_len, resp_defs[i].body, body_len);
+		else
+			memset(p + hdr_len, 'x', body_len);
+		resps[i].buf = p;
+		resps[i].len = hdr_len + body_len;
+		p += T_ALIGN_UP(resps[i].len, 64);
+	}
+	return 0;
+}
+
+static int setup_recv_ring(void)
+{
+	unsigned int mask = io_uring_buf_ring_mask(RECV_BUFS);
+	int ret, i;
+
+	recv_bufs = t_aligned_alloc(4096, RECV_BUFS * RECV_BUF_SIZE);
+	if (!recv_bufs)
+		return 1;
+	recv_br = io_uring_setup_buf_ring(&ring, RECV_BUFS, RECV_BGID, 0, &ret);
+	if (!recv_br) {
+		fprintf(stderr, "recv buffer ring: %s\n", strerror(-ret));
+		return 1;
+	}
+	for (i = 0; i < RECV_BUFS; i++)
+		io_uring_buf_ring_add(recv_br, recv_bufs + i * RECV_BUF_SIZE,
+				      RECV_BUF_SIZE, i, mask, i);
+	io_uring_buf_ring_advance(recv_br, RECV_BUFS);
+	return 0;
+}
+
+static void add_accept(void)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_multishot_accept_direct(sqe, listen_fd, NULL, NULL, 0);
+	io_uring_sqe_set_data64(sqe, encode_userdata(OP_ACCEPT, 0));
+}
+
+static void add_recv(int slot)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_recv_multishot(sqe, slot, NULL, 0, 0);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BGID;
+	sqe->ioprio |= IORING_RECVSEND_BUNDLE;
+	io_uring_sqe_set_data64(sqe, encode_userdata(OP_RECV, slot));
+	conns[slot].recv_armed = true;
+}
+
+/*
+ * Send everything queued on the connection. The kernel takes the buffers
+ * from the head of the connection's buffer ring, and MSG_WAITALL makes it
+ * retry until all of them have been sent.
+ */
+static void add_send(int slot)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_send(sqe, slot, NULL, 0, MSG_WAITALL | MSG_NOSIGNAL);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->buf_group = slot + 1;
+	sqe->ioprio |= IORING_RECVSEND_BUNDLE;
+	io_uring_sqe_set_data64(sqe, encode_userdata(OP_SEND, slot));
+	conns[slot].send_pending = true;
+	stats.sends++;
+}
+
+static void maybe_close(int slot)
+{
+	struct conn *c = &conns[slot];
+	struct io_uring_sqe *sqe;
+
+	if (!c->closing || c->close_issued || c->recv_armed || c->send_pending)
+		return;
+	if (c->q_head != c->q_tail && !c->send_failed)
+		return;
+
+	/*
+	 * If a send failed, the kernel may have consumed only part of what
+	 * was queued. Start the next connection in this slot with a new
+	 * buffer ring rather than try to resync this one.
+	 */
+	if (c->q_head != c->q_pub) {
+		io_uring_free_buf_ring(&ring, c->sbr, SEND_ENTRIES, slot + 1);
+		c->sbr = NULL;
+	}
+	c->close_issued = true;
+	sqe = get_sqe();
+	io_uring_prep_close_direct(sqe, slot);
+	io_uring_sqe_set_data64(sqe, encode_userdata(OP_CLOSE, slot));
+}
+
+/*
+ * Close the connection once the recv and send in flight are done. If the
+ * recv is still armed, shut the socket down to terminate it.
+ */
+static void start_close(int slot)
+{
+	struct conn *c = &conns[slot];
+	struct io_uring_sqe *sqe;
+
+	if (!c->closing && c->recv_armed) {
+		sqe = get_sqe();
+		io_uring_prep_shutdown(sqe, slot, SHUT_RDWR);
+		sqe->flags |= IOSQE_FIXED_FILE;
+		io_uring_sqe_set_data64(sqe, encode_userdata(OP_SHUTDOWN, slot));
+	}
+	c->closing = true;
+	maybe_close(slot);
+}
+
+static void queue_response(int slot, int resp, bool close)
+{
+	struct conn *c = &conns[slot];
+
+	/* pipelining deeper than we can queue, give up on the client */
+	if (c->q_tail - c->q_head == QUEUE_MAX) {
+		stats.errors++;
+		c->close_after = true;
+		start_close(slot);
+		return;
+	}
+	c->q_resp[c->q_tail++ & (QUEUE_MAX - 1)] = resp;
+	stats.requests++;
+	if (close)
+		c->close_after = true;
+}
+
+/*
+ * Hand as many queued responses to the kernel as fit in the buffer ring,
+ * and send them if no send is in flight already. Entries added while a
+ * send is in flight may still go out with it.
+ */
+static void flush_responses(int slot)
+{
+	unsigned int mask = io_uring_buf_ring_mask(SEND_ENTRIES);
+	struct conn *c = &conns[slot];
+	unsigned int nr = 0;
+
+	while (c->q_pub + nr != c->q_tail &&
+	       c->q_pub + nr - c->q_head < SEND_ENTRIES) {
+		unsigned int q = c->q_pub + nr;
+		int resp = c->q_resp[q & (QUEUE_MAX - 1)];
+
+		io_uring_buf_ring_add(c->sbr, resps[resp].buf, resps[resp].len,
+				      q & mask, mask, nr);
+		nr++;
+	}
+	if (nr) {
+		io_uring_buf_ring_advance(c->sbr, nr);
+		c->q_pub += nr;
+	}
+	if (!c->send_pending && c->q_head != c->q_tail)
+		add_send(slot);
+}
+
+static bool path_is(const char *path, int len, const char *match)
+{
+	return strlen(match) == len && !memcmp(path, match, len);
+}
+
+/* pick the response for "METHOD /path HTTP/1.x" in c->line */
+static void parse_request_line(struct conn *c)
+{
+	const char *line = c->line, *path, *sp;
+	unsigned int len = c->line_len;
+	int i, path_len;
+
+	c->resp = RESP_BAD_REQUEST;
+	c->resp_close = true;
+	if (len > HDR_LINE_MAX)
+		return;
+	if (len && line[len - 1] == '\r')
+		len--;
+	if (len < 14 || memcmp(line + len - 8, "HTTP/1.", 7))
+		return;
+	if (line[len - 1] == '0')
+		c->resp_close = true;
+	else if (line[len - 1] == '1')
+		c->resp_close = false;
+	else
+		return;
+
+	sp = memchr(line, ' ', len);
+	if (!sp || sp[1] != '/')
+		return;
+	path = sp + 1;
+	path_len = line + len - 9 - path;
+	if (path_len < 1 || path[path_len] != ' ')
+		return;
+
+	if (sp - line != 3 || memcmp(line, "GET", 3)) {
+		c->resp = RESP_BAD_METHOD;
+		return;
+	}
+	c->resp = RESP_NOT_FOUND;
+	for (i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+		if (path_is(path, path_len, routes[i].path)) {
+			c->resp = routes[i].resp;
+			break;
+		}
+	}
+}
+
+/*
+ * Feed received data to the parser. It jumps from one newline to the next,
+ * a request is complete at the first empty line after the request line.
+ * Only the request line is copied, as it may span buffers.
+ */
+static void parse(int slot, const char *p, unsigned int len)
+{
+	struct conn *c = &conns[slot];
+	const char *end = p + len;
+
+	while (p < end && !c->close_after) {
+		const char *nl = memchr(p, '\n', end - p);
+		unsigned int n = (nl ? nl : end) - p;
+		bool blank;
+
+		if (!c->line_len && n)
+			c->first_cr = *p == '\r';
+		if (!c->in_headers) {
+			/* too long, parse_request_line() will reject it */
+			if (c->line_len + n > HDR_LINE_MAX) {
+				c->line_len = HDR_LINE_MAX + 1;
+				n = 0;
+			}
+			memcpy(c->line + c->line_len, p, n);
+		}
+		c->line_len += n;
+		if (!nl)
+			break;
+		p = nl + 1;
+
+		blank = !c->line_len || (c->line_len == 1 && c->first_cr);
+		if (!c->in_headers) {
+			/* empty lines before a request are allowed */
+			if (!blank) {
+				parse_request_line(c);
+				c->in_headers = true;
+			}
+		} else if (blank) {
+			queue_response(slot, c->resp, c->resp_close);
+			c->in_headers = false;
+		}
+		c->line_len = 0;
+	}
+}
+
+static void handle_accept(struct io_uring_cqe *cqe)
+{
+	int slot = cqe->res;
+	struct conn *c;
+	int ret;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		add_accept();
+	if (slot < 0) {
+		if (slot != -ENFILE)
+			fprintf(stderr, "accept: %s\n", strerror(-slot));
+		return;
+	}
+
+	c = &conns[slot];
+	if (!c->sbr) {
+		c->sbr = io_uring_setup_buf_ring(&ring, SEND_ENTRIES, slot + 1,
+						 0, &ret);
+		c->q_head = c->q_pub = c->q_tail = 0;
+	}
+	c->line_len = 0;
+	c->in_headers = false;
+	c->send_failed = c->close_after = false;
+	c->closing = c->close_issued = false;
+	stats.conns++;
+	if (!c->sbr) {
+		fprintf(stderr, "send buffer ring: %s\n", strerror(-ret));
+		start_close(slot);
+		return;
+	}
+	add_recv(slot);
+}
+
+static void handle_recv(int slot, struct io_uring_cqe *cqe)
+{
+	unsigned int mask = io_uring_buf_ring_mask(RECV_BUFS);
+	struct conn *c = &conns[slot];
+	int left = cqe->res, bid, nr = 0;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		c->recv_armed = false;
+
+	if (cqe->res <= 0) {
+		if (cqe->res == -ENOBUFS && !c->closing) {
+			add_recv(slot);
+			return;
+		}
+		if (cqe->res < 0 && cqe->res != -ECONNRESET &&
+		    cqe->res != -ECANCELED)
+			stats.errors++;
+		start_close(slot);
+		return;
+	}
+
+	/*
+	 * The buffers are always put back in the order they were taken, so
+	 * a bundle is made of consecutive buffer IDs.
+	 */
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	while (left) {
+		int len = left < RECV_BUF_SIZE ? left : RECV_BUF_SIZE;
+		char *buf = recv_bufs + bid * RECV_BUF_SIZE;
+
+		if (!c->closing)
+			parse(slot, buf, len);
+		io_uring_buf_ring_add(recv_br, buf, RECV_BUF_SIZE, bid, mask,
+				      nr++);
+		bid = (bid + 1) & mask;
+		left -= len;
+	}
+	io_uring_buf_ring_advance(recv_br, nr);
+	stats.recvs++;
+	stats.recv_bufs += nr;
+
+	if (!c->closing)
+		flush_responses(slot);
+	if (!c->recv_armed && !c->closing)
+		add_recv(slot);
+	maybe_close(slot);
+}
+
+static void handle_send(int slot, struct io_uring_cqe *cqe)
+{
+	struct conn *c = &conns[slot];
+	int left = cqe->res;
+
+	c->send_pending = false;
+	if (left < 0) {
+		if (left != -EPIPE && left != -ECONNRESET)
+			stats.errors++;
+		c->send_failed = true;
+		start_close(slot);
+		return;
+	}
+
+	/* retire the responses covered by the bundle */
+	while (left > 0 && c->q_head != c->q_pub) {
+		left -= resps[c->q_resp[c->q_head & (QUEUE_MAX - 1)]].len;
+		c->q_head++;
+	}
+	if (left) {
+		fprintf(stderr, "send: short bundle\n");
+		stats.errors++;
+		c->send_failed = true;
+		start_close(slot);
+		return;
+	}
+
+	flush_responses(slot);
+	if (c->close_after && c->q_head == c->q_tail)
+		start_close(slot);
+	else
+		maybe_close(slot);
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe)
+{
+	int slot = cqe->user_data & 0xffffffff;
+
+	switch (cqe->user_data >> 32) {
+	case OP_ACCEPT:
+		handle_accept(cqe);
+		break;
+	case OP_RECV:
+		handle_recv(slot, cqe);
+		break;
+	case OP_SEND:
+		handle_send(slot, cqe);
+		break;
+	case OP_SHUTDOWN:
+	case OP_CLOSE:
+		break;
+	}
+}
+
+/*
+ * liburing skips the io_uring_enter(2) call if there's nothing to submit
+ * and completions are already waiting, only count the ones that happen.
+ */
+static int submit_and_wait(void)
+{
+	struct __kernel_timespec ts = { .tv_sec = 1 };
+	struct io_uring_cqe *cqe;
+
+	if (io_uring_sq_ready(&ring) || !io_uring_cq_ready(&ring))
+		stats.enters++;
+	return io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+}
+
+static int event_loop(void)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, count;
+	int ret;
+
+	add_accept();
+
+	while (!stop) {
+		ret = submit_and_wait();
+		if (ret == -EINTR || ret == -ETIME)
+			continue;
+		if (ret < 0) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			return 1;
+		}
+
+		count = 0;
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			handle_cqe(cqe);
+			count++;
+		}
+		io_uring_cq_advance(&ring, count);
+	}
+	return 0;
+}
+
+static void show_stats(void)
+{
+	printf("conns=%lu requests=%lu recvs=%lu recv_bufs=%lu sends=%lu "
+		"reqs_per_send=%.2f syscalls=%lu syscalls_per_req=%.3f "
+		"errors=%lu\n", stats.conns, stats.requests, stats.recvs,
+		stats.recv_bufs, stats.sends,
+		stats.sends ? (double) stats.requests / stats.sends : 0.0,
+		stats.enters, stats.requests ?
+		(double) stats.enters / stats.requests : 0.0, stats.errors);
+}
+
+static void sig_int(int sig)
+{
+	(void) sig;
+	stop = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-p port] [-c max conns]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct io_uring_params params = { };
+	struct sigaction sa = { };
+	int port = DEFAULT_PORT;
+	int ret, opt, val = 1;
+
+	while ((opt = getopt(argc, argv, "p:c:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			max_conns = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	/* the connection slot is also the send buffer group ID */
+	if (max_conns < 1 || max_conns >= 65535) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	conns = calloc(max_conns, sizeof(struct conn));
+	if (!conns || render_responses()) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	listen_fd = setup_listening_socket(port, 0);
+	if (listen_fd < 0)
+		return 1;
+	/* inherited by the accepted sockets */
+	setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+	params.cq_entries = QD * 16;
+	params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE |
+		       IORING_SETUP_SINGLE_ISSUER |
+		       IORING_SETUP_DEFER_TASKRUN;
+	ret = io_uring_queue_init_params(QD, &ring, &params);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+	if (!(params.features & IORING_FEAT_RECVSEND_BUNDLE)) {
+		fprintf(stderr, "recv/send bundles not supported\n");
+		return 1;
+	}
+	ret = io_uring_register_files_sparse(&ring, max_conns);
+	if (ret) {
+		fprintf(stderr, "file registration: %s\n", strerror(-ret));
+		return 1;
+	}
+	if (setup_recv_ring())
+		return 1;
+
+	/* no SA_RESTART, SIGINT should break us out of waiting */
+	sa.sa_handler = sig_int;
+	sigaction(SIGINT, &sa, NULL);
+
+	printf("http server listening on port %d\n", port);
+	fflush(stdout);
+
+	ret = event_loop();
+	show_stats();
+	io_uring_queue_exit(&ring);
+	close(listen_fd);
+	return ret;
+}
@@ -0,0 +1,534 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Storage benchmark, a small subset of fio built on liburing alone. Runs
+ * a random or sequential read or write workload against a file or block
+ * device, from one or more threads with a ring each, and prints a single
+ * line of key=value pairs:
+ *
+ *   ios, iops, mb_per_sec	completed IOs, per second, and bandwidth
+ *   p50_us .. max_us		completion latency, from the IO being queued
+ *				to its completion being reaped
+ *   est_syscalls_per_io	io_uring_enter(2) calls per IO, for SQPOLL
+ *				only the wakeups and waits. An estimate from
+ *				when liburing needs to enter the kernel, not
+ *				a count taken at the syscall itself.
+ *
+ * Options:
+ *
+ *   -r rw		randread, randwrite, read, write or randrw (default
+ *			randread)
+ *   -M pct		reads in percent for randrw (default 50)
+ *   -b bs		block size (default 4096)
+ *   -d depth		IOs in flight per thread (default 32)
+ *   -s size		size of the region used, a file is created or
+ *			extended to this size (default 1G, or the device
+ *			size for block devices)
+ *   -D			O_DIRECT
+ *   -f			fixed file
+ *   -B			fixed buffers
+ *   -p mode		none, iopoll, hybrid (IORING_SETUP_HYBRID_IOPOLL) or
+ *			sqpoll (default none)
+ *   -S batch		submit in batches of this many IOs (default depth)
+ *   -C batch		wait for this many completions at a time (default 1)
+ *   -j jobs		threads, each with its own ring (default 1)
+ *   -t seconds		runtime (default 5)
+ *
+ * IOPOLL needs O_DIRECT, and a device with polled queues.
+ *
+ * Usage: ./io-bench [options] <file or device>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+enum {
+	RW_RANDREAD,
+	RW_RANDWRITE,
+	RW_READ,
+	RW_WRITE,
+	RW_RANDRW,
+};
+
+static const char *rw_names[] = {
+	"randread", "randwrite", "read", "write", "randrw"
+};
+
+enum {
+	POLL_NONE,
+	POLL_IOPOLL,
+	POLL_HYBRID,
+	POLL_SQPOLL,
+};
+
+static const char *poll_names[] = { "none", "iopoll", "hybrid", "sqpoll" };
+
+static const char *path;
+static int rw = RW_RANDREAD;
+static int read_pct = 50;
+static unsigned int bs = 4096;
+static unsigned int depth = 32;
+static unsigned long long size;
+static bool o_direct;
+static bool fixed_file;
+static bool fixed_bufs;
+static int poll_mode = POLL_NONE;
+static unsigned int submit_batch;
+static unsigned int complete_batch = 1;
+static int nr_jobs = 1;
+static int runtime = 5;
+
+static pthread_barrier_t barrier;
+static volatile int stop;
+
+struct io_slot {
+	void *buf;
+	uint64_t ts;
+};
+
+struct job {
+	pthread_t thread;
+	int id;
+	struct io_uring ring;
+	int fd;
+	struct io_slot *slots;
+	unsigned int *free_slots;
+	unsigned int nr_free;
+	unsigned int inflight;
+	uint64_t rand_state;
+	unsigned long long seq_off;
+	unsigned long ios;
+	unsigned long enters;
+	struct lat_hist lat;
+	int error;
+};
+
+static uint64_t job_rand(struct job *j)
+{
+	/* xorshift64 */
+	j->rand_state ^= j->rand_state << 13;
+	j->rand_state ^= j->rand_state >> 7;
+	j->rand_state ^= j->rand_state << 17;
+	return j->rand_state;
+}
+
+static void prep_io(struct job *j)
+{
+	unsigned int idx = j->free_slots[--j->nr_free];
+	struct io_slot *slot = &j->slots[idx];
+	unsigned long long blocks = size / bs, off;
+	struct io_uring_sqe *sqe;
+	int fd = fixed_file ? 0 : j->fd;
+	bool write;
+
+	switch (rw) {
+	case RW_READ:
+	case RW_WRITE:
+		off = j->seq_off;
+		j->seq_off += bs;
+		if (j->seq_off + bs > size)
+			j->seq_off = 0;
+		write = rw == RW_WRITE;
+		break;
+	default:
+		off = (job_rand(j) % blocks) * bs;
+		write = rw == RW_RANDWRITE ||
+			(rw == RW_RANDRW && job_rand(j) % 100 >= read_pct);
+		break;
+	}
+
+	sqe = io_uring_get_sqe(&j->ring);
+	if (fixed_bufs && write)
+		io_uring_prep_write_fixed(sqe, fd, slot->buf, bs, off, idx);
+	else if (fixed_bufs)
+		io_uring_prep_read_fixed(sqe, fd, slot->buf, bs, off, idx);
+	else if (write)
+		io_uring_prep_write(sqe, fd, slot->buf, bs, off);
+	else
+		io_uring_prep_read(sqe, fd, slot->buf, bs, off);
+	if (fixed_file)
+		sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data64(sqe, idx);
+	slot->ts = now_ns();
+}
+
+/*
+ * Submit, and wait for 'wait_nr' completions. Only count the calls that
+ * should enter the kernel: liburing skips io_uring_enter(2) if there's
+ * nothing to submit and the completions are already there, and with
+ * SQPOLL it only enters to wake up the SQ thread or to wait. This mirrors
+ * liburing's logic rather than seeing the syscalls, hence est_syscalls.
+ */
+static int submit_and_wait(struct job *j, unsigned int wait_nr)
+{
+	struct io_uring *ring = &j->ring;
+	bool sq = io_uring_sq_ready(ring);
+
+	if (wait_nr && io_uring_cq_ready(ring) >= wait_nr)
+		wait_nr = 0;
+	if (poll_mode == POLL_SQPOLL) {
+		if (sq && (IO_URING_READ_ONCE(*ring->sq.kflags) &
+			   IORING_SQ_NEED_WAKEUP))
+			j->enters++;
+		else if (wait_nr)
+			j->enters++;
+	} else if (sq || wait_nr || poll_mode != POLL_NONE) {
+		j->enters++;
+	}
+	return io_uring_submit_and_wait(ring, wait_nr);
+}
+
+static int reap(struct job *j, bool measure)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, count = 0;
+	uint64_t now = now_ns();
+
+	io_uring_for_each_cqe(&j->ring, head, cqe) {
+		unsigned int idx = cqe->user_data;
+
+		if (cqe->res != bs && !j->error) {
+			fprintf(stderr, "job %d: IO %s\n", j->id,
+				cqe->res < 0 ? strerror(-cqe->res) : "short");
+			j->error = 1;
+		}
+		if (measure) {
+			lat_add(&j->lat, now - j->slots[idx].ts);
+			j->ios++;
+		}
+		j->free_slots[j->nr_free++] = idx;
+		count++;
+	}
+	io_uring_cq_advance(&j->ring, count);
+	j->inflight -= count;
+	return count;
+}
+
+static int job_setup(struct job *j)
+{
+	struct io_uring_params p = { };
+	struct iovec *iovs;
+	unsigned int i;
+	int ret, flags;
+
+	flags = O_RDWR;
+	if (o_direct)
+		flags |= O_DIRECT;
+	j->fd = open(path, flags);
+	if (j->fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	switch (poll_mode) {
+	case POLL_HYBRID:
+		p.flags |= IORING_SETUP_HYBRID_IOPOLL;
+		/* fall through */
+	case POLL_IOPOLL:
+		p.flags |= IORING_SETUP_IOPOLL;
+		break;
+	case POLL_SQPOLL:
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 100;
+		break;
+	}
+	if (poll_mode != POLL_SQPOLL)
+		p.flags |= IORING_SETUP_SINGLE_ISSUER |
+			   IORING_SETUP_DEFER_TASKRUN;
+	ret = io_uring_queue_init_params(depth, &j->ring, &p);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	j->slots = calloc(depth, sizeof(*j->slots));
+	j->free_slots = calloc(depth, sizeof(unsigned int));
+	iovs = calloc(depth, sizeof(*iovs));
+	if (!j->slots || !j->free_slots || !iovs)
+		return 1;
+	for (i = 0; i < depth; i++) {
+		j->slots[i].buf = t_aligned_alloc(4096, bs);
+		if (!j->slots[i].buf)
+			return 1;
+		memset(j->slots[i].buf, 0x5a + i, bs);
+		iovs[i].iov_base = j->slots[i].buf;
+		iovs[i].iov_len = bs;
+		j->free_slots[i] = i;
+	}
+	j->nr_free = depth;
+
+	if (fixed_bufs) {
+		ret = io_uring_register_buffers(&j->ring, iovs, depth);
+		if (ret) {
+			fprintf(stderr, "register buffers: %s\n",
+				strerror(-ret));
+			return 1;
+		}
+	}
+	free(iovs);
+	if (fixed_file) {
+		ret = io_uring_register_files(&j->ring, &j->fd, 1);
+		if (ret) {
+			fprintf(stderr, "register files: %s\n", strerror(-ret));
+			return 1;
+		}
+	}
+
+	j->rand_state = 0x9e3779b97f4a7c15ULL * (j->id + 1);
+	/* sequential jobs each start at their own part of the region */
+	j->seq_off = (size / bs / nr_jobs) * j->id * bs;
+	return 0;
+}
+
+static void *job_fn(void *data)
+{
+	struct job *j = data;
+	int ret;
+
+	ret = job_setup(j);
+	if (ret)
+		j->error = 1;
+	pthread_barrier_wait(&barrier);
+	if (ret)
+		return NULL;
+
+	while (!stop && !j->error) {
+		unsigned int queued = 0, wait_nr;
+
+		while (j->nr_free) {
+			prep_io(j);
+			/* the last batch goes out with the wait below */
+			if (++queued == submit_batch && j->nr_free) {
+				ret = submit_and_wait(j, 0);
+				if (ret < 0)
+					break;
+				j->inflight += queued;
+				queued = 0;
+			}
+		}
+		j->inflight += queued;
+
+		wait_nr = complete_batch;
+		if (wait_nr > j->inflight)
+			wait_nr = j->inflight;
+		ret = submit_and_wait(j, wait_nr);
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			j->error = 1;
+			break;
+		}
+		reap(j, true);
+	}
+
+	/* drain, for IOPOLL the kernel needs us to reap what's in flight */
+	while (j->inflight) {
+		if (submit_and_wait(j, 1) < 0)
+			break;
+		reap(j, false);
+	}
+	io_uring_queue_exit(&j->ring);
+	close(j->fd);
+	return NULL;
+}
+
+/* create or extend a regular file to 'size', and find the device size */
+static int prepare_target(void)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		return 1;
+	}
+	if (S_ISBLK(st.st_mode)) {
+		unsigned long long bytes;
+
+		if (ioctl(fd, BLKGETSIZE64, &bytes)) {
+			perror("BLKGETSIZE64");
+			return 1;
+		}
+		if (!size || size > bytes)
+			size = bytes;
+		close(fd);
+		return 0;
+	}
+	if (!size)
+		size = 1ULL << 30;
+
+	/* write it out for real, so reads don't just hit holes */
+	if (st.st_size < size) {
+		unsigned long long off = st.st_size & ~(1024 * 1024ULL - 1);
+
+		buf = malloc(1024 * 1024);
+		if (!buf)
+			return 1;
+		memset(buf, 0xa5, 1024 * 1024);
+		for (; off < size; off += 1024 * 1024) {
+			if (pwrite(fd, buf, 1024 * 1024, off) != 1024 * 1024) {
+				perror("pwrite");
+				return 1;
+			}
+		}
+		fsync(fd);
+		free(buf);
+	}
+	close(fd);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-r rw] [-M read pct] [-b bs] [-d depth] "
+			"[-s size] [-D] [-f] [-B] [-p none|iopoll|hybrid|sqpoll] "
+			"[-S submit batch] [-C complete batch] [-j jobs] "
+			"[-t seconds] <file or device>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct lat_hist lat = { };
+	unsigned long ios = 0, enters = 0;
+	uint64_t start, nsec;
+	struct job *jobs;
+	int opt, i, k, err = 0;
+
+	while ((opt = getopt(argc, argv, "r:M:b:d:s:DfBp:S:C:j:t:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			for (i = 0; i < 5; i++)
+				if (!strcmp(optarg, rw_names[i]))
+					break;
+			if (i == 5) {
+				usage(argv[0]);
+				return 1;
+			}
+			rw = i;
+			break;
+		case 'M':
+			read_pct = atoi(optarg);
+			break;
+		case 'b':
+			bs = parse_size(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'D':
+			o_direct = true;
+			break;
+		case 'f':
+			fixed_file = true;
+			break;
+		case 'B':
+			fixed_bufs = true;
+			break;
+		case 'p':
+			for (i = 0; i < 4; i++)
+				if (!strcmp(optarg, poll_names[i]))
+					break;
+			if (i == 4) {
+				usage(argv[0]);
+				return 1;
+			}
+			poll_mode = i;
+			break;
+		case 'S':
+			submit_batch = atoi(optarg);
+			break;
+		case 'C':
+			complete_batch = atoi(optarg);
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || !bs || depth < 1 || depth > 4096 ||
+	    nr_jobs < 1 || runtime < 1 || read_pct < 0 || read_pct > 100) {
+		usage(argv[0]);
+		return 1;
+	}
+	path = argv[optind];
+	if (!submit_batch || submit_batch > depth)
+		submit_batch = depth;
+	if (complete_batch < 1)
+		complete_batch = 1;
+
+	if (prepare_target())
+		return 1;
+	if (size < bs * (unsigned long long) nr_jobs) {
+		fprintf(stderr, "size too small\n");
+		return 1;
+	}
+
+	jobs = calloc(nr_jobs, sizeof(*jobs));
+	if (!jobs)
+		return 1;
+	pthread_barrier_init(&barrier, NULL, nr_jobs + 1);
+	for (i = 0; i < nr_jobs; i++) {
+		jobs[i].id = i;
+		if (pthread_create(&jobs[i].thread, NULL, job_fn, &jobs[i]))
+			return 1;
+	}
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	for (i = 0; i < runtime * 10; i++) {
+		usleep(100000);
+		for (k = 0; k < nr_jobs; k++)
+			if (jobs[k].error)
+				break;
+		if (k < nr_jobs)
+			break;
+	}
+	stop = 1;
+	nsec = now_ns() - start;
+
+	for (i = 0; i < nr_jobs; i++) {
+		struct job *j = &jobs[i];
+
+		pthread_join(j->thread, NULL);
+		err |= j->error;
+		ios += j->ios;
+		enters += j->enters;
+		lat_merge(&lat, &j->lat);
+	}
+	if (err)
+		return 1;
+
+	printf("rw=%s bs=%u depth=%u jobs=%d direct=%d fixed_file=%d "
+		"fixed_bufs=%d poll=%s batch=%u/%u secs=%.2f ios=%lu iops=%.0f "
+		"mb_per_sec=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f "
+		"max_us=%.1f est_syscalls_per_io=%.3f\n", rw_names[rw], bs, depth,
+		nr_jobs, o_direct, fixed_file, fixed_bufs,
+		poll_names[poll_mode], submit_batch, complete_batch,
+		nsec / 1e9, ios, ios / (nsec / 1e9),
+		ios * (double) bs / 1e6 / (nsec / 1e9),
+		lat_percentile(&lat, 50.0) / 1000.0,
+		lat_percentile(&lat, 99.0) / 1000.0,
+		lat_percentile(&lat, 99.9) / 1000.0, lat.max / 1000.0,
+		ios ? (double) enters / ios : 0.0);
+	return 0;
+}
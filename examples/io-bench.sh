@@ -0,0 +1,75 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Runs a fixed matrix of io-bench workloads, so results can be compared
+# across kernel and liburing versions. Without a target, a loop device is
+# set up over a scratch file in the current directory, and both the file
+# and the loop device are tested. IOPOLL runs that the target doesn't
+# support are reported as failed.
+#
+# Needs root for the loop device. Usage: ./io-bench.sh [file or device]
+#
+# SECS is the runtime of each run, SIZE the size of the scratch file.
+
+secs=${SECS:-5}
+size=${SIZE:-1G}
+
+bench="$(dirname "$0")/io-bench"
+if [ ! -x "$bench" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+runs=(
+	"-r randread -b 4k -d 1 -D"
+	"-r randread -b 4k -d 32 -D"
+	"-r randread -b 4k -d 32 -D -f -B"
+	"-r randread -b 4k -d 32 -D -f -B -S 8 -C 8"
+	"-r randread -b 4k -d 32 -D -f -B -p sqpoll"
+	"-r randread -b 4k -d 32 -D -f -B -p iopoll"
+	"-r randread -b 4k -d 32 -D -f -B -p hybrid"
+	"-r randread -b 4k -d 32 -D -j 4"
+	"-r randwrite -b 4k -d 32 -D"
+	"-r randrw -M 70 -b 4k -d 32 -D"
+	"-r read -b 128k -d 8 -D"
+	"-r write -b 128k -d 8 -D"
+	"-r randread -b 4k -d 32"
+)
+
+run_target() {
+	echo "== $1"
+	printf "%-45s %10s %10s %9s %9s %10s\n" "args" "iops" "mb/s" "p50_us" \
+		"p99_us" "est_sys/io"
+	for args in "${runs[@]}"; do
+		out=$($bench $args -s $size -t $secs "$1" 2>&1)
+		if [ $? -ne 0 ]; then
+			printf "%-45s failed: %s\n" "$args" "$(echo "$out" | tail -1)"
+			continue
+		fi
+		printf "%-45s %10s %10s %9s %9s %10s\n" "$args" \
+			"$(echo "$out" | sed -n 's/.* iops=\([0-9.]*\).*/\1/p')" \
+			"$(echo "$out" | sed -n 's/.*mb_per_sec=\([0-9.]*\).*/\1/p')" \
+			"$(echo "$out" | sed -n 's/.*p50_us=\([0-9.]*\).*/\1/p')" \
+			"$(echo "$out" | sed -n 's/.*p99_us=\([0-9.]*\).*/\1/p')" \
+			"$(echo "$out" | sed -n 's/.*est_syscalls_per_io=\([0-9.]*\).*/\1/p')"
+	done
+}
+
+if [ -n "$1" ]; then
+	run_target "$1"
+	exit 0
+fi
+
+file=./io-bench.$$
+loop=
+cleanup() {
+	[ -n "$loop" ] && losetup -d $loop
+	rm -f $file
+}
+trap cleanup EXIT
+
+# io-bench lays the file out, so the loop device has real blocks
+$bench -s $size -t 1 -d 1 $file > /dev/null || exit 1
+run_target $file
+loop=$(losetup -f --show --direct-io=on $file) || exit 1
+run_target $loop
@@ -1,6 +1,15 @@
 /* SPDX-License-Identifier: MIT */
 /*
  * gcc -Wall -O2 -D_GNU_SOURCE -o io_uring-cp io_uring-cp.c -luring
+ *
+ * Copies a file with up to 'qd' reads and writes in flight, each write
+ * queued once the read for its chunk is done. By default the chunks are
+ * read and written with fixed buffers on fixed files. If buffers can't be
+ * registered, plain reads and writes are used. With -m splice, chunks go
+ * through a pipe each instead, without being copied to userspace.
+ *
+ * With -a, the block size and queue depth are tuned while copying, see
+ * copy_tuner_done(). The parameters used are printed at the end.
  */
 #include <stdio.h>
 #include <fcntl.h>
@@ -14,19 +23,45 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include "liburing.h"
+#include "helpers.h"
+#include "copy-tuner.h"
 
 #define QD	64
 #define BS	(32*1024)
 
+#define MAX_QD	64
+#define MAX_BS	(1024*1024)
+
+enum {
+	METHOD_FIXED,
+	METHOD_RW,
+	METHOD_SPLICE,
+};
+
+static const char *method_names[] = { "fixed", "rw", "splice" };
+
 static int infd, outfd;
+/* what requests use for the files, the fixed ones if registered */
+static int in_file, out_file, file_flags;
+static int method = METHOD_FIXED;
+static struct copy_tuner tuner;
+static int tune;
 
 struct io_data {
 	int read;
+	int index;
 	off_t first_offset, offset;
 	size_t first_len;
+	unsigned long long start_ns;
 	struct iovec iov;
+	int pipe[2];
 };
 
+/* one per chunk in flight, with a buffer or pipe each */
+static struct io_data *slots;
+static int *free_slots;
+static int nr_free_slots;
+
 static int setup_context(unsigned entries, struct io_uring *ring)
 {
 	int ret;
@@ -40,6 +75,77 @@ static int setup_context(unsigned entries, struct io_uring *ring)
 	return 0;
 }
 
+/*
+ * Sets up 'nr' slots of '*size' bytes, and registers the files and buffers.
+ * Falls back to plain reads and writes if the buffers can't be registered,
+ * and to normal file descriptors if the files can't. Pipes may not be as
+ * large as asked for, '*size' is lowered to the smallest one if so.
+ */
+static int setup_slots(struct io_uring *ring, unsigned nr, unsigned *size)
+{
+	struct iovec *iovs;
+	int fds[2] = { infd, outfd };
+	unsigned i;
+	int ret;
+
+	slots = calloc(nr, sizeof(*slots));
+	free_slots = calloc(nr, sizeof(int));
+	iovs = calloc(nr, sizeof(*iovs));
+	if (!slots || !free_slots || !iovs)
+		return 1;
+
+	for (i = 0; i < nr; i++) {
+		struct io_data *data = &slots[i];
+
+		data->index = i;
+		if (method == METHOD_SPLICE) {
+			if (pipe(data->pipe) < 0) {
+				perror("pipe");
+				return 1;
+			}
+			/* so a splice into it is never short */
+			fcntl(data->pipe[0], F_SETPIPE_SZ, *size);
+			ret = fcntl(data->pipe[0], F_GETPIPE_SZ);
+			if (ret < 0) {
+				perror("F_GETPIPE_SZ");
+				return 1;
+			}
+			if ((unsigned) ret < *size)
+				*size = ret;
+		} else {
+			iovs[i].iov_base = t_aligned_alloc(4096, *size);
+			iovs[i].iov_len = *size;
+			if (!iovs[i].iov_base)
+				return 1;
+		}
+		free_slots[nr_free_slots++] = i;
+	}
+
+	if (method == METHOD_FIXED) {
+		ret = io_uring_register_buffers(ring, iovs, nr);
+		if (ret) {
+			fprintf(stderr, "register buffers: %s, using read/write\n",
+					strerror(-ret));
+			method = METHOD_RW;
+		}
+	}
+	if (method != METHOD_SPLICE) {
+		for (i = 0; i < nr; i++)
+			slots[i].iov.iov_base = iovs[i].iov_base;
+	}
+	free(iovs);
+
+	in_file = infd;
+	out_file = outfd;
+	ret = io_uring_register_files(ring, fds, 2);
+	if (!ret) {
+		in_file = 0;
+		out_file = 1;
+		file_flags = IOSQE_FIXED_FILE;
+	}
+	return 0;
+}
+
 static int get_file_size(int fd, off_t *size)
 {
 	struct stat st;
@@ -69,53 +175,84 @@ static void queue_prepped(struct io_uring *ring, struct io_data *data)
 	sqe = io_uring_get_sqe(ring);
 	assert(sqe);
 
-	if (data->read)
-		io_uring_prep_readv(sqe, infd, &data->iov, 1, data->offset);
-	else
-		io_uring_prep_writev(sqe, outfd, &data->iov, 1, data->offset);
+	switch (method) {
+	case METHOD_FIXED:
+		if (data->read)
+			io_uring_prep_read_fixed(sqe, in_file, data->iov.iov_base,
+						 data->iov.iov_len, data->offset,
+						 data->index);
+		else
+			io_uring_prep_write_fixed(sqe, out_file, data->iov.iov_base,
+						  data->iov.iov_len, data->offset,
+						  data->index);
+		sqe->flags |= file_flags;
+		break;
+	case METHOD_RW:
+		if (data->read)
+			io_uring_prep_readv(sqe, in_file, &data->iov, 1, data->offset);
+		else
+			io_uring_prep_writev(sqe, out_file, &data->iov, 1, data->offset);
+		sqe->flags |= file_flags;
+		break;
+	case METHOD_SPLICE:
+		/* the pipe end isn't a fixed file, only the file end can be */
+		if (data->read) {
+			io_uring_prep_splice(sqe, in_file, data->offset,
+					     data->pipe[1], -1, data->iov.iov_len,
+					     file_flags ? SPLICE_F_FD_IN_FIXED : 0);
+		} else {
+			io_uring_prep_splice(sqe, data->pipe[0], -1, out_file,
+					     data->offset, data->iov.iov_len, 0);
+			sqe->flags |= file_flags;
+		}
+		break;
+	}
 
 	io_uring_sqe_set_data(sqe, data);
 }
 
 static int queue_read(struct io_uring *ring, off_t size, off_t offset)
 {
-	struct io_uring_sqe *sqe;
 	struct io_data *data;
 
-	data = malloc(size + sizeof(*data));
-	if (!data)
+	if (!nr_free_slots || !io_uring_sq_space_left(ring))
 		return 1;
-
-	sqe = io_uring_get_sqe(ring);
-	if (!sqe) {
-		free(data);
-		return 1;
-	}
+	data = &slots[free_slots[--nr_free_slots]];
 
 	data->read = 1;
 	data->offset = data->first_offset = offset;
+	data->start_ns = now_ns();
 
-	data->iov.iov_base = data + 1;
 	data->iov.iov_len = size;
 	data->first_len = size;
 
-	io_uring_prep_readv(sqe, infd, &data->iov, 1, offset);
-	io_uring_sqe_set_data(sqe, data);
+	queue_prepped(ring, data);
 	return 0;
 }
 
 static void queue_write(struct io_uring *ring, struct io_data *data)
 {
 	data->read = 0;
+	data->iov.iov_base = (char *) data->iov.iov_base -
+			     (data->offset - data->first_offset);
 	data->offset = data->first_offset;
-
-	data->iov.iov_base = data + 1;
 	data->iov.iov_len = data->first_len;
 
 	queue_prepped(ring, data);
 	io_uring_submit(ring);
 }
 
+static void done_write(struct io_data *data)
+{
+	/* the buffer may have been advanced by short writes */
+	data->iov.iov_base = (char *) data->iov.iov_base -
+			     (data->offset - data->first_offset);
+	data->offset = data->first_offset;
+	if (tune)
+		copy_tuner_done(&tuner, data->first_len, data->start_ns);
+	free_slots[nr_free_slots++] = data->index;
+}
+
 static int copy_file(struct io_uring *ring, off_t insize)
 {
 	unsigned long reads, writes;
@@ -129,7 +266,7 @@ static int copy_file(struct io_uring *ring, off_t insize)
 	while (insize || write_left) {
 		unsigned long had_reads;
 		int got_comp;
-	
+
 		/*
 		 * Queue up as many reads as we can
 		 */
@@ -137,10 +274,10 @@ static int copy_file(struct io_uring *ring, off_t insize)
 		while (insize) {
 			off_t this_size = insize;
 
-			if (reads + writes >= QD)
+			if (reads + writes >= tuner.qd)
 				break;
-			if (this_size > BS)
-				this_size = BS;
+			if (this_size > tuner.bs)
+				this_size = tuner.bs;
 			else if (!this_size)
 				break;
 
@@ -196,6 +333,9 @@ static int copy_file(struct io_uring *ring, off_t insize)
 				fprintf(stderr, "cqe failed: %s\n",
 						strerror(-cqe->res));
 				return 1;
+			} else if (!cqe->res) {
+				fprintf(stderr, "unexpected end of file\n");
+				return 1;
 			} else if ((size_t)cqe->res != data->iov.iov_len) {
 				/* Short read/write, adjust and requeue */
 				data->iov.iov_base += cqe->res;
@@ -217,7 +357,7 @@ static int copy_file(struct io_uring *ring, off_t insize)
 				reads--;
 				writes++;
 			} else {
-				free(data);
+				done_write(data);
 				writes--;
 			}
 			io_uring_cqe_seen(ring, cqe);
@@ -238,45 +378,117 @@ static int copy_file(struct io_uring *ring, off_t insize)
 			return 1;
 		}
 		data = io_uring_cqe_get_data(cqe);
-		free(data);
-		writes--;
+		if ((size_t)cqe->res != data->iov.iov_len) {
+			data->iov.iov_base += cqe->res;
+			data->iov.iov_len -= cqe->res;
+			data->offset += cqe->res;
+			queue_prepped(ring, data);
+			io_uring_submit(ring);
+		} else {
+			done_write(data);
+			writes--;
+		}
 		io_uring_cqe_seen(ring, cqe);
 	}
 
 	return 0;
 }
 
+static void usage(const char *name)
+{
+	printf("%s: [-b bs] [-q qd] [-a] [-m fixed|rw|splice] infile outfile\n",
+		name);
+}
+
 int main(int argc, char *argv[])
 {
+	unsigned bs = BS, qd = QD;
+	unsigned long long start, nsec;
 	struct io_uring ring;
 	off_t insize;
-	int ret;
-
-	if (argc < 3) {
-		printf("%s: infile outfile\n", argv[0]);
+	int ret, opt;
+
+	while ((opt = getopt(argc, argv, "b:q:am:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			qd = atoi(optarg);
+			break;
+		case 'a':
+			tune = 1;
+			break;
+		case 'm':
+			for (method = 0; method <= METHOD_SPLICE; method++)
+				if (!strcmp(optarg, method_names[method]))
+					break;
+			if (method > METHOD_SPLICE) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind < 2 || bs < 512 || bs > MAX_BS || !qd ||
+	    qd > MAX_QD) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	infd = open(argv[1], O_RDONLY);
+	infd = open(argv[optind], O_RDONLY);
 	if (infd < 0) {
 		perror("open infile");
 		return 1;
 	}
-	outfd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	outfd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	if (outfd < 0) {
 		perror("open outfile");
 		return 1;
 	}
+	if (get_file_size(infd, &insize))
+		return 1;
+
+	/* sized for the largest the tuner may pick */
+	if (tune) {
+		bs = MAX_BS;
+		qd = MAX_QD;
+	}
 
-	if (setup_context(QD, &ring))
+	if (setup_context(qd, &ring))
 		return 1;
-	if (get_file_size(infd, &insize))
+	if (setup_slots(&ring, qd, &bs))
 		return 1;
 
+	if (tune) {
+		unsigned long long step = insize / 32;
+
+		if (step < 4 * 1024 * 1024)
+			step = 4 * 1024 * 1024;
+		copy_tuner_init(&tuner, bs, MAX_QD, step);
+	} else {
+		tuner.bs = bs;
+		tuner.qd = qd;
+	}
+
+	start = now_ns();
 	ret = copy_file(&ring, insize);
+	nsec = now_ns() - start;
 
 	close(infd);
 	close(outfd);
 	io_uring_queue_exit(&ring);
-	return ret;
+	if (ret)
+		return ret;
+
+	printf("method=%s fixed_files=%d bs=%u qd=%u tuned=%d mb_per_sec=%.1f\n",
+		method_names[method], !!file_flags, tuner.bs, tuner.qd,
+		tune && tuner.state == TUNE_DONE, insize / 1e6 / (nsec / 1e9));
+	if (tune && tuner.state == TUNE_DONE)
+		printf("tuned_mb_per_sec=%.1f tuned_lat_us=%.1f\n",
+			tuner.rate / 1e6, tuner.lat_us);
+	return 0;
 }
@@ -1,9 +1,30 @@
 /* SPDX-License-Identifier: MIT */
-
+/*
+ * UDP echo server, using multishot recvmsg with provided buffers and
+ * sendmsg to echo each datagram back where it came from.
+ *
+ * With -g, UDP_GRO is enabled on the socket, so the kernel may hand us a
+ * number of same sized datagrams coalesced into a single receive, with the
+ * segment size in a UDP_GRO cmsg. Those are split into their datagrams,
+ * and echoed back in a single sendmsg with a UDP_SEGMENT cmsg, letting the
+ * kernel segment them again (GSO).
+ *
+ * With -c <port>, it acts as a load generator for the server instead. It
+ * keeps sending datagrams of -s bytes to the server on the loopback for -t
+ * seconds, -n at a time in a single GSO sendmsg with -g, and counts the
+ * echoes. Both ends report packets per second and CPU time per packet,
+ * the server when interrupted. Example:
+ *
+ *	./io_uring-udp -g -p 9000 &
+ *	./io_uring-udp -g -c 9000 -n 32 -s 1200
+ */
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netinet/udp.h>
@@ -17,9 +38,35 @@
 #define BUFFERS CQES
 #define CONTROLLEN 0
 
+/*
+ * GRO coalesces up to 64KB, size buffers to fit that plus the recvmsg
+ * header, and use fewer of them.
+ */
+#define GSO_BUF_SHIFT 17 /* 128k */
+#define GSO_BUFFERS 128
+#define GSO_CONTROLLEN CMSG_SPACE(sizeof(int))
+#define GSO_MAX_SEGS 64
+
+/* user_data of the load generator sends, recv uses BUFFERS + 1 */
+#define TX_DATA (BUFFERS + 2)
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
 struct sendmsg_ctx {
 	struct msghdr msg;
 	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+};
+
+struct udp_stats {
+	unsigned long rx_pkts;
+	unsigned long rx_cqes;
+	unsigned long tx_pkts;
+	unsigned long tx_calls;
+	struct timespec first, last;
+	struct rusage ru_start;
 };
 
 struct ctx {
@@ -28,12 +75,25 @@ struct ctx {
 	unsigned char *buffer_base;
 	struct msghdr msg;
 	int buf_shift;
+	int nr_bufs;
 	int af;
 	bool verbose;
+	bool gso;
 	struct sendmsg_ctx send[BUFFERS];
 	size_t buf_ring_size;
+
+	/* load generator */
+	bool client;
+	int seg_size;
+	int nr_segs;
+	unsigned char *tx_buf;
+	struct sendmsg_ctx tx;
+
+	struct udp_stats stats;
 };
 
+static volatile sig_atomic_t stop;
+
 static size_t buffer_size(struct ctx *ctx)
 {
 	return (size_t)1 << ctx->buf_shift;
@@ -49,10 +109,10 @@ static int setup_buffer_pool(struct ctx *ctx)
 	int ret, i;
 	void *mapped;
 	struct io_uring_buf_reg reg = { .ring_addr = 0,
-					.ring_entries = BUFFERS,
+					.ring_entries = ctx->nr_bufs,
 					.bgid = 0 };
 
-	ctx->buf_ring_size = (sizeof(struct io_uring_buf) + buffer_size(ctx)) * BUFFERS;
+	ctx->buf_ring_size = (sizeof(struct io_uring_buf) + buffer_size(ctx)) * ctx->nr_bufs;
 	mapped = mmap(NULL, ctx->buf_ring_size, PROT_READ | PROT_WRITE,
 		      MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
 	if (mapped == MAP_FAILED) {
@@ -65,11 +125,11 @@ static int setup_buffer_pool(struct ctx *ctx)
 
 	reg = (struct io_uring_buf_reg) {
 		.ring_addr = (unsigned long)ctx->buf_ring,
-		.ring_entries = BUFFERS,
+		.ring_entries = ctx->nr_bufs,
 		.bgid = 0
 	};
 	ctx->buffer_base = (unsigned char *)ctx->buf_ring +
-			   sizeof(struct io_uring_buf) * BUFFERS;
+			   sizeof(struct io_uring_buf) * ctx->nr_bufs;
 
 	ret = io_uring_register_buf_ring(&ctx->ring, &reg, 0);
 	if (ret) {
@@ -79,11 +139,11 @@ static int setup_buffer_pool(struct ctx *ctx)
 		return ret;
 	}
 
-	for (i = 0; i < BUFFERS; i++) {
+	for (i = 0; i < ctx->nr_bufs; i++) {
 		io_uring_buf_ring_add(ctx->buf_ring, get_buffer(ctx, i), buffer_size(ctx), i,
-				      io_uring_buf_ring_mask(BUFFERS), i);
+				      io_uring_buf_ring_mask(ctx->nr_bufs), i);
 	}
-	io_uring_buf_ring_advance(ctx->buf_ring, BUFFERS);
+	io_uring_buf_ring_advance(ctx->buf_ring, ctx->nr_bufs);
 
 	return 0;
 }
@@ -112,7 +172,7 @@ static int setup_context(struct ctx *ctx)
 
 	memset(&ctx->msg, 0, sizeof(ctx->msg));
 	ctx->msg.msg_namelen = sizeof(struct sockaddr_storage);
-	ctx->msg.msg_controllen = CONTROLLEN;
+	ctx->msg.msg_controllen = ctx->gso ? GSO_CONTROLLEN : CONTROLLEN;
 	return ret;
 }
 
@@ -210,7 +270,7 @@ static int add_recv(struct ctx *ctx, int idx)
 static void recycle_buffer(struct ctx *ctx, int idx)
 {
 	io_uring_buf_ring_add(ctx->buf_ring, get_buffer(ctx, idx), buffer_size(ctx), idx,
-			      io_uring_buf_ring_mask(BUFFERS), 0);
+			      io_uring_buf_ring_mask(ctx->nr_bufs), 0);
 	io_uring_buf_ring_advance(ctx->buf_ring, 1);
 }
 
@@ -224,12 +284,103 @@ static int process_cqe_send(struct ctx *ctx, struct io_uring_cqe *cqe)
 	return 0;
 }
 
+/*
+ * Attach a UDP_SEGMENT cmsg to 'msg', telling the kernel to split the
+ * payload into datagrams of 'seg_size' bytes.
+ */
+static void set_gso(struct sendmsg_ctx *s, uint16_t seg_size)
+{
+	struct cmsghdr *cmsg;
+
+	s->msg.msg_control = s->control;
+	s->msg.msg_controllen = sizeof(s->control);
+	cmsg = CMSG_FIRSTHDR(&s->msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	memcpy(CMSG_DATA(cmsg), &seg_size, sizeof(seg_size));
+}
+
+/*
+ * The segment size of a GRO coalesced receive is passed in a UDP_GRO
+ * cmsg. Without one, the payload is a single datagram.
+ */
+static unsigned int gro_seg_size(struct ctx *ctx, struct io_uring_recvmsg_out *o,
+				 unsigned int len)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = io_uring_recvmsg_cmsg_firsthdr(o, &ctx->msg); cmsg;
+	     cmsg = io_uring_recvmsg_cmsg_nexthdr(o, &ctx->msg, cmsg)) {
+		int seg;
+
+		if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+			continue;
+		memcpy(&seg, CMSG_DATA(cmsg), sizeof(seg));
+		if (seg > 0)
+			return seg;
+	}
+	return len;
+}
+
+static void stats_start(struct udp_stats *stats)
+{
+	clock_gettime(CLOCK_MONOTONIC, &stats->first);
+	getrusage(RUSAGE_SELF, &stats->ru_start);
+}
+
+static double stats_show(struct udp_stats *stats, const char *dir,
+			 unsigned long pkts, unsigned long calls)
+{
+	double secs, cpu;
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = (ru.ru_utime.tv_sec - stats->ru_start.ru_utime.tv_sec) +
+	      (ru.ru_stime.tv_sec - stats->ru_start.ru_stime.tv_sec) +
+	      (ru.ru_utime.tv_usec - stats->ru_start.ru_utime.tv_usec) / 1e6 +
+	      (ru.ru_stime.tv_usec - stats->ru_start.ru_stime.tv_usec) / 1e6;
+	secs = (stats->last.tv_sec - stats->first.tv_sec) +
+	       (stats->last.tv_nsec - stats->first.tv_nsec) / 1e9;
+	if (secs <= 0 || !pkts)
+		return 0;
+
+	printf("%s: packets=%lu, pps=%.0f, packets per call=%.1f, "
+		"cpu per packet=%.0fns\n", dir, pkts, pkts / secs,
+		(double) pkts / calls, cpu * 1e9 / pkts);
+	return secs;
+}
+
+static void show_datagram(struct ctx *ctx, struct io_uring_recvmsg_out *o,
+			  unsigned int len)
+{
+	struct sockaddr_in *addr = io_uring_recvmsg_name(o);
+	struct sockaddr_in6 *addr6 = (void *)addr;
+	char buff[INET6_ADDRSTRLEN + 1];
+	const char *name;
+	void *paddr;
+
+	if (ctx->af == AF_INET6)
+		paddr = &addr6->sin6_addr;
+	else
+		paddr = &addr->sin_addr;
+
+	name = inet_ntop(ctx->af, paddr, buff, sizeof(buff));
+	if (!name)
+		name = "<INVALID>";
+
+	fprintf(stderr, "received %u bytes %d from [%s]:%d\n", len,
+		o->namelen, name, (int)ntohs(addr->sin_port));
+}
+
 static int process_cqe_recv(struct ctx *ctx, struct io_uring_cqe *cqe,
 			    int fdidx)
 {
+	unsigned int len, seg_size, nr_segs, off;
 	int ret, idx;
 	struct io_uring_recvmsg_out *o;
 	struct io_uring_sqe *sqe;
+	unsigned char *payload;
 
 	if (!(cqe->flags & IORING_CQE_F_MORE)) {
 		ret = add_recv(ctx, fdidx);
@@ -270,34 +421,45 @@ static int process_cqe_recv(struct ctx *ctx, struct io_uring_cqe *cqe,
 		return 0;
 	}
 
-	if (ctx->verbose) {
-		struct sockaddr_in *addr = io_uring_recvmsg_name(o);
-		struct sockaddr_in6 *addr6 = (void *)addr;
-		char buff[INET6_ADDRSTRLEN + 1];
-		const char *name;
-		void *paddr;
-
-		if (ctx->af == AF_INET6)
-			paddr = &addr6->sin6_addr;
-		else
-			paddr = &addr->sin_addr;
+	payload = io_uring_recvmsg_payload(o, &ctx->msg);
+	len = io_uring_recvmsg_payload_length(o, cqe->res, &ctx->msg);
+	seg_size = ctx->gso ? gro_seg_size(ctx, o, len) : len;
+	if (!seg_size) {
+		recycle_buffer(ctx, idx);
+		return 0;
+	}
 
-		name = inet_ntop(ctx->af, paddr, buff, sizeof(buff));
-		if (!name)
-			name = "<INVALID>";
+	if (!ctx->stats.rx_cqes && !ctx->client)
+		stats_start(&ctx->stats);
+	clock_gettime(CLOCK_MONOTONIC, &ctx->stats.last);
+	ctx->stats.rx_cqes++;
+
+	/*
+	 * A coalesced receive holds its datagrams back to back, each of
+	 * seg_size bytes except for the last one, which may be shorter.
+	 */
+	nr_segs = 0;
+	for (off = 0; off < len; off += seg_size) {
+		unsigned int dlen = len - off < seg_size ? len - off : seg_size;
+
+		if (ctx->verbose)
+			show_datagram(ctx, o, dlen);
+		nr_segs++;
+	}
+	ctx->stats.rx_pkts += nr_segs;
 
-		fprintf(stderr, "received %u bytes %d from [%s]:%d\n",
-			io_uring_recvmsg_payload_length(o, cqe->res, &ctx->msg),
-			o->namelen, name, (int)ntohs(addr->sin_port));
+	/* the load generator only counts the echoes */
+	if (ctx->client) {
+		recycle_buffer(ctx, idx);
+		return 0;
 	}
 
 	if (get_sqe(ctx, &sqe))
 		return -1;
 
 	ctx->send[idx].iov = (struct iovec) {
-		.iov_base = io_uring_recvmsg_payload(o, &ctx->msg),
-		.iov_len =
-			io_uring_recvmsg_payload_length(o, cqe->res, &ctx->msg)
+		.iov_base = payload,
+		.iov_len = len
 	};
 	ctx->send[idx].msg = (struct msghdr) {
 		.msg_namelen = o->namelen,
@@ -307,6 +469,17 @@ static int process_cqe_recv(struct ctx *ctx, struct io_uring_cqe *cqe,
 		.msg_iov = &ctx->send[idx].iov,
 		.msg_iovlen = 1
 	};
+	/*
+	 * Echo a coalesced receive as one GSO send. GRO only merges
+	 * datagrams of the same flow, so they all go back to the one
+	 * sender, and splitting the payload at the same seg_size gives
+	 * back exactly the datagrams received, in the same order. One
+	 * sendmsg per datagram would put the same ones on the wire.
+	 */
+	if (nr_segs > 1)
+		set_gso(&ctx->send[idx], seg_size);
+	ctx->stats.tx_calls++;
+	ctx->stats.tx_pkts += nr_segs;
 
 	io_uring_prep_sendmsg(sqe, fdidx, &ctx->send[idx].msg, 0);
 	io_uring_sqe_set_data64(sqe, idx);
@@ -314,14 +487,91 @@ static int process_cqe_recv(struct ctx *ctx, struct io_uring_cqe *cqe,
 
 	return 0;
 }
+/*
+ * Load generator send, 'nr_segs' datagrams in one go with GSO, or a
+ * single one.
+ */
+static int add_tx(struct ctx *ctx, int fdidx)
+{
+	struct io_uring_sqe *sqe;
+
+	if (get_sqe(ctx, &sqe))
+		return -1;
+	io_uring_prep_sendmsg(sqe, fdidx, &ctx->tx.msg, 0);
+	io_uring_sqe_set_data64(sqe, TX_DATA);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	return 0;
+}
+
+static int process_cqe_tx(struct ctx *ctx, struct io_uring_cqe *cqe, int fdidx)
+{
+	if (cqe->res < 0) {
+		fprintf(stderr, "bad send %s\n", strerror(-cqe->res));
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ctx->stats.last);
+	ctx->stats.tx_calls++;
+	ctx->stats.tx_pkts += ctx->gso ? ctx->nr_segs : 1;
+	if (stop)
+		return 0;
+	return add_tx(ctx, fdidx);
+}
+
 static int process_cqe(struct ctx *ctx, struct io_uring_cqe *cqe, int fdidx)
 {
 	if (cqe->user_data < BUFFERS)
 		return process_cqe_send(ctx, cqe);
+	else if (cqe->user_data == TX_DATA)
+		return process_cqe_tx(ctx, cqe, fdidx);
 	else
 		return process_cqe_recv(ctx, cqe, fdidx);
 }
 
+static int setup_client(struct ctx *ctx, int sockfd, int port)
+{
+	struct sockaddr_storage ss = { };
+	socklen_t len;
+
+	if (ctx->af == AF_INET6) {
+		struct sockaddr_in6 *addr6 = (void *) &ss;
+
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_port = htons(port);
+		addr6->sin6_addr = in6addr_loopback;
+		len = sizeof(*addr6);
+	} else {
+		struct sockaddr_in *addr = (void *) &ss;
+
+		addr->sin_family = AF_INET;
+		addr->sin_port = htons(port);
+		addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof(*addr);
+	}
+	if (connect(sockfd, (struct sockaddr *) &ss, len)) {
+		fprintf(stderr, "connect: %s\n", strerror(errno));
+		return -1;
+	}
+
+	ctx->tx_buf = calloc(ctx->nr_segs, ctx->seg_size);
+	if (!ctx->tx_buf)
+		return -1;
+	ctx->tx.iov.iov_base = ctx->tx_buf;
+	ctx->tx.iov.iov_len = ctx->seg_size;
+	ctx->tx.msg.msg_iov = &ctx->tx.iov;
+	ctx->tx.msg.msg_iovlen = 1;
+	if (ctx->gso) {
+		ctx->tx.iov.iov_len *= ctx->nr_segs;
+		set_gso(&ctx->tx, ctx->seg_size);
+	}
+	return 0;
+}
+
+static void sig_int(int sig)
+{
+	(void) sig;
+	stop = 1;
+}
+
 int main(int argc, char *argv[])
 {
 	struct ctx ctx;
@@ -330,14 +580,20 @@ int main(int argc, char *argv[])
 	int sockfd;
 	int opt;
 	struct io_uring_cqe *cqes[CQES];
+	struct __kernel_timespec ts = { .tv_nsec = 100000000 };
+	struct sigaction sa = { };
+	struct timespec now, end = { };
 	unsigned int count, i;
+	int buf_shift = 0;
+	int runtime = 5;
 
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.verbose = false;
 	ctx.af = AF_INET;
-	ctx.buf_shift = BUF_SHIFT;
+	ctx.seg_size = 1024;
+	ctx.nr_segs = 16;
 
-	while ((opt = getopt(argc, argv, "6vp:b:")) != -1) {
+	while ((opt = getopt(argc, argv, "6vgp:b:c:s:n:t:")) != -1) {
 		switch (opt) {
 		case '6':
 			ctx.af = AF_INET6;
@@ -346,23 +602,66 @@ int main(int argc, char *argv[])
 			port = atoi(optarg);
 			break;
 		case 'b':
-			ctx.buf_shift = atoi(optarg);
+			buf_shift = atoi(optarg);
 			break;
 		case 'v':
 			ctx.verbose = true;
 			break;
+		case 'g':
+			ctx.gso = true;
+			break;
+		case 'c':
+			ctx.client = true;
+			port = atoi(optarg);
+			break;
+		case 's':
+			ctx.seg_size = atoi(optarg);
+			break;
+		case 'n':
+			ctx.nr_segs = atoi(optarg);
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
 		default:
 			fprintf(stderr, "Usage: %s [-p port] "
-					"[-b log2(BufferSize)] [-6] [-v]\n",
-					argv[0]);
+					"[-b log2(BufferSize)] [-6] [-v] [-g]\n"
+					"\t[-c port [-s size] [-n segments] "
+					"[-t seconds]]\n", argv[0]);
 			exit(-1);
 		}
 	}
 
-	sockfd = setup_sock(ctx.af, port);
+	ctx.buf_shift = ctx.gso ? GSO_BUF_SHIFT : BUF_SHIFT;
+	ctx.nr_bufs = ctx.gso ? GSO_BUFFERS : BUFFERS;
+	if (buf_shift)
+		ctx.buf_shift = buf_shift;
+
+	if (ctx.client && (port <= 0 || ctx.seg_size < 1 || runtime < 1 ||
+	    ctx.nr_segs < 1 || ctx.nr_segs > GSO_MAX_SEGS ||
+	    ctx.seg_size * ctx.nr_segs > 65000)) {
+		fprintf(stderr, "Bad port, size, segments or runtime\n");
+		return 1;
+	}
+
+	sockfd = setup_sock(ctx.af, ctx.client ? -1 : port);
 	if (sockfd < 0)
 		return 1;
 
+	if (ctx.gso) {
+		int val = 1;
+
+		if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &val, sizeof(val))) {
+			fprintf(stderr, "UDP_GRO: %s\n", strerror(errno));
+			close(sockfd);
+			return 1;
+		}
+	}
+	if (ctx.client && setup_client(&ctx, sockfd, port)) {
+		close(sockfd);
+		return 1;
+	}
+
 	if (setup_context(&ctx)) {
 		close(sockfd);
 		return 1;
@@ -378,13 +677,35 @@ int main(int argc, char *argv[])
 	if (ret)
 		return 1;
 
-	while (true) {
-		ret = io_uring_submit_and_wait(&ctx.ring, 1);
-		if (ret == -EINTR)
+	/* no SA_RESTART, SIGINT should break us out of waiting */
+	sa.sa_handler = sig_int;
+	sigaction(SIGINT, &sa, NULL);
+
+	if (ctx.client) {
+		stats_start(&ctx.stats);
+		end = ctx.stats.first;
+		end.tv_sec += runtime;
+		for (i = 0; i < 8; i++) {
+			ret = add_tx(&ctx, 0);
+			if (ret)
+				return 1;
+		}
+	}
+
+	while (!stop) {
+		ret = io_uring_submit_and_wait_timeout(&ctx.ring, &cqes[0], 1,
+						       &ts, NULL);
+		if (ctx.client) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > end.tv_sec ||
+			    (now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec))
+				stop = 1;
+		}
+		if (ret == -EINTR || ret == -ETIME)
 			continue;
 		if (ret < 0) {
 			fprintf(stderr, "submit and wait failed %d\n", ret);
-			break;
+			goto cleanup;
 		}
 
 		count = io_uring_peek_batch_cqe(&ctx.ring, &cqes[0], CQES);
@@ -396,6 +717,15 @@ int main(int argc, char *argv[])
 		io_uring_cq_advance(&ctx.ring, count);
 	}
 
+	if (ctx.client) {
+		stats_show(&ctx.stats, "tx", ctx.stats.tx_pkts, ctx.stats.tx_calls);
+		stats_show(&ctx.stats, "rx", ctx.stats.rx_pkts, ctx.stats.rx_cqes);
+	} else if (ctx.stats.rx_pkts) {
+		stats_show(&ctx.stats, "rx", ctx.stats.rx_pkts, ctx.stats.rx_cqes);
+		stats_show(&ctx.stats, "tx", ctx.stats.tx_pkts, ctx.stats.tx_calls);
+	}
+	ret = 0;
+
 cleanup:
 	cleanup_context(&ctx);
 	close(sockfd);
@@ -2,6 +2,18 @@
 /*
  * Proof-of-concept for doing file digests using the kernel's AF_ALG API.
  * Needs a bit of error handling.
+ *
+ * The default copy mode reads file data into buffers and sends those to
+ * the AF_ALG socket. The splice mode (-m splice) instead moves the page
+ * cache pages of the file through a pipe into the socket, with a splice
+ * into the pipe linked to a splice out of it, so the data never goes
+ * through userspace. Splice mode can hash several files at the same time
+ * (-j), each over its own AF_ALG socket, copy mode hashes them in turn.
+ *
+ * Usage: ./kdigest [-m copy|splice] [-j jobs] [-t] algorithm file...
+ *
+ * -t adds a line with the throughput, and the CPU time used per GB,
+ * including the io-wq workers doing the splices.
  */
 #include <stdio.h>
 #include <fcntl.h>
@@ -11,11 +23,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <linux/if_alg.h>
 #include "liburing.h"
+#include "helpers.h"
 
 #define QD		64
 #define WAIT_BATCH	(QD / 8)
@@ -24,6 +39,12 @@
 #define BGID		1
 #define BID_MASK	(QD - 1)
 
+/* each splice job has at most an in and an out splice queued */
+#define MAX_JOBS	(QD / 2)
+#define PIPE_SIZE	(1024 * 1024)
+/* big enough for any digest, HASH_MAX_DIGESTSIZE is 64 */
+#define DIGEST_MAX	128
+
 enum req_state {
 	IO_INIT = 0,
 	IO_READ,
@@ -253,12 +274,24 @@ static int digest_file(struct kdigest *kdigest, size_t insize)
 	return 0;
 }
 
+static void print_digest(const char *mode, const char *alg, const char *file,
+			 const uint8_t *digest, int len)
+{
+	int i;
+
+	fprintf(stdout, "uring %s%s(%s) returned(len=%u): ", mode, alg, file,
+		len);
+	for (i = 0; i < len; i++)
+		fprintf(stdout, "%02x", digest[i]);
+	putc('\n', stdout);
+}
+
 static int get_result(struct kdigest *kdigest, const char *alg, const char *file)
 {
 	struct io_uring *ring = &kdigest->ring;
 	struct io_uring_sqe *sqe;
 	struct io_uring_cqe *cqe;
-	int i, ret;
+	int ret;
 	/* reuse I/O buf block to stash hash result */
 
 	sqe = io_uring_get_sqe(ring);
@@ -278,37 +311,349 @@ static int get_result(struct kdigest *kdigest, const char *alg, const char *file
 		goto err;
 	}
 
-	fprintf(stdout, "uring %s%s(%s) returned(len=%u): ",
-		kdigest->br ? "bundled " : "", alg, file, cqe->res);
-	for (i = 0; i < cqe->res; i++)
-		fprintf(stdout, "%02x", kdigest->bufs[i]);
-	putc('\n', stdout);
+	print_digest(kdigest->br ? "bundled " : "", alg, file, kdigest->bufs,
+		     cqe->res);
 	ret = 0;
 err:
 	io_uring_cqe_seen(ring, cqe);
 	return ret;
 }
 
+enum {
+	SPLICE_IN	= 1,
+	SPLICE_OUT	= 2,
+	SPLICE_RECV	= 3,
+	SPLICE_TAG_MASK	= 3,
+};
+
+/*
+ * A file being hashed in splice mode. Its data goes from the file into the
+ * pipe and from the pipe into the AF_ALG socket, 'pipe_size' at a time.
+ */
+struct splice_job {
+	const char *file;
+	int infd;
+	int opfd;
+	int pipe[2];
+	unsigned int pipe_size;
+	/* where the next splice into the pipe starts, and what's left */
+	off_t offset;
+	size_t left;
+	/* in the pipe, but not in the socket yet */
+	size_t in_pipe;
+	/* length of the linked in and out splices in flight, 0 if out only */
+	unsigned int pair_len;
+	uint8_t digest[DIGEST_MAX];
+};
+
+static void splice_job_queue(struct io_uring *ring, struct splice_job *job)
+{
+	struct io_uring_sqe *sqe;
+
+	if (job->in_pipe) {
+		/* left over from a short splice, push it on first */
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_splice(sqe, job->pipe[0], -1, job->opfd, -1,
+				     job->in_pipe, SPLICE_F_MORE);
+		io_uring_sqe_set_data64(sqe, (uintptr_t) job | SPLICE_OUT);
+		job->pair_len = 0;
+	} else if (job->left) {
+		unsigned int len = job->pipe_size;
+
+		if (job->left < len)
+			len = job->left;
+
+		/*
+		 * The in splice only posts a CQE if it fails or comes up
+		 * short, which also cancels the out splice, without a CQE.
+		 */
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_splice(sqe, job->infd, job->offset, job->pipe[1],
+				     -1, len, 0);
+		sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data64(sqe, (uintptr_t) job | SPLICE_IN);
+
+		/* more is coming, don't let the socket finalize the hash */
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_splice(sqe, job->pipe[0], -1, job->opfd, -1,
+				     len, SPLICE_F_MORE);
+		io_uring_sqe_set_data64(sqe, (uintptr_t) job | SPLICE_OUT);
+		job->pair_len = len;
+	} else {
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_recv(sqe, job->opfd, job->digest,
+				   sizeof(job->digest), 0);
+		io_uring_sqe_set_data64(sqe, (uintptr_t) job | SPLICE_RECV);
+	}
+}
+
+static int splice_job_start(struct io_uring *ring, struct splice_job *job,
+			    int sfd, const char *file, size_t *bytes)
+{
+	job->file = file;
+	job->infd = open(file, O_RDONLY);
+	if (job->infd < 0) {
+		perror(file);
+		return 1;
+	}
+	if (get_file_size(job->infd, &job->left)) {
+		fprintf(stderr, "%s: can't get size\n", file);
+		return 1;
+	}
+	/* a new socket from accept() per file, each gets its own hash */
+	job->opfd = accept(sfd, NULL, 0);
+	if (job->opfd < 0) {
+		perror("AF_ALG accept");
+		return 1;
+	}
+	job->offset = 0;
+	job->in_pipe = 0;
+	*bytes += job->left;
+	splice_job_queue(ring, job);
+	return 0;
+}
+
+/*
+ * Returns 1 once the digest of the job's file is in, 0 if there's more to
+ * do, and -1 on errors.
+ */
+static int splice_job_complete(struct io_uring *ring, struct splice_job *job,
+			       int tag, int res, const char *alg)
+{
+	switch (tag) {
+	case SPLICE_IN:
+		if (res <= 0) {
+			fprintf(stderr, "%s: splice in: %s\n", job->file,
+				res ? strerror(-res) : "file got shorter");
+			return -1;
+		}
+		job->offset += res;
+		job->left -= res;
+		job->in_pipe = res;
+		break;
+	case SPLICE_OUT:
+		/* the in splice's CQE says what happened */
+		if (res == -ECANCELED && job->pair_len)
+			return 0;
+		if (res <= 0) {
+			fprintf(stderr, "%s: splice out: %s\n", job->file,
+				res ? strerror(-res) : "no progress");
+			return -1;
+		}
+		if (job->pair_len) {
+			job->offset += job->pair_len;
+			job->left -= job->pair_len;
+			job->in_pipe = job->pair_len - res;
+		} else {
+			job->in_pipe -= res;
+		}
+		break;
+	case SPLICE_RECV:
+		if (res < 0) {
+			fprintf(stderr, "%s: recv digest: %s\n", job->file,
+				strerror(-res));
+			return -1;
+		}
+		print_digest("splice ", alg, job->file, job->digest, res);
+		return 1;
+	}
+	splice_job_queue(ring, job);
+	return 0;
+}
+
+static int digest_files_splice(struct io_uring *ring, int sfd, const char *alg,
+			       char **files, int nr_files, int nr_jobs,
+			       size_t *bytes)
+{
+	struct splice_job *jobs;
+	struct io_uring_cqe *cqe;
+	int i, next = 0, running = 0, ret = 1;
+	unsigned head, nr;
+
+	if (nr_jobs > nr_files)
+		nr_jobs = nr_files;
+	jobs = calloc(nr_jobs, sizeof(*jobs));
+	if (!jobs)
+		return 1;
+
+	for (i = 0; i < nr_jobs; i++) {
+		struct splice_job *job = &jobs[i];
+		int size;
+
+		if (pipe(job->pipe) < 0) {
+			perror("pipe");
+			goto out;
+		}
+		/* bigger is fewer round trips, but the default will do */
+		size = fcntl(job->pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+		if (size < 0)
+			size = fcntl(job->pipe[1], F_GETPIPE_SZ);
+		if (size < 0) {
+			perror("F_GETPIPE_SZ");
+			goto out;
+		}
+		job->pipe_size = size;
+
+		if (splice_job_start(ring, job, sfd, files[next++], bytes))
+			goto out;
+		running++;
+	}
+
+	while (running) {
+		ret = io_uring_submit_and_wait(ring, 1);
+		if (ret < 0) {
+			fprintf(stderr, "wait cqe: %s\n", strerror(-ret));
+			ret = 1;
+			goto out;
+		}
+
+		nr = 0;
+		ret = 0;
+		io_uring_for_each_cqe(ring, head, cqe) {
+			uintptr_t data = cqe->user_data;
+			struct splice_job *job;
+
+			job = (struct splice_job *) (data & ~SPLICE_TAG_MASK);
+			nr++;
+			ret = splice_job_complete(ring, job,
+						  data & SPLICE_TAG_MASK,
+						  cqe->res, alg);
+			if (ret < 0)
+				break;
+			if (!ret)
+				continue;
+
+			close(job->infd);
+			close(job->opfd);
+			running--;
+			if (next < nr_files) {
+				ret = splice_job_start(ring, job, sfd,
+						       files[next++], bytes);
+				if (ret)
+					break;
+				running++;
+			}
+			ret = 0;
+		}
+		io_uring_cq_advance(ring, nr);
+		if (ret) {
+			ret = 1;
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	for (i = 0; i < nr_jobs; i++) {
+		if (jobs[i].pipe_size) {
+			close(jobs[i].pipe[0]);
+			close(jobs[i].pipe[1]);
+		}
+	}
+	free(jobs);
+	return ret;
+}
+
+static int digest_files_copy(struct kdigest *kdigest, int sfd, const char *alg,
+			     char **files, int nr_files, size_t *bytes)
+{
+	size_t insize;
+	int i;
+
+	for (i = 0; i < nr_files; i++) {
+		infd = open(files[i], O_RDONLY);
+		if (infd < 0) {
+			perror(files[i]);
+			return 1;
+		}
+		outfd = accept(sfd, NULL, 0);
+		if (outfd < 0) {
+			perror("AF_ALG accept");
+			return 1;
+		}
+		if (get_file_size(infd, &insize)) {
+			fprintf(stderr, "%s: can't get size\n", files[i]);
+			return 1;
+		}
+		*bytes += insize;
+
+		if (digest_file(kdigest, insize)) {
+			fprintf(stderr, "%s digest failed\n", alg);
+			return 1;
+		}
+		if (get_result(kdigest, alg, files[i])) {
+			fprintf(stderr, "failed to retrieve %s digest result\n",
+				alg);
+			return 1;
+		}
+		if (close(infd) < 0 || close(outfd) < 0)
+			return 1;
+	}
+	return 0;
+}
+
+static double cpu_sec(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "%s: [-m copy|splice] [-j jobs] [-t] algorithm "
+			"file...\n", argv0);
+}
+
 int main(int argc, char *argv[])
 {
 	const char *alg;
-	const char *infile;
-	size_t alg_len, insize;
+	size_t alg_len, bytes = 0;
 	struct sockaddr_alg sa = {
 		.salg_family = AF_ALG,
 		.salg_type = "hash",
 	};
 	struct kdigest kdigest = { };
 	struct io_uring_params p = { };
-	int sfd, ret;
-
-	if (argc < 3) {
-		fprintf(stderr, "%s: algorithm infile\n", argv[0]);
+	unsigned long long start;
+	bool splice = false, stats = false;
+	int sfd, ret, opt, nr_jobs = 1, nr_files;
+	double cpu;
+
+	while ((opt = getopt(argc, argv, "m:j:th")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (!strcmp(optarg, "splice")) {
+				splice = true;
+			} else if (strcmp(optarg, "copy")) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			if (nr_jobs < 1 || nr_jobs > MAX_JOBS) {
+				fprintf(stderr, "jobs must be 1..%d\n",
+					MAX_JOBS);
+				return 1;
+			}
+			break;
+		case 't':
+			stats = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind < 2) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	alg = argv[1];
-	infile = argv[2];
+	alg = argv[optind];
+	nr_files = argc - optind - 1;
 	alg_len = strlen(alg);
 	if (alg_len >= sizeof(sa.salg_name)) {
 		fprintf(stderr, "algorithm name too long\n");
@@ -317,12 +662,6 @@ int main(int argc, char *argv[])
 	/* +1 for null terminator */
 	memcpy(sa.salg_name, alg, alg_len + 1);
 
-	infd = open(infile, O_RDONLY);
-	if (infd < 0) {
-		perror("open infile");
-		return 1;
-	}
-
 	sfd = socket(AF_ALG, SOCK_SEQPACKET, 0);
 	if (sfd < 0) {
 		if (errno == EAFNOSUPPORT)
@@ -344,12 +683,6 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	outfd = accept(sfd, NULL, 0);
-	if (outfd < 0) {
-		perror("AF_ALG accept");
-		return 1;
-	}
-
 	if (posix_memalign((void **)&kdigest.bufs, 4096, QD * BS)) {
 		fprintf(stderr, "failed to alloc I/O bufs\n");
 		return 1;
@@ -368,7 +701,7 @@ int main(int argc, char *argv[])
 	} while (1);
 
 	/* use send bundles, if available */
-	if (p.features & IORING_FEAT_RECVSEND_BUNDLE) {
+	if (!splice && (p.features & IORING_FEAT_RECVSEND_BUNDLE)) {
 		kdigest.br = io_uring_setup_buf_ring(&kdigest.ring, QD, BGID, 0, &ret);
 		if (!kdigest.br) {
 			fprintf(stderr, "Failed setting up bundle buffer ring: %d\n", ret);
@@ -376,30 +709,34 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (get_file_size(infd, &insize))
+	start = now_ns();
+	cpu = cpu_sec();
+	if (splice)
+		ret = digest_files_splice(&kdigest.ring, sfd, alg,
+					  &argv[optind + 1], nr_files, nr_jobs,
+					  &bytes);
+	else
+		ret = digest_files_copy(&kdigest, sfd, alg, &argv[optind + 1],
+					nr_files, &bytes);
+	if (ret)
 		return 1;
 
-	ret = digest_file(&kdigest, insize);
-	if (ret) {
-		fprintf(stderr, "%s digest failed\n", alg);
-		return 1;
-	}
+	if (stats) {
+		double sec = (now_ns() - start) / 1e9;
+		double gb = bytes / 1e9;
 
-	ret = get_result(&kdigest, alg, infile);
-	if (ret) {
-		fprintf(stderr, "failed to retrieve %s digest result\n", alg);
-		return 1;
+		cpu = cpu_sec() - cpu;
+		printf("mode=%s jobs=%d files=%d bytes=%zu gb_per_sec=%.2f "
+			"cpu_sec_per_gb=%.3f\n", splice ? "splice" : "copy",
+			splice ? nr_jobs : 1, nr_files, bytes, gb / sec,
+			gb ? cpu / gb : 0);
 	}
 
 	if (kdigest.br)
 		io_uring_free_buf_ring(&kdigest.ring, kdigest.br, QD, BGID);
 	io_uring_queue_exit(&kdigest.ring);
 	free(kdigest.bufs);
-	if (close(infd) < 0)
-		ret |= 1;
 	if (close(sfd) < 0)
 		ret |= 1;
-	if (close(outfd) < 0)
-		ret |= 1;
 	return ret;
 }
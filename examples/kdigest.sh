@@ -0,0 +1,103 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Hashes a set of scratch files with kdigest in copy mode and in splice
+# mode, with one and with several jobs, and for a baseline in userspace
+# with openssl dgst, which uses SIMD or the SHA extensions where the CPU
+# has them, and with the coreutils <alg>sum tool if there is one. The files
+# are read once up front, so all runs hash from the page cache. Prints GB/s
+# and the CPU seconds, user and system, spent per GB, which includes the
+# io-wq workers of kdigest.
+#
+# Before timing anything, the digests kdigest computes in both modes are
+# checked against <alg>sum, or openssl dgst if there's no such tool, and
+# the script fails if they differ.
+#
+# Usage: ./kdigest.sh [directory]
+#
+# ALG is the hash, sha256 by default, FILES the number of scratch files and
+# SIZE_MB the size of each.
+
+dir=${1:-.}
+alg=${ALG:-sha256}
+nr_files=${FILES:-4}
+size_mb=${SIZE_MB:-256}
+
+kdigest="$(dirname "$0")/kdigest"
+if [ ! -x "$kdigest" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+files=()
+for i in $(seq $nr_files); do
+	files+=("$dir/kdigest.$$.$i")
+done
+trap 'rm -f "${files[@]}"' EXIT
+for f in "${files[@]}"; do
+	head -c ${size_mb}M /dev/urandom > "$f" || exit 1
+done
+cat "${files[@]}" > /dev/null
+
+gb=$(awk "BEGIN { print $nr_files * $size_mb * 1048576 / 1e9 }")
+
+row() {
+	local name=$1 out
+	shift
+
+	out=$( { TIMEFORMAT="%R %U %S"; time "$@" > /dev/null 2>&1; } 2>&1 )
+	if [ $? -ne 0 ]; then
+		printf "%-24s %10s\n" "$name" "failed"
+		return
+	fi
+	echo "$out" | awk -v name="$name" -v gb=$gb '{
+		printf "%-24s %10.2f %14.3f\n", name, gb / $1, ($2 + $3) / gb
+	}'
+}
+
+# "<digest> <file>" for each file, from the userspace reference tool
+reference() {
+	if command -v ${alg}sum > /dev/null; then
+		${alg}sum "${files[@]}" | awk '{ print $1, $2 }'
+	elif command -v openssl > /dev/null; then
+		openssl dgst -r -$alg "${files[@]}" | sed 's/ \*/ /'
+	fi
+}
+
+verify() {
+	local ref out mode
+
+	ref=$(reference | sort)
+	if [ -z "$ref" ]; then
+		echo "no ${alg}sum or openssl to check the digests against"
+		return 0
+	fi
+	for mode in copy splice; do
+		out=$($kdigest -m $mode $alg "${files[@]}" | \
+			sed -n 's/.*(\(.*\)) returned(len=[0-9]*): \([0-9a-f]*\)$/\2 \1/p' | \
+			sort)
+		if [ "$out" != "$ref" ]; then
+			echo "kdigest -m $mode: digests differ from the reference"
+			return 1
+		fi
+	done
+	echo "kdigest digests match the reference"
+}
+
+if $kdigest $alg "${files[0]}" > /dev/null; then
+	verify || exit 1
+fi
+
+printf "%-24s %10s %14s\n" "$alg, ${nr_files}x${size_mb}MB" "GB/s" "cpu_sec/GB"
+if $kdigest $alg "${files[0]}" > /dev/null 2>&1; then
+	row "kdigest copy" $kdigest -m copy $alg "${files[@]}"
+	row "kdigest splice" $kdigest -m splice $alg "${files[@]}"
+	row "kdigest splice -j $nr_files" $kdigest -m splice -j $nr_files \
+		$alg "${files[@]}"
+fi
+if command -v openssl > /dev/null; then
+	row "openssl dgst" openssl dgst -$alg "${files[@]}"
+fi
+if command -v ${alg}sum > /dev/null; then
+	row "${alg}sum" ${alg}sum "${files[@]}"
+fi
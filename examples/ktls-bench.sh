@@ -0,0 +1,34 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Runs ktls over every combination of send and receive path, with kernel
+# TLS and on plain TCP, and prints the throughput and CPU time per GB of
+# each. The plain TCP runs show what the encryption itself costs.
+#
+# Usage: ./ktls-bench.sh [seconds per run] [block size]
+
+secs=${1:-3}
+bs=${2:-262144}
+
+ktls="$(dirname "$0")/ktls"
+if [ ! -x "$ktls" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+printf "%-6s %-7s %-6s %8s %14s\n" "mode" "send" "recv" "gbps" "cpu_ms_per_gb"
+for mode in plain ktls; do
+	for send in sync send zc splice; do
+		for recv in sync mshot; do
+			out=$($ktls -m $mode -s $send -r $recv -b $bs -t $secs 2>&1)
+			if [ $? -ne 0 ]; then
+				printf "%-6s %-7s %-6s %s\n" $mode $send $recv \
+					"failed: $(echo "$out" | tail -1)"
+				continue
+			fi
+			printf "%-6s %-7s %-6s %8s %14s\n" $mode $send $recv \
+				"$(echo "$out" | sed -n 's/.*gbps=\([0-9.]*\).*/\1/p')" \
+				"$(echo "$out" | sed -n 's/.*cpu_ms_per_gb=\([0-9.]*\).*/\1/p')"
+		done
+	done
+done
@@ -0,0 +1,725 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Kernel TLS over io_uring. A sender thread and a receiver set up a TCP
+ * connection over loopback, exchange keys, and hand the record layer to
+ * the kernel. The sender then streams data for the given time, and the
+ * receiver prints the throughput and the CPU time it took per GB.
+ *
+ * There's no real handshake: the sender makes up the keys and sends them
+ * over in the clear, this is a test of the data path and nothing else. The
+ * keys are installed with linked SOCKET_URING_OP_SETSOCKOPT commands
+ * setting TCP_ULP, TLS_TX and TLS_RX, for TLS 1.3 with AES-GCM-128.
+ *
+ * The sender uses one of:
+ *
+ *   send	IORING_OP_SEND
+ *   zc		IORING_OP_SEND_ZC, from a registered buffer
+ *   splice	linked IORING_OP_SPLICE from a memfd to a pipe, and from the
+ *		pipe to the socket
+ *   sync	send(2)
+ *
+ * The receiver uses a multishot IORING_OP_RECVMSG with a provided buffer
+ * ring, or recvmsg(2) with 'sync'. With kTLS, every message carries the
+ * type of the record it came from in a TLS_GET_RECORD_TYPE control message.
+ * Only application data records count as data. The sender ends the stream
+ * with a close_notify alert, sent as a TLS_SET_RECORD_TYPE control message
+ * with IORING_OP_SENDMSG. Any other non-data record is counted and skipped.
+ * Without the control message buffer, the kernel fails the recv with EIO
+ * when it meets a non-data record.
+ *
+ * For comparison, -m plain runs the same paths on a plain TCP connection.
+ *
+ * Needs a kernel with CONFIG_TLS, and 6.7 or newer for the setsockopt
+ * command.
+ *
+ * Usage: ./ktls [-m ktls|plain] [-s send|zc|splice|sync] [-r mshot|sync]
+ *		 [-b block size] [-t seconds]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <linux/tls.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+#ifndef SOL_TLS
+#define SOL_TLS			282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP			31
+#endif
+
+#define TLS_RECORD_ALERT	21
+#define TLS_RECORD_DATA		23
+#define TLS_ALERT_CLOSE_NOTIFY	0
+
+#define RECV_BGID		0
+#define RECV_BUFS		64	/* must be power of 2 */
+
+enum {
+	SEND_SEND,
+	SEND_ZC,
+	SEND_SPLICE,
+	SEND_SYNC,
+};
+
+static const char *send_names[] = { "send", "zc", "splice", "sync" };
+
+static bool use_ktls = true;
+static int send_mode = SEND_SEND;
+static bool recv_sync;
+static unsigned int bs = 256 * 1024;
+static int runtime = 5;
+
+static const char hello_magic[8] = "URTLSKEY";
+
+/* keys for one direction */
+struct ktls_dir {
+	unsigned char key[TLS_CIPHER_AES_GCM_128_KEY_SIZE];
+	unsigned char iv[TLS_CIPHER_AES_GCM_128_IV_SIZE];
+	unsigned char salt[TLS_CIPHER_AES_GCM_128_SALT_SIZE];
+};
+
+struct ktls_hello {
+	char magic[8];
+	/* sender to receiver, and back */
+	struct ktls_dir dir[2];
+};
+
+static struct ktls_hello hello;
+static int sender_error;
+
+static uint64_t cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void ktls_crypto_info(struct tls12_crypto_info_aes_gcm_128 *ci,
+			     const struct ktls_dir *dir)
+{
+	memset(ci, 0, sizeof(*ci));
+	ci->info.version = TLS_1_3_VERSION;
+	ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+	memcpy(ci->key, dir->key, sizeof(ci->key));
+	memcpy(ci->iv, dir->iv, sizeof(ci->iv));
+	memcpy(ci->salt, dir->salt, sizeof(ci->salt));
+	/* rec_seq starts at zero */
+}
+
+/*
+ * Switch 'fd' to kernel TLS with a linked TCP_ULP -> TLS_TX -> TLS_RX chain
+ * of setsockopt commands. Exactly one completion is posted, the last
+ * step's, or that of the step that failed.
+ */
+static int ktls_install(struct io_uring *ring, int fd,
+			const struct ktls_dir *tx, const struct ktls_dir *rx)
+{
+	static const char ulp[] = "tls";
+	struct tls12_crypto_info_aes_gcm_128 ci_tx, ci_rx;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	static const char *steps[] = { "", "TCP_ULP", "TLS_TX", "TLS_RX" };
+	int ret;
+
+	ktls_crypto_info(&ci_tx, tx);
+	ktls_crypto_info(&ci_rx, rx);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_cmd_sock(sqe, SOCKET_URING_OP_SETSOCKOPT, fd, SOL_TCP,
+			       TCP_ULP, (void *) ulp, sizeof(ulp) - 1);
+	sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	io_uring_sqe_set_data64(sqe, 1);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_cmd_sock(sqe, SOCKET_URING_OP_SETSOCKOPT, fd, SOL_TLS,
+			       TLS_TX, &ci_tx, sizeof(ci_tx));
+	sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	io_uring_sqe_set_data64(sqe, 2);
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_cmd_sock(sqe, SOCKET_URING_OP_SETSOCKOPT, fd, SOL_TLS,
+			       TLS_RX, &ci_rx, sizeof(ci_rx));
+	io_uring_sqe_set_data64(sqe, 3);
+
+	ret = io_uring_submit(ring);
+	if (ret != 3) {
+		fprintf(stderr, "ktls submit: %d\n", ret);
+		return ret < 0 ? ret : -EIO;
+	}
+	ret = io_uring_wait_cqe(ring, &cqe);
+	if (ret)
+		return ret;
+	ret = cqe->res;
+	if (ret < 0)
+		fprintf(stderr, "ktls %s: %s\n", steps[cqe->user_data & 3],
+			strerror(-ret));
+	io_uring_cqe_seen(ring, cqe);
+	return ret < 0 ? ret : 0;
+}
+
+/* end the stream with a close_notify alert record */
+static int ktls_send_close_notify(struct io_uring *ring, int fd)
+{
+	unsigned char alert[2] = { 1, TLS_ALERT_CLOSE_NOTIFY };
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))] = { };
+	struct iovec iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*CMSG_DATA(cmsg) = TLS_RECORD_ALERT;
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_sendmsg(sqe, fd, &msg, 0);
+	ret = io_uring_submit_and_wait(ring, 1);
+	if (ret < 0)
+		return ret;
+	ret = io_uring_wait_cqe(ring, &cqe);
+	if (ret)
+		return ret;
+	ret = cqe->res;
+	io_uring_cqe_seen(ring, cqe);
+	if (ret < 0)
+		fprintf(stderr, "close_notify: %s\n", strerror(-ret));
+	return ret < 0 ? ret : 0;
+}
+
+struct sender {
+	struct io_uring ring;
+	int fd;
+	char *buf;
+	int memfd;
+	int pipe[2];
+	unsigned long notifs;
+};
+
+static int sender_setup(struct sender *s)
+{
+	unsigned int i;
+	int ret;
+
+	s->buf = t_aligned_alloc(4096, bs);
+	if (!s->buf)
+		return -ENOMEM;
+	/* a byte pattern the receiver can check, whatever the chunking */
+	for (i = 0; i < bs; i++)
+		s->buf[i] = i;
+
+	if (send_mode == SEND_ZC) {
+		struct iovec iov = { .iov_base = s->buf, .iov_len = bs };
+
+		ret = io_uring_register_buffers(&s->ring, &iov, 1);
+		if (ret) {
+			fprintf(stderr, "register buffers: %s\n",
+				strerror(-ret));
+			return ret;
+		}
+	} else if (send_mode == SEND_SPLICE) {
+		s->memfd = memfd_create("ktls", 0);
+		if (s->memfd < 0 || pwrite(s->memfd, s->buf, bs, 0) != bs ||
+		    pipe(s->pipe)) {
+			perror("splice setup");
+			return -errno;
+		}
+		/* the pipe takes a full block at a time */
+		if (fcntl(s->pipe[1], F_SETPIPE_SZ, bs) < 0) {
+			perror("F_SETPIPE_SZ");
+			return -errno;
+		}
+	}
+	return 0;
+}
+
+/* send one block, returns bytes sent or -error */
+static int sender_step(struct sender *s)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int ret, nr = 1, sent = 0, err = 0;
+
+	if (send_mode == SEND_SYNC) {
+		ret = send(s->fd, s->buf, bs, MSG_WAITALL | MSG_NOSIGNAL);
+		return ret < 0 ? -errno : ret;
+	}
+
+	sqe = io_uring_get_sqe(&s->ring);
+	switch (send_mode) {
+	case SEND_SEND:
+		io_uring_prep_send(sqe, s->fd, s->buf, bs,
+				   MSG_WAITALL | MSG_NOSIGNAL);
+		break;
+	case SEND_ZC:
+		io_uring_prep_send_zc_fixed(sqe, s->fd, s->buf, bs,
+					    MSG_WAITALL | MSG_NOSIGNAL, 0, 0);
+		break;
+	case SEND_SPLICE:
+		io_uring_prep_splice(sqe, s->memfd, 0, s->pipe[1], -1, bs, 0);
+		sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data64(sqe, 2);
+		sqe = io_uring_get_sqe(&s->ring);
+		io_uring_prep_splice(sqe, s->pipe[0], -1, s->fd, -1, bs, 0);
+		break;
+	}
+	io_uring_sqe_set_data64(sqe, 1);
+
+	ret = io_uring_submit_and_wait(&s->ring, 1);
+	if (ret < 0)
+		return ret;
+
+	/*
+	 * A zero copy send posts a notification when the kernel is done with
+	 * the buffer. The data never changes, so it's fine to send it again
+	 * before then, just count them so we can wait for all at the end.
+	 */
+	while (nr) {
+		ret = io_uring_wait_cqe(&s->ring, &cqe);
+		if (ret)
+			return ret;
+		if (cqe->flags & IORING_CQE_F_NOTIF) {
+			s->notifs--;
+		} else {
+			if (cqe->flags & IORING_CQE_F_MORE)
+				s->notifs++;
+			if (cqe->res < 0 && !err)
+				err = cqe->res;
+			else if (cqe->res > 0)
+				sent += cqe->res;
+			if (cqe->user_data == 1)
+				nr--;
+		}
+		io_uring_cqe_seen(&s->ring, cqe);
+	}
+	if (err)
+		return err;
+	/* a short splice would leave data behind in the pipe */
+	if (send_mode == SEND_SPLICE && sent != bs)
+		return -EIO;
+	return sent;
+}
+
+static void *sender_fn(void *data)
+{
+	struct io_uring_params p = { };
+	struct sender *s = data;
+	struct io_uring_cqe *cqe;
+	uint64_t end;
+	int ret;
+
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	ret = io_uring_queue_init_params(8, &s->ring, &p);
+	if (ret) {
+		fprintf(stderr, "sender queue_init: %s\n", strerror(-ret));
+		goto err;
+	}
+
+	if (getrandom(&hello.dir, sizeof(hello.dir), 0) != sizeof(hello.dir)) {
+		perror("getrandom");
+		goto err;
+	}
+	memcpy(hello.magic, hello_magic, sizeof(hello.magic));
+	if (send(s->fd, &hello, sizeof(hello), 0) != sizeof(hello)) {
+		perror("send hello");
+		goto err;
+	}
+	if (use_ktls && ktls_install(&s->ring, s->fd, &hello.dir[0],
+				     &hello.dir[1]))
+		goto err;
+	if (sender_setup(s))
+		goto err;
+
+	end = now_ns() + runtime * 1000000000ULL;
+	while (now_ns() < end) {
+		ret = sender_step(s);
+		if (ret < 0) {
+			fprintf(stderr, "%s: %s\n", send_names[send_mode],
+				strerror(-ret));
+			goto err;
+		}
+		if (ret != bs) {
+			fprintf(stderr, "short send %d\n", ret);
+			goto err;
+		}
+	}
+	while (s->notifs) {
+		if (io_uring_wait_cqe(&s->ring, &cqe))
+			break;
+		if (cqe->flags & IORING_CQE_F_NOTIF)
+			s->notifs--;
+		io_uring_cqe_seen(&s->ring, cqe);
+	}
+
+	if (use_ktls && ktls_send_close_notify(&s->ring, s->fd))
+		goto err;
+	shutdown(s->fd, SHUT_WR);
+	io_uring_queue_exit(&s->ring);
+	return NULL;
+err:
+	sender_error = 1;
+	shutdown(s->fd, SHUT_RDWR);
+	return NULL;
+}
+
+struct receiver {
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned int buf_size;
+	int fd;
+	unsigned long bytes;
+	unsigned long records_data;
+	unsigned long records_ctrl;
+	bool close_notify;
+	bool bad_data;
+};
+
+/*
+ * The record type of a kTLS message, from its control message. Plain TCP
+ * has none, everything is data. With a multishot recvmsg, 'o' is set and
+ * the control messages follow it in the buffer, 'msg' only has their size.
+ */
+static int record_type(struct msghdr *msg, struct io_uring_recvmsg_out *o)
+{
+	struct cmsghdr *cmsg;
+
+	if (o)
+		cmsg = io_uring_recvmsg_cmsg_firsthdr(o, msg);
+	else
+		cmsg = CMSG_FIRSTHDR(msg);
+	while (cmsg) {
+		if (cmsg->cmsg_level == SOL_TLS &&
+		    cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+			return *(unsigned char *) CMSG_DATA(cmsg);
+		if (o)
+			cmsg = io_uring_recvmsg_cmsg_nexthdr(o, msg, cmsg);
+		else
+			cmsg = CMSG_NXTHDR(msg, cmsg);
+	}
+	return TLS_RECORD_DATA;
+}
+
+/* returns 1 when the stream has ended */
+static int receiver_msg(struct receiver *r, int type, const unsigned char *p,
+			unsigned int len)
+{
+	unsigned int i;
+
+	if (type == TLS_RECORD_ALERT) {
+		/* close_notify ends the stream, any other alert is fatal */
+		if (len == 2 && p[1] == TLS_ALERT_CLOSE_NOTIFY) {
+			r->close_notify = true;
+			return 1;
+		}
+		fprintf(stderr, "alert level %d desc %d\n", len ? p[0] : -1,
+			len > 1 ? p[1] : -1);
+		r->bad_data = true;
+		return 1;
+	}
+	if (type != TLS_RECORD_DATA) {
+		r->records_ctrl++;
+		return 0;
+	}
+
+	/* check the pattern at both ends of the chunk */
+	if (len) {
+		i = len - 1;
+		if (p[0] != (unsigned char) ((r->bytes % bs) & 0xff) ||
+		    p[i] != (unsigned char) (((r->bytes + i) % bs) & 0xff))
+			r->bad_data = true;
+	}
+	r->records_data++;
+	r->bytes += len;
+	return 0;
+}
+
+static int receive_sync(struct receiver *r)
+{
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec iov = { .iov_base = r->bufs, .iov_len = r->buf_size };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	int ret;
+
+	for (;;) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		ret = recvmsg(r->fd, &msg, 0);
+		if (ret < 0) {
+			perror("recvmsg");
+			return 1;
+		}
+		if (!ret)
+			return 0;
+		if (receiver_msg(r, record_type(&msg, NULL),
+				 (unsigned char *) r->bufs, ret))
+			return 0;
+	}
+}
+
+static int receive_mshot(struct receiver *r)
+{
+	unsigned int mask = io_uring_buf_ring_mask(RECV_BUFS);
+	struct msghdr msg = {
+		.msg_controllen = CMSG_SPACE(sizeof(unsigned char)),
+	};
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	bool armed = false;
+	int ret, i;
+
+	r->br = io_uring_setup_buf_ring(&r->ring, RECV_BUFS, RECV_BGID, 0, &ret);
+	if (!r->br) {
+		fprintf(stderr, "buffer ring: %s\n", strerror(-ret));
+		return 1;
+	}
+	for (i = 0; i < RECV_BUFS; i++)
+		io_uring_buf_ring_add(r->br, r->bufs + i * r->buf_size,
+				      r->buf_size, i, mask, i);
+	io_uring_buf_ring_advance(r->br, RECV_BUFS);
+
+	for (;;) {
+		struct io_uring_recvmsg_out *o;
+		unsigned int len;
+		void *buf;
+		int bid;
+
+		if (!armed) {
+			sqe = io_uring_get_sqe(&r->ring);
+			io_uring_prep_recvmsg_multishot(sqe, r->fd, &msg, 0);
+			sqe->flags |= IOSQE_BUFFER_SELECT;
+			sqe->buf_group = RECV_BGID;
+			armed = true;
+		}
+		ret = io_uring_submit_and_wait(&r->ring, 1);
+		if (ret < 0) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			return 1;
+		}
+		ret = io_uring_peek_cqe(&r->ring, &cqe);
+		if (ret)
+			continue;
+
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			armed = false;
+		if (cqe->res == -ENOBUFS) {
+			io_uring_cqe_seen(&r->ring, cqe);
+			continue;
+		}
+		if (cqe->res < 0) {
+			fprintf(stderr, "recvmsg: %s\n", strerror(-cqe->res));
+			return 1;
+		}
+		if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+			io_uring_cqe_seen(&r->ring, cqe);
+			/* the socket saw EOF */
+			if (!armed)
+				return 0;
+			continue;
+		}
+
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = r->bufs + bid * r->buf_size;
+		o = io_uring_recvmsg_validate(buf, cqe->res, &msg);
+		ret = 0;
+		if (!o) {
+			fprintf(stderr, "bad recvmsg_out\n");
+			r->bad_data = true;
+			ret = 1;
+		} else if (o->flags & MSG_CTRUNC) {
+			fprintf(stderr, "control message truncated\n");
+			r->bad_data = true;
+			ret = 1;
+		} else {
+			len = io_uring_recvmsg_payload_length(o, cqe->res, &msg);
+			/* a zero length data message is the end of the stream */
+			if (!len && !o->controllen)
+				ret = 1;
+			else
+				ret = receiver_msg(r, record_type(&msg, o),
+					io_uring_recvmsg_payload(o, &msg), len);
+		}
+		io_uring_buf_ring_add(r->br, buf, r->buf_size, bid, mask, 0);
+		io_uring_buf_ring_advance(r->br, 1);
+		io_uring_cqe_seen(&r->ring, cqe);
+		if (ret)
+			return r->bad_data;
+	}
+}
+
+static int connect_pair(int *sfd, int *rfd)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(addr);
+	int lfd;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(lfd, 1) ||
+	    getsockname(lfd, (struct sockaddr *) &addr, &len)) {
+		perror("listen");
+		return 1;
+	}
+	*sfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (*sfd < 0 || connect(*sfd, (struct sockaddr *) &addr, len)) {
+		perror("connect");
+		return 1;
+	}
+	*rfd = accept(lfd, NULL, NULL);
+	if (*rfd < 0) {
+		perror("accept");
+		return 1;
+	}
+	close(lfd);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m ktls|plain] [-s send|zc|splice|sync] "
+			"[-r mshot|sync] [-b block size] [-t seconds]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct io_uring_params p = { };
+	struct sender s = { };
+	struct receiver r = { };
+	struct ktls_hello peer;
+	uint64_t start, start_cpu, nsec, cpu;
+	pthread_t thread;
+	int opt, ret, i;
+
+	while ((opt = getopt(argc, argv, "m:s:r:b:t:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (!strcmp(optarg, "plain"))
+				use_ktls = false;
+			else if (strcmp(optarg, "ktls")) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			for (i = 0; i < 4; i++)
+				if (!strcmp(optarg, send_names[i]))
+					break;
+			if (i == 4) {
+				usage(argv[0]);
+				return 1;
+			}
+			send_mode = i;
+			break;
+		case 'r':
+			if (!strcmp(optarg, "sync"))
+				recv_sync = true;
+			else if (strcmp(optarg, "mshot")) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'b':
+			bs = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (bs < 4096 || bs > 16 * 1024 * 1024 || runtime < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (connect_pair(&s.fd, &r.fd))
+		return 1;
+
+	/* room for the recvmsg header and the record type too */
+	r.buf_size = 64 * 1024;
+	r.bufs = t_aligned_alloc(4096, RECV_BUFS * r.buf_size);
+	if (!r.bufs)
+		return 1;
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	ret = io_uring_queue_init_params(8, &r.ring, &p);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	if (pthread_create(&thread, NULL, sender_fn, &s))
+		return 1;
+
+	if (recv(r.fd, &peer, sizeof(peer), MSG_WAITALL) != sizeof(peer) ||
+	    memcmp(peer.magic, hello_magic, sizeof(peer.magic))) {
+		fprintf(stderr, "bad key exchange\n");
+		pthread_join(thread, NULL);
+		return 1;
+	}
+	if (use_ktls && ktls_install(&r.ring, r.fd, &peer.dir[1],
+				     &peer.dir[0])) {
+		fprintf(stderr, "kernel TLS not available\n");
+		shutdown(r.fd, SHUT_RDWR);
+		pthread_join(thread, NULL);
+		return 1;
+	}
+
+	start = now_ns();
+	start_cpu = cpu_ns();
+	if (recv_sync)
+		ret = receive_sync(&r);
+	else
+		ret = receive_mshot(&r);
+	nsec = now_ns() - start;
+	cpu = cpu_ns() - start_cpu;
+	pthread_join(thread, NULL);
+
+	if (ret || sender_error || r.bad_data) {
+		fprintf(stderr, "transfer failed%s\n",
+			r.bad_data ? ", bad data" : "");
+		return 1;
+	}
+	if (use_ktls && !r.close_notify) {
+		fprintf(stderr, "stream ended without close_notify\n");
+		return 1;
+	}
+
+	printf("mode=%s send=%s recv=%s bs=%u secs=%.2f bytes=%lu gbps=%.2f "
+		"cpu_ms_per_gb=%.1f msgs=%lu ctrl_records=%lu\n",
+		use_ktls ? "ktls" : "plain", send_names[send_mode],
+		recv_sync ? "sync" : "mshot", bs, nsec / 1e9, r.bytes,
+		r.bytes * 8 / (double) nsec,
+		r.bytes ? cpu / 1e6 / (r.bytes / 1e9) : 0.0,
+		r.records_data, r.records_ctrl);
+	io_uring_queue_exit(&r.ring);
+	return 0;
+}
@@ -2,6 +2,14 @@
 /*
  * Very basic proof-of-concept for doing a copy with linked SQEs. Needs a
  * bit of error handling and short read love.
+ *
+ * Each chunk is a linked read -> write pair, with up to 'qd' pairs in
+ * flight. By default they use fixed buffers on fixed files, and plain reads
+ * and writes if buffers can't be registered. With -m splice, each pair is
+ * a splice into a pipe and one out of it instead.
+ *
+ * With -a, the block size and queue depth are tuned while copying, see
+ * copy_tuner_done(). The parameters used are printed at the end.
  */
 #include <stdio.h>
 #include <fcntl.h>
@@ -15,18 +23,45 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include "liburing.h"
+#include "helpers.h"
+#include "copy-tuner.h"
 
 #define QD	64
 #define BS	(32*1024)
 
+#define MAX_QD	64
+#define MAX_BS	(1024*1024)
+
+enum {
+	METHOD_FIXED,
+	METHOD_RW,
+	METHOD_SPLICE,
+};
+
+static const char *method_names[] = { "fixed", "rw", "splice" };
+
 struct io_data {
 	size_t offset;
 	int index;
+	int slot;
+	unsigned long long start_ns;
 	struct iovec iov;
+	int pipe[2];
 };
 
 static int infd, outfd;
 static int inflight;
+/* what requests use for the files, the fixed ones if registered */
+static int in_file, out_file, file_flags;
+static int method = METHOD_FIXED;
+static struct copy_tuner tuner;
+static int tune;
+
+/* one per pair in flight, with a buffer or pipe each */
+static struct io_data *slots;
+static int *free_slots;
+static int nr_free_slots;
+static int nr_slots;
 
 static int setup_context(unsigned entries, struct io_uring *ring)
 {
@@ -41,6 +76,76 @@ static int setup_context(unsigned entries, struct io_uring *ring)
 	return 0;
 }
 
+/*
+ * Sets up 'nr' slots of '*size' bytes, and registers the files and buffers.
+ * Falls back to plain reads and writes if the buffers can't be registered,
+ * and to normal file descriptors if the files can't. Pipes may not be as
+ * large as asked for, '*size' is lowered to the smallest one if so.
+ */
+static int setup_slots(struct io_uring *ring, unsigned nr, unsigned *size)
+{
+	struct iovec *iovs;
+	int fds[2] = { infd, outfd };
+	unsigned i;
+	int ret;
+
+	slots = calloc(nr, sizeof(*slots));
+	free_slots = calloc(nr, sizeof(int));
+	iovs = calloc(nr, sizeof(*iovs));
+	if (!slots || !free_slots || !iovs)
+		return 1;
+
+	for (i = 0; i < nr; i++) {
+		slots[i].slot = i;
+		if (method == METHOD_SPLICE) {
+			if (pipe(slots[i].pipe) < 0) {
+				perror("pipe");
+				return 1;
+			}
+			/* so a splice into it is never short */
+			fcntl(slots[i].pipe[0], F_SETPIPE_SZ, *size);
+			ret = fcntl(slots[i].pipe[0], F_GETPIPE_SZ);
+			if (ret < 0) {
+				perror("F_GETPIPE_SZ");
+				return 1;
+			}
+			if ((unsigned) ret < *size)
+				*size = ret;
+		} else {
+			iovs[i].iov_base = t_aligned_alloc(4096, *size);
+			iovs[i].iov_len = *size;
+			if (!iovs[i].iov_base)
+				return 1;
+		}
+		free_slots[nr_free_slots++] = i;
+	}
+	nr_slots = nr;
+
+	if (method == METHOD_FIXED) {
+		ret = io_uring_register_buffers(ring, iovs, nr);
+		if (ret) {
+			fprintf(stderr, "register buffers: %s, using read/write\n",
+					strerror(-ret));
+			method = METHOD_RW;
+		}
+	}
+	if (method != METHOD_SPLICE) {
+		for (i = 0; i < nr; i++)
+			slots[i].iov.iov_base = iovs[i].iov_base;
+	}
+	free(iovs);
+
+	in_file = infd;
+	out_file = outfd;
+	ret = io_uring_register_files(ring, fds, 2);
+	if (!ret) {
+		in_file = 0;
+		out_file = 1;
+		file_flags = IOSQE_FIXED_FILE;
+	}
+	return 0;
+}
+
 static int get_file_size(int fd, off_t *size)
 {
 	struct stat st;
@@ -68,19 +173,47 @@ static void queue_rw_pair(struct io_uring *ring, off_t size, off_t offset)
 	struct io_uring_sqe *sqe;
 	struct io_data *data;
 
-	data = malloc(size + sizeof(*data));
+	assert(nr_free_slots);
+	data = &slots[free_slots[--nr_free_slots]];
 	data->index = 0;
 	data->offset = offset;
-	data->iov.iov_base = data + 1;
 	data->iov.iov_len = size;
+	data->start_ns = now_ns();
 
 	sqe = io_uring_get_sqe(ring);
-	io_uring_prep_readv(sqe, infd, &data->iov, 1, offset);
+	switch (method) {
+	case METHOD_FIXED:
+		io_uring_prep_read_fixed(sqe, in_file, data->iov.iov_base, size,
+					 offset, data->slot);
+		break;
+	case METHOD_RW:
+		io_uring_prep_readv(sqe, in_file, &data->iov, 1, offset);
+		break;
+	case METHOD_SPLICE:
+		io_uring_prep_splice(sqe, in_file, offset, data->pipe[1], -1,
+				     size, file_flags ? SPLICE_F_FD_IN_FIXED : 0);
+		break;
+	}
+	if (method != METHOD_SPLICE)
+		sqe->flags |= file_flags;
 	sqe->flags |= IOSQE_IO_LINK;
 	io_uring_sqe_set_data(sqe, data);
 
 	sqe = io_uring_get_sqe(ring);
-	io_uring_prep_writev(sqe, outfd, &data->iov, 1, offset);
+	switch (method) {
+	case METHOD_FIXED:
+		io_uring_prep_write_fixed(sqe, out_file, data->iov.iov_base,
+					  size, offset, data->slot);
+		break;
+	case METHOD_RW:
+		io_uring_prep_writev(sqe, out_file, &data->iov, 1, offset);
+		break;
+	case METHOD_SPLICE:
+		io_uring_prep_splice(sqe, data->pipe[0], -1, out_file, offset,
+				     size, 0);
+		break;
+	}
+	sqe->flags |= file_flags;
 	io_uring_sqe_set_data(sqe, data);
 }
 
@@ -92,17 +225,20 @@ static int handle_cqe(struct io_uring *ring, struct io_uring_cqe *cqe)
 	data->index++;
 
 	if (cqe->res < 0) {
-		if (cqe->res == -ECANCELED) {
+		if (cqe->res == -ECANCELED && method != METHOD_SPLICE) {
 			queue_rw_pair(ring, data->iov.iov_len, data->offset);
 			inflight += 2;
 		} else {
+			/* a short splice would leave data in the pipe */
 			printf("cqe error: %s\n", strerror(-cqe->res));
 			ret = 1;
 		}
+	} else if (data->index == 2 && tune) {
+		copy_tuner_done(&tuner, data->iov.iov_len, data->start_ns);
 	}
 
 	if (data->index == 2)
-		free(data);
+		free_slots[nr_free_slots++] = data->slot;
 	io_uring_cqe_seen(ring, cqe);
 	return ret;
 }
@@ -116,10 +252,10 @@ static int copy_file(struct io_uring *ring, off_t insize)
 	offset = 0;
 	while (insize) {
 		int has_inflight = inflight;
-		int depth;
 
-		while (insize && inflight < QD) {
-			this_size = BS;
+		/* a pair holds its slot until the write is done */
+		while (insize && nr_slots - nr_free_slots < tuner.qd) {
+			this_size = tuner.bs;
 			if (this_size > insize)
 				this_size = insize;
 			queue_rw_pair(ring, this_size, offset);
@@ -131,11 +267,8 @@ static int copy_file(struct io_uring *ring, off_t insize)
 		if (has_inflight != inflight)
 			io_uring_submit(ring);
 
-		if (insize)
-			depth = QD;
-		else
-			depth = 1;
-		while (inflight >= depth) {
+		while (insize ? nr_slots - nr_free_slots >= tuner.qd :
+				inflight > 0) {
 			int ret;
 
 			ret = io_uring_wait_cqe(ring, &cqe);
@@ -152,37 +285,103 @@ static int copy_file(struct io_uring *ring, off_t insize)
 	return 0;
 }
 
+static void usage(const char *name)
+{
+	printf("%s: [-b bs] [-q qd] [-a] [-m fixed|rw|splice] infile outfile\n",
+		name);
+}
+
 int main(int argc, char *argv[])
 {
+	/* QD counts requests, and there are two per pair */
+	unsigned bs = BS, qd = QD / 2;
+	unsigned long long start, nsec;
 	struct io_uring ring;
 	off_t insize;
-	int ret;
-
-	if (argc < 3) {
-		printf("%s: infile outfile\n", argv[0]);
+	int ret, opt;
+
+	while ((opt = getopt(argc, argv, "b:q:am:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			qd = atoi(optarg);
+			break;
+		case 'a':
+			tune = 1;
+			break;
+		case 'm':
+			for (method = 0; method <= METHOD_SPLICE; method++)
+				if (!strcmp(optarg, method_names[method]))
+					break;
+			if (method > METHOD_SPLICE) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind < 2 || bs < 512 || bs > MAX_BS || !qd ||
+	    qd > MAX_QD) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	infd = open(argv[1], O_RDONLY);
+	infd = open(argv[optind], O_RDONLY);
 	if (infd < 0) {
 		perror("open infile");
 		return 1;
 	}
-	outfd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	outfd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	if (outfd < 0) {
 		perror("open outfile");
 		return 1;
 	}
+	if (get_file_size(infd, &insize))
+		return 1;
+
+	/* sized for the largest the tuner may pick */
+	if (tune) {
+		bs = MAX_BS;
+		qd = MAX_QD;
+	}
 
-	if (setup_context(QD, &ring))
+	/* a cancelled pair is requeued before its slot is freed */
+	if (setup_context(2 * qd, &ring))
 		return 1;
-	if (get_file_size(infd, &insize))
+	if (setup_slots(&ring, qd + 1, &bs))
 		return 1;
 
+	if (tune) {
+		unsigned long long step = insize / 32;
+
+		if (step < 4 * 1024 * 1024)
+			step = 4 * 1024 * 1024;
+		copy_tuner_init(&tuner, bs, MAX_QD, step);
+	} else {
+		tuner.bs = bs;
+		tuner.qd = qd;
+	}
+
+	start = now_ns();
 	ret = copy_file(&ring, insize);
+	nsec = now_ns() - start;
 
 	close(infd);
 	close(outfd);
 	io_uring_queue_exit(&ring);
-	return ret;
+	if (ret)
+		return ret;
+
+	printf("method=%s fixed_files=%d bs=%u qd=%u tuned=%d mb_per_sec=%.1f\n",
+		method_names[method], !!file_flags, tuner.bs, tuner.qd,
+		tune && tuner.state == TUNE_DONE, insize / 1e6 / (nsec / 1e9));
+	if (tune && tuner.state == TUNE_DONE)
+		printf("tuned_mb_per_sec=%.1f tuned_lat_us=%.1f\n",
+			tuner.rate / 1e6, tuner.lat_us);
+	return 0;
 }
@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Startup time benchmark for setting up a large number of TCP listening
+ * sockets, one per port, each with a multishot accept armed. Either:
+ *
+ *   sync	socket(2), setsockopt(2), bind(2) and listen(2) calls for each
+ *		socket in turn, with the multishot accepts submitted in
+ *		batches
+ *
+ *   ring	a linked socket -> setsockopt -> bind -> listen -> accept
+ *		chain per socket, see prep_listener_chain() in helpers.c,
+ *		with 'batch' chains going out per submit. The sockets only
+ *		ever exist as direct descriptors.
+ *
+ * The time until all listeners are ready is printed. Then every port is
+ * connected to once, to check that all the accepts are armed.
+ *
+ * Usage: ./listen-many [-m sync|ring] [-n listeners] [-b batch]
+ *			[-o nr options] [-p base port]
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+enum {
+	OP_SETUP = 1,
+	OP_LISTEN,
+	OP_ACCEPT,
+};
+
+enum {
+	MODE_SYNC,
+	MODE_RING,
+};
+
+static const char *mode_names[] = { "sync", "ring" };
+
+/* set on each listener before bind, the first 'nr_opts' are used */
+static const struct sockopt_val opts[] = {
+	{ SOL_SOCKET,	SO_REUSEADDR,	1 },
+	{ IPPROTO_TCP,	TCP_DEFER_ACCEPT, 0 },
+	{ SOL_SOCKET,	SO_RCVBUF,	65536 },
+	{ SOL_SOCKET,	SO_SNDBUF,	65536 },
+};
+#define MAX_OPTS	(sizeof(opts) / sizeof(opts[0]))
+
+static int mode = MODE_RING;
+static int nr_listeners = 1000;
+static int batch = 64;
+static int nr_opts = 1;
+static int base_port = 20000;
+
+static struct io_uring ring;
+static struct sockaddr_in *addrs;
+static int *fds;
+static unsigned long syscalls;
+
+static uint64_t encode(int op, int idx)
+{
+	return ((uint64_t) op << 32) | (uint32_t) idx;
+}
+
+static int submit(void)
+{
+	int ret;
+
+	syscalls++;
+	ret = io_uring_submit(&ring);
+	if (ret < 0)
+		fprintf(stderr, "submit: %s\n", strerror(-ret));
+	return ret;
+}
+
+static void prep_accept(int idx)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+	if (mode == MODE_RING) {
+		io_uring_prep_multishot_accept_direct(sqe, idx, NULL, NULL, 0);
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		io_uring_prep_multishot_accept(sqe, fds[idx], NULL, NULL, 0);
+	}
+	io_uring_sqe_set_data64(sqe, encode(OP_ACCEPT, idx));
+}
+
+static int setup_sync(void)
+{
+	int i, j;
+
+	for (i = 0; i < nr_listeners; i++) {
+		int fd;
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			perror("socket");
+			return 1;
+		}
+		for (j = 0; j < nr_opts; j++) {
+			if (setsockopt(fd, opts[j].level, opts[j].optname,
+				       &opts[j].val, sizeof(int)) < 0) {
+				perror("setsockopt");
+				return 1;
+			}
+		}
+		if (bind(fd, (struct sockaddr *) &addrs[i], sizeof(addrs[i])) ||
+		    listen(fd, 128)) {
+			fprintf(stderr, "port %d: %s\n", base_port + i,
+				strerror(errno));
+			return 1;
+		}
+		syscalls += 3 + nr_opts;
+		fds[i] = fd;
+
+		prep_accept(i);
+		if (((i + 1) % batch == 0 || i == nr_listeners - 1) &&
+		    submit() < 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * A chain posts one completion, for the listen or for the step that
+ * failed. Reap as we go, so the CQ ring never overflows.
+ */
+static int reap(int *done, int *errors, int wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, count = 0;
+	int ret;
+
+	if (wait) {
+		syscalls++;
+		ret = io_uring_wait_cqe(&ring, &cqe);
+		if (ret) {
+			fprintf(stderr, "wait_cqe: %s\n", strerror(-ret));
+			return ret;
+		}
+	}
+	io_uring_for_each_cqe(&ring, head, cqe) {
+		int op = cqe->user_data >> 32;
+		int idx = cqe->user_data & 0xffffffff;
+
+		count++;
+		if (op != OP_ACCEPT)
+			(*done)++;
+		if (cqe->res >= 0 || (op != OP_SETUP && cqe->res == -ECANCELED))
+			continue;
+		if ((*errors)++ < 5)
+			fprintf(stderr, "port %d: %s\n", base_port + idx,
+				strerror(-cqe->res));
+	}
+	io_uring_cq_advance(&ring, count);
+	return 0;
+}
+
+static int setup_ring(void)
+{
+	int i, ret, done = 0, errors = 0;
+
+	for (i = 0; i < nr_listeners; i++) {
+		ret = prep_listener_chain(&ring, (struct sockaddr *) &addrs[i],
+					  sizeof(addrs[i]), i, opts, nr_opts,
+					  128, 1, encode(OP_SETUP, i),
+					  encode(OP_LISTEN, i));
+		if (ret < 0) {
+			fprintf(stderr, "listener chain: %s\n", strerror(-ret));
+			return 1;
+		}
+		prep_accept(i);
+		if ((i + 1) % batch == 0 || i == nr_listeners - 1) {
+			if (submit() < 0)
+				return 1;
+			if (reap(&done, &errors, 0))
+				return 1;
+		}
+	}
+	while (done < nr_listeners) {
+		if (reap(&done, &errors, 1))
+			return 1;
+	}
+	if (errors) {
+		fprintf(stderr, "%d listeners failed\n", errors);
+		return 1;
+	}
+	return 0;
+}
+
+/* connect to every listener, and wait for all the accepts */
+static int verify(void)
+{
+	struct __kernel_timespec ts = { .tv_sec = 5 };
+	int *cfds, i, accepted = 0, ret = 0;
+
+	cfds = calloc(nr_listeners, sizeof(int));
+	if (!cfds)
+		return 1;
+	for (i = 0; i < nr_listeners; i++) {
+		cfds[i] = socket(AF_INET, SOCK_STREAM, 0);
+		if (cfds[i] < 0 || connect(cfds[i], (struct sockaddr *) &addrs[i],
+					   sizeof(addrs[i]))) {
+			fprintf(stderr, "connect port %d: %s\n", base_port + i,
+				strerror(errno));
+			ret = 1;
+			goto out;
+		}
+	}
+
+	while (accepted < nr_listeners) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, count = 0;
+
+		ret = io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
+		if (ret) {
+			fprintf(stderr, "%d of %d accepts seen: %s\n", accepted,
+				nr_listeners, strerror(-ret));
+			ret = 1;
+			break;
+		}
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			count++;
+			if (cqe->res < 0) {
+				fprintf(stderr, "accept: %s\n",
+					strerror(-cqe->res));
+				continue;
+			}
+			accepted++;
+			if (mode == MODE_SYNC)
+				close(cqe->res);
+		}
+		io_uring_cq_advance(&ring, count);
+	}
+out:
+	for (i = 0; i < nr_listeners; i++)
+		if (cfds[i] > 0)
+			close(cfds[i]);
+	free(cfds);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m sync|ring] [-n listeners] [-b batch] "
+			"[-o nr options] [-p base port]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct io_uring_params p = { };
+	struct rlimit rlim;
+	uint64_t start, nsec;
+	int opt, i, ret, entries;
+
+	while ((opt = getopt(argc, argv, "m:n:b:o:p:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (!strcmp(optarg, "sync"))
+				mode = MODE_SYNC;
+			else if (!strcmp(optarg, "ring"))
+				mode = MODE_RING;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			nr_listeners = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'o':
+			nr_opts = atoi(optarg);
+			break;
+		case 'p':
+			base_port = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nr_listeners < 1 || base_port < 1 ||
+	    base_port + nr_listeners > 65536 || batch < 1 || nr_opts < 0 ||
+	    nr_opts > MAX_OPTS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* listeners, accepted sockets and the verify connections */
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	addrs = calloc(nr_listeners, sizeof(*addrs));
+	fds = calloc(nr_listeners, sizeof(int));
+	if (!addrs || !fds) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < nr_listeners; i++) {
+		addrs[i].sin_family = AF_INET;
+		addrs[i].sin_port = htons(base_port + i);
+		addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+
+	/* room for 'batch' full chains, and their listen completions */
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+		  IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE;
+	entries = batch * (MAX_OPTS + 4);
+	p.cq_entries = 2 * (entries + nr_listeners);
+	ret = io_uring_queue_init_params(entries, &ring, &p);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+	if (mode == MODE_RING) {
+		/* listeners in the first half, accepted sockets in the second */
+		ret = io_uring_register_files_sparse(&ring, nr_listeners * 2);
+		if (!ret)
+			ret = io_uring_register_file_alloc_range(&ring,
+							nr_listeners,
+							nr_listeners);
+		if (ret) {
+			fprintf(stderr, "file table: %s\n", strerror(-ret));
+			return 1;
+		}
+	}
+
+	start = now_ns();
+	if (mode == MODE_RING)
+		ret = setup_ring();
+	else
+		ret = setup_sync();
+	nsec = now_ns() - start;
+	if (ret)
+		return 1;
+
+	printf("mode=%s listeners=%d batch=%d opts=%d ready_ms=%.2f "
+		"us_per_listener=%.2f syscalls=%lu\n", mode_names[mode],
+		nr_listeners, batch, nr_opts, nsec / 1e6,
+		nsec / 1e3 / nr_listeners, syscalls);
+
+	ret = verify();
+	io_uring_queue_exit(&ring);
+	if (mode == MODE_SYNC) {
+		for (i = 0; i < nr_listeners; i++)
+			close(fds[i]);
+	}
+	return ret;
+}
@@ -11,6 +11,9 @@
  *	-b -t10 -u
  *
  * send and receive 100k packets, using NAPI.
+ *
+ * With -i, the client waits the given number of usecs between getting a
+ * reply and sending the next ping, to emulate lower load levels.
  */
 #include <ctype.h>
 #include <errno.h>
@@ -64,6 +67,7 @@ struct ctx
 
 	int rtt_index;
 	double *rtt;
+	int interval;
 };
 
 struct options
@@ -76,6 +80,7 @@ struct options
 	bool busy_loop;
 	bool prefer_busy_poll;
 	bool ipv6;
+	int interval;
 
 	char port[PORTNOLEN];
 	char addr[ADDRLEN];
@@ -86,6 +91,7 @@ static struct option longopts[] =
 	{"address"  , 1, NULL, 'a'},
 	{"busy"     , 0, NULL, 'b'},
 	{"help"     , 0, NULL, 'h'},
+	{"interval" , 1, NULL, 'i'},
 	{"num_pings", 1, NULL, 'n'},
 	{"port"     , 1, NULL, 'p'},
 	{"prefer"   , 1, NULL, 'u'},
@@ -98,7 +104,8 @@ static void printUsage(const char *name)
 {
 	fprintf(stderr,
 	"Usage: %s [-l|--listen] [-a|--address ip_address] [-p|--port port-no] [-s|--sqpoll]"
-	" [-b|--busy] [-n|--num pings] [-t|--timeout busy-poll-timeout] [-u||--prefer] [-6] [-h|--help]\n"
+	" [-b|--busy] [-n|--num pings] [-t|--timeout busy-poll-timeout] [-u||--prefer] [-i|--interval usec]"
+	" [-6] [-h|--help]\n"
 	"--address\n"
 	"-a        : remote or local ipv6 address\n"
 	"--busy\n"
@@ -113,6 +120,8 @@ static void printUsage(const char *name)
 	"-t        : Configure NAPI busy poll timeout"
 	"--prefer\n"
 	"-u        : prefer NAPI busy poll\n"
+	"--interval\n"
+	"-i        : usecs to wait between a reply and the next ping\n"
 	"-6        : use IPV6\n"
 	"--help\n"
 	"-h        : Display this usage message\n\n",
@@ -211,6 +220,21 @@ static void recordRTT(struct ctx *ctx)
 {
 	struct timespec startTs = ctx->ts;
 
+	if (ctx->interval) {
+		struct timespec now, delay = {
+			.tv_sec = ctx->interval / 1000000,
+			.tv_nsec = (ctx->interval % 1000000) * 1000,
+		};
+
+		// Store round-trip time, then wait before the next ping.
+		clock_gettime(CLOCK_REALTIME, &now);
+		ctx->rtt[ctx->rtt_index] = diffTimespec(&now, &startTs);
+		ctx->rtt_index++;
+		nanosleep(&delay, NULL);
+		sendPing(ctx);
+		return;
+	}
+
 	// Send next ping.
 	sendPing(ctx);
 
@@ -302,7 +326,7 @@ int main(int argc, char *argv[])
 	memset(&opt, 0, sizeof(struct options));
 
 	// Process flags.
-	while ((flag = getopt_long(argc, argv, ":hs:bua:n:p:t:6d:", longopts, NULL)) != -1) {
+	while ((flag = getopt_long(argc, argv, ":hs:bua:n:p:t:6d:i:", longopts, NULL)) != -1) {
 		switch (flag) {
 		case 'a':
 			strcpy(opt.addr, optarg);
@@ -314,6 +338,9 @@ int main(int argc, char *argv[])
 			printUsage(argv[0]);
 			exit(0);
 			break;
+		case 'i':
+			opt.interval = atoi(optarg);
+			break;
 		case 'n':
 			opt.num_pings = atoi(optarg) + 1;
 			break;
@@ -444,6 +471,7 @@ int main(int argc, char *argv[])
 	ctx.napi_check = false;
 	ctx.buffer_len = sizeof(struct timespec);
 	ctx.num_pings  = opt.num_pings;
+	ctx.interval   = opt.interval;
 
 	ctx.rtt_index = 0;
 	ctx.rtt = (double *)malloc(sizeof(double) * opt.num_pings);
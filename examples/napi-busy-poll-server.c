@@ -11,6 +11,12 @@
  *	-p4444 -t10 -b -u
  *
  * will respond to 100k packages, using NAPI.
+ *
+ * With -A, busy polling is instead turned on and off and its timeout
+ * adjusted at runtime by the controller in napi-ctl.h, with -t as the
+ * largest timeout it will use. -V prints its decisions as it goes. At
+ * exit, the CPU used by the server is printed, and in adaptive mode how
+ * it splits between busy poll being on and off.
  */
 #include <ctype.h>
 #include <errno.h>
@@ -29,6 +35,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 
+#include "napi-ctl.h"
+
 #define MAXBUFLEN 100
 #define PORTNOLEN 10
 #define ADDRLEN   80
@@ -75,16 +83,20 @@ struct options
 	bool busy_loop;
 	bool prefer_busy_poll;
 	bool ipv6;
+	bool adaptive;
+	bool verbose;
 
 	char port[PORTNOLEN];
 	char addr[ADDRLEN];
 };
 
 static struct options opt;
+static struct napi_ctl napi_ctl;
 
 static struct option longopts[] =
 {
 	{"address"  , 1, NULL, 'a'},
+	{"adaptive" , 0, NULL, 'A'},
 	{"busy"     , 0, NULL, 'b'},
 	{"help"     , 0, NULL, 'h'},
 	{"listen"   , 0, NULL, 'l'},
@@ -93,6 +105,7 @@ static struct option longopts[] =
 	{"prefer"   , 1, NULL, 'u'},
 	{"sqpoll"   , 0, NULL, 's'},
 	{"timeout"  , 1, NULL, 't'},
+	{"verbose"  , 0, NULL, 'V'},
 	{NULL       , 0, NULL,  0 }
 };
 
@@ -100,7 +113,8 @@ static void printUsage(const char *name)
 {
 	fprintf(stderr,
 	"Usage: %s [-l|--listen] [-a|--address ip_address] [-p|--port port-no] [-s|--sqpoll]"
-	" [-b|--busy] [-n|--num pings] [-t|--timeout busy-poll-timeout] [-u|--prefer] [-6] [-h|--help]\n"
+	" [-b|--busy] [-n|--num pings] [-t|--timeout busy-poll-timeout] [-u|--prefer] [-A|--adaptive]"
+	" [-V|--verbose] [-6] [-h|--help]\n"
 	" --listen\n"
 	"-l        : Server mode\n"
 	"--address\n"
@@ -117,6 +131,10 @@ static void printUsage(const char *name)
 	"-t        : Configure NAPI busy poll timeout"
 	"--prefer\n"
 	"-u        : prefer NAPI busy poll\n"
+	"--adaptive\n"
+	"-A        : adapt NAPI busy poll to the load, -t is the largest timeout\n"
+	"--verbose\n"
+	"-V        : print adaptive busy poll decisions\n"
 	"-6        : use IPV6\n"
 	"--help\n"
 	"-h        : Display this usage message\n\n",
@@ -258,16 +276,20 @@ int main(int argc, char *argv[])
 	struct __kernel_timespec ts;
 	struct io_uring_params params;
 	struct io_uring_napi napi;
+	uint64_t start_wall, start_cpu, wall, cpu;
 	int ret, af;
 
 	memset(&opt, 0, sizeof(struct options));
 
 	// Process flags.
-	while ((flag = getopt_long(argc, argv, ":lhs:bua:n:p:t:6d:", longopts, NULL)) != -1) {
+	while ((flag = getopt_long(argc, argv, ":lhs:bua:n:p:t:6d:AV", longopts, NULL)) != -1) {
 		switch (flag) {
 		case 'a':
 			strcpy(opt.addr, optarg);
 			break;
+		case 'A':
+			opt.adaptive = true;
+			break;
 		case 'b':
 			opt.busy_loop = true;
 			break;
@@ -299,6 +321,9 @@ int main(int argc, char *argv[])
 		case 'd':
 			opt.defer_tw = !!atoi(optarg);
 			break;
+		case 'V':
+			opt.verbose = true;
+			break;
 		case ':':
 			printError("Missing argument", optopt);
 			printUsage(argv[0]);
@@ -322,6 +347,12 @@ int main(int argc, char *argv[])
 		printUsage(argv[0]);
 		exit(1);
 	}
+	if (opt.adaptive && opt.busy_loop) {
+		fprintf(stderr, "adaptive busy poll needs blocking waits, not -b\n");
+		exit(1);
+	}
+	if (opt.adaptive && !opt.timeout)
+		opt.timeout = 100;
 
 	if (opt.ipv6) {
 		af = AF_INET6;
@@ -382,7 +413,15 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (opt.timeout || opt.prefer_busy_poll) {
+	if (opt.adaptive) {
+		unsigned int min_to = opt.timeout / 16 ? opt.timeout / 16 : 1;
+
+		ret = napi_ctl_init(&napi_ctl, &ctx.ring, min_to, opt.timeout,
+				    opt.prefer_busy_poll);
+		if (ret)
+			exit(1);
+		napi_ctl.verbose = opt.verbose;
+	} else if (opt.timeout || opt.prefer_busy_poll) {
 		napi.prefer_busy_poll = opt.prefer_busy_poll;
 		napi.busy_poll_to = opt.timeout;
 
@@ -411,6 +450,7 @@ int main(int argc, char *argv[])
 
 	// Receive initial message to get napi id.
 	receivePing(&ctx);
+	start_wall = start_cpu = 0;
 
 	while (ctx.num_pings != 0) {
 		int res;
@@ -418,6 +458,8 @@ int main(int argc, char *argv[])
 		unsigned int head;
 		struct io_uring_cqe *cqe;
 
+		if (opt.adaptive)
+			napi_ctl_wait_start(&napi_ctl);
 		do {
 			res = io_uring_submit_and_wait_timeout(&ctx.ring, &cqe, 1, tsPtr, NULL);
 			if (res >= 0)
@@ -435,10 +477,26 @@ int main(int argc, char *argv[])
 
 		if (num_completed)
 			io_uring_cq_advance(&ctx.ring, num_completed);
+		if (opt.adaptive)
+			napi_ctl_wait_end(&napi_ctl, num_completed);
+
+		// Server CPU use is counted from the first ping.
+		if (!start_wall) {
+			start_wall = napi_ctl_clock(CLOCK_MONOTONIC);
+			start_cpu = napi_ctl_clock(CLOCK_THREAD_CPUTIME_ID);
+		}
 	}
 
+	wall = napi_ctl_clock(CLOCK_MONOTONIC) - start_wall;
+	cpu = napi_ctl_clock(CLOCK_THREAD_CPUTIME_ID) - start_cpu;
+	printf(" server cpu=%.1f%% cpu_per_ping=%.2fus\n", cpu * 100.0 / wall,
+		opt.num_pings > 1 ? cpu / 1000.0 / (opt.num_pings - 1) : 0.0);
+
 	// Clean up.
-	if (opt.timeout || opt.prefer_busy_poll) {
+	if (opt.adaptive) {
+		napi_ctl_report(&napi_ctl, stdout);
+		napi_ctl_exit(&napi_ctl);
+	} else if (opt.timeout || opt.prefer_busy_poll) {
 		ret = io_uring_unregister_napi(&ctx.ring, &napi);
 		if (ret)
 			fprintf(stderr, "io_uring_unregister_napi: %d\n", ret);
@@ -0,0 +1,85 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Compares NAPI busy poll off, fixed and adaptive (napi-ctl.h) in
+# napi-busy-poll-server across load levels. The server and client run in
+# two network namespaces joined by a veth pair, with GRO enabled on the
+# veth so received packets go through NAPI. The load is set by how long
+# the client waits between pings, the client itself never busy polls.
+# For each run, prints the client RTT and the server CPU use, and for
+# adaptive mode how long busy poll was on.
+#
+# Needs root. Usage: ./napi-busy-poll.sh [pings per run]
+#
+# INTERVALS is the list of client wait times in usecs, and TIMEOUT the
+# fixed, and largest adaptive, busy poll timeout in usecs. Best run with
+# the server and client on different CPUs, on a single CPU the busy
+# polling server competes with the client it is waiting for.
+
+pings=${1:-20000}
+intervals=${INTERVALS:-"0 20 100 1000"}
+timeout=${TIMEOUT:-50}
+port=4444
+
+dir=$(dirname "$0")
+server="$dir/napi-busy-poll-server"
+client="$dir/napi-busy-poll-client"
+
+if [ ! -x "$server" ] || [ ! -x "$client" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+ns_srv=napi-srv-$$
+ns_cli=napi-cli-$$
+
+cleanup() {
+	ip netns del $ns_srv 2>/dev/null
+	ip netns del $ns_cli 2>/dev/null
+}
+trap cleanup EXIT
+
+ip netns add $ns_srv || exit 1
+ip netns add $ns_cli || exit 1
+ip link add veth-srv netns $ns_srv type veth peer name veth-cli \
+	netns $ns_cli || exit 1
+ip -n $ns_srv addr add 10.77.0.1/24 dev veth-srv
+ip -n $ns_cli addr add 10.77.0.2/24 dev veth-cli
+ip -n $ns_srv link set veth-srv up
+ip -n $ns_cli link set veth-cli up
+ip netns exec $ns_srv ethtool -K veth-srv gro on > /dev/null 2>&1
+ip netns exec $ns_cli ethtool -K veth-cli gro on > /dev/null 2>&1
+
+printf "%-9s %8s %10s %10s %9s %12s %10s\n" "mode" "gap_us" "rtt_avg" \
+	"rtt_max" "srv_cpu%" "cpu/ping_us" "poll_on_s"
+
+for interval in $intervals; do
+	for mode in off fixed adaptive; do
+		case $mode in
+		off)		args="" ;;
+		fixed)		args="-t $timeout" ;;
+		adaptive)	args="-A -t $timeout" ;;
+		esac
+
+		log=$(mktemp)
+		port=$((port + 1))
+		ip netns exec $ns_srv $server -l -a 10.77.0.1 -p $port \
+			-n $pings $args > $log 2>&1 &
+		server_pid=$!
+		sleep 0.5
+
+		out=$(timeout 120 ip netns exec $ns_cli $client -a 10.77.0.1 \
+			-p $port -n $pings -i $interval 2>&1 | \
+			sed -n 's/.*= //p')
+		wait $server_pid
+
+		srv=$(cat $log)
+		rm -f $log
+		printf "%-9s %8s %10s %10s %9s %12s %10s\n" $mode $interval \
+			"$(echo "$out" | cut -d/ -f2)" \
+			"$(echo "$out" | cut -d/ -f3)" \
+			"$(echo "$srv" | sed -n 's/.*server cpu=\([0-9.]*\)%.*/\1/p')" \
+			"$(echo "$srv" | sed -n 's/.*cpu_per_ping=\([0-9.]*\)us.*/\1/p')" \
+			"$(echo "$srv" | sed -n 's/.*busy poll on *: \([0-9.]*\)s.*/\1/p')"
+	done
+done
@@ -0,0 +1,242 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef LIBURING_NAPI_CTL_H
+#define LIBURING_NAPI_CTL_H
+
+/*
+ * Adaptive NAPI busy poll controller for a single ring.
+ *
+ * Busy polling only pays off if the next completion arrives before the
+ * poll window runs out, otherwise the task spins for the full window and
+ * then goes to sleep anyway. The controller times every wait for
+ * completions, and once per interval looks at the 75th percentile of
+ * those wait times:
+ *
+ * - With busy polling on, if most waits are longer than the largest
+ *   allowed window, polling just burns CPU and it is turned off. If not,
+ *   the window is sized to cover most waits.
+ *
+ * - With busy polling off, if most waits are shorter than half the largest
+ *   window, it is turned back on. The gap between the two thresholds keeps
+ *   it from flapping at the boundary.
+ *
+ * CPU and wall time, completions, and time spent waiting are accounted
+ * separately for the on and off states, so the cost of polling can be
+ * compared against what it buys. Usage:
+ *
+ *	napi_ctl_init(&ctl, &ring, min_usec, max_usec, prefer);
+ *	for (;;) {
+ *		napi_ctl_wait_start(&ctl);
+ *		io_uring_submit_and_wait(&ring, 1);
+ *		nr = <reap completions>;
+ *		napi_ctl_wait_end(&ctl, nr);
+ *	}
+ *	napi_ctl_report(&ctl, stdout);
+ *	napi_ctl_exit(&ctl);
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "liburing.h"
+
+#define NAPI_CTL_INTERVAL_NS	(100 * 1000000ULL)
+#define NAPI_CTL_BUCKETS	64
+
+struct napi_ctl_stats {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	uint64_t wait_ns;
+	unsigned long waits;
+	unsigned long cqes;
+};
+
+struct napi_ctl {
+	struct io_uring *ring;
+	unsigned int min_to;
+	unsigned int max_to;
+	bool prefer;
+	bool verbose;
+
+	bool enabled;
+	unsigned int busy_poll_to;
+	unsigned long switches;
+	unsigned long retunes;
+
+	/* current interval */
+	uint64_t win_start;
+	uint64_t win_cpu;
+	uint64_t wait_start;
+	struct napi_ctl_stats win;
+	/* wait times, power of two buckets of nsecs */
+	unsigned long wait_hist[NAPI_CTL_BUCKETS];
+
+	/* totals, indexed by busy poll being off or on */
+	struct napi_ctl_stats st[2];
+};
+
+static inline uint64_t napi_ctl_clock(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int napi_ctl_apply(struct napi_ctl *ctl, bool enable,
+				 unsigned int to)
+{
+	struct io_uring_napi napi = { };
+	int ret;
+
+	if (enable) {
+		napi.busy_poll_to = to;
+		napi.prefer_busy_poll = ctl->prefer;
+		ret = io_uring_register_napi(ctl->ring, &napi);
+	} else {
+		ret = io_uring_unregister_napi(ctl->ring, &napi);
+	}
+	if (ret) {
+		fprintf(stderr, "napi %sregister: %d\n", enable ? "" : "un", ret);
+		return ret;
+	}
+	if (enable != ctl->enabled)
+		ctl->switches++;
+	else if (to != ctl->busy_poll_to)
+		ctl->retunes++;
+	ctl->enabled = enable;
+	ctl->busy_poll_to = enable ? to : 0;
+	return 0;
+}
+
+/*
+ * Start out with busy polling on at the largest window, it gets turned
+ * down or off after the first interval if it isn't paying off.
+ */
+static inline int napi_ctl_init(struct napi_ctl *ctl, struct io_uring *ring,
+				unsigned int min_to, unsigned int max_to,
+				bool prefer)
+{
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->ring = ring;
+	ctl->min_to = min_to;
+	ctl->max_to = max_to;
+	ctl->prefer = prefer;
+	ctl->win_start = napi_ctl_clock(CLOCK_MONOTONIC);
+	ctl->win_cpu = napi_ctl_clock(CLOCK_THREAD_CPUTIME_ID);
+	if (napi_ctl_apply(ctl, true, max_to))
+		return -1;
+	ctl->switches = 0;
+	return 0;
+}
+
+static inline void napi_ctl_exit(struct napi_ctl *ctl)
+{
+	if (ctl->enabled)
+		napi_ctl_apply(ctl, false, 0);
+}
+
+/* usecs that 'pct' percent of the waits in this interval were shorter than */
+static inline unsigned int napi_ctl_wait_pct(struct napi_ctl *ctl, int pct)
+{
+	unsigned long want = ctl->win.waits * pct / 100, seen = 0;
+	int i;
+
+	for (i = 0; i < NAPI_CTL_BUCKETS; i++) {
+		seen += ctl->wait_hist[i];
+		if (seen > want)
+			break;
+	}
+	if (i >= 40)
+		return -1U;
+	return ((1ULL << (i + 1)) + 999) / 1000;
+}
+
+static inline void napi_ctl_update(struct napi_ctl *ctl, uint64_t now)
+{
+	uint64_t cpu = napi_ctl_clock(CLOCK_THREAD_CPUTIME_ID);
+	struct napi_ctl_stats *st = &ctl->st[ctl->enabled];
+	unsigned int p75 = napi_ctl_wait_pct(ctl, 75);
+	bool was_enabled = ctl->enabled;
+	unsigned int was_to = ctl->busy_poll_to;
+
+	ctl->win.wall_ns = now - ctl->win_start;
+	ctl->win.cpu_ns = cpu - ctl->win_cpu;
+	st->wall_ns += ctl->win.wall_ns;
+	st->cpu_ns += ctl->win.cpu_ns;
+	st->wait_ns += ctl->win.wait_ns;
+	st->waits += ctl->win.waits;
+	st->cqes += ctl->win.cqes;
+
+	if (ctl->enabled && p75 > ctl->max_to) {
+		napi_ctl_apply(ctl, false, 0);
+	} else if (ctl->enabled || p75 <= ctl->max_to / 2) {
+		unsigned int to = p75;
+
+		if (to < ctl->min_to)
+			to = ctl->min_to;
+		else if (to > ctl->max_to)
+			to = ctl->max_to;
+		if (!ctl->enabled || to != ctl->busy_poll_to)
+			napi_ctl_apply(ctl, true, to);
+	}
+
+	if (ctl->verbose) {
+		printf("napi: %s to=%uus -> %s to=%uus, rate=%.0f/s cpu=%.1f%% "
+			"wait_p75=%dus\n", was_enabled ? "on" : "off", was_to,
+			ctl->enabled ? "on" : "off", ctl->busy_poll_to,
+			ctl->win.cqes * 1e9 / ctl->win.wall_ns,
+			ctl->win.cpu_ns * 100.0 / ctl->win.wall_ns,
+			p75 == -1U ? -1 : (int) p75);
+	}
+
+	memset(&ctl->win, 0, sizeof(ctl->win));
+	memset(ctl->wait_hist, 0, sizeof(ctl->wait_hist));
+	ctl->win_start = now;
+	ctl->win_cpu = cpu;
+}
+
+static inline void napi_ctl_wait_start(struct napi_ctl *ctl)
+{
+	ctl->wait_start = napi_ctl_clock(CLOCK_MONOTONIC);
+}
+
+/* account a finished wait that reaped 'nr' completions */
+static inline void napi_ctl_wait_end(struct napi_ctl *ctl, unsigned int nr)
+{
+	uint64_t now = napi_ctl_clock(CLOCK_MONOTONIC);
+	uint64_t wait = now - ctl->wait_start;
+
+	ctl->win.waits++;
+	ctl->win.wait_ns += wait;
+	ctl->win.cqes += nr;
+	ctl->wait_hist[wait ? 63 - __builtin_clzll(wait) : 0]++;
+
+	if (now - ctl->win_start >= NAPI_CTL_INTERVAL_NS)
+		napi_ctl_update(ctl, now);
+}
+
+static inline void napi_ctl_report(struct napi_ctl *ctl, FILE *f)
+{
+	int i;
+
+	napi_ctl_update(ctl, napi_ctl_clock(CLOCK_MONOTONIC));
+
+	fprintf(f, "napi: %lu switches, %lu timeout changes\n", ctl->switches,
+		ctl->retunes);
+	for (i = 1; i >= 0; i--) {
+		struct napi_ctl_stats *st = &ctl->st[i];
+
+		if (!st->wall_ns)
+			continue;
+		fprintf(f, " busy poll %-3s: %.2fs, cqes=%lu cpu=%.1f%% "
+			"cpu_per_cqe=%.2fus wait_avg=%.2fus\n", i ? "on" : "off",
+			st->wall_ns / 1e9, st->cqes,
+			st->cpu_ns * 100.0 / st->wall_ns,
+			st->cqes ? st->cpu_ns / 1000.0 / st->cqes : 0.0,
+			st->waits ? st->wait_ns / 1000.0 / st->waits : 0.0);
+	}
+}
+
+#endif
@@ -0,0 +1,1049 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Loopback network benchmark for comparing the io_uring receive strategies:
+ *
+ *   recv	single shot recv with a provided buffer, re-armed per completion
+ *   mshot	multishot recv, one provided buffer per completion
+ *   bundle	multishot recv bundles, many provided buffers per completion
+ *   inc	multishot recv with an incrementally consumed buffer ring
+ *   recvmsg	multishot recvmsg, one provided buffer per completion
+ *
+ * A server thread receives with the chosen strategy, and a client thread
+ * drives it over loopback. Both use io_uring, the ring setup flags only
+ * apply to the server, which is the side being measured. Modes:
+ *
+ *   tcp-rr	client sends requests, server echoes them back. Latency is
+ *		from a request being submitted to its response arriving,
+ *		with up to 'depth' requests pipelined per connection
+ *   tcp-stream	client streams data, server receives and discards it
+ *   udp-rr	as tcp-rr, with a connected UDP socket pair per connection.
+ *		Requests carry an ID, and one without a response after
+ *		RR_TIMEOUT_MS is counted as dropped and sent again
+ *   udp-stream	as tcp-stream, over UDP. Datagrams dropped by the kernel
+ *		simply don't count
+ *
+ * An op is one message of 'size' bytes, received by the server for the
+ * stream modes and a full request/response for the rr modes. Results are
+ * printed as a single line of key=value pairs:
+ *
+ *   rps		ops per second
+ *   gbps		payload received by the server, in Gbit/sec
+ *   p50_us/p99_us	request latency percentiles, rr modes only
+ *   cpu_us_per_op	process CPU time per op, includes the client and
+ *			any SQPOLL or io-wq threads
+ *   srv_cpu_us_per_op	server thread CPU time per op
+ *   cqes_per_op	server receive completions per op
+ *   drops, late	udp-rr only, requests that timed out, and responses
+ *			that arrived after their request timed out
+ *
+ * Example, compare multishot and bundles for streaming over 8 connections:
+ *
+ *	./net-bench -m tcp-stream -r mshot -c8 -s 65536
+ *	./net-bench -m tcp-stream -r bundle -c8 -s 65536
+ *
+ * Run with -h to see a list of options, and their defaults.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+enum {
+	MODE_TCP_RR,
+	MODE_TCP_STREAM,
+	MODE_UDP_RR,
+	MODE_UDP_STREAM,
+};
+
+static const char *mode_names[] = {
+	"tcp-rr", "tcp-stream", "udp-rr", "udp-stream",
+};
+
+enum {
+	STRAT_RECV,
+	STRAT_MSHOT,
+	STRAT_BUNDLE,
+	STRAT_INC,
+	STRAT_RECVMSG,
+};
+
+static const char *strat_names[] = {
+	"recv", "mshot", "bundle", "inc", "recvmsg",
+};
+
+enum {
+	RING_NONE,
+	RING_COOP,
+	RING_DEFER,
+	RING_SQPOLL,
+};
+
+static const char *ring_names[] = {
+	"none", "coop", "defer", "sqpoll",
+};
+
+static int mode = MODE_TCP_RR;
+static int strategy = STRAT_MSHOT;
+static int ring_mode = RING_DEFER;
+static int nr_conns = 4;
+static int msg_size = 64;
+static int depth = 1;
+static int buf_size = 4096;
+static int nr_bufs = 64;
+static int runtime = 5;
+static int verbose;
+
+static volatile int stop;
+
+static int is_rr(void)
+{
+	return mode == MODE_TCP_RR || mode == MODE_UDP_RR;
+}
+
+static int is_udp(void)
+{
+	return mode == MODE_UDP_RR || mode == MODE_UDP_STREAM;
+}
+
+static double rusage_sec(struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1000000.0 +
+		ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1000000.0;
+}
+
+static struct lat_hist latency;
+
+#define RR_TIMEOUT_MS	200
+
+/*
+ * Server side. Each connection has its own provided buffer ring, so that
+ * completions for a connection consume its ring in order and we can track
+ * which buffers a bundle or an incremental completion used.
+ */
+enum {
+	OP_RECV = 1,
+	OP_SEND,
+};
+
+struct srv_conn;
+
+struct srv_req {
+	int op;
+	struct srv_conn *c;
+	int bid;
+	char *buf;
+	int len;
+	struct srv_req *next;
+};
+
+struct srv_conn {
+	struct srv_req recv_req;
+	int fd;
+	int bgid;
+	int armed;
+	int dead;
+
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	int buf_len;
+	/* bid at each ring index, and our view of the ring head and tail */
+	int *ring_bids;
+	unsigned head, tail;
+	/* sends still using the buffer, and whether we're done receiving */
+	int *refs;
+	char *done;
+	/* consumed part of each buffer, for incremental rings */
+	int *offs;
+
+	struct msghdr msg;
+};
+
+static struct io_uring srv_ring;
+static struct srv_conn *srv_conns;
+static struct srv_req *free_reqs;
+static pthread_barrier_t srv_barrier;
+static int srv_error;
+
+static unsigned long srv_bytes, srv_msgs, srv_cqes, srv_enobufs;
+static double srv_cpu;
+
+static struct io_uring_sqe *get_sqe(struct io_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(ring);
+	if (!sqe) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+	}
+	return sqe;
+}
+
+static struct srv_req *srv_req_get(void)
+{
+	struct srv_req *req = free_reqs;
+
+	if (req) {
+		free_reqs = req->next;
+		return req;
+	}
+	return calloc(1, sizeof(*req));
+}
+
+static void srv_req_put(struct srv_req *req)
+{
+	req->next = free_reqs;
+	free_reqs = req;
+}
+
+static char *srv_buf(struct srv_conn *c, int bid)
+{
+	return c->bufs + bid * c->buf_len;
+}
+
+static void srv_arm(struct srv_conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	if (c->armed || c->dead || stop || c->tail == c->head)
+		return;
+
+	sqe = get_sqe(&srv_ring);
+	switch (strategy) {
+	case STRAT_RECV:
+		io_uring_prep_recv(sqe, c->fd, NULL, 0, 0);
+		break;
+	case STRAT_MSHOT:
+	case STRAT_INC:
+		io_uring_prep_recv_multishot(sqe, c->fd, NULL, 0, 0);
+		break;
+	case STRAT_BUNDLE:
+		io_uring_prep_recv_multishot(sqe, c->fd, NULL, 0, 0);
+		sqe->ioprio |= IORING_RECVSEND_BUNDLE;
+		break;
+	case STRAT_RECVMSG:
+		io_uring_prep_recvmsg_multishot(sqe, c->fd, &c->msg, 0);
+		break;
+	}
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = c->bgid;
+	io_uring_sqe_set_data(sqe, &c->recv_req);
+	c->armed = 1;
+}
+
+static void srv_recycle(struct srv_conn *c, int bid)
+{
+	int mask = io_uring_buf_ring_mask(nr_bufs);
+
+	c->done[bid] = 0;
+	c->offs[bid] = 0;
+	c->ring_bids[c->tail & mask] = bid;
+	io_uring_buf_ring_add(c->br, srv_buf(c, bid), c->buf_len, bid, mask, 0);
+	io_uring_buf_ring_advance(c->br, 1);
+	c->tail++;
+}
+
+static void srv_put_buf(struct srv_conn *c, int bid)
+{
+	if (c->done[bid] && !c->refs[bid])
+		srv_recycle(c, bid);
+}
+
+static void srv_send(struct srv_req *req)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(&srv_ring);
+	io_uring_prep_send(sqe, req->c->fd, req->buf, req->len, MSG_NOSIGNAL);
+	io_uring_sqe_set_data(sqe, req);
+}
+
+/*
+ * A chunk of received data in buffer 'bid'. For rr, echo it back and
+ * hold on to the buffer until the send is done, for streaming just let
+ * it go. 'done' tells us whether the buffer has been fully consumed. The
+ * payload isn't checked, so the order echoes go out in doesn't matter.
+ */
+static void srv_data(struct srv_conn *c, int bid, char *buf, int len, int done)
+{
+	if (!stop) {
+		srv_bytes += len;
+		if (is_udp())
+			srv_msgs++;
+	}
+
+	c->done[bid] = done;
+	if (is_rr() && len) {
+		struct srv_req *req = srv_req_get();
+
+		req->op = OP_SEND;
+		req->c = c;
+		req->bid = bid;
+		req->buf = buf;
+		req->len = len;
+		c->refs[bid]++;
+		srv_send(req);
+	}
+	srv_put_buf(c, bid);
+}
+
+static void srv_handle_recv(struct srv_conn *c, struct io_uring_cqe *cqe)
+{
+	int mask = io_uring_buf_ring_mask(nr_bufs);
+	int res = cqe->res;
+	int bid;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		c->armed = 0;
+
+	if (res <= 0) {
+		if (res == -ENOBUFS) {
+			srv_enobufs++;
+		} else if (!res || stop || res == -ECONNRESET) {
+			c->dead = 1;
+		} else {
+			fprintf(stderr, "recv: %s\n", strerror(-res));
+			srv_error = 1;
+			c->dead = 1;
+		}
+		return;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+		fprintf(stderr, "recv completion without a buffer\n");
+		srv_error = 1;
+		return;
+	}
+	if (!stop)
+		srv_cqes++;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	switch (strategy) {
+	case STRAT_RECV:
+	case STRAT_MSHOT:
+		c->head++;
+		srv_data(c, bid, srv_buf(c, bid), res, 1);
+		break;
+	case STRAT_BUNDLE:
+		/* buffers are consumed from the head of the ring, in order */
+		while (res) {
+			int len = res < c->buf_len ? res : c->buf_len;
+
+			bid = c->ring_bids[c->head++ & mask];
+			srv_data(c, bid, srv_buf(c, bid), len, 1);
+			res -= len;
+		}
+		break;
+	case STRAT_INC: {
+		char *buf = srv_buf(c, bid) + c->offs[bid];
+		int done = !(cqe->flags & IORING_CQE_F_BUF_MORE);
+
+		c->offs[bid] += res;
+		if (done)
+			c->head++;
+		srv_data(c, bid, buf, res, done);
+		break;
+		}
+	case STRAT_RECVMSG: {
+		struct io_uring_recvmsg_out *o;
+
+		c->head++;
+		o = io_uring_recvmsg_validate(srv_buf(c, bid), res, &c->msg);
+		if (!o) {
+			fprintf(stderr, "bad recvmsg\n");
+			srv_error = 1;
+			break;
+		}
+		srv_data(c, bid, io_uring_recvmsg_payload(o, &c->msg),
+			 io_uring_recvmsg_payload_length(o, res, &c->msg), 1);
+		break;
+		}
+	}
+}
+
+static void srv_handle_send(struct srv_req *req, struct io_uring_cqe *cqe)
+{
+	struct srv_conn *c = req->c;
+
+	if (cqe->res > 0 && cqe->res < req->len) {
+		req->buf += cqe->res;
+		req->len -= cqe->res;
+		srv_send(req);
+		return;
+	}
+	if (cqe->res < 0 && !stop && cqe->res != -EPIPE &&
+	    cqe->res != -ECONNRESET) {
+		fprintf(stderr, "send: %s\n", strerror(-cqe->res));
+		srv_error = 1;
+	}
+
+	c->refs[req->bid]--;
+	srv_put_buf(c, req->bid);
+	srv_req_put(req);
+}
+
+static int srv_setup_ring(void)
+{
+	struct io_uring_params p = { };
+	int ret, entries;
+
+	switch (ring_mode) {
+	case RING_COOP:
+		p.flags = IORING_SETUP_COOP_TASKRUN;
+		break;
+	case RING_DEFER:
+		p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+		break;
+	case RING_SQPOLL:
+		p.flags = IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;
+		break;
+	}
+
+	entries = nr_conns * (depth + 1);
+	if (entries < 64)
+		entries = 64;
+	if (entries > 4096)
+		entries = 4096;
+	p.flags |= IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 4;
+
+	ret = io_uring_queue_init_params(entries, &srv_ring, &p);
+	if (ret) {
+		fprintf(stderr, "server ring setup: %s\n", strerror(-ret));
+		return 1;
+	}
+	return 0;
+}
+
+static int srv_setup_conn(struct srv_conn *c, int i)
+{
+	unsigned flags = strategy == STRAT_INC ? IOU_PBUF_RING_INC : 0;
+	int ret, j;
+
+	c->recv_req.op = OP_RECV;
+	c->recv_req.c = c;
+	c->bgid = i;
+	c->buf_len = buf_size;
+	if (strategy == STRAT_RECVMSG)
+		c->buf_len += sizeof(struct io_uring_recvmsg_out);
+
+	c->br = io_uring_setup_buf_ring(&srv_ring, nr_bufs, c->bgid, flags, &ret);
+	if (!c->br) {
+		fprintf(stderr, "buffer ring setup: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	c->bufs = t_aligned_alloc(4096, (size_t) nr_bufs * c->buf_len);
+	c->ring_bids = calloc(nr_bufs, sizeof(int));
+	c->refs = calloc(nr_bufs, sizeof(int));
+	c->done = calloc(nr_bufs, sizeof(char));
+	c->offs = calloc(nr_bufs, sizeof(int));
+	if (!c->bufs || !c->ring_bids || !c->refs || !c->done || !c->offs) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (j = 0; j < nr_bufs; j++)
+		srv_recycle(c, j);
+	return 0;
+}
+
+static void *srv_thread(void *data)
+{
+	struct __kernel_timespec ts = { .tv_nsec = 100000000 };
+	struct rusage start, end;
+	int i, done = 0;
+
+	(void) data;
+
+	/* DEFER_TASKRUN rings must be setup by the task using them */
+	if (srv_setup_ring()) {
+		srv_error = 1;
+		pthread_barrier_wait(&srv_barrier);
+		return NULL;
+	}
+	for (i = 0; i < nr_conns; i++) {
+		if (srv_setup_conn(&srv_conns[i], i)) {
+			srv_error = 1;
+			break;
+		}
+		srv_arm(&srv_conns[i]);
+	}
+	io_uring_submit(&srv_ring);
+
+	getrusage(RUSAGE_THREAD, &start);
+	pthread_barrier_wait(&srv_barrier);
+
+	while (!srv_error) {
+		struct io_uring_cqe *cqe;
+		unsigned head, nr = 0;
+
+		if (stop && !done) {
+			getrusage(RUSAGE_THREAD, &end);
+			srv_cpu = rusage_sec(&end) - rusage_sec(&start);
+			done = 1;
+		}
+		if (stop > 1)
+			break;
+
+		io_uring_submit_and_wait_timeout(&srv_ring, &cqe, 1, &ts, NULL);
+
+		io_uring_for_each_cqe(&srv_ring, head, cqe) {
+			struct srv_req *req = io_uring_cqe_get_data(cqe);
+
+			nr++;
+			if (req->op == OP_RECV)
+				srv_handle_recv(req->c, cqe);
+			else
+				srv_handle_send(req, cqe);
+		}
+		io_uring_cq_advance(&srv_ring, nr);
+
+		for (i = 0; i < nr_conns; i++)
+			srv_arm(&srv_conns[i]);
+	}
+
+	io_uring_queue_exit(&srv_ring);
+	return NULL;
+}
+
+/*
+ * Client side. Requests and stream data are sent from a buffer that's
+ * never modified, so a send completion only needs the connection and
+ * length to resubmit whatever was left.
+ */
+enum {
+	CL_SEND = 1,
+	CL_RECV,
+};
+
+struct cl_conn {
+	int fd;
+	/* partial response bytes */
+	int rx_bytes;
+	/* submit times of inflight requests */
+	uint64_t *ts;
+	unsigned ts_head, ts_tail;
+	char *rbuf;
+	/*
+	 * udp-rr: responses can be lost, so each request slot has its own
+	 * send buffer, starting with the request ID. ts[] is indexed by
+	 * slot rather than used as a FIFO.
+	 */
+	char *sbuf;
+	uint64_t *ids;
+	uint64_t next_id;
+};
+
+static struct io_uring cl_ring;
+static struct cl_conn *cl_conns;
+static char *cl_sbuf;
+static unsigned long cl_ops;
+static unsigned long cl_drops;
+static unsigned long cl_late;
+static int cl_error;
+
+static uint64_t cl_data(int op, int idx, int len)
+{
+	return ((uint64_t) op << 56) | ((uint64_t) idx << 32) | len;
+}
+
+static void cl_send(int idx, int len)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(&cl_ring);
+	io_uring_prep_send(sqe, cl_conns[idx].fd, cl_sbuf, len, MSG_NOSIGNAL);
+	sqe->user_data = cl_data(CL_SEND, idx, len);
+}
+
+static void cl_recv(int idx)
+{
+	struct io_uring_sqe *sqe;
+	int len = is_udp() ? msg_size : msg_size * depth;
+
+	sqe = get_sqe(&cl_ring);
+	io_uring_prep_recv(sqe, cl_conns[idx].fd, cl_conns[idx].rbuf, len, 0);
+	sqe->user_data = cl_data(CL_RECV, idx, 0);
+}
+
+static void cl_request(int idx)
+{
+	struct cl_conn *c = &cl_conns[idx];
+
+	c->ts[c->ts_tail++ % depth] = now_ns();
+	cl_send(idx, msg_size);
+}
+
+static void cl_udp_request(int idx, int slot)
+{
+	struct cl_conn *c = &cl_conns[idx];
+	char *buf = c->sbuf + slot * msg_size;
+	struct io_uring_sqe *sqe;
+
+	c->ids[slot] = ++c->next_id;
+	memcpy(buf, &c->ids[slot], sizeof(uint64_t));
+	c->ts[slot] = now_ns();
+
+	sqe = get_sqe(&cl_ring);
+	io_uring_prep_send(sqe, c->fd, buf, msg_size, MSG_NOSIGNAL);
+	sqe->user_data = cl_data(CL_SEND, idx, msg_size);
+}
+
+/*
+ * A udp-rr response echoes the request ID. If it's not one that's in
+ * flight, the request timed out and was sent again already.
+ */
+static void cl_udp_response(int idx)
+{
+	struct cl_conn *c = &cl_conns[idx];
+	uint64_t id;
+	int slot;
+
+	memcpy(&id, c->rbuf, sizeof(id));
+	for (slot = 0; slot < depth; slot++)
+		if (c->ids[slot] == id)
+			break;
+	if (slot == depth) {
+		if (!stop)
+			cl_late++;
+		return;
+	}
+	if (stop)
+		return;
+	lat_add(&latency, now_ns() - c->ts[slot]);
+	cl_ops++;
+	cl_udp_request(idx, slot);
+}
+
+static void cl_udp_expire(uint64_t now)
+{
+	uint64_t timeout = RR_TIMEOUT_MS * 1000000ULL;
+	int i, slot;
+
+	for (i = 0; i < nr_conns; i++) {
+		struct cl_conn *c = &cl_conns[i];
+
+		for (slot = 0; slot < depth; slot++) {
+			if (now - c->ts[slot] < timeout)
+				continue;
+			cl_drops++;
+			cl_udp_request(i, slot);
+		}
+	}
+}
+
+static void cl_handle_recv(int idx, int res)
+{
+	struct cl_conn *c = &cl_conns[idx];
+
+	if (res <= 0) {
+		if (!stop && res != -ECONNRESET) {
+			fprintf(stderr, "client recv: %s\n", strerror(-res));
+			cl_error = 1;
+		}
+		return;
+	}
+
+	if (mode == MODE_UDP_RR) {
+		if (res == msg_size)
+			cl_udp_response(idx);
+		if (!stop)
+			cl_recv(idx);
+		return;
+	}
+
+	c->rx_bytes += res;
+	while (c->rx_bytes >= msg_size) {
+		uint64_t lat = now_ns() - c->ts[c->ts_head++ % depth];
+
+		c->rx_bytes -= msg_size;
+		if (stop)
+			continue;
+		lat_add(&latency, lat);
+		cl_ops++;
+		cl_request(idx);
+	}
+	if (!stop)
+		cl_recv(idx);
+}
+
+static void cl_handle_send(int idx, int len, int res)
+{
+	if (res < 0) {
+		if (!stop && res != -EPIPE && res != -ECONNRESET) {
+			fprintf(stderr, "client send: %s\n", strerror(-res));
+			cl_error = 1;
+		}
+		return;
+	}
+
+	/* streaming keeps 'depth' sends going per connection */
+	if (res < len)
+		cl_send(idx, len - res);
+	else if (!is_rr() && !stop)
+		cl_send(idx, msg_size);
+}
+
+static void *cl_thread(void *data)
+{
+	struct __kernel_timespec ts = { .tv_nsec = 100000000 };
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_SINGLE_ISSUER |
+			 IORING_SETUP_DEFER_TASKRUN |
+			 IORING_SETUP_CQSIZE,
+	};
+	uint64_t next_expire = now_ns() + RR_TIMEOUT_MS * 1000000ULL;
+	int i, j, ret, entries;
+
+	(void) data;
+
+	entries = nr_conns * (depth + 1);
+	if (entries < 64)
+		entries = 64;
+	if (entries > 4096)
+		entries = 4096;
+	p.cq_entries = entries * 4;
+	ret = io_uring_queue_init_params(entries, &cl_ring, &p);
+	if (ret) {
+		fprintf(stderr, "client ring setup: %s\n", strerror(-ret));
+		cl_error = 1;
+		return NULL;
+	}
+
+	for (i = 0; i < nr_conns; i++) {
+		if (is_rr())
+			cl_recv(i);
+		for (j = 0; j < depth; j++) {
+			if (mode == MODE_UDP_RR)
+				cl_udp_request(i, j);
+			else if (is_rr())
+				cl_request(i);
+			else
+				cl_send(i, msg_size);
+		}
+	}
+
+	while (!cl_error && !stop) {
+		struct io_uring_cqe *cqe;
+		unsigned head, nr = 0;
+
+		io_uring_submit_and_wait_timeout(&cl_ring, &cqe, 1, &ts, NULL);
+
+		io_uring_for_each_cqe(&cl_ring, head, cqe) {
+			int op = cqe->user_data >> 56;
+			int idx = (cqe->user_data >> 32) & 0xffffff;
+			int len = cqe->user_data & 0xffffffff;
+
+			nr++;
+			if (op == CL_RECV)
+				cl_handle_recv(idx, cqe->res);
+			else
+				cl_handle_send(idx, len, cqe->res);
+		}
+		io_uring_cq_advance(&cl_ring, nr);
+
+		/* the submit wait times out well within RR_TIMEOUT_MS */
+		if (mode == MODE_UDP_RR && now_ns() >= next_expire) {
+			next_expire = now_ns() + RR_TIMEOUT_MS * 1000000ULL / 4;
+			cl_udp_expire(now_ns());
+		}
+	}
+
+	io_uring_queue_exit(&cl_ring);
+	return NULL;
+}
+
+static void set_nodelay(int fd)
+{
+	int val = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+}
+
+static int bind_loopback(int fd)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	return bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+}
+
+/*
+ * Connect up the socket pairs. For TCP, connect to a loopback listener
+ * and accept right away, for UDP bind both ends and connect them to each
+ * other. Setup isn't part of what's being measured, so just use plain
+ * blocking syscalls.
+ */
+static int setup_conns(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int i, lfd = -1;
+
+	if (!is_udp()) {
+		int val = 1;
+
+		lfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (lfd < 0 ||
+		    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) ||
+		    bind_loopback(lfd) || listen(lfd, 128)) {
+			perror("listen");
+			return 1;
+		}
+		getsockname(lfd, (struct sockaddr *) &addr, &len);
+	}
+
+	for (i = 0; i < nr_conns; i++) {
+		struct srv_conn *sc = &srv_conns[i];
+		struct cl_conn *cc = &cl_conns[i];
+		struct sockaddr_in caddr;
+		socklen_t clen = sizeof(caddr);
+
+		if (!is_udp()) {
+			cc->fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (cc->fd < 0 ||
+			    connect(cc->fd, (struct sockaddr *) &addr, len)) {
+				perror("connect");
+				return 1;
+			}
+			sc->fd = accept(lfd, NULL, NULL);
+			if (sc->fd < 0) {
+				perror("accept");
+				return 1;
+			}
+			set_nodelay(cc->fd);
+			set_nodelay(sc->fd);
+		} else {
+			cc->fd = socket(AF_INET, SOCK_DGRAM, 0);
+			sc->fd = socket(AF_INET, SOCK_DGRAM, 0);
+			if (cc->fd < 0 || sc->fd < 0 || bind_loopback(cc->fd) ||
+			    bind_loopback(sc->fd)) {
+				perror("udp socket");
+				return 1;
+			}
+			getsockname(sc->fd, (struct sockaddr *) &addr, &len);
+			getsockname(cc->fd, (struct sockaddr *) &caddr, &clen);
+			if (connect(cc->fd, (struct sockaddr *) &addr, len) ||
+			    connect(sc->fd, (struct sockaddr *) &caddr, clen)) {
+				perror("udp connect");
+				return 1;
+			}
+		}
+
+		cc->ts = calloc(depth, sizeof(uint64_t));
+		cc->rbuf = malloc(msg_size * depth);
+		if (!cc->ts || !cc->rbuf) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		if (mode == MODE_UDP_RR) {
+			cc->sbuf = calloc(depth, msg_size);
+			cc->ids = calloc(depth, sizeof(uint64_t));
+			if (!cc->sbuf || !cc->ids) {
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+		}
+	}
+
+	if (lfd != -1)
+		close(lfd);
+	return 0;
+}
+
+static int lookup(const char *name, const char **names, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (!strcmp(name, names[i]))
+			return i;
+	return -1;
+}
+
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+
+static void usage(const char *name)
+{
+	printf("%s:\n", name);
+	printf("\t-m:\t\tMode, tcp-rr, tcp-stream, udp-rr or udp-stream (%s)\n",
+		mode_names[mode]);
+	printf("\t-r:\t\tReceive strategy, recv, mshot, bundle, inc or recvmsg (%s)\n",
+		strat_names[strategy]);
+	printf("\t-R:\t\tServer ring flags, none, coop, defer or sqpoll (%s)\n",
+		ring_names[ring_mode]);
+	printf("\t-c:\t\tNumber of connections (%d)\n", nr_conns);
+	printf("\t-s:\t\tMessage size (%d)\n", msg_size);
+	printf("\t-q:\t\tRequests in flight per connection, or sends for streaming (%d)\n", depth);
+	printf("\t-b:\t\tProvided buffer size (%d)\n", buf_size);
+	printf("\t-n:\t\tProvided buffers per connection, power of 2 (%d)\n", nr_bufs);
+	printf("\t-t:\t\tRuntime in seconds (%d)\n", runtime);
+	printf("\t-V:\t\tPrint extra server stats (%d)\n", verbose);
+}
+
+int main(int argc, char *argv[])
+{
+	struct rusage ru_start, ru_end;
+	pthread_t srv_tid, cl_tid;
+	unsigned long ops, bytes;
+	uint64_t start, elapsed;
+	double secs, cpu;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:r:R:c:s:q:b:n:t:Vh?")) != -1) {
+		switch (opt) {
+		case 'm':
+			mode = lookup(optarg, mode_names, ARRAY_SIZE(mode_names));
+			break;
+		case 'r':
+			strategy = lookup(optarg, strat_names, ARRAY_SIZE(strat_names));
+			break;
+		case 'R':
+			ring_mode = lookup(optarg, ring_names, ARRAY_SIZE(ring_names));
+			break;
+		case 'c':
+			nr_conns = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			buf_size = atoi(optarg);
+			break;
+		case 'n':
+			nr_bufs = atoi(optarg);
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
+		case 'V':
+			verbose++;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (mode < 0 || strategy < 0 || ring_mode < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (nr_conns < 1 || nr_conns > 65535 || depth < 1 || msg_size < 1 ||
+	    buf_size < 1 || runtime < 1) {
+		fprintf(stderr, "Invalid connections, depth, size or runtime\n");
+		return 1;
+	}
+	if (nr_bufs < 1 || nr_bufs > 32768 || (nr_bufs & (nr_bufs - 1))) {
+		fprintf(stderr, "Number of buffers must be a power of 2\n");
+		return 1;
+	}
+	if (is_udp() && (msg_size > buf_size || msg_size > 65507)) {
+		fprintf(stderr, "UDP messages must fit in a buffer\n");
+		return 1;
+	}
+	if (mode == MODE_UDP_RR && msg_size < (int) sizeof(uint64_t)) {
+		fprintf(stderr, "udp-rr messages must hold a request ID, "
+				"%d bytes\n", (int) sizeof(uint64_t));
+		return 1;
+	}
+	if (strategy == STRAT_BUNDLE) {
+		struct io_uring_params p = { };
+		struct io_uring ring;
+
+		if (io_uring_queue_init_params(1, &ring, &p) == 0) {
+			io_uring_queue_exit(&ring);
+			if (!(p.features & IORING_FEAT_RECVSEND_BUNDLE)) {
+				fprintf(stderr, "Recv bundles not supported\n");
+				return 1;
+			}
+		}
+	}
+
+	srv_conns = calloc(nr_conns, sizeof(struct srv_conn));
+	cl_conns = calloc(nr_conns, sizeof(struct cl_conn));
+	cl_sbuf = calloc(1, msg_size);
+	if (!srv_conns || !cl_conns || !cl_sbuf) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	if (setup_conns())
+		return 1;
+
+	pthread_barrier_init(&srv_barrier, NULL, 2);
+	pthread_create(&srv_tid, NULL, srv_thread, NULL);
+	pthread_barrier_wait(&srv_barrier);
+	if (srv_error) {
+		pthread_join(srv_tid, NULL);
+		return 1;
+	}
+
+	getrusage(RUSAGE_SELF, &ru_start);
+	start = now_ns();
+	pthread_create(&cl_tid, NULL, cl_thread, NULL);
+
+	while (!srv_error && !cl_error && now_ns() - start < runtime * 1000000000ULL)
+		usleep(10000);
+
+	/* stop counting, then give the server a chance to note its CPU usage */
+	stop = 1;
+	elapsed = now_ns() - start;
+	getrusage(RUSAGE_SELF, &ru_end);
+	pthread_join(cl_tid, NULL);
+	usleep(200000);
+	stop = 2;
+	pthread_join(srv_tid, NULL);
+
+	if (srv_error || cl_error)
+		return 1;
+
+	secs = elapsed / 1000000000.0;
+	cpu = rusage_sec(&ru_end) - rusage_sec(&ru_start);
+	bytes = srv_bytes;
+	if (is_rr())
+		ops = cl_ops;
+	else if (is_udp())
+		ops = srv_msgs;
+	else
+		ops = srv_bytes / msg_size;
+	if (!ops)
+		ops = 1;
+
+	printf("mode=%s strategy=%s ring=%s conns=%d size=%d depth=%d "
+		"buf_size=%d nr_bufs=%d secs=%.2f rps=%.0f gbps=%.3f "
+		"p50_us=%.1f p99_us=%.1f cpu_us_per_op=%.3f "
+		"srv_cpu_us_per_op=%.3f cqes_per_op=%.3f",
+		mode_names[mode], strat_names[strategy], ring_names[ring_mode],
+		nr_conns, msg_size, depth, buf_size, nr_bufs, secs, ops / secs,
+		bytes * 8 / secs / 1e9,
+		lat_percentile(&latency, 50.0) / 1000.0,
+		lat_percentile(&latency, 99.0) / 1000.0,
+		cpu * 1e6 / ops, srv_cpu * 1e6 / ops,
+		(double) srv_cqes / ops);
+	if (mode == MODE_UDP_RR)
+		printf(" drops=%lu late=%lu", cl_drops, cl_late);
+	printf("\n");
+	if (verbose)
+		fprintf(stderr, "server: bytes=%lu, recv cqes=%lu, enobufs=%lu\n",
+			srv_bytes, srv_cqes, srv_enobufs);
+	return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Runs net-bench for every receive strategy in each mode, printing one
+# key=value result line per run. Unsupported combinations print a "failed"
+# line rather than stopping the sweep.
+#
+# Usage: ./net-bench.sh [seconds per run]
+#
+# Extra net-bench options for all runs can be passed in BENCH_ARGS, eg
+# BENCH_ARGS="-c16 -R coop". Message sizes default to 64 bytes for the rr
+# modes, RR_SIZE, 64KB for TCP streaming, TCP_SIZE, and 1400 bytes for UDP
+# streaming, UDP_SIZE.
+
+runtime=${1:-5}
+bench_args=${BENCH_ARGS:-}
+rr_size=${RR_SIZE:-64}
+tcp_size=${TCP_SIZE:-65536}
+udp_size=${UDP_SIZE:-1400}
+
+bench="$(dirname "$0")/net-bench"
+
+if [ ! -x "$bench" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+for mode in tcp-rr tcp-stream udp-rr udp-stream; do
+	case $mode in
+	tcp-stream)	size=$tcp_size ;;
+	udp-stream)	size=$udp_size ;;
+	*)		size=$rr_size ;;
+	esac
+	for strategy in recv mshot bundle inc recvmsg; do
+		if ! timeout $((runtime + 10)) $bench $bench_args -m $mode \
+			-r $strategy -s $size -t $runtime 2>/dev/null; then
+			echo "mode=$mode strategy=$strategy failed"
+		fi
+	done
+done
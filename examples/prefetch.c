@@ -0,0 +1,410 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Read-ahead driven by the reads an application does. The application
+ * here is a scan, reading one chunk at a time, at offsets following a
+ * pattern, and optionally spending some time on each chunk. The
+ * prefetcher looks at the offsets read, and once it has seen the same
+ * distance between them twice, it keeps up to 'window' chunks ahead of the
+ * scan advised with IORING_OP_FADVISE (POSIX_FADV_WILLNEED), or with
+ * IORING_OP_MADVISE (MADV_WILLNEED) when the file is mmap'ed. Those run
+ * asynchronously, and get submitted along with the next read.
+ *
+ * Reads are first issued with RWF_NOWAIT, which fails with -EAGAIN if the
+ * data isn't in the page cache, and are retried as normal reads if so.
+ * With mmap, mincore(2) tells whether a chunk is resident before touching
+ * it. Once 2 * window chunks in a row have been found in the page cache,
+ * the prefetcher stays out of the way until there's a miss again.
+ *
+ * Prints a single line of key=value pairs:
+ *
+ *   chunks, mb_per_sec	chunks read, and bandwidth
+ *   hits, misses	chunks found in the page cache, and not
+ *   advised		advisory requests issued
+ *   dormant		chunks read with the prefetcher out of the way
+ *
+ * Options:
+ *
+ *   -p pattern		seq, reverse, stride or random (default seq)
+ *   -S stride		distance between chunks read for stride, in chunks
+ *			(default 4)
+ *   -b size		chunk size (default 128k)
+ *   -w window		chunks to keep advised ahead, 0 to disable (default
+ *			16)
+ *   -m			mmap the file and touch the pages, rather than read
+ *   -c usec		time spent on each chunk (default 0)
+ *   -C			don't drop the file from the page cache first
+ *   -R			disable the kernel's own read-ahead (POSIX_FADV_RANDOM)
+ *
+ * Usage: ./prefetch [options] <file>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+enum {
+	PAT_SEQ,
+	PAT_REVERSE,
+	PAT_STRIDE,
+	PAT_RANDOM,
+};
+
+static const char *pattern_names[] = { "seq", "reverse", "stride", "random" };
+
+#define READ_DATA	1
+#define ADVISE_DATA	2
+
+struct prefetcher {
+	int fd;
+	char *map;
+	off_t size;
+	/* bytes per advisory request, the chunk size */
+	unsigned int len;
+	unsigned int window;
+
+	/* pattern detection */
+	off_t last_off;
+	long long stride;
+	int confidence;
+
+	/* next offset to advise, and advisory requests in flight */
+	off_t next;
+	unsigned int inflight;
+	/* chunks in a row found in the page cache */
+	unsigned int hits;
+
+	unsigned long advised;
+	unsigned long dormant;
+};
+
+static void pf_advise(struct prefetcher *pf, struct io_uring *ring, off_t off)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	off_t len = pf->len;
+
+	if (off + len > pf->size)
+		len = pf->size - off;
+	if (pf->map)
+		io_uring_prep_madvise64(sqe, pf->map + off, len, MADV_WILLNEED);
+	else
+		io_uring_prep_fadvise64(sqe, pf->fd, off, len,
+					POSIX_FADV_WILLNEED);
+	io_uring_sqe_set_data64(sqe, ADVISE_DATA);
+	pf->inflight++;
+	pf->advised++;
+}
+
+/*
+ * Called for every chunk the application reads, 'hit' telling whether it
+ * was in the page cache. Queues advice for the chunks it expects next.
+ */
+static void pf_observe(struct prefetcher *pf, struct io_uring *ring,
+		       off_t off, bool hit)
+{
+	long long delta = off - pf->last_off, ahead;
+
+	pf->last_off = off;
+	if (hit)
+		pf->hits++;
+	else
+		pf->hits = 0;
+
+	if (delta && delta == pf->stride) {
+		if (pf->confidence < 2)
+			pf->confidence++;
+	} else {
+		pf->stride = delta;
+		pf->confidence = 0;
+	}
+	if (!pf->window || pf->confidence < 2)
+		return;
+	if (pf->hits >= 2 * pf->window) {
+		pf->dormant++;
+		return;
+	}
+
+	/*
+	 * After a change of pattern or a dormant spell, 'next' isn't within
+	 * the window ahead of the scan, restart from here.
+	 */
+	ahead = (pf->next - off) / pf->stride;
+	if (ahead < 1 || ahead > pf->window)
+		pf->next = off + pf->stride;
+
+	while (pf->inflight < pf->window &&
+	       (pf->next - off) / pf->stride <= pf->window) {
+		if (pf->next < 0 || pf->next >= pf->size)
+			break;
+		pf_advise(pf, ring, pf->next);
+		pf->next += pf->stride;
+	}
+}
+
+static void reap_advice(struct io_uring *ring, struct prefetcher *pf)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, nr = 0;
+
+	io_uring_for_each_cqe(ring, head, cqe) {
+		if (cqe->user_data != ADVISE_DATA)
+			break;
+		if (cqe->res < 0)
+			fprintf(stderr, "advise: %s\n", strerror(-cqe->res));
+		pf->inflight--;
+		nr++;
+	}
+	io_uring_cq_advance(ring, nr);
+}
+
+/* wait for the read, reaping advice completions that come before it */
+static int wait_read(struct io_uring *ring, struct prefetcher *pf)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	for (;;) {
+		ret = io_uring_wait_cqe(ring, &cqe);
+		if (ret)
+			return ret;
+		if (cqe->user_data == READ_DATA) {
+			ret = cqe->res;
+			io_uring_cqe_seen(ring, cqe);
+			return ret;
+		}
+		reap_advice(ring, pf);
+	}
+}
+
+/*
+ * Read a chunk, without blocking first. Returns 1 if it was all in the
+ * page cache, 0 if not, or -errno.
+ */
+static int read_chunk(struct io_uring *ring, struct prefetcher *pf,
+		      char *buf, off_t off, unsigned int len)
+{
+	struct io_uring_sqe *sqe;
+	int hit = 1, ret;
+	unsigned int done = 0;
+
+	while (done < len) {
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_read(sqe, pf->fd, buf + done, len - done,
+				   off + done);
+		if (hit)
+			sqe->rw_flags = RWF_NOWAIT;
+		io_uring_sqe_set_data64(sqe, READ_DATA);
+		io_uring_submit(ring);
+
+		ret = wait_read(ring, pf);
+		if (ret == -EAGAIN && hit) {
+			hit = 0;
+			continue;
+		} else if (ret < 0) {
+			return ret;
+		} else if (!ret) {
+			return -ENODATA;
+		}
+		/* a short nowait read means only part of it was cached */
+		done += ret;
+		if (done < len)
+			hit = 0;
+	}
+	return hit;
+}
+
+/* mincore tells whether the chunk is resident, touching it reads it */
+static int touch_chunk(struct io_uring *ring, struct prefetcher *pf,
+		       off_t off, unsigned int len, unsigned long *sum)
+{
+	unsigned char vec[1024];
+	unsigned int pages = (len + 4095) / 4096, i;
+	int hit = 1;
+
+	/* the advice gets submitted before the scan may block */
+	io_uring_submit(ring);
+	reap_advice(ring, pf);
+
+	if (pages > sizeof(vec))
+		pages = sizeof(vec);
+	if (mincore(pf->map + off, len, vec) < 0)
+		return -errno;
+	for (i = 0; i < pages; i++) {
+		if (!(vec[i] & 1))
+			hit = 0;
+	}
+	for (i = 0; i < len; i += 4096)
+		*sum += pf->map[off + i];
+	return hit;
+}
+
+static void spin(unsigned int usec)
+{
+	unsigned long long end = now_ns() + usec * 1000ULL;
+
+	while (now_ns() < end)
+		;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-p seq|reverse|stride|random] [-S stride] "
+			"[-b size] [-w window] [-m] [-c usec] [-C] [-R] "
+			"<file>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long start, nsec, rnd = 0x9e3779b97f4a7c15ULL;
+	unsigned long hits = 0, misses = 0, sum = 0, nr_chunks, i;
+	unsigned int chunk = 128 * 1024, stride = 4, work_usec = 0;
+	struct prefetcher pf = { .window = 16 };
+	int pattern = PAT_SEQ, opt, ret;
+	bool use_mmap = false, cold = true, no_ra = false;
+	struct io_uring ring;
+	struct stat st;
+	char *buf = NULL;
+
+	while ((opt = getopt(argc, argv, "p:S:b:w:mc:CRh")) != -1) {
+		switch (opt) {
+		case 'p':
+			for (pattern = 0; pattern <= PAT_RANDOM; pattern++)
+				if (!strcmp(optarg, pattern_names[pattern]))
+					break;
+			break;
+		case 'S':
+			stride = atoi(optarg);
+			break;
+		case 'b':
+			chunk = parse_size(optarg);
+			break;
+		case 'w':
+			pf.window = atoi(optarg);
+			break;
+		case 'm':
+			use_mmap = true;
+			break;
+		case 'c':
+			work_usec = atoi(optarg);
+			break;
+		case 'C':
+			cold = false;
+			break;
+		case 'R':
+			no_ra = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 1 || pattern > PAT_RANDOM || !stride ||
+	    chunk < 4096 || chunk > 4 * 1024 * 1024 || chunk % 4096) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	pf.fd = open(argv[optind], O_RDONLY);
+	if (pf.fd < 0 || fstat(pf.fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	pf.size = st.st_size;
+	pf.len = chunk;
+	nr_chunks = pf.size / chunk;
+	if (!nr_chunks) {
+		fprintf(stderr, "file smaller than a chunk\n");
+		return 1;
+	}
+
+	if (cold)
+		posix_fadvise(pf.fd, 0, 0, POSIX_FADV_DONTNEED);
+	if (no_ra)
+		posix_fadvise(pf.fd, 0, 0, POSIX_FADV_RANDOM);
+	if (use_mmap) {
+		pf.map = mmap(NULL, pf.size, PROT_READ, MAP_SHARED, pf.fd, 0);
+		if (pf.map == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+		if (no_ra)
+			madvise(pf.map, pf.size, MADV_RANDOM);
+	} else {
+		buf = t_aligned_alloc(4096, chunk);
+		if (!buf)
+			return 1;
+	}
+
+	ret = io_uring_queue_init(2 * pf.window + 8, &ring, 0);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	/* a stride scan covers every stride'th chunk */
+	if (pattern == PAT_STRIDE)
+		nr_chunks = (nr_chunks + stride - 1) / stride;
+
+	start = now_ns();
+	for (i = 0; i < nr_chunks; i++) {
+		unsigned long idx;
+		off_t off;
+
+		switch (pattern) {
+		case PAT_SEQ:
+			idx = i;
+			break;
+		case PAT_REVERSE:
+			idx = nr_chunks - 1 - i;
+			break;
+		case PAT_STRIDE:
+			idx = i * stride;
+			break;
+		default:
+			rnd ^= rnd << 13;
+			rnd ^= rnd >> 7;
+			rnd ^= rnd << 17;
+			idx = rnd % nr_chunks;
+			break;
+		}
+		off = (off_t) idx * chunk;
+
+		if (use_mmap)
+			ret = touch_chunk(&ring, &pf, off, chunk, &sum);
+		else
+			ret = read_chunk(&ring, &pf, buf, off, chunk);
+		if (ret < 0) {
+			fprintf(stderr, "read: %s\n", strerror(-ret));
+			return 1;
+		}
+		if (ret)
+			hits++;
+		else
+			misses++;
+
+		pf_observe(&pf, &ring, off, ret);
+		if (work_usec)
+			spin(work_usec);
+	}
+	nsec = now_ns() - start;
+
+	printf("pattern=%s window=%u mmap=%d chunks=%lu mb_per_sec=%.1f "
+		"hits=%lu misses=%lu advised=%lu dormant=%lu\n",
+		pattern_names[pattern], pf.window, use_mmap, nr_chunks,
+		nr_chunks * (double) chunk / 1e6 / (nsec / 1e9), hits, misses,
+		pf.advised, pf.dormant);
+	/* keep the mmap scan from being optimized out */
+	if (sum == 1)
+		printf("\n");
+	io_uring_queue_exit(&ring);
+	return 0;
+}
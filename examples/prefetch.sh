@@ -0,0 +1,62 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Runs prefetch over a scratch file for each access pattern, without the
+# prefetcher and with two window sizes, through read and mmap. Every run
+# starts from a cold cache, dropped with drop_caches when running as root,
+# and by prefetch itself with POSIX_FADV_DONTNEED otherwise. The last runs
+# are on a warm cache, where the prefetcher should stay out of the way.
+#
+# Usage: ./prefetch.sh [directory]
+#
+# SIZE is the size of the scratch file.
+
+dir=${1:-.}
+size=${SIZE:-1G}
+
+bench="$(dirname "$0")/prefetch"
+if [ ! -x "$bench" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+file=$dir/prefetch.$$
+trap "rm -f $file" EXIT
+head -c $size /dev/urandom > $file || exit 1
+sync
+
+patterns=("-p seq" "-p reverse" "-p stride -S 4" "-p stride -S 32" "-p random")
+
+row() {
+	local out
+
+	out=$($bench "$@" $file)
+	printf "%-30s %10s %8s %8s %9s %8s\n" "$*" \
+		"$(echo "$out" | sed -n 's/.*mb_per_sec=\([0-9.]*\).*/\1/p')" \
+		"$(echo "$out" | sed -n 's/.*hits=\([0-9]*\).*/\1/p')" \
+		"$(echo "$out" | sed -n 's/.*misses=\([0-9]*\).*/\1/p')" \
+		"$(echo "$out" | sed -n 's/.*advised=\([0-9]*\).*/\1/p')" \
+		"$(echo "$out" | sed -n 's/.*dormant=\([0-9]*\).*/\1/p')"
+}
+
+drop() {
+	[ $(id -u) -eq 0 ] && echo 3 > /proc/sys/vm/drop_caches
+}
+
+printf "%-30s %10s %8s %8s %9s %8s\n" "args" "mb/s" "hits" "misses" \
+	"advised" "dormant"
+for mmap in "" "-m"; do
+	for p in "${patterns[@]}"; do
+		for w in 0 16 64; do
+			drop
+			row $p -w $w $mmap
+		done
+	done
+done
+
+# warm the file, then scan it again
+cat $file > /dev/null
+for w in 0 16; do
+	row -p seq -w $w -C
+	row -p reverse -w $w -C
+done
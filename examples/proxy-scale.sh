@@ -0,0 +1,58 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Loopback scaling test for the sharded proxy mode (-P). For 1..N shards, a
+# sharded proxy sink is started, then a sharded proxy forwarding to it, and
+# send-zerocopy drives traffic into the proxy with a number of connections
+# per shard. Prints the throughput seen by the sender for each shard count.
+#
+# Usage: ./proxy-scale.sh [max shards] [seconds per run]
+#
+# Extra proxy options can be passed in PROXY_ARGS, the number of connections
+# per shard in CONNS_PER_SHARD, and the send size in SEND_SIZE.
+
+max_shards=${1:-$(nproc)}
+runtime=${2:-5}
+conns_per_shard=${CONNS_PER_SHARD:-4}
+send_size=${SEND_SIZE:-65536}
+proxy_args=${PROXY_ARGS:--m1 -b4096 -n256}
+proxy_port=9100
+sink_port=9101
+
+dir=$(dirname "$0")
+proxy="$dir/proxy"
+sender="$dir/send-zerocopy"
+
+if [ ! -x "$proxy" ] || [ ! -x "$sender" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+printf "%8s %8s %12s\n" "shards" "conns" "MB/s"
+for ((shards = 1; shards <= max_shards; shards++)); do
+	conns=$((shards * conns_per_shard))
+	if [ $conns -gt 100 ]; then
+		conns=100
+	fi
+
+	# fresh ports for each run, so lingering sockets don't get in the way
+	proxy_port=$((proxy_port + 2))
+	sink_port=$((sink_port + 2))
+
+	$proxy $proxy_args -s1 -P$shards -r$sink_port > /dev/null 2>&1 &
+	sink_pid=$!
+	$proxy $proxy_args -P$shards -r$proxy_port -H 127.0.0.1 \
+		-p$sink_port > /dev/null 2>&1 &
+	proxy_pid=$!
+	sleep 1
+
+	out=$(timeout $((runtime + 10)) $sender -4 -D 127.0.0.1 \
+		-p $proxy_port -t $runtime -T $conns -z0 -n1 -s $send_size \
+		tcp 2>/dev/null)
+	mbs=$(echo "$out" | sed -n 's/.*MB\/s=\([0-9]*\)).*/\1/p')
+
+	kill -INT $proxy_pid $sink_pid > /dev/null 2>&1
+	wait $proxy_pid $sink_pid > /dev/null 2>&1
+
+	printf "%8d %8d %12s\n" $shards $conns "${mbs:-failed}"
+done
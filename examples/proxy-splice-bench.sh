@@ -0,0 +1,65 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Loopback comparison of the proxy forwarding paths: receiving into provided
+# buffers and sending those, vs splicing through a pipe (-F1). For each, a
+# proxy sink is started, then the proxy forwarding to it, and send-zerocopy
+# drives traffic into the proxy. Prints the throughput seen by the sender and
+# the CPU the proxy used per GB forwarded.
+#
+# Usage: ./proxy-splice-bench.sh [seconds per run]
+#
+# Extra proxy options for both runs can be passed in PROXY_ARGS, the number
+# of connections in CONNS, and the send size in SEND_SIZE.
+
+runtime=${1:-5}
+conns=${CONNS:-4}
+send_size=${SEND_SIZE:-65536}
+proxy_args=${PROXY_ARGS:-}
+proxy_port=9110
+sink_port=9111
+
+dir=$(dirname "$0")
+proxy="$dir/proxy"
+sender="$dir/send-zerocopy"
+
+if [ ! -x "$proxy" ] || [ ! -x "$sender" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+run() {
+	local name=$1
+	local args=$2
+	local log
+
+	log=$(mktemp)
+
+	# fresh ports for each run, so lingering sockets don't get in the way
+	proxy_port=$((proxy_port + 2))
+	sink_port=$((sink_port + 2))
+
+	$proxy -s1 -b4096 -r$sink_port > /dev/null 2>&1 &
+	sink_pid=$!
+	$proxy $proxy_args $args -r$proxy_port -H 127.0.0.1 \
+		-p$sink_port > $log 2>&1 &
+	proxy_pid=$!
+	sleep 1
+
+	out=$(timeout $((runtime + 10)) $sender -4 -D 127.0.0.1 \
+		-p $proxy_port -t $runtime -T $conns -z0 -n1 -s $send_size \
+		tcp 2>/dev/null)
+	mbs=$(echo "$out" | sed -n 's/.*MB\/s=\([0-9]*\)).*/\1/p')
+
+	kill -INT $proxy_pid $sink_pid > /dev/null 2>&1
+	wait $proxy_pid $sink_pid > /dev/null 2>&1
+
+	cpu=$(sed -n 's/.*per GB=\([0-9.]*\)s.*/\1/p' $log)
+	rm -f $log
+
+	printf "%-12s %10s %16s\n" "$name" "${mbs:-failed}" "${cpu:-n/a}"
+}
+
+printf "%-12s %10s %16s\n" "mode" "MB/s" "CPU sec per GB"
+run "buffer-ring" "-m1 -b4096 -n256"
+run "splice" "-F1"
@@ -28,6 +28,23 @@
  *
  * 	./proxy -m1 -s1 -r4445
  *
+ * Act as a proxy with 4 sharded threads, each pinned to a CPU and serving
+ * all the connections accepted on its own SO_REUSEPORT listening socket from
+ * a single DEFER_TASKRUN ring, rather than using a thread per connection:
+ *
+ * 	./proxy -m1 -P4 -r4444 -H 192.168.2.6 -p4445
+ *
+ * Act as a proxy that forwards through a pipe per direction with splice,
+ * rather than receiving into provided buffers and sending those:
+ *
+ * 	./proxy -F1 -r4444 -H 192.168.2.6 -p4445
+ *
+ * Track how long data sits in the proxy, from being received to the send
+ * carrying it being issued, and from that to the send completing. Shown
+ * with the stats at exit, or at any time by sending the proxy SIGUSR1:
+ *
+ * 	./proxy -m1 -l1 -r4444 -H 192.168.2.6 -p4445
+ *
  * Run with -h to see a list of options, and their defaults.
  *
  * (C) 2024 Jens Axboe <axboe@kernel.dk>
@@ -45,10 +62,12 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <linux/mman.h>
 #include <locale.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <liburing.h>
 
 #include "proxy.h"
@@ -98,6 +117,12 @@ static int rcv_bundle;
 static int use_huge;
 static int ext_stat;
 static int verbose;
+static int nr_shards;
+static int shard_conns = 4096;
+static int use_splice;
+static int lat_stats;
+static double cycles_per_usec;
+static volatile sig_atomic_t dump_latency;
 
 static int nr_bufs = 256;
 static int br_mask;
@@ -131,6 +156,22 @@ struct io_msg {
 	int vec_index;
 };
 
+/*
+ * Forwarding latency is tracked in two parts: from the recv completion of
+ * the oldest buffer a send carries, to that send being issued, and from
+ * the send being issued to it completing.
+ */
+enum {
+	LAT_RECV_SEND,
+	LAT_SEND_DONE,
+	LAT_NR,
+};
+
+static const char *lat_names[LAT_NR] = {
+	"recv->send issue",
+	"send issue->done",
+};
+
 /*
  * Per socket stats per connection. For bi-directional, we'll have both
  * sends and receives on each socket, this helps track them separately.
@@ -157,6 +198,13 @@ struct conn_dir {
 	int *rcv_bucket;
 	int *snd_bucket;
 
+	/*
+	 * Forwarding latency of data going out on this side, see
+	 * lat_stats. Owned by the conn, or the shard one if sharded.
+	 */
+	struct lat_hist *lat;
+	uint64_t snd_issue;
+
 	unsigned long in_bytes, out_bytes;
 
 	/* only ever have a single recv pending */
@@ -164,6 +212,16 @@ struct conn_dir {
 
 	/* one send that is inflight, and one being prepared for the next one */
 	struct io_msg io_snd_msg;
+
+	/*
+	 * Splice mode, data received on this side goes through this pipe
+	 * on its way to the other side. pipe_bytes is what's currently
+	 * sitting in the pipe, splice_pending the number of inflight splices.
+	 */
+	int pipe_fds[2];
+	int pipe_bytes;
+	int splice_pending;
+	int splice_eof;
 };
 
 enum {
@@ -174,6 +232,8 @@ enum {
 	CONN_F_STATS_SHOWN	= 16,
 	CONN_F_END_TIME		= 32,
 	CONN_F_REAPED		= 64,
+	CONN_F_CLOSING		= 128,
+	CONN_F_OPEN		= 256,
 };
 
 /*
@@ -185,9 +245,14 @@ struct conn_buf_ring {
 	int bgid;
 };
 
+struct shard;
+
 struct conn {
 	struct io_uring ring;
 
+	/* sharded mode, the shard whose ring serves this connection */
+	struct shard *shard;
+
 	/* receive side buffer ring, new data arrives here */
 	struct conn_buf_ring in_br;
 	/* if send_ring is used, outgoing data to send */
@@ -196,10 +261,18 @@ struct conn {
 	int tid;
 	int in_fd, out_fd;
 	int pending_cancels;
+	int pending_pipes;
+	/* sharded mode, requests issued that haven't fully completed yet */
+	int inflight;
+	/* pending requests are being canceled, stop arming new ones */
+	int stopping;
 	int flags;
 
 	struct conn_dir cd[2];
 
+	/* when each buffer was received, for latency tracking */
+	uint64_t *rcv_ts;
+
 	struct timeval start_time, end_time;
 
 	union {
@@ -212,13 +285,74 @@ struct conn {
 };
 
 #define MAX_CONNS	1024
-static struct conn conns[MAX_CONNS];
+static struct conn *conns;
+
+/*
+ * Max amount to splice in one go, matches the default pipe size.
+ */
+#define SPLICE_LEN	(64 * 1024)
+static int max_conns = MAX_CONNS;
+
+/*
+ * Sharded mode. Each shard is a thread pinned to a CPU, with its own ring
+ * and SO_REUSEPORT listening socket. Connections accepted on that socket
+ * get a slot in the shard's slice of conns[] and are served from the
+ * shard's ring, instead of getting a thread and ring of their own.
+ */
+struct shard {
+	struct io_uring ring;
+	int index;
+	int cpu;
+	int listen_fd;
+	int failed;
+
+	/* conns[first_tid] .. conns[first_tid + shard_conns - 1] */
+	int first_tid;
+	int *free_slots;
+	int nr_free;
+
+	/* connections that have started shutting down */
+	struct conn **closing;
+	int nr_closing;
+
+	/* only updated by the shard, see shard_stat_add() */
+	int open_conns;
+	unsigned long accepted;
+	unsigned long event_loops, events;
+	unsigned long in_bytes, out_bytes;
+
+	/* forwarding latency, per direction */
+	struct lat_hist lat[2][LAT_NR];
+
+	pthread_t thread;
+};
+
+static struct shard *shards;
+static pthread_barrier_t shard_barrier;
+static struct timeval shards_start;
+
+/*
+ * Each shard updates its own counters, and the main thread reads them while
+ * the shards run. A single writer makes a relaxed load and store enough.
+ */
+#define shard_stat_add(s, field, val)					\
+	__atomic_store_n(&(s)->field, (s)->field + (val), __ATOMIC_RELAXED)
+#define shard_stat(s, field)	__atomic_load_n(&(s)->field, __ATOMIC_RELAXED)
 
 #define vlog(str, ...) do {						\
 	if (verbose)							\
 		printf(str, ##__VA_ARGS__);				\
 } while (0)
 
+/*
+ * Per connection setup and teardown logging. Sharded mode is meant for a lot
+ * of connections, only log those if verbose.
+ */
+#define clog(str, ...) do {						\
+	if (!nr_shards || verbose)					\
+		printf(str, ##__VA_ARGS__);				\
+} while (0)
+
 static int prep_next_send(struct io_uring *ring, struct conn *c,
 			  struct conn_dir *cd, int fd);
 static void *thread_main(void *data);
@@ -230,6 +364,16 @@ static struct conn *cqe_to_conn(struct io_uring_cqe *cqe)
 	return &conns[ud.op_tid & TID_MASK];
 }
 
+/*
+ * The ring serving this connection, either its own or the shard one.
+ */
+static struct io_uring *conn_ring(struct conn *c)
+{
+	if (c->shard)
+		return &c->shard->ring;
+	return &c->ring;
+}
+
 static struct conn_dir *cqe_to_conn_dir(struct conn *c,
 					struct io_uring_cqe *cqe)
 {
@@ -275,6 +419,10 @@ enum {
 	__FD_PASS	= 11,
 	__NOP		= 12,
 	__STOP		= 13,
+	__PIPE		= 14,
+	__SPLICE_IN	= 15,
+	__SPLICE_OUT	= 16,
+	__SHARD_CLOSE	= 17,
 };
 
 struct error_handler {
@@ -286,16 +434,24 @@ static int recv_error(struct error_handler *err, struct io_uring *ring,
 		      struct io_uring_cqe *cqe);
 static int send_error(struct error_handler *err, struct io_uring *ring,
 		      struct io_uring_cqe *cqe);
+static int splice_error(struct error_handler *err, struct io_uring *ring,
+			struct io_uring_cqe *cqe);
+static int accept_error(struct error_handler *err, struct io_uring *ring,
+			struct io_uring_cqe *cqe);
+static int conn_error(struct io_uring *ring, struct conn *c);
 
-static int default_error(struct error_handler *err,
-			 struct io_uring __attribute__((__unused__)) *ring,
+static int default_error(struct error_handler *err, struct io_uring *ring,
 			 struct io_uring_cqe *cqe)
 {
 	struct conn *c = cqe_to_conn(cqe);
 
+	/* the rest of a failed shard connection, being canceled */
+	if (c->shard && c->stopping)
+		return 0;
+
 	fprintf(stderr, "%d: %s error %s\n", c->tid, err->name, strerror(-cqe->res));
 	fprintf(stderr, "fd=%d, bid=%d\n", cqe_to_fd(cqe), cqe_to_bid(cqe));
-	return 1;
+	return conn_error(ring, c);
 }
 
 /*
@@ -308,7 +464,7 @@ static int default_error(struct error_handler *err,
  */
 static struct error_handler error_handlers[] = {
 	{ .name = "NULL",	.error_fn = NULL, },
-	{ .name = "ACCEPT",	.error_fn = default_error, },
+	{ .name = "ACCEPT",	.error_fn = accept_error, },
 	{ .name = "SOCK",	.error_fn = default_error, },
 	{ .name = "CONNECT",	.error_fn = default_error, },
 	{ .name = "RECV",	.error_fn = recv_error, },
@@ -321,6 +477,10 @@ static struct error_handler error_handlers[] = {
 	{ .name = "FD_PASS",	.error_fn = default_error, },
 	{ .name = "NOP",	.error_fn = NULL, },
 	{ .name = "STOP",	.error_fn = default_error, },
+	{ .name = "PIPE",	.error_fn = default_error, },
+	{ .name = "SPLICE_IN",	.error_fn = splice_error, },
+	{ .name = "SPLICE_OUT",	.error_fn = splice_error, },
+	{ .name = "SHARD_CLOSE",	.error_fn = NULL, },
 };
 
 static void free_buffer_ring(struct io_uring *ring, struct conn_buf_ring *cbr)
@@ -392,7 +552,7 @@ static int setup_recv_ring(struct io_uring *ring, struct conn *c)
 		ptr += buf_size;
 	}
 	io_uring_buf_ring_advance(cbr->br, nr_bufs);
-	printf("%d: recv buffer ring bgid %d, bufs %d\n", c->tid, cbr->bgid, nr_bufs);
+	clog("%d: recv buffer ring bgid %d, bufs %d\n", c->tid, cbr->bgid, nr_bufs);
 	return 0;
 }
 
@@ -416,7 +576,7 @@ static int setup_send_ring(struct io_uring *ring, struct conn *c)
 		return 1;
 	}
 
-	printf("%d: send buffer ring bgid %d, bufs %d\n", c->tid, cbr->bgid, nr_bufs);
+	clog("%d: send buffer ring bgid %d, bufs %d\n", c->tid, cbr->bgid, nr_bufs);
 	return 0;
 }
 
@@ -454,9 +614,17 @@ static int setup_buffer_rings(struct io_uring *ring, struct conn *c)
 {
 	int ret;
 
-	/* no locking needed on cur_bgid, parent serializes setup */
-	c->in_br.bgid = cur_bgid++;
-	c->out_br.bgid = cur_bgid++;
+	if (c->shard) {
+		/* shard rings are shared, bgid follows the slot in the shard */
+		int slot = c->tid - c->shard->first_tid;
+
+		c->in_br.bgid = 2 * slot + 1;
+		c->out_br.bgid = 2 * slot + 2;
+	} else {
+		/* no locking needed on cur_bgid, parent serializes setup */
+		c->in_br.bgid = cur_bgid++;
+		c->out_br.bgid = cur_bgid++;
+	}
 	c->out_br.br = NULL;
 
 	ret = setup_recv_ring(ring, c);
@@ -547,6 +715,28 @@ static void show_buckets(struct conn_dir *cd)
 	free(rstat);
 }
 
+static void show_lat_hist(const char *name, struct lat_hist *h)
+{
+	double div = cycles_per_usec;
+
+	if (!h->nr)
+		return;
+
+	printf("\t   : %s: samples=%lu, avg=%.1f, p50=%.1f, p90=%.1f, "
+		"p99=%.1f, p99.9=%.1f, max=%.1f usec\n", name, h->nr,
+		h->sum / div / h->nr, lat_percentile(h, 50.0) / div,
+		lat_percentile(h, 90.0) / div, lat_percentile(h, 99.0) / div,
+		lat_percentile(h, 99.9) / div, h->max / div);
+}
+
+static void show_lat(struct lat_hist *lat)
+{
+	int i;
+
+	for (i = 0; i < LAT_NR; i++)
+		show_lat_hist(lat_names[i], &lat[i]);
+}
+
 static void __show_stats(struct conn *c)
 {
 	unsigned long msec, qps;
@@ -598,6 +788,9 @@ static void __show_stats(struct conn *c)
 		printf("\t   : mshot_rcv=%d, mshot_snd=%d\n", cd->rcv_mshot,
 			cd->snd_mshot);
 		show_buckets(cd);
+		/* shard latency is shown in aggregate */
+		if (cd->lat && !c->shard)
+			show_lat(cd->lat);
 
 	}
 	if (msec) {
@@ -610,26 +803,143 @@ static void __show_stats(struct conn *c)
 	c->flags |= CONN_F_STATS_SHOWN;
 }
 
+/*
+ * CPU usage of the whole process, which includes the io-wq workers, and
+ * normalized to the amount of data that went through us.
+ */
+static void show_cpu_stats(unsigned long bytes)
+{
+	struct rusage ru;
+	double usr, sys;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return;
+
+	usr = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0;
+	sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+	printf("CPU: usr=%.2fs, sys=%.2fs", usr, sys);
+	if (bytes >= (1UL << 20))
+		printf(", per GB=%.3fs", (usr + sys) * (1UL << 30) / bytes);
+	printf("\n");
+}
+
+/*
+ * Bytes that went through, forwarded ones for a proxy and received ones
+ * for a sink.
+ */
+static unsigned long conn_bytes(struct conn *c)
+{
+	if (is_sink)
+		return c->cd[0].in_bytes;
+	return c->cd[0].out_bytes + c->cd[1].out_bytes;
+}
+
+static void show_shard_stats(void)
+{
+	unsigned long bytes = 0, accepted = 0, msec, bw;
+	int i;
+
+	for (i = 0; i < nr_shards; i++) {
+		struct shard *s = &shards[i];
+		unsigned long in = shard_stat(s, in_bytes);
+		unsigned long out = shard_stat(s, out_bytes);
+		unsigned long events = shard_stat(s, events);
+		unsigned long loops = shard_stat(s, event_loops);
+		unsigned long conns = shard_stat(s, accepted);
+		float events_per_loop = 0.0;
+
+		if (events && loops)
+			events_per_loop = (float) events / (float) loops;
+
+		printf("Shard %d (cpu %d): conns=%lu, open=%d, event loops %lu, "
+			"events %lu, events per loop %.2f\n", s->index, s->cpu,
+			conns, shard_stat(s, open_conns), loops, events,
+			events_per_loop);
+		printf("\t   : in_bytes=%lu (Kb %lu), out_bytes=%lu (Kb %lu)\n",
+			in, in >> 10, out, out >> 10);
+		bytes += in + out;
+		accepted += conns;
+	}
+
+	msec = mtime_since_now(&shards_start);
+	printf("Total: shards=%d, conns=%lu, msec=%lu\n", nr_shards, accepted,
+		msec);
+	if (msec) {
+		bw = (8UL * bytes / 1000) / msec;
+		printf("\tBW=%'luMbit\n", bw);
+	}
+
+	bytes = 0;
+	for (i = 0; i < nr_shards; i++)
+		bytes += is_sink ? shard_stat(&shards[i], in_bytes) :
+				   shard_stat(&shards[i], out_bytes);
+	show_cpu_stats(bytes);
+}
+
+/*
+ * Forwarding latency per direction, summed over all connections. Direction
+ * 1 is data going out to the remote host, 0 is data going back to the
+ * client with -B1.
+ */
+static void show_latency(void)
+{
+	struct lat_hist lat[2][LAT_NR];
+	int i, j, k;
+
+	if (!lat_stats || is_sink || use_splice)
+		return;
+
+	memset(lat, 0, sizeof(lat));
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < LAT_NR; j++) {
+			for (k = 0; k < nr_shards; k++)
+				lat_merge(&lat[i][j], &shards[k].lat[i][j]);
+			for (k = 0; !nr_shards && k < nr_conns; k++) {
+				if (conns[k].cd[i].lat)
+					lat_merge(&lat[i][j], &conns[k].cd[i].lat[j]);
+			}
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (!lat[i][LAT_RECV_SEND].nr)
+			continue;
+		printf("Latency, direction %d:\n", i);
+		show_lat(lat[i]);
+	}
+}
+
 static void show_stats(void)
 {
 	float events_per_loop = 0.0;
 	static int stats_shown;
+	unsigned long bytes = 0;
 	int i;
 
 	if (stats_shown)
 		return;
 
+	if (nr_shards) {
+		show_shard_stats();
+		show_latency();
+		stats_shown = 1;
+		return;
+	}
+
 	if (events)
 		events_per_loop = (float) events / (float) event_loops;
 
 	printf("Event loops: %lu, events %lu, events per loop %.2f\n", event_loops,
 							events, events_per_loop);
 
-	for (i = 0; i < MAX_CONNS; i++) {
+	for (i = 0; i < max_conns; i++) {
 		struct conn *c = &conns[i];
 
 		__show_stats(c);
+		bytes += conn_bytes(c);
 	}
+	show_cpu_stats(bytes);
+	show_latency();
 	stats_shown = 1;
 }
 
@@ -640,6 +950,29 @@ static void sig_int(int __attribute__((__unused__)) sig)
 	exit(1);
 }
 
+/*
+ * Ask for the latency histograms so far, without stopping. stdio isn't
+ * async signal safe, so the main thread dumps them from its loop.
+ */
+static void sig_usr1(int __attribute__((__unused__)) sig)
+{
+	dump_latency = 1;
+}
+
+/*
+ * The numbers are read racily while the loops keep updating them, which is
+ * fine for a snapshot.
+ */
+static void check_dump_latency(void)
+{
+	if (!dump_latency)
+		return;
+	dump_latency = 0;
+	printf("\n");
+	show_latency();
+	fflush(stdout);
+}
+
 /*
  * Special cased for SQPOLL only, as we don't control when SQEs are consumed if
  * that is used. Hence we may need to wait for the SQPOLL thread to keep up
@@ -674,9 +1007,35 @@ static struct io_uring_sqe *get_sqe(struct io_uring *ring)
  * See __encode_userdata() for how we encode sqe->user_data, which is passed
  * back as cqe->user_data at completion time.
  */
+/*
+ * A shard hands a connection's slot out again once it has been closed, but
+ * its canceled requests or the close of its pipes may still be completing
+ * then, and their CQEs only carry the slot. So each connection counts the
+ * requests it has in flight, and the slot is only recycled once they have
+ * all posted their final CQE. Those arriving after the close are dropped,
+ * as the connection's buffers are gone by then. The shutdown linked in
+ * front of a close skips its CQE on success, so it isn't counted. The rest
+ * of the ops that aren't counted don't belong to a connection of a shard.
+ */
+static bool conn_req_counted(int op)
+{
+	switch (op) {
+	case __ACCEPT:
+	case __SHUTDOWN:
+	case __FD_PASS:
+	case __STOP:
+	case __SHARD_CLOSE:
+		return false;
+	default:
+		return true;
+	}
+}
+
 static void encode_userdata(struct io_uring_sqe *sqe, struct conn *c, int op,
 			    int bid, int fd)
 {
+	if (c->shard && conn_req_counted(op))
+		c->inflight++;
 	__encode_userdata(sqe, c->tid, op, bid, fd);
 }
 
@@ -822,10 +1181,29 @@ static void queue_cancel(struct io_uring *ring, struct conn *c)
 {
 	struct io_uring_sqe *sqe;
 	int flags = 0;
+	int i;
+
+	c->stopping = 1;
 
 	if (fixed_files)
 		flags |= IORING_ASYNC_CANCEL_FD_FIXED;
 
+	/*
+	 * A splice from a socket into a pipe is issued against the pipe, so
+	 * cancel those too. That will also kick any splice blocked waiting
+	 * on the socket.
+	 */
+	for (i = 0; i < 2; i++) {
+		int fd = c->cd[i].pipe_fds[1];
+
+		if (fd == -1)
+			continue;
+		sqe = get_sqe(ring);
+		io_uring_prep_cancel_fd(sqe, fd, flags);
+		encode_userdata(sqe, c, __CANCEL, 0, fd);
+		c->pending_cancels++;
+	}
+
 	sqe = get_sqe(ring);
 	io_uring_prep_cancel_fd(sqe, c->in_fd, flags);
 	encode_userdata(sqe, c, __CANCEL, 0, c->in_fd);
@@ -841,6 +1219,34 @@ static void queue_cancel(struct io_uring *ring, struct conn *c)
 	io_uring_submit(ring);
 }
 
+/*
+ * A request of this connection failed. In the thread per connection mode
+ * that ends the thread, and the connection with it. A shard serves many
+ * connections, so there only this one is torn down: its pending requests
+ * are canceled, and it's shut down and closed from there as usual.
+ */
+static int conn_error(struct io_uring *ring, struct conn *c)
+{
+	struct shard *s = c->shard;
+
+	if (!s)
+		return 1;
+	if (c->stopping)
+		return 0;
+
+	if (!(c->flags & CONN_F_CLOSING)) {
+		s->closing[s->nr_closing++] = c;
+		c->flags |= CONN_F_CLOSING;
+	}
+	if (!(c->flags & CONN_F_END_TIME)) {
+		gettimeofday(&c->end_time, NULL);
+		c->flags |= CONN_F_END_TIME;
+	}
+	c->flags |= CONN_F_DISCONNECTING;
+	queue_cancel(ring, c);
+	return 0;
+}
+
 static int pending_shutdown(struct conn *c)
 {
 	return c->cd[0].pending_shutdown + c->cd[1].pending_shutdown;
@@ -857,6 +1263,11 @@ static bool should_shutdown(struct conn *c)
 	if (!bidi)
 		return c->cd[0].in_bytes == c->cd[1].out_bytes;
 
+	/* splices don't map 1:1 between sides, check bytes in both directions */
+	if (use_splice)
+		return c->cd[0].in_bytes == c->cd[1].out_bytes &&
+		       c->cd[1].in_bytes == c->cd[0].out_bytes;
+
 	for (i = 0; i < 2; i++) {
 		if (c->cd[0].rcv != c->cd[1].snd)
 			return false;
@@ -889,6 +1300,14 @@ static void close_cd(struct conn *c, struct conn_dir *cd)
 {
 	cd->pending_shutdown = 1;
 
+	/* let the shard house keeping know it needs to check on us */
+	if (c->shard && !(c->flags & CONN_F_CLOSING)) {
+		struct shard *s = c->shard;
+
+		s->closing[s->nr_closing++] = c;
+		c->flags |= CONN_F_CLOSING;
+	}
+
 	if (cd->pending_send)
 		return;
 
@@ -965,24 +1384,12 @@ static void free_msgs(struct conn_dir *cd)
 	free_mvec(&cd->io_rcv_msg.vecs[0]);
 }
 
-/*
- * Multishot accept completion triggered. If we're acting as a sink, we're
- * good to go. Just issue a receive for that case. If we're acting as a proxy,
- * then start opening a socket that we can use to connect to the other end.
- */
-static int handle_accept(struct io_uring *ring, struct io_uring_cqe *cqe)
+static void init_conn(struct conn *c, int tid)
 {
-	struct conn *c;
 	int i;
 
-	if (nr_conns == MAX_CONNS) {
-		fprintf(stderr, "max clients reached %d\n", nr_conns);
-		return 1;
-	}
-
-	/* main thread handles this, which is obviously serialized */
-	c = &conns[nr_conns];
-	c->tid = nr_conns++;
+	memset(c, 0, sizeof(*c));
+	c->tid = tid;
 	c->in_fd = -1;
 	c->out_fd = -1;
 
@@ -992,12 +1399,64 @@ static int handle_accept(struct io_uring *ring, struct io_uring_cqe *cqe)
 		cd->index = i;
 		cd->snd_next_bid = -1;
 		cd->rcv_next_bid = -1;
+		cd->pipe_fds[0] = cd->pipe_fds[1] = -1;
 		if (ext_stat) {
 			cd->rcv_bucket = calloc(nr_bufs + 1, sizeof(int));
 			cd->snd_bucket = calloc(nr_bufs + 1, sizeof(int));
 		}
 		init_msgs(cd);
 	}
+}
+
+/*
+ * Setup forwarding latency tracking, if enabled. Only done for the buffer
+ * based proxy modes, a sink doesn't send and splice never sees the data.
+ * The per-conn histograms stay around after the conn is closed, so they
+ * can be included in the final summary.
+ */
+static void init_conn_lat(struct conn *c)
+{
+	int i;
+
+	if (!lat_stats || is_sink || use_splice)
+		return;
+
+	c->rcv_ts = calloc(nr_bufs, sizeof(uint64_t));
+	for (i = 0; i < 2; i++) {
+		struct conn_dir *cd = &c->cd[i];
+
+		if (c->shard)
+			cd->lat = c->shard->lat[i];
+		else
+			cd->lat = calloc(LAT_NR, sizeof(struct lat_hist));
+	}
+}
+
+static int shard_accept(struct shard *s, struct io_uring *ring,
+			struct io_uring_cqe *cqe);
+
+/*
+ * Multishot accept completion triggered. If we're acting as a sink, we're
+ * good to go. Just issue a receive for that case. If we're acting as a proxy,
+ * then start opening a socket that we can use to connect to the other end.
+ */
+static int handle_accept(struct io_uring *ring, struct io_uring_cqe *cqe)
+{
+	struct conn *c;
+
+	/* for sharded mode, the accept carries the shard index as the bid */
+	if (nr_shards)
+		return shard_accept(&shards[cqe_to_bid(cqe)], ring, cqe);
+
+	if (nr_conns == max_conns) {
+		fprintf(stderr, "max clients reached %d\n", nr_conns);
+		return 1;
+	}
+
+	/* main thread handles this, which is obviously serialized */
+	c = &conns[nr_conns];
+	init_conn(c, nr_conns++);
+	init_conn_lat(c);
 
 	printf("New client: id=%d, in=%d\n", c->tid, c->in_fd);
 	gettimeofday(&c->start_time, NULL);
@@ -1078,18 +1537,37 @@ static int handle_sock(struct io_uring *ring, struct io_uring_cqe *cqe)
 	return 0;
 }
 
+/*
+ * Shards own their connection counts, only the thread per connection mode
+ * needs to serialize on the global one.
+ */
+static void conn_opened(struct conn *c)
+{
+	c->flags |= CONN_F_OPEN;
+	if (c->shard) {
+		shard_stat_add(c->shard, open_conns, 1);
+		return;
+	}
+	pthread_mutex_lock(&thread_lock);
+	open_conns++;
+	pthread_mutex_unlock(&thread_lock);
+}
+
 /*
  * Connection to the other end is done, submit a receive to start receiving
  * data. If we're a bidirectional proxy, issue a receive on both ends. If not,
  * then just a single recv will do.
  */
+static int setup_splice(struct io_uring *ring, struct conn *c);
+
 static int handle_connect(struct io_uring *ring, struct io_uring_cqe *cqe)
 {
 	struct conn *c = cqe_to_conn(cqe);
 
-	pthread_mutex_lock(&thread_lock);
-	open_conns++;
-	pthread_mutex_unlock(&thread_lock);
+	conn_opened(c);
+
+	if (use_splice)
+		return setup_splice(ring, c);
 
 	if (bidi)
 		submit_bidi_receive(ring, c);
@@ -1277,11 +1755,25 @@ static int recv_mshot_msg(struct conn *c, struct conn_dir *cd, int *bid,
 	return nr_packets;
 }
 
+/*
+ * Note the time the buffers from this recv completion arrived, it's the
+ * start of the forwarding latency for the data they hold.
+ */
+static void stamp_recv(struct conn *c, int bid, int nr_packets)
+{
+	uint64_t now = get_cycles();
+
+	while (nr_packets--) {
+		c->rcv_ts[bid] = now;
+		bid = (bid + 1) & br_mask;
+	}
+}
+
 static int __handle_recv(struct io_uring *ring, struct conn *c,
 			 struct conn_dir *cd, struct io_uring_cqe *cqe)
 {
 	struct conn_dir *ocd = &c->cd[!cd->index];
-	int bid, nr_packets;
+	int bid, start_bid, nr_packets;
 
 	/*
 	 * Not having a buffer attached should only happen if we get a zero
@@ -1318,6 +1810,7 @@ start_close:
 	}
 
 	vlog("%d: recv: bid=%d, res=%d, cflags=%x\n", c->tid, bid, cqe->res, cqe->flags);
+	start_bid = bid;
 	/*
 	 * If we're a sink, we're done here. Just replenish the buffer back
 	 * to the pool. For proxy mode, we will send the data to the other
@@ -1335,6 +1828,8 @@ start_close:
 
 	if (cd->rcv_bucket)
 		cd->rcv_bucket[nr_packets]++;
+	if (c->rcv_ts)
+		stamp_recv(c, start_bid, nr_packets);
 
 	if (!is_sink) {
 		ocd->out_buffers += nr_packets;
@@ -1367,8 +1862,11 @@ start_close:
 	    !(cqe->flags & IORING_CQE_F_MORE)) && !is_sink)
 		prep_next_send(ring, c, ocd, other_dir_fd(c, cqe_to_fd(cqe)));
 
-	if (!recv_done_res(cqe->res))
+	if (!recv_done_res(cqe->res)) {
 		cd->in_bytes += cqe->res;
+		if (c->shard)
+			shard_stat_add(c->shard, in_bytes, cqe->res);
+	}
 	return 0;
 }
 
@@ -1406,6 +1904,11 @@ static void submit_send(struct io_uring *ring, struct conn *c,
 		return;
 	cd->pending_send = 1;
 
+	if (cd->lat) {
+		cd->snd_issue = get_cycles();
+		lat_add(&cd->lat[LAT_RECV_SEND], cd->snd_issue - c->rcv_ts[bid]);
+	}
+
 	flags |= MSG_WAITALL | MSG_NOSIGNAL;
 
 	sqe = get_sqe(ring);
@@ -1625,6 +2128,7 @@ static int __handle_send(struct io_uring *ring, struct conn *c,
 			 struct conn_dir *cd, struct io_uring_cqe *cqe)
 {
 	struct conn_dir *ocd;
+	unsigned long out_bytes;
 	int bid, nr_packets;
 
 	if (send_ring) {
@@ -1651,6 +2155,9 @@ static int __handle_send(struct io_uring *ring, struct conn *c,
 	} else {
 		if (cqe->res && cqe->res < buf_size)
 			cd->snd_shrt++;
+		if (cd->lat)
+			lat_add(&cd->lat[LAT_SEND_DONE],
+				get_cycles() - cd->snd_issue);
 
 		/*
 		 * BIDI will use the same buffer pool and do sends on both CDs,
@@ -1667,12 +2174,16 @@ static int __handle_send(struct io_uring *ring, struct conn *c,
 
 		vlog("send: got %d, %lu\n", cqe->res, cd->out_bytes);
 
+		out_bytes = cd->out_bytes;
 		if (buf_ring_inc)
 			nr_packets = handle_send_inc(c, cd, bid, cqe);
 		else if (send_ring)
 			nr_packets = handle_send_ring(c, cd, bid, cqe->res);
 		else
 			nr_packets = handle_send_buf(c, cd, bid, cqe->res);
+		if (c->shard)
+			shard_stat_add(c->shard, out_bytes,
+				       cd->out_bytes - out_bytes);
 
 		if (cd->snd_bucket)
 			cd->snd_bucket[nr_packets]++;
@@ -1736,6 +2247,212 @@ static int send_error(struct error_handler *err, struct io_uring *ring,
 	return 0;
 }
 
+static int splices_pending(struct conn *c)
+{
+	return c->cd[0].splice_pending + c->cd[1].splice_pending;
+}
+
+static void queue_conn_close(struct io_uring *ring, struct conn *c)
+{
+	queue_shutdown_close(ring, c, c->in_fd);
+	if (c->out_fd != -1)
+		queue_shutdown_close(ring, c, c->out_fd);
+	io_uring_submit(ring);
+}
+
+/*
+ * Splice mode. Rather than receiving into provided buffers and sending from
+ * those, data is moved from one socket to the other through a pipe, and
+ * never touches user memory. Each direction has a pipe, and a hard linked
+ * pair of splices: one from the receiving socket into the pipe, and one from
+ * the pipe into the sending socket. The second one is non-blocking, as the
+ * first may not have moved anything. It has to be a hard link, as a short
+ * splice would otherwise break the link. Anything the pair leaves in the
+ * pipe is drained with blocking splices to the sending socket, before the
+ * next pair is armed.
+ */
+static int dir_fd(struct conn *c, struct conn_dir *cd)
+{
+	return cd->index ? c->out_fd : c->in_fd;
+}
+
+static void prep_splice_out(struct io_uring_sqe *sqe, struct conn *c,
+			    struct conn_dir *cd, int len, int flags)
+{
+	struct conn_dir *ocd = &c->cd[!cd->index];
+
+	if (fixed_files)
+		flags |= SPLICE_F_FD_IN_FIXED;
+
+	io_uring_prep_splice(sqe, cd->pipe_fds[0], -1, dir_fd(c, ocd), -1, len,
+				SPLICE_F_MOVE | flags);
+	encode_userdata(sqe, c, __SPLICE_OUT, 0, dir_fd(c, cd));
+	if (fixed_files)
+		sqe->flags |= IOSQE_FIXED_FILE;
+	cd->splice_pending++;
+}
+
+static void submit_splice_pair(struct io_uring *ring, struct conn *c,
+			       struct conn_dir *cd)
+{
+	struct conn_dir *ocd = &c->cd[!cd->index];
+	struct io_uring_sqe *sqe1, *sqe2;
+	int flags = SPLICE_F_MOVE;
+
+	vlog("%d: submit splice fd=%d\n", c->tid, dir_fd(c, cd));
+
+	/* see queue_shutdown_close(), links can't span submissions */
+	sqe1 = get_sqe(ring);
+	sqe2 = get_sqe(ring);
+
+	if (fixed_files)
+		flags |= SPLICE_F_FD_IN_FIXED;
+	io_uring_prep_splice(sqe1, dir_fd(c, cd), -1, cd->pipe_fds[1], -1,
+				SPLICE_LEN, flags);
+	encode_userdata(sqe1, c, __SPLICE_IN, 0, dir_fd(c, cd));
+	if (fixed_files)
+		sqe1->flags |= IOSQE_FIXED_FILE;
+	sqe1->flags |= IOSQE_IO_HARDLINK;
+	cd->splice_pending++;
+
+	prep_splice_out(sqe2, c, cd, SPLICE_LEN, SPLICE_F_NONBLOCK);
+
+	cd->pending_recv = 1;
+	ocd->pending_send = 1;
+}
+
+static void submit_splice_pairs(struct io_uring *ring, struct conn *c)
+{
+	submit_splice_pair(ring, c, &c->cd[0]);
+	if (bidi)
+		submit_splice_pair(ring, c, &c->cd[1]);
+}
+
+/*
+ * Connected, setup a pipe for each direction. With fixed files, the pipes
+ * are direct descriptors too, created by IORING_OP_PIPE. Without, just use
+ * a normal pipe.
+ */
+static int setup_splice(struct io_uring *ring, struct conn *c)
+{
+	struct io_uring_sqe *sqe;
+	int i;
+
+	for (i = 0; i < 1 + bidi; i++) {
+		struct conn_dir *cd = &c->cd[i];
+
+		if (!fixed_files) {
+			if (pipe2(cd->pipe_fds, O_CLOEXEC) < 0) {
+				perror("pipe2");
+				return 1;
+			}
+			continue;
+		}
+		sqe = get_sqe(ring);
+		io_uring_prep_pipe_direct(sqe, cd->pipe_fds, 0,
+						IORING_FILE_INDEX_ALLOC);
+		encode_userdata(sqe, c, __PIPE, 0, dir_fd(c, cd));
+		c->pending_pipes++;
+	}
+
+	if (!fixed_files)
+		submit_splice_pairs(ring, c);
+	return 0;
+}
+
+static int handle_pipe(struct io_uring *ring, struct io_uring_cqe *cqe)
+{
+	struct conn *c = cqe_to_conn(cqe);
+
+	vlog("%d: pipe: res=%d\n", c->tid, cqe->res);
+
+	/* the other pipe failed, and the connection is going away */
+	if (c->stopping)
+		return 0;
+	if (!--c->pending_pipes)
+		submit_splice_pairs(ring, c);
+	return 0;
+}
+
+/*
+ * Both splices of a pair, or a drain splice, have completed. Drain what's
+ * left in the pipe, or arm the next pair. If the receiving side is done and
+ * the pipe empty, start closing.
+ */
+static void splice_next(struct io_uring *ring, struct conn *c,
+			struct conn_dir *cd)
+{
+	struct conn_dir *ocd = &c->cd[!cd->index];
+
+	if (c->stopping) {
+		cd->pending_recv = ocd->pending_send = 0;
+		if (!c->pending_cancels && !splices_pending(c))
+			queue_conn_close(ring, c);
+		return;
+	}
+
+	if (cd->pipe_bytes) {
+		prep_splice_out(get_sqe(ring), c, cd, cd->pipe_bytes, 0);
+		return;
+	}
+
+	cd->pending_recv = ocd->pending_send = 0;
+	if (!cd->splice_eof)
+		submit_splice_pair(ring, c, cd);
+	else
+		close_cd(c, cd);
+}
+
+static int handle_splice(struct io_uring *ring, struct io_uring_cqe *cqe)
+{
+	struct conn *c = cqe_to_conn(cqe);
+	struct conn_dir *cd = cqe_to_conn_dir(c, cqe);
+	struct conn_dir *ocd = &c->cd[!cd->index];
+	int res = cqe->res;
+
+	vlog("%d: splice: op=%d, res=%d\n", c->tid, cqe_to_op(cqe), res);
+
+	cd->splice_pending--;
+	if (cqe_to_op(cqe) == __SPLICE_IN) {
+		if (res > 0) {
+			cd->rcv++;
+			cd->in_bytes += res;
+			cd->pipe_bytes += res;
+			if (c->shard)
+				shard_stat_add(c->shard, in_bytes, res);
+		} else {
+			cd->splice_eof = 1;
+		}
+	} else if (res > 0) {
+		ocd->snd++;
+		ocd->out_bytes += res;
+		cd->pipe_bytes -= res;
+		if (c->shard)
+			shard_stat_add(c->shard, out_bytes, res);
+	}
+
+	/* wait for the other half of the pair */
+	if (!cd->splice_pending)
+		splice_next(ring, c, cd);
+	return 0;
+}
+
+/*
+ * The non-blocking half of a pair finding the pipe empty is expected, as
+ * are canceled splices if we're stopping.
+ */
+static int splice_error(struct error_handler *err, struct io_uring *ring,
+			struct io_uring_cqe *cqe)
+{
+	struct conn *c = cqe_to_conn(cqe);
+
+	if (c->stopping ||
+	    (cqe->res == -EAGAIN && cqe_to_op(cqe) == __SPLICE_OUT))
+		return handle_splice(ring, cqe);
+
+	return default_error(err, ring, cqe);
+}
+
 /*
  * We don't expect to get here, as we marked it with skipping posting a
  * CQE if it was successful. If it does trigger, than means it fails and
@@ -1764,6 +2481,26 @@ static int handle_shutdown(struct io_uring *ring, struct io_uring_cqe *cqe)
 	return 0;
 }
 
+static void close_pipe(struct io_uring *ring, struct conn *c,
+		       struct conn_dir *cd)
+{
+	struct io_uring_sqe *sqe;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (cd->pipe_fds[i] == -1)
+			continue;
+		if (fixed_files) {
+			sqe = get_sqe(ring);
+			io_uring_prep_close_direct(sqe, cd->pipe_fds[i]);
+			encode_userdata(sqe, c, __NOP, 0, 0);
+		} else {
+			close(cd->pipe_fds[i]);
+		}
+		cd->pipe_fds[i] = -1;
+	}
+}
+
 /*
  * Final stage of a connection, the shutdown and close has finished. Mark
  * it as disconnected and let the main loop reap it.
@@ -1773,7 +2510,7 @@ static int handle_close(struct io_uring *ring, struct io_uring_cqe *cqe)
 	struct conn *c = cqe_to_conn(cqe);
 	int fd = cqe_to_fd(cqe);
 
-	printf("Closed client: id=%d, in_fd=%d, out_fd=%d\n", c->tid, c->in_fd, c->out_fd);
+	clog("Closed client: id=%d, in_fd=%d, out_fd=%d\n", c->tid, c->in_fd, c->out_fd);
 	if (fd == c->in_fd)
 		c->in_fd = -1;
 	else if (fd == c->out_fd)
@@ -1782,17 +2519,32 @@ static int handle_close(struct io_uring *ring, struct io_uring_cqe *cqe)
 	if (c->in_fd == -1 && c->out_fd == -1) {
 		c->flags |= CONN_F_DISCONNECTED;
 
-		pthread_mutex_lock(&thread_lock);
-		__show_stats(c);
-		open_conns--;
-		pthread_mutex_unlock(&thread_lock);
+		/* a connection that failed may not have gotten as far as open */
+		if (c->shard) {
+			/* shard stats are shown in aggregate */
+			if (verbose)
+				__show_stats(c);
+			if (c->flags & CONN_F_OPEN)
+				shard_stat_add(c->shard, open_conns, -1);
+		} else {
+			pthread_mutex_lock(&thread_lock);
+			__show_stats(c);
+			if (c->flags & CONN_F_OPEN)
+				open_conns--;
+			pthread_mutex_unlock(&thread_lock);
+		}
 		free_buffer_rings(ring, c);
+		close_pipe(ring, c, &c->cd[0]);
+		close_pipe(ring, c, &c->cd[1]);
+		io_uring_submit(ring);
 		free_msgs(&c->cd[0]);
 		free_msgs(&c->cd[1]);
 		free(c->cd[0].rcv_bucket);
 		free(c->cd[0].snd_bucket);
 		free(c->cd[1].rcv_bucket);
 		free(c->cd[1].snd_bucket);
+		free(c->rcv_ts);
+		c->rcv_ts = NULL;
 	}
 
 	return 0;
@@ -1807,12 +2559,12 @@ static int handle_cancel(struct io_uring *ring, struct io_uring_cqe *cqe)
 
 	vlog("%d: got cancel fd %d, refs %d\n", c->tid, fd, c->pending_cancels);
 
-	if (!c->pending_cancels) {
-		queue_shutdown_close(ring, c, c->in_fd);
-		if (c->out_fd != -1)
-			queue_shutdown_close(ring, c, c->out_fd);
-		io_uring_submit(ring);
-	}
+	/*
+	 * Inflight splices reference both sockets, if there are any then
+	 * the last one to complete will do the shutdown and close.
+	 */
+	if (!c->pending_cancels && !splices_pending(c))
+		queue_conn_close(ring, c);
 
 	return 0;
 }
@@ -1820,11 +2572,8 @@ static int handle_cancel(struct io_uring *ring, struct io_uring_cqe *cqe)
 static void open_socket(struct conn *c)
 {
 	if (is_sink) {
-		pthread_mutex_lock(&thread_lock);
-		open_conns++;
-		pthread_mutex_unlock(&thread_lock);
-
-		submit_receive(&c->ring, c);
+		conn_opened(c);
+		submit_receive(conn_ring(c), c);
 	} else {
 		struct io_uring_sqe *sqe;
 		int domain;
@@ -1861,7 +2610,7 @@ static void open_socket(struct conn *c)
 		 * the POSIX mandated "lowest free must be returned". It may
 		 * return any free descriptor of its choosing.
 		 */
-		sqe = get_sqe(&c->ring);
+		sqe = get_sqe(conn_ring(c));
 		if (fixed_files)
 			io_uring_prep_socket_direct_alloc(sqe, domain, SOCK_STREAM, 0, 0);
 		else
@@ -1889,7 +2638,7 @@ static int handle_stop(struct io_uring_cqe *cqe)
 	struct conn *c = cqe_to_conn(cqe);
 
 	printf("Client %d: queueing shutdown\n", c->tid);
-	queue_cancel(&c->ring, c);
+	queue_cancel(conn_ring(c), c);
 	return 0;
 }
 
@@ -1901,6 +2650,16 @@ static int handle_cqe(struct io_uring *ring, struct io_uring_cqe *cqe)
 {
 	int ret;
 
+	if (nr_shards && conn_req_counted(cqe_to_op(cqe))) {
+		struct conn *c = cqe_to_conn(cqe);
+
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			c->inflight--;
+		/* torn down and its state freed, this is just draining */
+		if (c->flags & CONN_F_DISCONNECTED)
+			return 0;
+	}
+
 	/*
 	 * Unlikely, but there's an error in this CQE. If an error handler
 	 * is defined, call it, and that will deal with it. If no error
@@ -1947,7 +2706,15 @@ static int handle_cqe(struct io_uring *ring, struct io_uring_cqe *cqe)
 	case __STOP:
 		ret = handle_stop(cqe);
 		break;
+	case __PIPE:
+		ret = handle_pipe(ring, cqe);
+		break;
+	case __SPLICE_IN:
+	case __SPLICE_OUT:
+		ret = handle_splice(ring, cqe);
+		break;
 	case __NOP:
+	case __SHARD_CLOSE:
 		ret = 0;
 		break;
 	default:
@@ -1966,6 +2733,7 @@ static void house_keeping(struct io_uring *ring)
 	int i, j;
 
 	vlog("House keeping entered\n");
+	check_dump_latency();
 
 	bytes = 0;
 	for (i = 0; i < nr_conns; i++) {
@@ -2011,11 +2779,40 @@ static void house_keeping(struct io_uring *ring)
 }
 
 /*
- * Event loop shared between the parent, and the connections. Could be
- * split in two, as they don't handle the same types of events. For the per
- * connection loop, 'c' is valid. For the main loop, it's NULL.
+ * Sharded version of the house keeping. Only connections that have started
+ * shutting down need looking at. Those that are ready get their pending
+ * requests canceled, which kicks off the shutdown and close, and those that
+ * have been closed give their slot back to the shard, once nothing they
+ * issued is still in flight.
+ */
+static void shard_house_keeping(struct shard *s)
+{
+	int i = 0;
+
+	while (i < s->nr_closing) {
+		struct conn *c = s->closing[i];
+
+		if (c->flags & CONN_F_DISCONNECTED) {
+			if (!c->inflight) {
+				s->free_slots[s->nr_free++] = c->tid - s->first_tid;
+				s->closing[i] = s->closing[--s->nr_closing];
+				continue;
+			}
+		} else if (!(c->flags & CONN_F_DISCONNECTING) && should_shutdown(c)) {
+			c->flags |= CONN_F_DISCONNECTING;
+			queue_cancel(&s->ring, c);
+		}
+		i++;
+	}
+}
+
+/*
+ * Event loop shared between the parent, the shards, and the connections.
+ * Could be split, as they don't handle the same types of events. For the per
+ * connection loop, 'c' is valid. For a shard, 's' is valid. For the main
+ * loop, both are NULL.
  */
-static int __event_loop(struct io_uring *ring, struct conn *c)
+static int __event_loop(struct io_uring *ring, struct conn *c, struct shard *s)
 {
 	struct __kernel_timespec active_ts, idle_ts;
 	int flags;
@@ -2036,7 +2833,7 @@ static int __event_loop(struct io_uring *ring, struct conn *c)
 		struct __kernel_timespec *ts = &idle_ts;
 		struct io_uring_cqe *cqe;
 		unsigned int head;
-		int ret, i, to_wait;
+		int ret, i, to_wait, nr_open;
 
 		/*
 		 * If wait_batch is set higher than 1, then we'll wait on
@@ -2055,7 +2852,8 @@ static int __event_loop(struct io_uring *ring, struct conn *c)
 		 * always.
 		 */
 		to_wait = 1;
-		if (open_conns && !flags) {
+		nr_open = s ? s->open_conns : open_conns;
+		if (nr_open && !flags) {
 			ts = &active_ts;
 			to_wait = wait_batch;
 		}
@@ -2089,14 +2887,21 @@ static int __event_loop(struct io_uring *ring, struct conn *c)
 		 */
 		if (i) {
 			io_uring_cq_advance(ring, i);
-			events += i;
+			if (s)
+				shard_stat_add(s, events, i);
+			else
+				events += i;
 		}
 
-		event_loops++;
 		if (c) {
+			event_loops++;
 			if (c->flags & CONN_F_DISCONNECTED)
 				break;
+		} else if (s) {
+			shard_stat_add(s, event_loops, 1);
+			shard_house_keeping(s);
 		} else {
+			event_loops++;
 			house_keeping(ring);
 		}
 	}
@@ -2131,10 +2936,10 @@ static int parent_loop(struct io_uring *ring, int fd)
 		io_uring_prep_multishot_accept(sqe, fd, NULL, NULL, 0);
 	__encode_userdata(sqe, 0, __ACCEPT, 0, fd);
 
-	return __event_loop(ring, NULL);
+	return __event_loop(ring, NULL, NULL);
 }
 
-static int init_ring(struct io_uring *ring, int nr_files)
+static int init_ring(struct io_uring *ring, int nr_files, int cq_entries)
 {
 	struct io_uring_params params;
 	int ret;
@@ -2152,7 +2957,7 @@ static int init_ring(struct io_uring *ring, int nr_files)
 	memset(&params, 0, sizeof(params));
 	params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_CLAMP;
 	params.flags |= IORING_SETUP_CQSIZE;
-	params.cq_entries = 1024;
+	params.cq_entries = cq_entries;
 
 	/*
 	 * If use_huge is set, setup the ring with IORING_SETUP_NO_MMAP. This
@@ -2288,6 +3093,15 @@ static int init_ring(struct io_uring *ring, int nr_files)
 	return 0;
 }
 
+/*
+ * Direct descriptors needed per connection, the two sockets and, for splice
+ * mode, a pipe for each direction.
+ */
+static int conn_files(void)
+{
+	return use_splice ? 6 : 2;
+}
+
 static void *thread_main(void *data)
 {
 	struct conn *c = data;
@@ -2295,12 +3109,12 @@ static void *thread_main(void *data)
 
 	c->flags |= CONN_F_STARTED;
 
-	/* we need a max of 4 descriptors for each client */
-	ret = init_ring(&c->ring, 4);
+	/* we need a max of 4 descriptors for each client, plus pipes */
+	ret = init_ring(&c->ring, 2 * conn_files(), 1024);
 	if (ret)
 		goto done;
 
-	if (setup_buffer_rings(&c->ring, c))
+	if (!use_splice && setup_buffer_rings(&c->ring, c))
 		goto done;
 
 	/*
@@ -2315,11 +3129,223 @@ static void *thread_main(void *data)
 	/* we're ready */
 	pthread_barrier_wait(&c->startup_barrier);
 
-	__event_loop(&c->ring, c);
+	__event_loop(&c->ring, c, NULL);
 done:
 	return NULL;
 }
 
+/*
+ * Arm multishot accept on the shard listening socket. The shard index is
+ * passed in the bid part of the user_data, so handle_accept() can find it.
+ */
+static void shard_arm_accept(struct shard *s)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(&s->ring);
+	if (fixed_files)
+		io_uring_prep_multishot_accept_direct(sqe, s->listen_fd, NULL, NULL, 0);
+	else
+		io_uring_prep_multishot_accept(sqe, s->listen_fd, NULL, NULL, 0);
+	__encode_userdata(sqe, 0, __ACCEPT, s->index, s->listen_fd);
+}
+
+/*
+ * New connection on a shard. Unlike the thread per connection mode, the
+ * descriptor was accepted straight into the ring that will serve it, so
+ * there's no passing it around. Grab a free slot and get going.
+ */
+static int shard_accept(struct shard *s, struct io_uring *ring,
+			struct io_uring_cqe *cqe)
+{
+	struct conn *c;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		shard_arm_accept(s);
+
+	if (!s->nr_free) {
+		struct io_uring_sqe *sqe;
+
+		fprintf(stderr, "shard %d: max clients reached %d\n", s->index,
+				shard_conns);
+		sqe = get_sqe(ring);
+		if (fixed_files)
+			io_uring_prep_close_direct(sqe, cqe->res);
+		else
+			io_uring_prep_close(sqe, cqe->res);
+		__encode_userdata(sqe, 0, __SHARD_CLOSE, 0, 0);
+		return 0;
+	}
+
+	c = &conns[s->first_tid + s->free_slots[--s->nr_free]];
+	init_conn(c, c - conns);
+	c->shard = s;
+	init_conn_lat(c);
+	c->in_fd = cqe->res;
+	c->flags |= CONN_F_STARTED;
+	gettimeofday(&c->start_time, NULL);
+	shard_stat_add(s, accepted, 1);
+
+	clog("New client: id=%d, in=%d, shard=%d\n", c->tid, c->in_fd, s->index);
+
+	if (!use_splice && setup_buffer_rings(ring, c)) {
+		fprintf(stderr, "%d: buffer ring setup failed\n", c->tid);
+		return conn_error(ring, c);
+	}
+
+	open_socket(c);
+	return 0;
+}
+
+/*
+ * Failing to accept a connection doesn't affect the ones the shard already
+ * serves, just make sure it keeps accepting.
+ */
+static int accept_error(struct error_handler *err, struct io_uring *ring,
+			struct io_uring_cqe *cqe)
+{
+	struct shard *s;
+
+	if (!nr_shards)
+		return default_error(err, ring, cqe);
+
+	s = &shards[cqe_to_bid(cqe)];
+	fprintf(stderr, "shard %d: accept error %s\n", s->index,
+			strerror(-cqe->res));
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		shard_arm_accept(s);
+	return 0;
+}
+
+static int shard_setup(struct shard *s)
+{
+	cpu_set_t mask;
+	int i, ret, cq_entries;
+
+	CPU_ZERO(&mask);
+	CPU_SET(s->cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask))
+		perror("sched_setaffinity");
+
+	s->listen_fd = setup_reuseport_listening_socket(receive_port, ipv6);
+	if (s->listen_fd == -1)
+		return 1;
+
+	/*
+	 * Each connection needs a few direct descriptors, and completions for
+	 * all of them end up in this one ring, so size the CQ ring to match.
+	 * It can't be smaller than the SQ ring though.
+	 */
+	cq_entries = 2 * shard_conns;
+	if (cq_entries < 2 * ring_size)
+		cq_entries = 2 * ring_size;
+	ret = init_ring(&s->ring, conn_files() * shard_conns, cq_entries);
+	if (ret)
+		return ret;
+
+	s->free_slots = calloc(shard_conns, sizeof(int));
+	s->closing = calloc(shard_conns, sizeof(struct conn *));
+	if (!s->free_slots || !s->closing) {
+		perror("calloc");
+		return 1;
+	}
+
+	/* hand out low slots first */
+	for (i = 0; i < shard_conns; i++)
+		s->free_slots[i] = shard_conns - i - 1;
+	s->nr_free = shard_conns;
+	return 0;
+}
+
+static void *shard_main(void *data)
+{
+	struct shard *s = data;
+
+	s->failed = shard_setup(s);
+
+	/* ring is setup, or failed to */
+	pthread_barrier_wait(&shard_barrier);
+	if (s->failed)
+		return NULL;
+
+	shard_arm_accept(s);
+	__event_loop(&s->ring, NULL, s);
+	return NULL;
+}
+
+/*
+ * Start the shards, each pinned to its own CPU, and wait for all of them to
+ * have their rings setup. Returns non-zero if any failed.
+ */
+static int start_shards(void)
+{
+	int i, nr_cpus, ret = 0;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_cpus < 1)
+		nr_cpus = 1;
+
+	shards = calloc(nr_shards, sizeof(struct shard));
+	pthread_barrier_init(&shard_barrier, NULL, nr_shards + 1);
+	for (i = 0; i < nr_shards; i++) {
+		struct shard *s = &shards[i];
+
+		s->index = i;
+		s->cpu = i % nr_cpus;
+		s->first_tid = i * shard_conns;
+		pthread_create(&s->thread, NULL, shard_main, s);
+	}
+	pthread_barrier_wait(&shard_barrier);
+
+	for (i = 0; i < nr_shards; i++) {
+		if (shards[i].failed) {
+			fprintf(stderr, "shard %d failed setup\n", i);
+			ret = 1;
+		}
+	}
+	gettimeofday(&shards_start, NULL);
+	return ret;
+}
+
+/*
+ * The shards do all the work, the main thread just aggregates and shows the
+ * bandwidth across all of them.
+ */
+static int shards_loop(void)
+{
+	unsigned long last_bytes = 0;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	while (1) {
+		unsigned long bytes, elapsed, bw;
+		int i, open;
+
+		sleep(1);
+		check_dump_latency();
+
+		bytes = open = 0;
+		for (i = 0; i < nr_shards; i++) {
+			bytes += shard_stat(&shards[i], in_bytes) +
+				 shard_stat(&shards[i], out_bytes);
+			open += shard_stat(&shards[i], open_conns);
+		}
+
+		elapsed = mtime_since_now(&tv);
+		if (!elapsed || bytes == last_bytes)
+			continue;
+
+		bw = (8 * (bytes - last_bytes) / 1000UL) / elapsed;
+		if (bw)
+			printf("Bandwidth (shards=%d, conns=%d): %'luMbit\n",
+				nr_shards, open, bw);
+		gettimeofday(&tv, NULL);
+		last_bytes = bytes;
+	}
+
+	return 0;
+}
+
 static void usage(const char *name)
 {
 	printf("%s:\n", name);
@@ -2348,6 +3374,10 @@ static void usage(const char *name)
 	printf("\t-M:\t\tUse sendmsg (%d)\n", snd_msg);
 	printf("\t-M:\t\tUse recvmsg (%d)\n", rcv_msg);
 	printf("\t-x:\t\tShow extended stats (%d)\n", ext_stat);
+	printf("\t-P:\t\tNumber of pinned shard threads, 0 for thread per conn (%d)\n", nr_shards);
+	printf("\t-K:\t\tMax connections per shard (%d)\n", shard_conns);
+	printf("\t-F:\t\tForward with splice through a pipe (%d)\n", use_splice);
+	printf("\t-l:\t\tTrack forwarding latency, SIGUSR1 dumps it (%d)\n", lat_stats);
 	printf("\t-V:\t\tIncrease verbosity (%d)\n", verbose);
 }
 
@@ -2371,7 +3401,7 @@ int main(int argc, char *argv[])
 
 	pthread_mutex_init(&thread_lock, NULL);
 
-	optstring = "m:d:S:s:b:f:H:r:p:n:B:N:T:w:t:M:R:u:c:C:q:a:x:z:i:6Vh?";
+	optstring = "m:d:S:s:b:f:H:r:p:n:B:N:T:w:t:M:R:u:c:C:q:a:x:z:i:P:K:F:l:6Vh?";
 	while ((opt = getopt(argc, argv, optstring)) != -1) {
 		switch (opt) {
 		case 'm':
@@ -2452,6 +3482,18 @@ int main(int argc, char *argv[])
 		case 'x':
 			ext_stat = !!atoi(optarg);
 			break;
+		case 'P':
+			nr_shards = atoi(optarg);
+			break;
+		case 'K':
+			shard_conns = atoi(optarg);
+			break;
+		case 'F':
+			use_splice = !!atoi(optarg);
+			break;
+		case 'l':
+			lat_stats = !!atoi(optarg);
+			break;
 		case 'V':
 			verbose++;
 			break;
@@ -2466,6 +3508,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Can't be both bidi proxy and sink\n");
 		return 1;
 	}
+	if (use_splice && is_sink) {
+		fprintf(stderr, "Can't splice forward as a sink\n");
+		return 1;
+	}
 	if (snd_msg && sqpoll) {
 		fprintf(stderr, "SQPOLL with msg variants disabled\n");
 		snd_msg = 0;
@@ -2496,23 +3542,61 @@ int main(int argc, char *argv[])
 		buf_size += sizeof(struct io_uring_recvmsg_out);
 	}
 
+	/*
+	 * Shards serve many connections per ring, the direct descriptor
+	 * index and buffer group ID must fit in 16 bits.
+	 */
+	if (nr_shards) {
+		int max_shard_conns = 65535 / conn_files();
+
+		if (shard_conns < 1 || shard_conns > max_shard_conns) {
+			fprintf(stderr, "Max connections per shard must be "
+					"1..%d\n", max_shard_conns);
+			return 1;
+		}
+		if (sqpoll) {
+			fprintf(stderr, "Shards use DEFER_TASKRUN, SQPOLL disabled\n");
+			sqpoll = 0;
+		}
+		defer_tw = 1;
+		max_conns = nr_shards * shard_conns;
+	}
+
 	br_mask = nr_bufs - 1;
 
-	fd = setup_listening_socket(receive_port, ipv6);
+	if (lat_stats) {
+		if (is_sink || use_splice)
+			fprintf(stderr, "Latency only tracked for buffer forwarding\n");
+		cycles_per_usec = calibrate_cycles();
+	}
+
+	conns = calloc(max_conns, sizeof(struct conn));
+	if (!conns) {
+		perror("calloc");
+		return 1;
+	}
+
 	if (is_sink)
 		send_port = -1;
 
-	if (fd == -1)
-		return 1;
+	if (nr_shards) {
+		fd = -1;
+		ret = start_shards();
+	} else {
+		fd = setup_listening_socket(receive_port, ipv6);
+		if (fd == -1)
+			return 1;
+		ret = init_ring(&ring, MAX_CONNS * 3, 1024);
+	}
+	if (ret)
+		return ret;
 
 	atexit(show_stats);
 	sa.sa_handler = sig_int;
 	sa.sa_flags = SA_RESTART;
 	sigaction(SIGINT, &sa, NULL);
-
-	ret = init_ring(&ring, MAX_CONNS * 3);
-	if (ret)
-		return ret;
+	sa.sa_handler = sig_usr1;
+	sigaction(SIGUSR1, &sa, NULL);
 
 	printf("Backend: sqpoll=%d, defer_tw=%d, fixed_files=%d, "
 		"is_sink=%d, buf_size=%d, nr_bufs=%d, host=%s, send_port=%d, "
@@ -2525,6 +3609,14 @@ int main(int argc, char *argv[])
 	printf(" send options: sendmsg=%d, send_ring=%d, send_bundle=%d, "
 		"send_zerocopy=%d\n", snd_msg, send_ring, snd_bundle,
 			snd_zc);
+	if (use_splice)
+		printf(" splice forwarding, buffer options unused\n");
+
+	if (nr_shards) {
+		printf(" shards=%d, max conns per shard=%d\n", nr_shards,
+			shard_conns);
+		return shards_loop();
+	}
 
 	return parent_loop(&ring, fd);
 }
@@ -2,7 +2,9 @@
 #ifndef LIBURING_PROXY_H
 #define LIBURING_PROXY_H
 
+#include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 
 /*
  * Generic opcode agnostic encoding to sqe/cqe->user_data
@@ -10,7 +12,7 @@
 struct userdata {
 	union {
 		struct {
-			uint16_t op_tid; /* 4 bits op, 12 bits tid */
+			uint32_t op_tid; /* 8 bits op, 24 bits tid */
 			uint16_t bid;
 			uint16_t fd;
 		};
@@ -18,8 +20,8 @@ struct userdata {
 	};
 };
 
-#define OP_SHIFT	(12)
-#define TID_MASK	((1U << 12) - 1)
+#define OP_SHIFT	(24)
+#define TID_MASK	((1U << 24) - 1)
 
 /*
  * Packs the information that we will need at completion time into the
@@ -99,4 +101,50 @@ static unsigned long long mtime_since_now(struct timeval *tv)
 	return mtime_since(tv, &end);
 }
 
+/*
+ * Cheap timestamps for latency tracking on the hot path. Uses the TSC or
+ * the generic timer where available, and falls back to the monotonic clock.
+ * Units are cycles, see calibrate_cycles() for converting them to time.
+ */
+static inline uint64_t get_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+#elif defined(__aarch64__)
+	uint64_t val;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (val));
+	return val;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Returns the number of cycles per usec, measured against the monotonic
+ * clock.
+ */
+static double calibrate_cycles(void)
+{
+	struct timespec start, end, delay = { .tv_nsec = 50000000 };
+	uint64_t c_start, c_end;
+	double usec;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	c_start = get_cycles();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	c_end = get_cycles();
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000.0;
+	usec += (end.tv_nsec - start.tv_nsec) / 1000.0;
+	return (c_end - c_start) / usec;
+}
+
 #endif
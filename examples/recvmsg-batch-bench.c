@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Microbenchmark for parsing recvmsg multishot completions, comparing the
+ * per-CQE io_uring_recvmsg_* helpers against io_uring_recvmsg_parse_batch().
+ *
+ * The buffers and CQEs are synthetic, laid out as the kernel would for a
+ * UDP socket with an IPv4 source address and room for a timestamp and a
+ * UDP_GRO cmsg, so only the parsing cost is measured. Each pass parses
+ * 'batch' CQEs and sums the payload lengths, and prints ns per CQE for:
+ *
+ *   helpers		validate + payload + payload_length per CQE
+ *   batch		io_uring_recvmsg_parse_batch(), payloads only
+ *   helpers+cmsg	as helpers, also walking the cmsgs per CQE
+ *   batch+cmsg		as batch, also asking for GRO size and timestamp
+ *
+ * Usage: ./recvmsg-batch-bench [-b batch] [-n buffers] [-i iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP		17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO		104
+#endif
+
+#define BUF_SIZE	2048
+
+static int batch_size = 32;
+static int nr_bufs = 1024;
+static long iterations = 200000;
+
+static char *bufs;
+static struct io_uring_cqe *cqe_mem;
+static struct io_uring_cqe **cqes;
+static struct msghdr msgh;
+static char control[CMSG_SPACE(sizeof(struct timespec)) +
+		    CMSG_SPACE(sizeof(int))];
+
+/* the sum of all payload bytes parsed, printed so nothing is optimized out */
+static unsigned long sink;
+
+/*
+ * Fill in buffer 'bid' the way recvmsg multishot would for a datagram of
+ * 'len' bytes, with a timestamp and a GRO cmsg.
+ */
+static int fill_buf(int bid, int len)
+{
+	struct io_uring_recvmsg_out *o;
+	struct sockaddr_in *sin;
+	struct cmsghdr *cmsg;
+	struct timespec ts;
+	char *buf = bufs + bid * BUF_SIZE;
+	int gro = 1400;
+
+	o = (struct io_uring_recvmsg_out *) buf;
+	o->namelen = sizeof(struct sockaddr_in);
+	o->controllen = sizeof(control);
+	o->payloadlen = len;
+	o->flags = 0;
+
+	sin = io_uring_recvmsg_name(o);
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(9000);
+
+	cmsg = io_uring_recvmsg_cmsg_firsthdr(o, &msgh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SO_TIMESTAMPNS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(ts));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(CMSG_DATA(cmsg), &ts, sizeof(ts));
+
+	cmsg = io_uring_recvmsg_cmsg_nexthdr(o, &msgh, cmsg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_GRO;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(gro));
+	memcpy(CMSG_DATA(cmsg), &gro, sizeof(gro));
+
+	return sizeof(*o) + msgh.msg_namelen + msgh.msg_controllen + len;
+}
+
+static void parse_helpers(struct io_uring_cqe **c, int nr, int cmsgs)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		int bid = c[i]->flags >> IORING_CQE_BUFFER_SHIFT;
+		struct io_uring_recvmsg_out *o;
+		struct cmsghdr *cmsg;
+		void *payload;
+
+		if (!(c[i]->flags & IORING_CQE_F_BUFFER))
+			continue;
+		o = io_uring_recvmsg_validate(bufs + bid * BUF_SIZE, c[i]->res,
+					      &msgh);
+		if (!o)
+			continue;
+		payload = io_uring_recvmsg_payload(o, &msgh);
+		sink += io_uring_recvmsg_payload_length(o, c[i]->res, &msgh);
+		sink += *(unsigned char *) payload;
+		if (!cmsgs)
+			continue;
+		for (cmsg = io_uring_recvmsg_cmsg_firsthdr(o, &msgh); cmsg;
+		     cmsg = io_uring_recvmsg_cmsg_nexthdr(o, &msgh, cmsg)) {
+			if (cmsg->cmsg_level == SOL_UDP &&
+			    cmsg->cmsg_type == UDP_GRO)
+				sink += *(int *) CMSG_DATA(cmsg);
+			else if (cmsg->cmsg_level == SOL_SOCKET &&
+				 cmsg->cmsg_type == SO_TIMESTAMPNS)
+				sink += ((struct timespec *) CMSG_DATA(cmsg))->tv_nsec;
+		}
+	}
+}
+
+static void parse_batch(struct io_uring_cqe **c, int nr, int cmsgs)
+{
+	void *payload[nr];
+	unsigned int len[nr];
+	int gro[nr];
+	__u64 tstamp[nr];
+	struct io_uring_recvmsg_batch b = {
+		.payload = payload,
+		.payload_len = len,
+		.gro_size = cmsgs ? gro : NULL,
+		.tstamp = cmsgs ? tstamp : NULL,
+	};
+	int i;
+
+	io_uring_recvmsg_parse_batch(c, nr, bufs, BUF_SIZE, &msgh, &b);
+	for (i = 0; i < nr; i++) {
+		if (!payload[i])
+			continue;
+		sink += len[i] + *(unsigned char *) payload[i];
+		if (cmsgs)
+			sink += gro[i] + tstamp[i];
+	}
+}
+
+static void run(const char *name,
+		void (*fn)(struct io_uring_cqe **, int, int), int cmsgs)
+{
+	int nr_batches = nr_bufs / batch_size;
+	uint64_t start, nsec;
+	long i;
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++)
+		fn(&cqes[(i % nr_batches) * batch_size], batch_size, cmsgs);
+	nsec = now_ns() - start;
+
+	printf("%-14s %8.2f ns/cqe\n", name,
+		(double) nsec / (iterations * batch_size));
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-b batch] [-n buffers] [-i iterations]\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in name;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "b:n:i:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			batch_size = atoi(optarg);
+			break;
+		case 'n':
+			nr_bufs = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (batch_size < 1 || nr_bufs < batch_size || nr_bufs > 65536 ||
+	    iterations < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	msgh.msg_name = &name;
+	msgh.msg_namelen = sizeof(name);
+	msgh.msg_control = control;
+	msgh.msg_controllen = sizeof(control);
+
+	bufs = calloc(nr_bufs, BUF_SIZE);
+	cqe_mem = calloc(nr_bufs, sizeof(*cqe_mem));
+	cqes = calloc(nr_bufs, sizeof(*cqes));
+	if (!bufs || !cqe_mem || !cqes) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	/*
+	 * Datagram sizes vary, and CQEs complete in a shuffled buffer order,
+	 * as they would once buffers are recycled out of order.
+	 */
+	srand(1);
+	for (i = 0; i < nr_bufs; i++) {
+		struct io_uring_cqe *cqe = &cqe_mem[i];
+
+		cqe->res = fill_buf(i, 64 + rand() % 1400);
+		cqe->flags = IORING_CQE_F_BUFFER | IORING_CQE_F_MORE |
+			     (i << IORING_CQE_BUFFER_SHIFT);
+		cqes[i] = cqe;
+	}
+	for (i = nr_bufs - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		struct io_uring_cqe *tmp = cqes[i];
+
+		cqes[i] = cqes[j];
+		cqes[j] = tmp;
+	}
+
+	printf("batch=%d buffers=%d iterations=%ld\n", batch_size, nr_bufs,
+		iterations);
+	run("helpers", parse_helpers, 0);
+	run("batch", parse_batch, 0);
+	run("helpers+cmsg", parse_helpers, 1);
+	run("batch+cmsg", parse_batch, 1);
+	printf("(sum %lu)\n", sink);
+
+	free(cqes);
+	free(cqe_mem);
+	free(bufs);
+	return 0;
+}
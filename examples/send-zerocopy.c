@@ -12,6 +12,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <poll.h>
 #include <sched.h>
@@ -42,13 +43,60 @@
 #include <signal.h>
 
 #include "liburing.h"
+#include "helpers.h"
 
 #define PATTERN_SIZE	26
 
 #define ZC_TAG 0xfffffffULL
 #define MAX_SUBMIT_NR 512
+/* request slot of the tuner's probe, past the end of any batch */
+#define PROBE_SLOT MAX_SUBMIT_NR
 #define MAX_THREADS 100
 
+enum {
+	SEND_MODE_COPY,
+	SEND_MODE_ZC,
+	SEND_MODE_ZC_FIXED,
+
+	NR_SEND_MODES,
+};
+
+static const char *send_mode_names[NR_SEND_MODES] = {
+	"copy", "zc", "zc_fixed",
+};
+
+/*
+ * Adaptive mode keeps per size class (log2 of the payload length) statistics
+ * for every send mode, and picks the one with the lowest observed cost.
+ * Cost is measured on a probe, one request sent on its own ahead of each
+ * batch, as the time from its submission until the buffer is free again:
+ * the completion for a copy, the notification for zerocopy. It's scaled to
+ * 1KB and kept as an EWMA. Zerocopy notifications that report the kernel
+ * fell back to copying inflate the cost of that mode, as it then pays for
+ * both the copy and the notification.
+ */
+#define TUNER_NR_BUCKETS	32
+#define TUNER_WARMUP		8
+#define TUNER_EXPLORE		64
+#define TUNER_EWMA_SHIFT	3
+
+struct send_tuner_arm {
+	int64_t cost;
+	unsigned samples;
+	unsigned notifs;
+	unsigned copied;
+};
+
+struct send_tuner_bucket {
+	struct send_tuner_arm arm[NR_SEND_MODES];
+	unsigned calls;
+};
+
+struct send_tuner {
+	struct send_tuner_bucket bucket[TUNER_NR_BUCKETS];
+	int nr_modes;
+};
+
 struct thread_data {
 	pthread_t thread;
 	void *ret;
@@ -56,6 +104,11 @@ struct thread_data {
 	unsigned long long packets;
 	unsigned long long bytes;
 	unsigned long long dt_ms;
+	unsigned long long mode_reqs[NR_SEND_MODES];
+	unsigned long long mode_bytes[NR_SEND_MODES];
+	unsigned long long zc_copied;
+	unsigned zc_threshold;
+	unsigned rand_state;
 	struct sockaddr_storage dst_addr;
 	int fd;
 };
@@ -82,6 +135,8 @@ static int  cfg_port		= 8000;
 static int  cfg_runtime_ms	= 4200;
 static bool cfg_rx_poll		= false;
 static bool cfg_verify;
+static bool cfg_adaptive;
+static int  cfg_min_payload_len;
 
 static socklen_t cfg_alen;
 static char *str_addr = NULL;
@@ -103,20 +158,6 @@ static void sigint_handler(__attribute__((__unused__)) int sig)
 /*
  * Implementation of error(3), prints an error message and exits.
  */
-static void t_error(int status, int errnum, const char *format, ...)
-{
-	va_list args;
-	va_start(args, format);
-
-	vfprintf(stderr, format, args);
-	if (errnum)
-		fprintf(stderr, ": %s", strerror(errnum));
-
-	fprintf(stderr, "\n");
-	va_end(args);
-	exit(status);
-}
-
 static void set_cpu_affinity(void)
 {
 	cpu_set_t mask;
@@ -316,6 +357,118 @@ static void *do_rx(void *arg)
 	return NULL;
 }
 
+static inline unsigned tuner_bucket(unsigned len)
+{
+	return 31 - __builtin_clz(len | 1);
+}
+
+static int64_t tuner_cost(struct send_tuner_arm *arm)
+{
+	if (!arm->notifs || !arm->copied)
+		return arm->cost;
+	return arm->cost + arm->cost * arm->copied / arm->notifs;
+}
+
+static int tuner_best(struct send_tuner *t, struct send_tuner_bucket *b)
+{
+	int i, best = SEND_MODE_COPY;
+
+	for (i = 1; i < t->nr_modes; i++)
+		if (tuner_cost(&b->arm[i]) < tuner_cost(&b->arm[best]))
+			best = i;
+	return best;
+}
+
+static int tuner_pick(struct send_tuner *t, unsigned len)
+{
+	struct send_tuner_bucket *b = &t->bucket[tuner_bucket(len)];
+	unsigned calls = b->calls++;
+	int i, best;
+
+	/* sample every mode a few times before trusting the averages */
+	for (i = 0; i < t->nr_modes; i++)
+		if (b->arm[i].samples < TUNER_WARMUP)
+			return calls % t->nr_modes;
+
+	best = tuner_best(t, b);
+	/* keep probing the losers, the crossover point moves with load */
+	if (calls % TUNER_EXPLORE == TUNER_EXPLORE - 1) {
+		i = 1 + (calls / TUNER_EXPLORE) % (t->nr_modes - 1);
+		return (best + i) % t->nr_modes;
+	}
+	return best;
+}
+
+static void tuner_complete(struct send_tuner *t, unsigned bucket, int mode,
+			   unsigned len, uint64_t ns)
+{
+	struct send_tuner_arm *arm = &t->bucket[bucket].arm[mode];
+	int64_t cost = ns * 1024 / (len ? len : 1);
+
+	if (!arm->samples++)
+		arm->cost = cost;
+	else
+		arm->cost += (cost - arm->cost) >> TUNER_EWMA_SHIFT;
+}
+
+static void tuner_notif(struct send_tuner *t, unsigned bucket, int mode,
+			bool copied)
+{
+	struct send_tuner_arm *arm = &t->bucket[bucket].arm[mode];
+
+	arm->notifs++;
+	if (copied)
+		arm->copied++;
+}
+
+/*
+ * The smallest size class from which on zerocopy wins for all larger classes
+ * that have seen traffic, 0 if copy won in the largest one.
+ */
+static unsigned tuner_threshold(struct send_tuner *t)
+{
+	struct send_tuner_bucket *b;
+	unsigned threshold = 0;
+	int i;
+
+	for (i = TUNER_NR_BUCKETS - 1; i >= 0; i--) {
+		b = &t->bucket[i];
+		if (b->arm[SEND_MODE_COPY].samples < TUNER_WARMUP)
+			continue;
+		if (tuner_best(t, b) == SEND_MODE_COPY)
+			break;
+		threshold = 1U << i;
+	}
+	return threshold;
+}
+
+/* user_data layout: mode | size class | request slot */
+static inline __u64 send_user_data(int mode, unsigned bucket, unsigned slot)
+{
+	return ((__u64) mode << 24) | (bucket << 16) | slot;
+}
+
+static unsigned pick_payload_len(struct thread_data *td)
+{
+	unsigned lo = tuner_bucket(cfg_min_payload_len);
+	unsigned hi = tuner_bucket(cfg_payload_len);
+	unsigned x = td->rand_state, len;
+
+	/* xorshift32, pick a size class uniformly then a length within it */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	td->rand_state = x;
+
+	len = 1U << (lo + x % (hi - lo + 1));
+	len += (x >> 8) & (len - 1);
+	if (len < cfg_min_payload_len)
+		len = cfg_min_payload_len;
+	if (len > cfg_payload_len)
+		len = cfg_payload_len;
+	return len;
+}
+
 static inline struct io_uring_cqe *wait_cqe_fast(struct io_uring *ring)
 {
 	struct io_uring_cqe *cqe;
@@ -331,9 +484,139 @@ static inline struct io_uring_cqe *wait_cqe_fast(struct io_uring *ring)
 	return cqe;
 }
 
+static char *send_buf(struct thread_data *td)
+{
+	char *buf = payload;
+
+	if (cfg_verify && cfg_type == SOCK_STREAM)
+		buf += td->bytes % PATTERN_SIZE;
+	return buf;
+}
+
+static void prep_send(struct io_uring_sqe *sqe, int fd, int mode, char *buf,
+		      unsigned len)
+{
+	unsigned msg_flags = MSG_WAITALL;
+	unsigned buf_idx = 0;
+
+	switch (mode) {
+	case SEND_MODE_COPY:
+		io_uring_prep_send(sqe, fd, buf, len, 0);
+		break;
+	case SEND_MODE_ZC:
+		io_uring_prep_send_zc(sqe, fd, buf, len, msg_flags, 0);
+		break;
+	case SEND_MODE_ZC_FIXED:
+		io_uring_prep_send_zc_fixed(sqe, fd, buf, len, msg_flags, 0,
+					    buf_idx);
+		break;
+	}
+	if (cfg_adaptive && mode != SEND_MODE_COPY)
+		sqe->ioprio |= IORING_SEND_ZC_REPORT_USAGE;
+	if (cfg_fixed_files) {
+		sqe->fd = 0;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+}
+
+static void handle_notif(struct thread_data *td, struct send_tuner *t,
+			 struct io_uring_cqe *cqe)
+{
+	unsigned bucket = (cqe->user_data >> 16) & 0xff;
+	int mode = cqe->user_data >> 24;
+	bool copied;
+
+	if (cqe->flags & IORING_CQE_F_MORE)
+		t_error(1, -EINVAL, "F_MORE notif");
+	if (cfg_adaptive) {
+		copied = (__u32) cqe->res & IORING_NOTIF_USAGE_ZC_COPIED;
+		tuner_notif(t, bucket, mode, copied);
+		td->zc_copied += copied;
+	}
+}
+
+/* account for a send result, -1 if the connection is gone */
+static int handle_send_res(struct thread_data *td, struct io_uring_cqe *cqe)
+{
+	int mode = cqe->user_data >> 24;
+
+	if (cqe->res >= 0) {
+		td->packets++;
+		td->bytes += cqe->res;
+		td->mode_reqs[mode]++;
+		td->mode_bytes[mode] += cqe->res;
+	} else if (cqe->res == -ECONNREFUSED || cqe->res == -EPIPE ||
+		   cqe->res == -ECONNRESET) {
+		printf("Connection failure %i\n", cqe->res);
+		return -1;
+	} else if (cqe->res != -EAGAIN) {
+		t_error(1, cqe->res, "send failed");
+	}
+	return 0;
+}
+
+/*
+ * Send a request on its own and feed its cost to the tuner. Timing requests
+ * of a batch instead would charge each with sending the ones ahead of it.
+ * Only notifications of earlier batches can come in meanwhile, those are
+ * handled as usual.
+ */
+static int tuner_probe(struct thread_data *td, struct io_uring *ring,
+		       struct send_tuner *t, int fd, int *compl_cqes)
+{
+	unsigned len = cfg_payload_len;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned bucket;
+	bool sent = false, done = false;
+	uint64_t start;
+	int mode, ret;
+
+	if (cfg_min_payload_len)
+		len = pick_payload_len(td);
+	bucket = tuner_bucket(len);
+	mode = tuner_pick(t, len);
+
+	sqe = io_uring_get_sqe(ring);
+	prep_send(sqe, fd, mode, send_buf(td), len);
+	sqe->user_data = send_user_data(mode, bucket, PROBE_SLOT);
+
+	start = now_ns();
+	ret = io_uring_submit(ring);
+	if (ret != 1)
+		t_error(1, ret, "submit probe");
+
+	while (!done) {
+		cqe = wait_cqe_fast(ring);
+		if (cqe->flags & IORING_CQE_F_NOTIF) {
+			handle_notif(td, t, cqe);
+			if ((cqe->user_data & 0xffff) == PROBE_SLOT)
+				done = true;
+			else
+				(*compl_cqes)--;
+			io_uring_cqe_seen(ring, cqe);
+			continue;
+		}
+
+		ret = handle_send_res(td, cqe);
+		sent = cqe->res >= 0;
+		/* zerocopy, the buffer isn't free until the notification */
+		done = !(cqe->flags & IORING_CQE_F_MORE);
+		if (ret && !done)
+			(*compl_cqes)++;
+		io_uring_cqe_seen(ring, cqe);
+		if (ret)
+			return ret;
+	}
+	if (sent)
+		tuner_complete(t, bucket, mode, len, now_ns() - start);
+	return 0;
+}
+
 static void do_tx(struct thread_data *td, int domain, int type, int protocol)
 {
 	const int notif_slack = 128;
+	struct send_tuner tuner = { };
 	struct io_uring ring;
 	struct iovec iov;
 	uint64_t tstart;
@@ -398,55 +681,61 @@ static void do_tx(struct thread_data *td, int domain, int type, int protocol)
 			t_error(1, ret, "submit poll");
 	}
 
+	tuner.nr_modes = cfg_fixed_buf ? NR_SEND_MODES : SEND_MODE_ZC_FIXED;
+	td->rand_state = 0x9e3779b9U * (td->idx + 1);
+
 	pthread_barrier_wait(&barrier);
 
 	tstart = gettimeofday_ms();
 	do {
 		struct io_uring_sqe *sqe;
 		struct io_uring_cqe *cqe;
-		unsigned buf_idx = 0;
-		unsigned msg_flags = MSG_WAITALL;
+		int first = 0;
 
-		for (i = 0; i < cfg_nr_reqs; i++) {
-			char *buf = payload;
+		/* the probe is the first request of the batch */
+		if (cfg_adaptive) {
+			if (tuner_probe(td, &ring, &tuner, fd, &compl_cqes))
+				goto out_fail;
+			first = 1;
+		}
 
-			if (cfg_verify && cfg_type == SOCK_STREAM)
-				buf += td->bytes % PATTERN_SIZE;
+		for (i = first; i < cfg_nr_reqs; i++) {
+			unsigned len = cfg_payload_len;
+			int mode;
 
-			sqe = io_uring_get_sqe(&ring);
+			if (cfg_min_payload_len)
+				len = pick_payload_len(td);
 
-			if (!cfg_zc)
-				io_uring_prep_send(sqe, fd, buf,
-						   cfg_payload_len, 0);
-			else {
-				io_uring_prep_send_zc(sqe, fd, buf,
-						     cfg_payload_len, msg_flags, 0);
-				if (cfg_fixed_buf) {
-					sqe->ioprio |= IORING_RECVSEND_FIXED_BUF;
-					sqe->buf_index = buf_idx;
-				}
-			}
-			sqe->user_data = 1;
-			if (cfg_fixed_files) {
-				sqe->fd = 0;
-				sqe->flags |= IOSQE_FIXED_FILE;
-			}
+			if (cfg_adaptive)
+				mode = tuner_best(&tuner,
+						  &tuner.bucket[tuner_bucket(len)]);
+			else if (!cfg_zc)
+				mode = SEND_MODE_COPY;
+			else if (cfg_fixed_buf)
+				mode = SEND_MODE_ZC_FIXED;
+			else
+				mode = SEND_MODE_ZC;
+
+			sqe = io_uring_get_sqe(&ring);
+			prep_send(sqe, fd, mode, send_buf(td), len);
+			sqe->user_data = send_user_data(mode, tuner_bucket(len), i);
 		}
+		if (first == cfg_nr_reqs)
+			goto next;
 
 		if (cfg_defer_taskrun && compl_cqes >= notif_slack)
 			ret = io_uring_submit_and_get_events(&ring);
 		else
 			ret = io_uring_submit(&ring);
 
-		if (ret != cfg_nr_reqs)
+		if (ret != cfg_nr_reqs - first)
 			t_error(1, ret, "submit");
 
-		for (i = 0; i < cfg_nr_reqs; i++) {
+		for (i = first; i < cfg_nr_reqs; i++) {
 			cqe = wait_cqe_fast(&ring);
 
 			if (cqe->flags & IORING_CQE_F_NOTIF) {
-				if (cqe->flags & IORING_CQE_F_MORE)
-					t_error(1, -EINVAL, "F_MORE notif");
+				handle_notif(td, &tuner, cqe);
 				compl_cqes--;
 				i--;
 				io_uring_cqe_seen(&ring, cqe);
@@ -455,24 +744,18 @@ static void do_tx(struct thread_data *td, int domain, int type, int protocol)
 			if (cqe->flags & IORING_CQE_F_MORE)
 				compl_cqes++;
 
-			if (cqe->res >= 0) {
-				td->packets++;
-				td->bytes += cqe->res;
-			} else if (cqe->res == -ECONNREFUSED || cqe->res == -EPIPE ||
-				   cqe->res == -ECONNRESET) {
-				printf("Connection failure %i\n", cqe->res);
+			if (handle_send_res(td, cqe))
 				goto out_fail;
-			} else if (cqe->res != -EAGAIN) {
-				t_error(1, cqe->res, "send failed");
-			}
 			io_uring_cqe_seen(&ring, cqe);
 		}
+next:
 		if (should_stop)
 			break;
 	} while ((++loop % 16 != 0) || gettimeofday_ms() < tstart + cfg_runtime_ms);
 
 out_fail:
 	td->dt_ms = gettimeofday_ms() - tstart;
+	td->zc_threshold = tuner_threshold(&tuner);
 
 	shutdown(fd, SHUT_RDWR);
 	if (close(fd))
@@ -511,6 +794,8 @@ static void usage(const char *filepath)
 	printf("  -s <size>\tBytes per request\n");
 	printf("  -n <nr>\tNumber of parallel requests\n");
 	printf("  -z <mode>\tZerocopy mode, 0 to disable, enabled otherwise\n");
+	printf("  -A\t\tAdaptively pick copy or zerocopy send per request\n");
+	printf("  -m <size>\tRandom request sizes between <size> and -s\n");
 	printf("  -b <mode>\tUse registered buffers\n");
 	printf("  -l <mode>\tUse huge pages\n");
 	printf("  -d\t\tUse defer taskrun\n");
@@ -537,7 +822,7 @@ static void parse_opts(int argc, char **argv)
 
 	cfg_payload_len = max_udp_payload_len;
 
-	while ((c = getopt(argc, argv, "46D:p:s:t:n:z:I:b:l:dC:T:Ryv")) != -1) {
+	while ((c = getopt(argc, argv, "46D:p:s:t:n:z:I:b:l:dC:T:RyvAm:")) != -1) {
 		switch (c) {
 		case '4':
 			if (cfg_family != PF_UNSPEC)
@@ -598,6 +883,12 @@ static void parse_opts(int argc, char **argv)
 		case 'y':
 			cfg_rx_poll = 1;
 			break;
+		case 'A':
+			cfg_adaptive = true;
+			break;
+		case 'm':
+			cfg_min_payload_len = strtoul(optarg, NULL, 0);
+			break;
 		}
 	}
 
@@ -626,6 +917,13 @@ static void parse_opts(int argc, char **argv)
 			t_error(1, 0, "Server mode doesn't support data verification");
 	}
 
+	if (cfg_min_payload_len) {
+		if (cfg_type != SOCK_STREAM)
+			t_error(1, 0, "-m: random sizes are only supported for tcp");
+		if (cfg_min_payload_len > cfg_payload_len)
+			t_error(1, 0, "-m: min size exceeds -s");
+	}
+
 	if (cfg_type == SOCK_DGRAM && cfg_payload_len > max_udp_payload_len)
 		t_error(1, 0, "-s: UDP payload exceeds max (%d)", max_udp_payload_len);
 
@@ -662,8 +960,11 @@ int main(int argc, char **argv)
 {
 	unsigned long long tsum = 0;
 	unsigned long long packets = 0, bytes = 0;
+	unsigned long long mode_reqs[NR_SEND_MODES] = { };
+	unsigned long long mode_bytes[NR_SEND_MODES] = { };
+	unsigned long long zc_copied = 0;
 	struct thread_data *td;
-	unsigned int i;
+	unsigned int i, j;
 	void *res;
 
 	page_size = sysconf(_SC_PAGESIZE);
@@ -698,6 +999,11 @@ int main(int argc, char **argv)
 		packets += td->packets;
 		bytes += td->bytes;
 		tsum += td->dt_ms;
+		for (j = 0; j < NR_SEND_MODES; j++) {
+			mode_reqs[j] += td->mode_reqs[j];
+			mode_bytes[j] += td->mode_bytes[j];
+		}
+		zc_copied += td->zc_copied;
 	}
 	tsum = tsum / cfg_nr_threads;
 
@@ -710,6 +1016,25 @@ int main(int argc, char **argv)
 			(bytes >> 20) * 1000 / tsum);
 	}
 
+	if (!cfg_rx && packets) {
+		printf("mode mix:");
+		for (j = 0; j < NR_SEND_MODES; j++)
+			printf(" %s=%llu%% (MB=%llu)", send_mode_names[j],
+				mode_reqs[j] * 100 / packets, mode_bytes[j] >> 20);
+		printf("\n");
+	}
+	if (cfg_adaptive && !cfg_rx) {
+		printf("zc notifications reporting a copy: %llu\n", zc_copied);
+		for (i = 0; i < cfg_nr_threads; i++) {
+			td = &threads[i];
+			if (td->zc_threshold)
+				printf("thread %u: zerocopy from %u bytes\n",
+					i, td->zc_threshold);
+			else
+				printf("thread %u: copy for all sizes\n", i);
+		}
+	}
+
 	if (payload)
 		munmap(payload, alloc_size);
 	pthread_barrier_destroy(&barrier);
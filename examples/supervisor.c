@@ -0,0 +1,618 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Process supervisor that spawns children with posix_spawn(), which glibc
+ * does with a vfork style clone, holds a pidfd for each and reaps it with
+ * IORING_OP_WAITID on that pidfd, so there is no SIGCHLD handling and no
+ * waitpid() loop. The stdout and stderr pipes of each child are read with
+ * multishot reads into a provided buffer ring, a child is done once it has
+ * been reaped and both of its pipes have hit EOF.
+ *
+ * It runs 'count' children of the command, /bin/echo by default, with at
+ * most 'jobs' at a time, and prints a line of key=value pairs with the
+ * spawn and reap throughput for each mode:
+ *
+ *   ring	as above
+ *   poll	the usual loop for comparison, SIGCHLD through a signalfd and
+ *		poll() on it and the pipes, with waitpid(WNOHANG) until no more
+ *		children are left to reap
+ *
+ * -o passes the output of the children through to ours, otherwise it is
+ * only counted. In ring mode, -t kills children still running after that
+ * many msec with pidfd_send_signal(), the wait has a linked timeout and is
+ * requeued once the child has been sent SIGKILL.
+ *
+ * Usage: ./supervisor [-m ring|poll] [-n count] [-j jobs] [-t msec] [-o]
+ *		       [-- command [args]]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+#ifndef P_PIDFD
+#define P_PIDFD			3
+#endif
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal	424
+#endif
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open		434
+#endif
+
+#define BUF_SIZE	4096
+#define NR_BUFS		256
+#define BGID		0
+
+extern char **environ;
+
+enum mode {
+	MODE_RING,
+	MODE_POLL,
+	NR_MODES,
+};
+
+static const char *mode_names[] = { "ring", "poll" };
+
+/* in the low bits of the user_data, child structs are aligned past them */
+enum {
+	TAG_STDOUT,
+	TAG_STDERR,
+	TAG_WAITID,
+	TAG_TIMEOUT,
+	TAG_MASK	= 3,
+};
+
+enum {
+	STREAM_OUT,
+	STREAM_ERR,
+	NR_STREAMS,
+};
+
+struct child {
+	pid_t pid;
+	int pidfd;
+	/* read ends of the stdout and stderr pipes, -1 once at EOF */
+	int fds[NR_STREAMS];
+	/* pipes not at EOF, and whether it has been reaped */
+	int pending;
+	bool killed;
+	siginfo_t info;
+};
+
+static unsigned long nr_children = 1000;
+static unsigned int nr_jobs = 16;
+static unsigned int timeout_ms;
+static bool forward;
+static char *default_argv[] = { "/bin/echo", "supervised", NULL };
+static char **cmd_argv = default_argv;
+
+static struct child *children;
+static unsigned int *free_slots;
+static unsigned int nr_free;
+
+static struct {
+	unsigned long reaped;
+	unsigned long failed;
+	unsigned long killed;
+	unsigned long long bytes;
+} stats;
+
+static int pidfd_open(pid_t pid)
+{
+	return syscall(__NR_pidfd_open, pid, 0);
+}
+
+static int pidfd_send_signal(int pidfd, int sig)
+{
+	return syscall(__NR_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+/*
+ * Start 'c' with its stdout and stderr on new pipes. SIGCHLD may be
+ * blocked here, so the child gets an empty mask rather than ours. If that
+ * fails, nothing is left open and the child counts as failed.
+ */
+static int spawn_child(struct child *c)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	int pipes[NR_STREAMS][2];
+	sigset_t mask;
+	int i, ret;
+
+	/* only set if the spawn succeeds, poll mode looks children up by it */
+	c->pid = 0;
+	for (i = 0; i < NR_STREAMS; i++) {
+		if (pipe2(pipes[i], O_CLOEXEC) < 0) {
+			perror("pipe2");
+			while (i--) {
+				close(pipes[i][0]);
+				close(pipes[i][1]);
+			}
+			stats.failed++;
+			return 1;
+		}
+	}
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, pipes[STREAM_OUT][1],
+					 STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, pipes[STREAM_ERR][1],
+					 STDERR_FILENO);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	ret = posix_spawnp(&c->pid, cmd_argv[0], &fa, &attr, cmd_argv,
+			   environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	for (i = 0; i < NR_STREAMS; i++)
+		close(pipes[i][1]);
+	if (ret) {
+		fprintf(stderr, "spawn %s: %s\n", cmd_argv[0], strerror(ret));
+		for (i = 0; i < NR_STREAMS; i++)
+			close(pipes[i][0]);
+		stats.failed++;
+		return 1;
+	}
+	for (i = 0; i < NR_STREAMS; i++)
+		c->fds[i] = pipes[i][0];
+	c->pidfd = -1;
+	c->pending = NR_STREAMS + 1;
+	c->killed = false;
+	return 0;
+}
+
+static void output(int stream, const void *data, size_t len)
+{
+	stats.bytes += len;
+	if (forward && write(stream == STREAM_OUT ? STDOUT_FILENO :
+			     STDERR_FILENO, data, len) < 0)
+		perror("write");
+}
+
+/* 'code' and 'status' as in the siginfo from waitid() */
+static void reaped(struct child *c, int code, int status)
+{
+	stats.reaped++;
+	if (c->killed && code == CLD_KILLED)
+		stats.killed++;
+	else if (code != CLD_EXITED || status)
+		stats.failed++;
+}
+
+/* the child has been reaped and its pipes drained, free its slot */
+static void child_done(struct child *c)
+{
+	free_slots[nr_free++] = c - children;
+}
+
+static struct io_uring_sqe *get_sqe(struct io_uring *ring)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+	if (!sqe) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+	}
+	return sqe;
+}
+
+static void queue_read(struct io_uring *ring, struct child *c, int stream)
+{
+	struct io_uring_sqe *sqe = get_sqe(ring);
+
+	io_uring_prep_read_multishot(sqe, c->fds[stream], 0, 0, BGID);
+	io_uring_sqe_set_data64(sqe, (uintptr_t) c | stream);
+}
+
+static void queue_waitid(struct io_uring *ring, struct child *c, bool timed)
+{
+	static struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe = get_sqe(ring);
+
+	io_uring_prep_waitid(sqe, P_PIDFD, c->pidfd, &c->info, WEXITED, 0);
+	io_uring_sqe_set_data64(sqe, (uintptr_t) c | TAG_WAITID);
+	if (!timed)
+		return;
+
+	/* cancels the wait with -ECANCELED if it fires */
+	sqe->flags |= IOSQE_IO_LINK;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000ULL;
+	sqe = get_sqe(ring);
+	io_uring_prep_link_timeout(sqe, &ts, 0);
+	io_uring_sqe_set_data64(sqe, TAG_TIMEOUT);
+}
+
+static int ring_start_child(struct io_uring *ring)
+{
+	struct child *c = &children[free_slots[--nr_free]];
+	int i;
+
+	/* on to the next one */
+	if (spawn_child(c)) {
+		child_done(c);
+		return 0;
+	}
+	/* nobody else reaps, so the pid can't have been reused yet */
+	c->pidfd = pidfd_open(c->pid);
+	if (c->pidfd < 0) {
+		perror("pidfd_open");
+		return 1;
+	}
+	queue_waitid(ring, c, timeout_ms);
+	for (i = 0; i < NR_STREAMS; i++)
+		queue_read(ring, c, i);
+	return 0;
+}
+
+static int handle_read(struct io_uring *ring, struct io_uring_buf_ring *br,
+		       char *bufs, struct child *c, int stream,
+		       struct io_uring_cqe *cqe)
+{
+	unsigned int bid;
+
+	if (cqe->res > 0) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		output(stream, bufs + bid * BUF_SIZE, cqe->res);
+		io_uring_buf_ring_add(br, bufs + bid * BUF_SIZE, BUF_SIZE, bid,
+				      io_uring_buf_ring_mask(NR_BUFS), 0);
+		io_uring_buf_ring_advance(br, 1);
+		/* terminated, like when it ran out of buffers */
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			queue_read(ring, c, stream);
+		return 0;
+	}
+	if (cqe->res == -ENOBUFS) {
+		queue_read(ring, c, stream);
+		return 0;
+	}
+	if (cqe->res < 0) {
+		fprintf(stderr, "read: %s\n", strerror(-cqe->res));
+		return 1;
+	}
+
+	/* EOF, the last CQE of the multishot read */
+	close(c->fds[stream]);
+	c->fds[stream] = -1;
+	if (!--c->pending)
+		child_done(c);
+	return 0;
+}
+
+static int handle_waitid(struct io_uring *ring, struct child *c,
+			 struct io_uring_cqe *cqe)
+{
+	if (cqe->res == -ECANCELED) {
+		/* timed out, kill it and wait for it again */
+		if (pidfd_send_signal(c->pidfd, SIGKILL) < 0 && errno != ESRCH) {
+			perror("pidfd_send_signal");
+			return 1;
+		}
+		c->killed = true;
+		queue_waitid(ring, c, false);
+		return 0;
+	}
+	if (cqe->res < 0) {
+		fprintf(stderr, "waitid: %s\n", strerror(-cqe->res));
+		return 1;
+	}
+
+	reaped(c, c->info.si_code, c->info.si_status);
+	close(c->pidfd);
+	c->pidfd = -1;
+	if (!--c->pending)
+		child_done(c);
+	return 0;
+}
+
+static int run_ring(void)
+{
+	struct io_uring_buf_ring *br;
+	struct io_uring_cqe *cqe;
+	struct io_uring ring;
+	unsigned long started = 0;
+	unsigned int head, nr, i;
+	char *bufs;
+	int ret;
+
+	/* a wait, a timeout and two reads for each child */
+	ret = io_uring_queue_init(nr_jobs * 4, &ring,
+				  IORING_SETUP_SINGLE_ISSUER |
+				  IORING_SETUP_DEFER_TASKRUN);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+	br = io_uring_setup_buf_ring(&ring, NR_BUFS, BGID, 0, &ret);
+	if (!br) {
+		fprintf(stderr, "setup_buf_ring: %s\n", strerror(-ret));
+		return 1;
+	}
+	bufs = malloc(NR_BUFS * BUF_SIZE);
+	if (!bufs)
+		return 1;
+	for (i = 0; i < NR_BUFS; i++)
+		io_uring_buf_ring_add(br, bufs + i * BUF_SIZE, BUF_SIZE, i,
+				      io_uring_buf_ring_mask(NR_BUFS), i);
+	io_uring_buf_ring_advance(br, NR_BUFS);
+
+	while (started < nr_children || nr_free < nr_jobs) {
+		while (nr_free && started < nr_children) {
+			if (ring_start_child(&ring))
+				return 1;
+			started++;
+		}
+		/* all of them failed to spawn */
+		if (nr_free == nr_jobs)
+			continue;
+
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			return 1;
+		}
+
+		nr = 0;
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			uintptr_t data = cqe->user_data;
+			struct child *c = (struct child *) (data & ~TAG_MASK);
+			int tag = data & TAG_MASK;
+
+			nr++;
+			if (tag == TAG_TIMEOUT)
+				continue;
+			if (tag == TAG_WAITID)
+				ret = handle_waitid(&ring, c, cqe);
+			else
+				ret = handle_read(&ring, br, bufs, c, tag, cqe);
+			if (ret)
+				return 1;
+		}
+		io_uring_cq_advance(&ring, nr);
+	}
+
+	io_uring_free_buf_ring(&ring, br, NR_BUFS, BGID);
+	io_uring_queue_exit(&ring);
+	free(bufs);
+	return 0;
+}
+
+static int poll_read(struct child *c, int stream, char *buf)
+{
+	ssize_t ret;
+
+	ret = read(c->fds[stream], buf, BUF_SIZE);
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		perror("read");
+		return 1;
+	}
+	if (ret) {
+		output(stream, buf, ret);
+		return 0;
+	}
+	close(c->fds[stream]);
+	c->fds[stream] = -1;
+	if (!--c->pending)
+		child_done(c);
+	return 0;
+}
+
+/* reap everything that has exited, SIGCHLD signals can coalesce */
+static int poll_reap(void)
+{
+	struct child *c;
+	unsigned int i;
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < nr_jobs; i++) {
+			if (children[i].pid == pid)
+				break;
+		}
+		if (i == nr_jobs) {
+			fprintf(stderr, "reaped unknown pid %d\n", pid);
+			return 1;
+		}
+		c = &children[i];
+		c->pid = 0;
+		if (WIFEXITED(status))
+			reaped(c, CLD_EXITED, WEXITSTATUS(status));
+		else
+			reaped(c, CLD_KILLED, WTERMSIG(status));
+		if (!--c->pending)
+			child_done(c);
+	}
+	if (pid < 0 && errno != ECHILD) {
+		perror("waitpid");
+		return 1;
+	}
+	return 0;
+}
+
+static int run_poll(void)
+{
+	struct pollfd *pfds;
+	struct signalfd_siginfo si;
+	unsigned long started = 0;
+	unsigned int i, j, nr;
+	sigset_t mask, old;
+	char *buf;
+	int sfd, ret = 1;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &old);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (sfd < 0) {
+		perror("signalfd");
+		return 1;
+	}
+	pfds = calloc(nr_jobs * NR_STREAMS + 1, sizeof(*pfds));
+	buf = malloc(BUF_SIZE);
+	if (!pfds || !buf)
+		return 1;
+
+	while (started < nr_children || nr_free < nr_jobs) {
+		while (nr_free && started < nr_children) {
+			struct child *c = &children[free_slots[--nr_free]];
+
+			if (spawn_child(c))
+				child_done(c);
+			started++;
+		}
+		/* all of them failed to spawn */
+		if (nr_free == nr_jobs)
+			continue;
+
+		pfds[0].fd = sfd;
+		pfds[0].events = POLLIN;
+		nr = 1;
+		for (i = 0; i < nr_jobs; i++) {
+			for (j = 0; j < NR_STREAMS; j++) {
+				pfds[nr].fd = children[i].fds[j];
+				pfds[nr].events = POLLIN;
+				nr++;
+			}
+		}
+		/* negative fds, of free slots and closed pipes, are skipped */
+		if (poll(pfds, nr, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			goto out;
+		}
+
+		for (i = 0; i < nr_jobs; i++) {
+			for (j = 0; j < NR_STREAMS; j++) {
+				struct pollfd *p = &pfds[1 + i * NR_STREAMS + j];
+
+				if (p->fd >= 0 && p->revents &&
+				    poll_read(&children[i], j, buf))
+					goto out;
+			}
+		}
+		if (pfds[0].revents) {
+			while (read(sfd, &si, sizeof(si)) == sizeof(si))
+				;
+			if (poll_reap())
+				goto out;
+		}
+	}
+	ret = 0;
+out:
+	free(buf);
+	free(pfds);
+	close(sfd);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return ret;
+}
+
+static int run(enum mode mode)
+{
+	unsigned long long start, nsec;
+	unsigned int i;
+	int ret;
+
+	memset(&stats, 0, sizeof(stats));
+	for (i = 0; i < nr_jobs; i++) {
+		children[i].pid = 0;
+		children[i].pidfd = -1;
+		children[i].fds[STREAM_OUT] = -1;
+		children[i].fds[STREAM_ERR] = -1;
+		free_slots[i] = nr_jobs - 1 - i;
+	}
+	nr_free = nr_jobs;
+
+	start = now_ns();
+	if (mode == MODE_RING)
+		ret = run_ring();
+	else
+		ret = run_poll();
+	nsec = now_ns() - start;
+	if (ret)
+		return 1;
+
+	printf("mode=%s children=%lu jobs=%u spawns_per_sec=%.0f "
+		"usec_per_child=%.1f bytes=%llu failed=%lu killed=%lu\n",
+		mode_names[mode], stats.reaped, nr_jobs,
+		stats.reaped / (nsec / 1e9),
+		stats.reaped ? nsec / 1e3 / stats.reaped : 0.0,
+		stats.bytes, stats.failed, stats.killed);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, mode, only = -1;
+
+	while ((opt = getopt(argc, argv, "m:n:j:t:oh")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (only = 0; only < NR_MODES; only++)
+				if (!strcmp(optarg, mode_names[only]))
+					break;
+			if (only == NR_MODES) {
+				fprintf(stderr, "unknown mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			nr_children = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
+		case 't':
+			timeout_ms = atoi(optarg);
+			break;
+		case 'o':
+			forward = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-m ring|poll] [-n count] "
+					"[-j jobs] [-t msec] [-o] "
+					"[-- command [args]]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		cmd_argv = &argv[optind];
+	if (!nr_jobs || !nr_children) {
+		fprintf(stderr, "need at least 1 job and 1 child\n");
+		return 1;
+	}
+
+	children = calloc(nr_jobs, sizeof(*children));
+	free_slots = calloc(nr_jobs, sizeof(*free_slots));
+	if (!children || !free_slots)
+		return 1;
+
+	for (mode = 0; mode < NR_MODES; mode++) {
+		if (only >= 0 && mode != only)
+			continue;
+		if (run(mode))
+			return 1;
+	}
+	free(children);
+	free(free_slots);
+	return 0;
+}
@@ -0,0 +1,409 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Benchmark of the timer wheel in timer-wheel.c against a kernel timeout
+ * per timer, as used for per connection idle and read deadlines. Each mode
+ * arms 'timers' timers, due 'min' to 'max' msec out, pushes all of them
+ * back by rearming them to a new deadline as activity on a connection
+ * would, cancels one in 'cancel' and then runs until the rest have fired.
+ * A line of key=value pairs is printed for each mode:
+ *
+ *   wheel	the timers are in the wheel, ticked every 'tick' usec by one
+ *		multishot timeout
+ *   kernel	an IORING_OP_TIMEOUT per timer, rearmed with a timeout update
+ *		and cancelled with a timeout remove
+ *
+ * with the cost per add, rearm and cancel including submitting the SQEs
+ * for the kernel mode, how late timers fired on average and at most, and
+ * how many times the loop waited for CQEs while they did. The kernel finds
+ * the timeout to update or remove by walking all of them, so the kernel
+ * mode gets 'ktimers' timers, fewer by default.
+ *
+ * Usage: ./timer-bench [-m wheel|kernel] [-n timers] [-k ktimers]
+ *			[-t tick usec] [-d min msec] [-D max msec]
+ *			[-c cancel one in]
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "liburing.h"
+#include "timer-wheel.h"
+#include "helpers.h"
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define TICK_DATA	(-1ULL)
+#define UPDATE_DATA	(-2ULL)
+#define REMOVE_DATA	(-3ULL)
+
+enum mode {
+	MODE_WHEEL,
+	MODE_KERNEL,
+	NR_MODES,
+};
+
+static const char *mode_names[] = { "wheel", "kernel" };
+
+static unsigned long nr_timers = 1000000;
+static unsigned long nr_ktimers = 20000;
+static unsigned int tick_us = 1000;
+static unsigned int min_ms = 500;
+static unsigned int max_ms = 1500;
+static unsigned int cancel_one_in = 10;
+
+struct timer {
+	struct tw_timer tw;
+	unsigned long long deadline;
+	struct __kernel_timespec ts;
+};
+
+static struct timer *timers;
+
+static struct {
+	unsigned long fired;
+	unsigned long cancelled;
+	unsigned long early;
+	unsigned long waits;
+	unsigned long long late_ns;
+	unsigned long long max_late_ns;
+} stats;
+
+static unsigned long long rand_delay_ns(void)
+{
+	return (min_ms + random() % (max_ms - min_ms + 1)) * 1000000ULL;
+}
+
+static void fired(struct timer *t)
+{
+	unsigned long long now = now_ns();
+
+	stats.fired++;
+	if (now < t->deadline) {
+		stats.early++;
+		return;
+	}
+	stats.late_ns += now - t->deadline;
+	if (now - t->deadline > stats.max_late_ns)
+		stats.max_late_ns = now - t->deadline;
+}
+
+static void wheel_fn(struct tw_timer *tw)
+{
+	fired(container_of(tw, struct timer, tw));
+}
+
+static bool is_cancelled(unsigned long i)
+{
+	return cancel_one_in && !(i % cancel_one_in);
+}
+
+static void print_op(const char *name, unsigned long long nsec,
+		     unsigned long nr)
+{
+	printf(" %s_ns=%.1f", name, nr ? (double) nsec / nr : 0.0);
+}
+
+static int run_wheel(unsigned long n, unsigned long long ns[3])
+{
+	struct timer_wheel *w;
+	struct io_uring_cqe *cqe;
+	struct io_uring ring;
+	unsigned long long start;
+	unsigned int head, nr;
+	unsigned long i;
+	int ret;
+
+	ret = io_uring_queue_init(8, &ring, IORING_SETUP_SINGLE_ISSUER |
+					   IORING_SETUP_DEFER_TASKRUN);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+	w = malloc(sizeof(*w));
+	if (!w)
+		return 1;
+	tw_init(w, tick_us * 1000ULL);
+	tw_arm(w, &ring, TICK_DATA);
+	io_uring_submit(&ring);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		struct timer *t = &timers[i];
+		unsigned long long delay = rand_delay_ns();
+
+		tw_timer_init(&t->tw, wheel_fn);
+		t->deadline = now_ns() + delay;
+		tw_mod(w, &t->tw, tw_after(w, delay));
+	}
+	ns[0] = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		struct timer *t = &timers[i];
+		unsigned long long delay = rand_delay_ns();
+
+		t->deadline = now_ns() + delay;
+		tw_mod(w, &t->tw, tw_after(w, delay));
+	}
+	ns[1] = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (is_cancelled(i) && tw_del(w, &timers[i].tw))
+			stats.cancelled++;
+	}
+	ns[2] = now_ns() - start;
+
+	while (stats.fired + stats.cancelled < n) {
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			return 1;
+		}
+		stats.waits++;
+
+		nr = 0;
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			ret = tw_handle_cqe(w, &ring, cqe);
+			if (ret < 0) {
+				fprintf(stderr, "tick: %s\n", strerror(-ret));
+				return 1;
+			}
+			nr++;
+		}
+		io_uring_cq_advance(&ring, nr);
+	}
+
+	io_uring_queue_exit(&ring);
+	free(w);
+	return 0;
+}
+
+static void set_ts(struct timer *t)
+{
+	t->ts.tv_sec = t->deadline / 1000000000ULL;
+	t->ts.tv_nsec = t->deadline % 1000000000ULL;
+}
+
+static int kernel_reap(struct io_uring *ring)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, nr = 0;
+
+	io_uring_for_each_cqe(ring, head, cqe) {
+		nr++;
+		if (cqe->user_data == UPDATE_DATA ||
+		    cqe->user_data == REMOVE_DATA) {
+			/* fired before it was updated, the deadline is stale */
+			if (cqe->res == -ENOENT) {
+				fprintf(stderr, "timer fired before its rearm, "
+						"use fewer or later timers\n");
+				return 1;
+			}
+			if (cqe->res < 0)
+				goto err;
+			continue;
+		}
+		if (cqe->res == -ECANCELED) {
+			stats.cancelled++;
+			continue;
+		}
+		if (cqe->res != -ETIME)
+			goto err;
+		fired(&timers[cqe->user_data]);
+	}
+	io_uring_cq_advance(ring, nr);
+	return 0;
+err:
+	fprintf(stderr, "timeout: %s\n", strerror(-cqe->res));
+	return 1;
+}
+
+static struct io_uring_sqe *kernel_get_sqe(struct io_uring *ring)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+	if (!sqe) {
+		io_uring_submit(ring);
+		if (kernel_reap(ring))
+			return NULL;
+		sqe = io_uring_get_sqe(ring);
+	}
+	return sqe;
+}
+
+static int run_kernel(unsigned long n, unsigned long long ns[3])
+{
+	struct io_uring_params p = { };
+	struct io_uring_sqe *sqe;
+	struct io_uring ring;
+	unsigned long long start;
+	unsigned long i;
+	int ret;
+
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+		  IORING_SETUP_CQSIZE;
+	p.cq_entries = 65536;
+	ret = io_uring_queue_init_params(4096, &ring, &p);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		struct timer *t = &timers[i];
+
+		t->deadline = now_ns() + rand_delay_ns();
+		set_ts(t);
+		sqe = kernel_get_sqe(&ring);
+		if (!sqe)
+			return 1;
+		io_uring_prep_timeout(sqe, &t->ts, 0, IORING_TIMEOUT_ABS);
+		io_uring_sqe_set_data64(sqe, i);
+	}
+	io_uring_submit(&ring);
+	ns[0] = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		struct timer *t = &timers[i];
+
+		t->deadline = now_ns() + rand_delay_ns();
+		set_ts(t);
+		sqe = kernel_get_sqe(&ring);
+		if (!sqe)
+			return 1;
+		io_uring_prep_timeout_update(sqe, &t->ts, i,
+					     IORING_TIMEOUT_ABS);
+		io_uring_sqe_set_data64(sqe, UPDATE_DATA);
+	}
+	io_uring_submit(&ring);
+	ns[1] = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (!is_cancelled(i))
+			continue;
+		sqe = kernel_get_sqe(&ring);
+		if (!sqe)
+			return 1;
+		io_uring_prep_timeout_remove(sqe, i, 0);
+		io_uring_sqe_set_data64(sqe, REMOVE_DATA);
+	}
+	io_uring_submit(&ring);
+	ns[2] = now_ns() - start;
+
+	while (stats.fired + stats.cancelled < n) {
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			return 1;
+		}
+		stats.waits++;
+		if (kernel_reap(&ring))
+			return 1;
+	}
+
+	io_uring_queue_exit(&ring);
+	return 0;
+}
+
+static int run(enum mode mode)
+{
+	unsigned long n = mode == MODE_WHEEL ? nr_timers : nr_ktimers;
+	unsigned long long ns[3], start, nsec;
+	int ret;
+
+	memset(&stats, 0, sizeof(stats));
+	srandom(1);
+	start = now_ns();
+	if (mode == MODE_WHEEL)
+		ret = run_wheel(n, ns);
+	else
+		ret = run_kernel(n, ns);
+	nsec = now_ns() - start;
+	if (ret)
+		return 1;
+	if (stats.early) {
+		fprintf(stderr, "%s: %lu timers fired early\n",
+			mode_names[mode], stats.early);
+		return 1;
+	}
+
+	printf("mode=%s timers=%lu fired=%lu cancelled=%lu", mode_names[mode],
+		n, stats.fired, stats.cancelled);
+	print_op("add", ns[0], n);
+	print_op("rearm", ns[1], n);
+	print_op("cancel", ns[2], stats.cancelled);
+	printf(" late_avg_us=%.1f late_max_us=%.1f waits=%lu run_ms=%llu\n",
+		stats.fired ? stats.late_ns / 1e3 / stats.fired : 0.0,
+		stats.max_late_ns / 1e3, stats.waits, nsec / 1000000);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, mode, only = -1;
+
+	while ((opt = getopt(argc, argv, "m:n:k:t:d:D:c:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (only = 0; only < NR_MODES; only++)
+				if (!strcmp(optarg, mode_names[only]))
+					break;
+			if (only == NR_MODES) {
+				fprintf(stderr, "unknown mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			nr_timers = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			nr_ktimers = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			tick_us = atoi(optarg);
+			break;
+		case 'd':
+			min_ms = atoi(optarg);
+			break;
+		case 'D':
+			max_ms = atoi(optarg);
+			break;
+		case 'c':
+			cancel_one_in = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-m wheel|kernel] [-n timers] "
+					"[-k ktimers] [-t tick usec] "
+					"[-d min msec] [-D max msec] "
+					"[-c cancel one in]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!tick_us || max_ms < min_ms) {
+		fprintf(stderr, "need a tick and min <= max\n");
+		return 1;
+	}
+
+	timers = calloc(nr_timers > nr_ktimers ? nr_timers : nr_ktimers,
+			sizeof(*timers));
+	if (!timers)
+		return 1;
+
+	for (mode = 0; mode < NR_MODES; mode++) {
+		if (only >= 0 && mode != only)
+			continue;
+		if (run(mode))
+			return 1;
+	}
+	free(timers);
+	return 0;
+}
@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Hierarchical timer wheel ticked by a multishot timeout, see
+ * timer-wheel.h.
+ */
+#include <errno.h>
+#include <string.h>
+
+#include "timer-wheel.h"
+#include "helpers.h"
+
+/* as far out as the top level reaches, later timers are parked there */
+#define TW_MAX_DELTA	((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+
+void tw_init(struct timer_wheel *w, unsigned long long tick_ns)
+{
+	memset(w, 0, sizeof(*w));
+	w->tick_ns = tick_ns;
+	w->start_ns = now_ns();
+	w->ts.tv_sec = tick_ns / 1000000000ULL;
+	w->ts.tv_nsec = tick_ns % 1000000000ULL;
+}
+
+uint64_t tw_clock(struct timer_wheel *w)
+{
+	return (now_ns() - w->start_ns) / w->tick_ns;
+}
+
+/*
+ * The clock may be just short of the next tick, so a timer due on tick
+ * 'clock + 1 + ceil(ns / tick)' fires at least 'ns' from now.
+ */
+uint64_t tw_after(struct timer_wheel *w, unsigned long long ns)
+{
+	return tw_clock(w) + 1 + (ns + w->tick_ns - 1) / w->tick_ns;
+}
+
+static void tw_link(struct tw_timer **head, struct tw_timer *t)
+{
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+}
+
+static void tw_unlink(struct tw_timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->pprev = NULL;
+}
+
+/*
+ * The slot for 't', in the lowest level that reaches its expiry. Expired
+ * timers go in the slot of the next tick to run.
+ */
+static struct tw_timer **tw_slot(struct timer_wheel *w, uint64_t expires)
+{
+	uint64_t delta = expires - w->tick;
+	int level;
+
+	if ((int64_t) delta < 0)
+		return &w->slots[0][w->tick & TW_MASK];
+	if (delta > TW_MAX_DELTA) {
+		delta = TW_MAX_DELTA;
+		expires = w->tick + delta;
+	}
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < 1ULL << (TW_BITS * (level + 1)))
+			break;
+	}
+	return &w->slots[level][(expires >> (TW_BITS * level)) & TW_MASK];
+}
+
+void tw_mod(struct timer_wheel *w, struct tw_timer *t, uint64_t expires)
+{
+	if (tw_pending(t))
+		tw_unlink(t);
+	else
+		w->nr_pending++;
+	t->expires = expires;
+	tw_link(tw_slot(w, expires), t);
+}
+
+bool tw_del(struct timer_wheel *w, struct tw_timer *t)
+{
+	if (!tw_pending(t))
+		return false;
+	tw_unlink(t);
+	w->nr_pending--;
+	return true;
+}
+
+/*
+ * Move the timers of the current slot of 'level' down, now that the levels
+ * below have wrapped around to it. Returns the slot index, the level above
+ * needs cascading too when it's 0.
+ */
+static unsigned int tw_cascade(struct timer_wheel *w, int level)
+{
+	unsigned int idx = (w->tick >> (TW_BITS * level)) & TW_MASK;
+	struct tw_timer *t, *next;
+
+	t = w->slots[level][idx];
+	w->slots[level][idx] = NULL;
+	for (; t; t = next) {
+		next = t->next;
+		tw_link(tw_slot(w, t->expires), t);
+	}
+	return idx;
+}
+
+unsigned long tw_run(struct timer_wheel *w, uint64_t now)
+{
+	struct tw_timer *head, *t;
+	unsigned long fired = 0;
+	unsigned int idx;
+	int level;
+
+	while ((int64_t) (now - w->tick) >= 0) {
+		/* nothing to cascade or run, skip ahead */
+		if (!w->nr_pending) {
+			w->tick = now + 1;
+			break;
+		}
+
+		idx = w->tick & TW_MASK;
+		if (!idx) {
+			for (level = 1; level < TW_LEVELS; level++) {
+				if (tw_cascade(w, level))
+					break;
+			}
+		}
+
+		/*
+		 * Run from a list of our own, and only once the tick has
+		 * moved on, so timers added from the callbacks with an expiry
+		 * of now go to the next tick rather than this list.
+		 */
+		head = w->slots[0][idx];
+		w->slots[0][idx] = NULL;
+		if (head)
+			head->pprev = &head;
+		w->tick++;
+		while ((t = head) != NULL) {
+			tw_unlink(t);
+			w->nr_pending--;
+			t->fn(t);
+			fired++;
+		}
+	}
+	return fired;
+}
+
+int tw_arm(struct timer_wheel *w, struct io_uring *ring, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(ring);
+	if (!sqe) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+		if (!sqe)
+			return -EBUSY;
+	}
+	/* a count of 0 keeps it going until cancelled */
+	io_uring_prep_timeout(sqe, &w->ts, 0, IORING_TIMEOUT_MULTISHOT);
+	io_uring_sqe_set_data64(sqe, user_data);
+	w->user_data = user_data;
+	return 0;
+}
+
+int tw_handle_cqe(struct timer_wheel *w, struct io_uring *ring,
+		  struct io_uring_cqe *cqe)
+{
+	int ret;
+
+	if (cqe->res != -ETIME)
+		return cqe->res < 0 ? cqe->res : -EINVAL;
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		ret = tw_arm(w, ring, w->user_data);
+		if (ret)
+			return ret;
+	}
+	return tw_run(w, tw_clock(w));
+}
@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef LIBURING_EX_TIMER_WHEEL_H
+#define LIBURING_EX_TIMER_WHEEL_H
+
+/*
+ * Hierarchical timer wheel in userspace, driven by a single multishot
+ * IORING_OP_TIMEOUT that fires every tick, in place of a kernel timeout per
+ * deadline. Adding, rearming and cancelling a timer is O(1) and doesn't
+ * touch the ring. There are TW_LEVELS levels of TW_SIZE slots, level 0 has
+ * a slot per tick and each level above one per TW_SIZE slots of the one
+ * below. Timers are hashed into the level covering how far out they are,
+ * and moved down a level when the one below wraps around, as the classic
+ * Linux timer wheel did.
+ *
+ * Timers fire on the first tick at or after their expiry, so the wheel is
+ * for coarse deadlines, like idle and read timeouts that keep getting
+ * pushed back. Deadlines that need better than tick precision are better
+ * off with their own kernel timeout.
+ *
+ * Times are in ticks since tw_init(), by CLOCK_MONOTONIC, and tick CQEs
+ * only wake the loop up, the clock decides what has expired. So late or
+ * coalesced tick CQEs don't make timers drift.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "liburing.h"
+
+#define TW_BITS		8
+#define TW_SIZE		(1U << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+
+struct tw_timer {
+	struct tw_timer *next;
+	/* NULL when the timer isn't pending */
+	struct tw_timer **pprev;
+	uint64_t expires;
+	/* called from tw_run(), may add or cancel any timer */
+	void (*fn)(struct tw_timer *t);
+};
+
+struct timer_wheel {
+	/* the next tick to run */
+	uint64_t tick;
+	unsigned long long tick_ns;
+	unsigned long long start_ns;
+	unsigned long nr_pending;
+	/* of the tick timeout, for requeueing it */
+	uint64_t user_data;
+	struct __kernel_timespec ts;
+	struct tw_timer *slots[TW_LEVELS][TW_SIZE];
+};
+
+void tw_init(struct timer_wheel *w, unsigned long long tick_ns);
+
+/* the current tick, by the clock */
+uint64_t tw_clock(struct timer_wheel *w);
+
+/* the tick on which a timer 'ns' from now is due, never earlier */
+uint64_t tw_after(struct timer_wheel *w, unsigned long long ns);
+
+static inline void tw_timer_init(struct tw_timer *t,
+				 void (*fn)(struct tw_timer *t))
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+	t->fn = fn;
+}
+
+static inline bool tw_pending(const struct tw_timer *t)
+{
+	return t->pprev != NULL;
+}
+
+/* (re)arm 't' to fire at tick 'expires', whether pending or not */
+void tw_mod(struct timer_wheel *w, struct tw_timer *t, uint64_t expires);
+
+/* returns true if 't' was pending */
+bool tw_del(struct timer_wheel *w, struct tw_timer *t);
+
+/* run all timers due up to and including tick 'now', returns how many */
+unsigned long tw_run(struct timer_wheel *w, uint64_t now);
+
+/*
+ * Queue the multishot timeout that ticks the wheel, with 'user_data'. The
+ * caller submits it.
+ */
+int tw_arm(struct timer_wheel *w, struct io_uring *ring, uint64_t user_data);
+
+/*
+ * Handle a CQE of the tick timeout, running what has expired and queueing
+ * the timeout again if it stopped. Returns the number of timers run, or
+ * -errno if the timeout failed.
+ */
+int tw_handle_cqe(struct timer_wheel *w, struct io_uring *ring,
+		  struct io_uring_cqe *cqe);
+
+#endif
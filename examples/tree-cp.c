@@ -0,0 +1,892 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Copies a directory tree, with everything but the directory listing done
+ * through io_uring:
+ *
+ *   - Every entry is looked at with IORING_OP_STATX
+ *   - Directories are created with IORING_OP_MKDIRAT, and their entries
+ *     are only created once that has completed
+ *   - Symlinks are created with IORING_OP_SYMLINKAT
+ *   - Regular files are copied with a single link chain each, made of two
+ *     IORING_OP_OPENAT into direct descriptors, a read_fixed/write_fixed
+ *     pair per chunk into a registered buffer, and two IORING_OP_CLOSE.
+ *     If the buffers can't be registered, plain reads and writes are used.
+ *     Large files take more than one chain, the files stay open across
+ *     them. Only the last request in a chain posts a completion, unless
+ *     something fails. A short read or write breaks the chain too.
+ *   - With -x, extended attributes are copied with IORING_OP_FGETXATTR and
+ *     IORING_OP_FSETXATTR, between the last write and the closes. Those of
+ *     directories are copied by path, with IORING_OP_GETXATTR and
+ *     IORING_OP_SETXATTR, before they are listed.
+ *
+ * Directories are listed with readdir(3), and xattr names with
+ * llistxattr(2), as there are no io_uring requests for either. File modes
+ * are preserved. Directories are created writable by their owner so their
+ * entries can be, and get their own mode with chmod(2) once the whole tree
+ * is copied, as cp -r does. Ownership and timestamps are not preserved,
+ * there are no requests for setting those either.
+ *
+ * A global budget limits how many statx, mkdirat and symlinkat requests
+ * and file copies are in flight at once.
+ *
+ * Usage: ./tree-cp [-q budget] [-b chunk size] [-x] <source> <dest>
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+/* chunks per link chain, larger files take more chains */
+#define CHAIN_CHUNKS	16
+#define MAX_XATTRS	16
+#define XATTR_VAL_SIZE	4096
+
+/* set in the user_data of the request expected to end a chain */
+#define LAST_TAG	1UL
+
+enum {
+	KIND_ENTRY = 1,
+	KIND_COPY,
+};
+
+enum {
+	ENTRY_STATX,
+	ENTRY_CREATE,
+	ENTRY_XATTR_GET,
+	ENTRY_XATTR_SET,
+};
+
+struct xattrs {
+	char *names;
+	int nr;
+	const char *name[MAX_XATTRS];
+	int len[MAX_XATTRS];
+	char *vals;
+};
+
+struct entry {
+	int kind;
+	int state;
+	char *src;
+	char *dst;
+	struct statx stx;
+	struct entry *next;
+
+	/* directories only, while their xattrs are copied */
+	struct xattrs *x;
+	int pending;
+	int err;
+};
+
+struct entry_queue {
+	struct entry *head, *tail;
+};
+
+enum {
+	COPY_DATA,
+	COPY_XATTR_GET,
+	COPY_XATTR_SET,
+	COPY_CLEANUP,
+};
+
+/* a file copy in flight, it owns direct descriptors 2*idx and 2*idx+1 */
+struct copy {
+	int kind;
+	int idx;
+	int state;
+	struct entry *e;
+	unsigned long long off;
+	/* expected result of the request that ends the chain */
+	int last_res;
+	int pending;
+	bool failed;
+	struct xattrs x;
+};
+
+static unsigned int budget = 64;
+static unsigned int chunk = 128 * 1024;
+static bool copy_xattrs;
+/* cleared if the buffers can't be registered */
+static bool fixed_bufs = true;
+
+static struct io_uring ring;
+static char *bufs;
+static struct copy *copies;
+static int *free_copies;
+static int nr_free_copies;
+static unsigned int inflight;
+
+static struct entry_queue dirs, stats, files;
+/* directories to chmod at the end, the most recently listed first */
+static struct entry *modes;
+
+static struct {
+	unsigned long files;
+	unsigned long dirs;
+	unsigned long symlinks;
+	unsigned long skipped;
+	unsigned long long bytes;
+	unsigned long xattrs;
+	unsigned long errors;
+	unsigned long enters;
+	unsigned long sync_calls;
+} st;
+
+static void push(struct entry_queue *q, struct entry *e)
+{
+	e->next = NULL;
+	if (q->tail)
+		q->tail->next = e;
+	else
+		q->head = e;
+	q->tail = e;
+}
+
+static struct entry *pop(struct entry_queue *q)
+{
+	struct entry *e = q->head;
+
+	if (e) {
+		q->head = e->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	return e;
+}
+
+static void free_entry(struct entry *e)
+{
+	free(e->src);
+	free(e->dst);
+	free(e);
+}
+
+static char *path_join(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *p = malloc(len);
+
+	if (p)
+		snprintf(p, len, "%s/%s", dir, name);
+	return p;
+}
+
+static void error(const char *what, const char *path, int err)
+{
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(err));
+	st.errors++;
+}
+
+/* make sure the next 'nr' SQEs end up in the same submit */
+static void reserve_sqes(unsigned int nr)
+{
+	if (io_uring_sq_space_left(&ring) < nr) {
+		st.enters++;
+		io_uring_submit(&ring);
+	}
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+	if (!sqe) {
+		st.enters++;
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+	}
+	return sqe;
+}
+
+static void scan_dir(struct entry *d)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	st.sync_calls++;
+	dir = opendir(d->src);
+	if (!dir) {
+		error("opendir", d->src, errno);
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		struct entry *e;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			break;
+		e->kind = KIND_ENTRY;
+		e->src = path_join(d->src, de->d_name);
+		e->dst = path_join(d->dst, de->d_name);
+		push(&stats, e);
+	}
+	closedir(dir);
+}
+
+static void prep_statx(struct entry *e)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_statx(sqe, AT_FDCWD, e->src, AT_SYMLINK_NOFOLLOW,
+			    STATX_TYPE | STATX_MODE | STATX_SIZE, &e->stx);
+	io_uring_sqe_set_data(sqe, e);
+	inflight++;
+}
+
+static void prep_symlink(struct entry *e)
+{
+	char target[PATH_MAX];
+	struct io_uring_sqe *sqe;
+	ssize_t len;
+
+	st.sync_calls++;
+	len = readlink(e->src, target, sizeof(target) - 1);
+	if (len < 0) {
+		error("readlink", e->src, errno);
+		free_entry(e);
+		return;
+	}
+	target[len] = '\0';
+	/* the target is read when the request is issued, keep it around */
+	free(e->src);
+	e->src = strdup(target);
+
+	sqe = get_sqe();
+	io_uring_prep_symlinkat(sqe, e->src, AT_FDCWD, e->dst);
+	io_uring_sqe_set_data(sqe, e);
+	inflight++;
+}
+
+static void prep_mkdir(struct entry *e)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_mkdirat(sqe, AT_FDCWD, e->dst,
+			      (e->stx.stx_mode & 07777) | S_IRWXU);
+	io_uring_sqe_set_data(sqe, e);
+	inflight++;
+}
+
+/* the xattr names are only available synchronously */
+static int list_xattrs(const char *path, struct xattrs *x)
+{
+	char *p, *end;
+	ssize_t len;
+
+	x->nr = 0;
+	st.sync_calls++;
+	len = llistxattr(path, NULL, 0);
+	if (len <= 0)
+		return 0;
+	x->names = malloc(len);
+	if (!x->names)
+		return -ENOMEM;
+	len = llistxattr(path, x->names, len);
+	if (len < 0)
+		return -errno;
+	for (p = x->names, end = p + len; p < end; p += strlen(p) + 1) {
+		if (x->nr == MAX_XATTRS)
+			return -E2BIG;
+		x->name[x->nr++] = p;
+	}
+	return 0;
+}
+
+/*
+ * Get the xattrs of a directory that was just created, all linked so the
+ * completions with their lengths arrive in order. Returns false if there
+ * are none.
+ */
+static bool prep_dir_xattr_get(struct entry *e)
+{
+	struct io_uring_sqe *sqe;
+	struct xattrs *x;
+	int i, ret;
+
+	x = calloc(1, sizeof(*x));
+	if (!x) {
+		error("xattrs", e->src, ENOMEM);
+		return false;
+	}
+	ret = list_xattrs(e->src, x);
+	if (ret)
+		error("listxattr", e->src, -ret);
+	if (x->nr)
+		x->vals = malloc(x->nr * XATTR_VAL_SIZE);
+	if (!x->vals) {
+		free(x->names);
+		free(x);
+		return false;
+	}
+
+	e->x = x;
+	e->state = ENTRY_XATTR_GET;
+	e->pending = x->nr;
+	e->err = 0;
+	reserve_sqes(x->nr);
+	for (i = 0; i < x->nr; i++) {
+		sqe = get_sqe();
+		io_uring_prep_getxattr(sqe, x->name[i],
+				       x->vals + i * XATTR_VAL_SIZE, e->src,
+				       XATTR_VAL_SIZE);
+		if (i + 1 < x->nr)
+			sqe->flags |= IOSQE_IO_LINK;
+		io_uring_sqe_set_data(sqe, e);
+	}
+	inflight++;
+	return true;
+}
+
+static void prep_dir_xattr_set(struct entry *e)
+{
+	struct io_uring_sqe *sqe;
+	struct xattrs *x = e->x;
+	int i;
+
+	e->state = ENTRY_XATTR_SET;
+	e->pending = x->nr;
+	for (i = 0; i < x->nr; i++) {
+		sqe = get_sqe();
+		io_uring_prep_setxattr(sqe, x->name[i],
+				       x->vals + i * XATTR_VAL_SIZE, e->dst, 0,
+				       x->len[i]);
+		io_uring_sqe_set_data(sqe, e);
+	}
+}
+
+/* the directory exists, copy its xattrs if asked to and then list it */
+static void dir_created(struct entry *e)
+{
+	if (copy_xattrs && prep_dir_xattr_get(e))
+		return;
+	push(&dirs, e);
+}
+
+static void handle_dir_xattr(struct entry *e, int res)
+{
+	struct xattrs *x = e->x;
+
+	/* after a failed get, the rest complete with -ECANCELED */
+	if (res < 0 && !e->err)
+		e->err = res;
+	if (e->state == ENTRY_XATTR_GET)
+		x->len[x->nr - e->pending] = res;
+	if (--e->pending)
+		return;
+
+	if (e->state == ENTRY_XATTR_GET && !e->err) {
+		prep_dir_xattr_set(e);
+		return;
+	}
+	if (e->err)
+		error(e->state == ENTRY_XATTR_GET ? "getxattr" : "setxattr",
+		      e->src, -e->err);
+	else
+		st.xattrs += x->nr;
+	free(x->vals);
+	free(x->names);
+	free(x);
+	e->x = NULL;
+	inflight--;
+	push(&dirs, e);
+}
+
+/* statx is done, now create whatever it is */
+static void handle_statx(struct entry *e, int res)
+{
+	inflight--;
+	if (res < 0) {
+		error("statx", e->src, -res);
+		free_entry(e);
+		return;
+	}
+	e->state = ENTRY_CREATE;
+	switch (e->stx.stx_mode & S_IFMT) {
+	case S_IFREG:
+		push(&files, e);
+		return;
+	case S_IFDIR:
+		prep_mkdir(e);
+		return;
+	case S_IFLNK:
+		prep_symlink(e);
+		return;
+	default:
+		st.skipped++;
+		free_entry(e);
+		return;
+	}
+}
+
+/* the mkdirat or symlinkat for 'e' is done */
+static void handle_created(struct entry *e, int res)
+{
+	inflight--;
+	if (res < 0 && res != -EEXIST) {
+		error(S_ISDIR(e->stx.stx_mode) ? "mkdir" : "symlink", e->dst,
+		      -res);
+		free_entry(e);
+		return;
+	}
+	if (S_ISDIR(e->stx.stx_mode)) {
+		st.dirs++;
+		dir_created(e);
+	} else {
+		st.symlinks++;
+		free_entry(e);
+	}
+}
+
+static void prep_closes(struct copy *c)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	io_uring_prep_close_direct(sqe, 2 * c->idx);
+	sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	io_uring_sqe_set_data(sqe, c);
+
+	sqe = get_sqe();
+	io_uring_prep_close_direct(sqe, 2 * c->idx + 1);
+	io_uring_sqe_set_data64(sqe, (uintptr_t) c | LAST_TAG);
+}
+
+/*
+ * Queue the next link chain for a file: the opens if it's the first one,
+ * up to CHAIN_CHUNKS read/write pairs, and the closes if this is the end
+ * of the file and there are no xattrs to copy. Everything but the last
+ * request skips its completion on success.
+ */
+static void prep_data_chain(struct copy *c)
+{
+	unsigned long long size = c->e->stx.stx_size;
+	int src = 2 * c->idx, dst = src + 1;
+	char *buf = bufs + (size_t) c->idx * chunk;
+	struct io_uring_sqe *sqe = NULL;
+	unsigned int nr = 0, len = 0;
+	bool first = !c->off, closes;
+
+	while (nr < CHAIN_CHUNKS && c->off + (unsigned long long) nr * chunk < size)
+		nr++;
+	closes = c->off + (unsigned long long) nr * chunk >= size &&
+		 !c->x.nr;
+	reserve_sqes((first ? 2 : 0) + nr * 2 + (closes ? 2 : 0));
+
+	if (first) {
+		sqe = get_sqe();
+		io_uring_prep_openat_direct(sqe, AT_FDCWD, c->e->src, O_RDONLY,
+					    0, src);
+		sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data(sqe, c);
+
+		sqe = get_sqe();
+		io_uring_prep_openat_direct(sqe, AT_FDCWD, c->e->dst,
+					    O_WRONLY | O_CREAT | O_TRUNC,
+					    c->e->stx.stx_mode & 07777, dst);
+		sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data(sqe, c);
+		c->last_res = 0;
+	}
+
+	while (nr--) {
+		len = chunk;
+		if (c->off + len > size)
+			len = size - c->off;
+
+		sqe = get_sqe();
+		if (fixed_bufs)
+			io_uring_prep_read_fixed(sqe, src, buf, len, c->off, 0);
+		else
+			io_uring_prep_read(sqe, src, buf, len, c->off);
+		sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK |
+			      IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data(sqe, c);
+
+		sqe = get_sqe();
+		if (fixed_bufs)
+			io_uring_prep_write_fixed(sqe, dst, buf, len, c->off, 0);
+		else
+			io_uring_prep_write(sqe, dst, buf, len, c->off);
+		sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK |
+			      IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data(sqe, c);
+		c->off += len;
+		c->last_res = len;
+	}
+
+	if (closes) {
+		prep_closes(c);
+		c->last_res = 0;
+		c->state = COPY_CLEANUP;
+		return;
+	}
+	/* the last request posts its completion, and ends the chain */
+	sqe->flags &= ~(IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+	io_uring_sqe_set_data64(sqe, (uintptr_t) c | LAST_TAG);
+}
+
+/*
+ * Get every xattr value. Each posts a completion with its length, and as
+ * they are linked, those arrive in order.
+ */
+static void prep_xattr_get(struct copy *c)
+{
+	struct io_uring_sqe *sqe;
+	int i;
+
+	reserve_sqes(c->x.nr);
+	c->state = COPY_XATTR_GET;
+	c->pending = c->x.nr;
+	for (i = 0; i < c->x.nr; i++) {
+		sqe = get_sqe();
+		io_uring_prep_fgetxattr(sqe, 2 * c->idx, c->x.name[i],
+					c->x.vals + i * XATTR_VAL_SIZE,
+					XATTR_VAL_SIZE);
+		sqe->flags |= IOSQE_FIXED_FILE;
+		if (i + 1 < c->x.nr)
+			sqe->flags |= IOSQE_IO_LINK;
+		io_uring_sqe_set_data(sqe, c);
+	}
+}
+
+/* set them all on the copy, and close both files */
+static void prep_xattr_set(struct copy *c)
+{
+	struct io_uring_sqe *sqe;
+	int i;
+
+	reserve_sqes(c->x.nr + 2);
+	for (i = 0; i < c->x.nr; i++) {
+		sqe = get_sqe();
+		io_uring_prep_fsetxattr(sqe, 2 * c->idx + 1, c->x.name[i],
+					c->x.vals + i * XATTR_VAL_SIZE, 0,
+					c->x.len[i]);
+		sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK |
+			      IOSQE_CQE_SKIP_SUCCESS;
+		io_uring_sqe_set_data(sqe, c);
+	}
+	prep_closes(c);
+	c->state = COPY_CLEANUP;
+	c->last_res = 0;
+}
+
+static void start_copy(struct entry *e)
+{
+	struct copy *c = &copies[free_copies[--nr_free_copies]];
+	int ret;
+
+	c->kind = KIND_COPY;
+	c->e = e;
+	c->off = 0;
+	c->failed = false;
+	c->state = COPY_DATA;
+	c->x.nr = 0;
+	c->x.names = NULL;
+	inflight++;
+
+	if (copy_xattrs) {
+		ret = list_xattrs(e->src, &c->x);
+		if (ret)
+			error("listxattr", e->src, -ret);
+	}
+	prep_data_chain(c);
+}
+
+static void finish_copy(struct copy *c)
+{
+	if (!c->failed) {
+		st.files++;
+		st.bytes += c->e->stx.stx_size;
+		st.xattrs += c->x.nr;
+	}
+	free(c->x.names);
+	free_entry(c->e);
+	free_copies[nr_free_copies++] = c->idx;
+	inflight--;
+}
+
+/*
+ * Something in a chain failed, and nothing after it ran. Close whatever
+ * may be open, independently as either may fail.
+ */
+static void fail_copy(struct copy *c, const char *what, int res)
+{
+	struct io_uring_sqe *sqe;
+	int i;
+
+	if (res < 0)
+		error(what, c->e->src, -res);
+	else
+		error(what, c->e->src, EIO);
+	c->failed = true;
+	c->state = COPY_CLEANUP;
+	c->pending = 2;
+	c->last_res = INT_MIN;
+	for (i = 0; i < 2; i++) {
+		sqe = get_sqe();
+		io_uring_prep_close_direct(sqe, 2 * c->idx + i);
+		io_uring_sqe_set_data(sqe, c);
+	}
+}
+
+static void handle_copy(struct copy *c, int res, bool last)
+{
+	switch (c->state) {
+	case COPY_DATA:
+		/* a failed or short request breaks the chain */
+		if (!last || res != c->last_res) {
+			fail_copy(c, "copy", res);
+			return;
+		}
+		if (c->off < c->e->stx.stx_size)
+			prep_data_chain(c);
+		else
+			prep_xattr_get(c);
+		return;
+	case COPY_XATTR_GET:
+		/* after a failure, the rest complete with -ECANCELED */
+		if (res < 0 && !c->failed) {
+			c->failed = true;
+			c->last_res = res;
+		}
+		c->x.len[c->x.nr - c->pending] = res;
+		if (--c->pending)
+			return;
+		if (c->failed)
+			fail_copy(c, "fgetxattr", c->last_res);
+		else
+			prep_xattr_set(c);
+		return;
+	case COPY_CLEANUP:
+		if (c->last_res == INT_MIN) {
+			/* the closes after a failure */
+			if (--c->pending)
+				return;
+		} else if (!last || res != c->last_res) {
+			/* a setxattr or close failed, the rest didn't run */
+			fail_copy(c, "copy", res);
+			return;
+		}
+		finish_copy(c);
+		return;
+	}
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe)
+{
+	int *kind = (int *) (uintptr_t) (cqe->user_data & ~LAST_TAG);
+	struct entry *e;
+
+	if (*kind == KIND_COPY) {
+		handle_copy((struct copy *) kind, cqe->res,
+			    cqe->user_data & LAST_TAG);
+		return;
+	}
+	e = (struct entry *) kind;
+	switch (e->state) {
+	case ENTRY_STATX:
+		handle_statx(e, cqe->res);
+		break;
+	case ENTRY_CREATE:
+		handle_created(e, cqe->res);
+		break;
+	default:
+		handle_dir_xattr(e, cqe->res);
+		break;
+	}
+}
+
+static int copy_tree(const char *src, const char *dst)
+{
+	struct entry *root;
+	struct statx stx;
+
+	if (statx(AT_FDCWD, src, 0, STATX_MODE, &stx)) {
+		perror(src);
+		return 1;
+	}
+	if (mkdir(dst, (stx.stx_mode & 07777) | S_IRWXU) && errno != EEXIST) {
+		perror(dst);
+		return 1;
+	}
+	root = calloc(1, sizeof(*root));
+	if (!root)
+		return 1;
+	root->src = strdup(src);
+	root->dst = strdup(dst);
+	root->stx = stx;
+	dir_created(root);
+
+	for (;;) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, count = 0;
+		struct entry *e;
+		int ret;
+
+		while (inflight < budget && nr_free_copies &&
+		       (e = pop(&files)) != NULL)
+			start_copy(e);
+		while (inflight < budget && (e = pop(&stats)) != NULL)
+			prep_statx(e);
+		/* only list more directories if there's room for their entries */
+		if (inflight < budget && !stats.head && (e = pop(&dirs))) {
+			scan_dir(e);
+			if ((e->stx.stx_mode & S_IRWXU) != S_IRWXU) {
+				e->next = modes;
+				modes = e;
+			} else {
+				free_entry(e);
+			}
+			continue;
+		}
+		if (!inflight)
+			break;
+
+		if (io_uring_sq_ready(&ring) || !io_uring_cq_ready(&ring))
+			st.enters++;
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+			return 1;
+		}
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			handle_cqe(cqe);
+			count++;
+		}
+		io_uring_cq_advance(&ring, count);
+	}
+	return 0;
+}
+
+/*
+ * Directories get their modes once nothing more is created in them.
+ * Subdirectories are listed after their parent, so they go first, and may
+ * still be reached if the parent loses its search permission.
+ */
+static void apply_modes(void)
+{
+	struct entry *e;
+
+	while ((e = modes) != NULL) {
+		modes = e->next;
+		st.sync_calls++;
+		if (chmod(e->dst, e->stx.stx_mode & 07777))
+			error("chmod", e->dst, errno);
+		free_entry(e);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-q budget] [-b chunk size] [-x] <source> "
+			"<dest>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct io_uring_params p = { };
+	struct iovec iov;
+	uint64_t start, nsec;
+	unsigned int i;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "q:b:xh")) != -1) {
+		switch (opt) {
+		case 'q':
+			budget = atoi(optarg);
+			break;
+		case 'b':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			copy_xattrs = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 2 || budget < 1 || budget > 4096 ||
+	    chunk < 4096 || chunk > 16 * 1024 * 1024) {
+		usage(argv[0]);
+		return 1;
+	}
+	/* the modes of the source are used as is */
+	umask(0);
+
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+		  IORING_SETUP_CQSIZE;
+	/* each file in flight posts at most one completion per xattr */
+	p.cq_entries = budget * (MAX_XATTRS + 2);
+	if (p.cq_entries < 512)
+		p.cq_entries = 512;
+	ret = io_uring_queue_init_params(256, &ring, &p);
+	if (ret) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	/*
+	 * A slice of one registered buffer and two direct descriptors per file
+	 * in flight
+	 */
+	copies = calloc(budget, sizeof(*copies));
+	free_copies = calloc(budget, sizeof(int));
+	bufs = t_aligned_alloc(4096, (size_t) budget * chunk);
+	if (!copies || !free_copies || !bufs) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < budget; i++) {
+		copies[i].idx = i;
+		if (copy_xattrs) {
+			copies[i].x.vals = malloc(MAX_XATTRS * XATTR_VAL_SIZE);
+			if (!copies[i].x.vals)
+				return 1;
+		}
+		free_copies[nr_free_copies++] = i;
+	}
+	/* the default of 8MB is as much as RLIMIT_MEMLOCK often allows */
+	iov.iov_base = bufs;
+	iov.iov_len = (size_t) budget * chunk;
+	ret = io_uring_register_buffers(&ring, &iov, 1);
+	if (ret) {
+		fprintf(stderr, "register buffers: %s, using read/write\n",
+				strerror(-ret));
+		fixed_bufs = false;
+	}
+	ret = io_uring_register_files_sparse(&ring, budget * 2);
+	if (ret) {
+		fprintf(stderr, "register files: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	start = now_ns();
+	ret = copy_tree(argv[optind], argv[optind + 1]);
+	apply_modes();
+	nsec = now_ns() - start;
+	io_uring_queue_exit(&ring);
+	if (ret)
+		return 1;
+
+	printf("files=%lu dirs=%lu symlinks=%lu xattrs=%lu skipped=%lu "
+		"errors=%lu bytes=%llu secs=%.3f files_per_sec=%.0f "
+		"mb_per_sec=%.1f syscalls=%lu\n", st.files, st.dirs,
+		st.symlinks, st.xattrs, st.skipped, st.errors, st.bytes,
+		nsec / 1e9, st.files / (nsec / 1e9),
+		st.bytes / 1e6 / (nsec / 1e9), st.enters + st.sync_calls);
+	return st.errors ? 1 : 0;
+}
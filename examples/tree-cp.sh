@@ -0,0 +1,87 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Compares tree-cp against cp -a, copying a generated tree of many small
+# files plus a few large ones, on tmpfs and on an ext4 image over a loop
+# device. The page cache is dropped before every run on ext4. The copies
+# are checked with diff -r.
+#
+# Needs root for the mounts. Usage: ./tree-cp.sh [budget]
+#
+# DIRS and FILES set the shape of the tree, FILES being per directory.
+
+budget=${1:-64}
+dirs=${DIRS:-50}
+files=${FILES:-200}
+
+bench="$(dirname "$0")/tree-cp"
+if [ ! -x "$bench" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+bench=$(realpath "$bench")
+
+work=$(mktemp -d)
+loop=
+cleanup() {
+	umount $work/tmpfs $work/ext4 2> /dev/null
+	[ -n "$loop" ] && losetup -d $loop
+	rm -rf $work
+}
+trap cleanup EXIT
+
+make_tree() {
+	local d f
+
+	for d in $(seq 1 $dirs); do
+		mkdir -p $1/d$d/sub
+		for f in $(seq 1 $files); do
+			head -c $(((d * 7919 + f * 104729) % 16384)) \
+				/dev/urandom > $1/d$d/f$f
+		done
+		ln -s f1 $1/d$d/link
+	done
+	for f in 1 2 3 4; do
+		head -c 64M /dev/urandom > $1/d$f/sub/large
+	done
+}
+
+run() {
+	local start end
+
+	rm -rf $1/dst
+	sync
+	[ "$2" = cold ] && echo 3 > /proc/sys/vm/drop_caches
+	start=$(date +%s.%N)
+	shift 2
+	"$@" > /dev/null || echo "failed: $*"
+	end=$(date +%s.%N)
+	echo "$start $end" | awk '{ printf "%8.3f", $2 - $1 }'
+}
+
+run_target() {
+	local cache=$2
+
+	echo "== $1 ($(find $1/src -type f | wc -l) files," \
+		"$(du -sh $1/src | cut -f1))"
+	printf "%-30s %8s\n" "copy" "secs"
+	printf "%-30s %s\n" "cp -a" "$(run $1 $cache cp -a $1/src $1/dst)"
+	printf "%-30s %s\n" "tree-cp -q $budget" \
+		"$(run $1 $cache $bench -q $budget $1/src $1/dst)"
+	diff -r --no-dereference $1/src $1/dst > /dev/null || echo "copy differs"
+	printf "%-30s %s\n" "tree-cp -q 1" \
+		"$(run $1 $cache $bench -q 1 $1/src $1/dst)"
+}
+
+mkdir -p $work/tmpfs $work/ext4
+mount -t tmpfs -o size=2G none $work/tmpfs || exit 1
+make_tree $work/tmpfs/src
+run_target $work/tmpfs warm
+
+truncate -s 2G $work/ext4.img
+mkfs.ext4 -q $work/ext4.img || exit 1
+loop=$(losetup -f --show $work/ext4.img) || exit 1
+mount $loop $work/ext4 || exit 1
+cp -a $work/tmpfs/src $work/ext4/src
+umount $work/tmpfs
+run_target $work/ext4 cold
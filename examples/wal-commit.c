@@ -0,0 +1,491 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Group commit for a write-ahead log. Appender threads write a record each
+ * into their own slot of a registered buffer, queue it, and wait for it to
+ * be durable. A commit thread takes everything queued, up to the batch
+ * size, and writes it with a single IORING_OP_WRITEV_FIXED straight from
+ * the slots, linked to an fdatasync or sync_file_range. All records in the
+ * batch are committed when the sync completes. Only one commit is in
+ * flight at a time, what gets queued meanwhile makes up the next batch.
+ * When the log is idle, the commit thread can wait a little for a batch to
+ * fill up, see -d.
+ *
+ * The log is preallocated and written to zeroes first, so an fdatasync
+ * only has to write data, and is used as a circular buffer.
+ *
+ * Prints a single line of key=value pairs:
+ *
+ *   appends, appends_per_sec	records made durable, and per second
+ *   syncs, avg_batch		syncs issued, and records per sync
+ *   p50_us .. max_us		latency from a record being queued to it
+ *				being durable
+ *
+ * Options:
+ *
+ *   -m mode		group, single (group commit with a batch size of
+ *			1) or sync (each appender does a pwrite and
+ *			fdatasync itself) (default group)
+ *   -s sync		fdatasync, range (sync_file_range, which doesn't
+ *			flush the device cache or metadata, so isn't durable
+ *			on its own) or none (default fdatasync)
+ *   -c clients		appender threads (default 16)
+ *   -r size		record size (default 256)
+ *   -b batch		max records per commit (default 256, max 1024)
+ *   -d usec		max time to wait for a batch to fill up, when no
+ *			commit is in flight (default 0)
+ *   -l size		log size (default 64m)
+ *   -t seconds		runtime (default 5)
+ *
+ * Usage: ./wal-commit [options] <log file>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+#define MAX_BATCH	1024
+
+enum {
+	MODE_GROUP,
+	MODE_SINGLE,
+	MODE_SYNC,
+};
+
+enum {
+	SYNC_FDATASYNC,
+	SYNC_RANGE,
+	SYNC_NONE,
+};
+
+static const char *mode_names[] = { "group", "single", "sync" };
+static const char *sync_names[] = { "fdatasync", "range", "none" };
+
+static int mode = MODE_GROUP;
+static int sync_mode = SYNC_FDATASYNC;
+static unsigned int nr_clients = 16;
+static unsigned int rec_size = 256;
+static unsigned int max_batch = 256;
+static unsigned int max_delay_us;
+static unsigned long long log_size = 64 * 1024 * 1024;
+static unsigned int runtime = 5;
+
+static int log_fd;
+static char *records;
+static volatile int stop;
+
+struct client {
+	pthread_t thread;
+	unsigned int idx;
+	struct lat_hist lat;
+};
+
+/*
+ * Shared between the appenders and the commit thread. Each appender has at
+ * most one record queued, so the queue holds at most one entry per client.
+ */
+static struct {
+	pthread_mutex_t lock;
+	/* the commit thread waits on this for records to be queued */
+	pthread_cond_t queued;
+	/* appenders wait on this for their record to be committed */
+	pthread_cond_t committed;
+	unsigned int *queue;
+	unsigned int head, tail;
+	bool commit_waiting;
+	/* records are numbered in the order they are queued */
+	unsigned long long next_lsn;
+	unsigned long long committed_lsn;
+	unsigned int active;
+} wal = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.committed = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned long long nr_syncs;
+static unsigned long long sync_off;
+
+static void fill_record(unsigned int idx, unsigned long long seq)
+{
+	char *rec = records + (size_t) idx * rec_size;
+
+	memset(rec, 'a' + idx % 26, rec_size);
+	memcpy(rec, &seq, sizeof(seq));
+}
+
+/* the appenders in sync mode, each writes and syncs its own records */
+static void *sync_client(void *data)
+{
+	unsigned long long slots = log_size / rec_size;
+	struct client *c = data;
+
+	while (!stop) {
+		unsigned long long seq, off;
+		uint64_t start = now_ns();
+		ssize_t ret;
+
+		seq = __atomic_fetch_add(&wal.next_lsn, 1, __ATOMIC_RELAXED);
+		off = (seq % slots) * rec_size;
+		fill_record(c->idx, seq);
+		ret = pwrite(log_fd, records + (size_t) c->idx * rec_size,
+			     rec_size, off);
+		if (ret != rec_size) {
+			perror("pwrite");
+			exit(1);
+		}
+		if (sync_mode == SYNC_FDATASYNC) {
+			ret = fdatasync(log_fd);
+		} else if (sync_mode == SYNC_RANGE) {
+			ret = sync_file_range(log_fd, off, rec_size,
+					      SYNC_FILE_RANGE_WAIT_BEFORE |
+					      SYNC_FILE_RANGE_WRITE |
+					      SYNC_FILE_RANGE_WAIT_AFTER);
+		}
+		if (ret < 0) {
+			perror("sync");
+			exit(1);
+		}
+		if (sync_mode != SYNC_NONE)
+			__atomic_fetch_add(&nr_syncs, 1, __ATOMIC_RELAXED);
+		lat_add(&c->lat, now_ns() - start);
+	}
+	return NULL;
+}
+
+static void *client(void *data)
+{
+	struct client *c = data;
+
+	while (!stop) {
+		unsigned long long lsn;
+		uint64_t start;
+
+		/* only this thread touches the slot until it's queued */
+		fill_record(c->idx, 0);
+		start = now_ns();
+
+		pthread_mutex_lock(&wal.lock);
+		lsn = ++wal.next_lsn;
+		memcpy(records + (size_t) c->idx * rec_size, &lsn, sizeof(lsn));
+		wal.queue[wal.tail++ % nr_clients] = c->idx;
+		if (wal.commit_waiting)
+			pthread_cond_signal(&wal.queued);
+		while (wal.committed_lsn < lsn)
+			pthread_cond_wait(&wal.committed, &wal.lock);
+		pthread_mutex_unlock(&wal.lock);
+
+		lat_add(&c->lat, now_ns() - start);
+	}
+
+	pthread_mutex_lock(&wal.lock);
+	wal.active--;
+	pthread_cond_signal(&wal.queued);
+	pthread_mutex_unlock(&wal.lock);
+	return NULL;
+}
+
+/*
+ * Take up to max_batch queued records, waiting for the first one, and for
+ * up to max_delay_us for the batch to fill up. Returns the number taken,
+ * and 0 once all appenders are gone. Called with the lock held.
+ */
+static unsigned int take_batch(struct iovec *iovs, unsigned long long *lsn)
+{
+	struct timespec deadline;
+	unsigned int i, nr;
+
+	while (wal.head == wal.tail) {
+		if (!wal.active)
+			return 0;
+		wal.commit_waiting = true;
+		pthread_cond_wait(&wal.queued, &wal.lock);
+		wal.commit_waiting = false;
+	}
+
+	if (max_delay_us) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += max_delay_us * 1000ULL;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		while (wal.tail - wal.head < max_batch &&
+		       wal.tail - wal.head < wal.active) {
+			wal.commit_waiting = true;
+			if (pthread_cond_timedwait(&wal.queued, &wal.lock,
+						   &deadline) == ETIMEDOUT)
+				break;
+		}
+		wal.commit_waiting = false;
+	}
+
+	nr = wal.tail - wal.head;
+	if (nr > max_batch)
+		nr = max_batch;
+	for (i = 0; i < nr; i++) {
+		unsigned int idx = wal.queue[wal.head++ % nr_clients];
+
+		iovs[i].iov_base = records + (size_t) idx * rec_size;
+		iovs[i].iov_len = rec_size;
+	}
+	/* records are queued in lsn order, so this is the batch's last */
+	*lsn = wal.next_lsn - (wal.tail - wal.head);
+	return nr;
+}
+
+/*
+ * Write the batch at the next spot in the log, and sync it. The write
+ * only posts a completion if it fails, so there is exactly one.
+ */
+static int commit_batch(struct io_uring *ring, struct iovec *iovs,
+			unsigned int nr)
+{
+	unsigned int len = nr * rec_size;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	if (sync_off + len > log_size)
+		sync_off = 0;
+
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_writev_fixed(sqe, 0, iovs, nr, sync_off, 0, 0);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data64(sqe, 1);
+	if (sync_mode != SYNC_NONE) {
+		sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		sqe = io_uring_get_sqe(ring);
+		if (sync_mode == SYNC_FDATASYNC)
+			io_uring_prep_fsync(sqe, 0, IORING_FSYNC_DATASYNC);
+		else
+			io_uring_prep_sync_file_range(sqe, 0, len, sync_off,
+						      SYNC_FILE_RANGE_WAIT_BEFORE |
+						      SYNC_FILE_RANGE_WRITE |
+						      SYNC_FILE_RANGE_WAIT_AFTER);
+		sqe->flags |= IOSQE_FIXED_FILE;
+		io_uring_sqe_set_data64(sqe, 2);
+		nr_syncs++;
+	}
+
+	ret = io_uring_submit_and_wait(ring, 1);
+	if (ret < 0) {
+		fprintf(stderr, "submit_and_wait: %s\n", strerror(-ret));
+		return 1;
+	}
+	ret = io_uring_peek_cqe(ring, &cqe);
+	if (ret) {
+		fprintf(stderr, "peek_cqe: %s\n", strerror(-ret));
+		return 1;
+	}
+	if (cqe->user_data == 1 && cqe->res != len) {
+		fprintf(stderr, "write: %s\n", cqe->res < 0 ?
+			strerror(-cqe->res) : "short write");
+		return 1;
+	} else if (cqe->res < 0) {
+		fprintf(stderr, "sync: %s\n", strerror(-cqe->res));
+		return 1;
+	}
+	io_uring_cqe_seen(ring, cqe);
+	sync_off += len;
+	return 0;
+}
+
+static void *commit_thread(void *data)
+{
+	struct iovec iovs[MAX_BATCH];
+	struct io_uring ring;
+	struct iovec reg;
+	int r;
+
+	(void) data;
+	r = io_uring_queue_init(8, &ring, IORING_SETUP_SINGLE_ISSUER |
+				IORING_SETUP_DEFER_TASKRUN);
+	if (r) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-r));
+		exit(1);
+	}
+	reg.iov_base = records;
+	reg.iov_len = (size_t) nr_clients * rec_size;
+	r = io_uring_register_buffers(&ring, &reg, 1);
+	if (!r)
+		r = io_uring_register_files(&ring, &log_fd, 1);
+	if (r) {
+		fprintf(stderr, "register: %s\n", strerror(-r));
+		exit(1);
+	}
+
+	pthread_mutex_lock(&wal.lock);
+	for (;;) {
+		unsigned long long lsn;
+		unsigned int nr;
+
+		nr = take_batch(iovs, &lsn);
+		if (!nr)
+			break;
+		pthread_mutex_unlock(&wal.lock);
+
+		if (commit_batch(&ring, iovs, nr))
+			exit(1);
+
+		pthread_mutex_lock(&wal.lock);
+		wal.committed_lsn = lsn;
+		pthread_cond_broadcast(&wal.committed);
+	}
+	pthread_mutex_unlock(&wal.lock);
+
+	io_uring_queue_exit(&ring);
+	return NULL;
+}
+
+/* write the whole log once, so later writes don't allocate or extend it */
+static int prepare_log(const char *path)
+{
+	unsigned long long off;
+	char *buf;
+
+	log_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (log_fd < 0) {
+		perror(path);
+		return 1;
+	}
+	buf = calloc(1, 1024 * 1024);
+	if (!buf)
+		return 1;
+	for (off = 0; off < log_size; off += 1024 * 1024) {
+		size_t len = 1024 * 1024;
+
+		if (len > log_size - off)
+			len = log_size - off;
+		if (pwrite(log_fd, buf, len, off) != (ssize_t) len) {
+			perror("pwrite");
+			return 1;
+		}
+	}
+	free(buf);
+	if (fsync(log_fd) < 0) {
+		perror("fsync");
+		return 1;
+	}
+	return 0;
+}
+
+static int lookup(const char *arg, const char **names, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (!strcmp(arg, names[i]))
+			return i;
+	return -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m group|single|sync] "
+			"[-s fdatasync|range|none] [-c clients] [-r size] "
+			"[-b batch] [-d usec] [-l size] [-t seconds] <log file>\n",
+			name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct lat_hist lat = { };
+	struct client *clients;
+	pthread_t committer;
+	unsigned long long appends;
+	unsigned int i;
+	uint64_t start, nsec;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:s:c:r:b:d:l:t:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			mode = lookup(optarg, mode_names, 3);
+			break;
+		case 's':
+			sync_mode = lookup(optarg, sync_names, 3);
+			break;
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 'r':
+			rec_size = parse_size(optarg);
+			break;
+		case 'b':
+			max_batch = atoi(optarg);
+			break;
+		case 'd':
+			max_delay_us = atoi(optarg);
+			break;
+		case 'l':
+			log_size = parse_size(optarg);
+			break;
+		case 't':
+			runtime = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 1 || mode < 0 || sync_mode < 0 || !nr_clients ||
+	    rec_size < sizeof(unsigned long long) || !max_batch ||
+	    max_batch > MAX_BATCH || log_size < (unsigned long long)
+	    MAX_BATCH * rec_size || !runtime) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (mode == MODE_SINGLE)
+		max_batch = 1;
+
+	records = t_aligned_alloc(4096, (size_t) nr_clients * rec_size);
+	wal.queue = calloc(nr_clients, sizeof(unsigned int));
+	clients = calloc(nr_clients, sizeof(*clients));
+	if (!records || !wal.queue || !clients) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	if (prepare_log(argv[optind]))
+		return 1;
+
+	wal.active = nr_clients;
+	if (mode != MODE_SYNC)
+		pthread_create(&committer, NULL, commit_thread, NULL);
+	start = now_ns();
+	for (i = 0; i < nr_clients; i++) {
+		clients[i].idx = i;
+		pthread_create(&clients[i].thread, NULL,
+			       mode == MODE_SYNC ? sync_client : client,
+			       &clients[i]);
+	}
+	sleep(runtime);
+	stop = 1;
+	for (i = 0; i < nr_clients; i++)
+		pthread_join(clients[i].thread, NULL);
+	if (mode != MODE_SYNC)
+		pthread_join(committer, NULL);
+	nsec = now_ns() - start;
+
+	for (i = 0; i < nr_clients; i++)
+		lat_merge(&lat, &clients[i].lat);
+	appends = lat.nr;
+
+	printf("mode=%s sync=%s clients=%u appends=%llu appends_per_sec=%.0f "
+		"syncs=%llu avg_batch=%.1f p50_us=%.1f p99_us=%.1f "
+		"p999_us=%.1f max_us=%.1f\n", mode_names[mode],
+		sync_names[sync_mode], nr_clients, appends,
+		appends / (nsec / 1e9), nr_syncs,
+		nr_syncs ? (double) appends / nr_syncs : 0.0,
+		lat_percentile(&lat, 50.0) / 1000.0,
+		lat_percentile(&lat, 99.0) / 1000.0,
+		lat_percentile(&lat, 99.9) / 1000.0, lat.max / 1000.0);
+	return 0;
+}
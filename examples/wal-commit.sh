@@ -0,0 +1,76 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+#
+# Compares group commit against a write and fdatasync per record, on ext4
+# and xfs images over loop devices. Filesystems without a mkfs are
+# skipped.
+#
+# Needs root for the mounts. Usage: ./wal-commit.sh [clients ...]
+#
+# SECS is the runtime of each run.
+
+secs=${SECS:-5}
+clients=${@:-1 4 16 64}
+
+bench="$(dirname "$0")/wal-commit"
+if [ ! -x "$bench" ]; then
+	echo "Build the examples first"
+	exit 1
+fi
+
+work=$(mktemp -d)
+loop=
+cleanup() {
+	umount $work/mnt 2> /dev/null
+	[ -n "$loop" ] && losetup -d $loop
+	rm -rf $work
+}
+trap cleanup EXIT
+
+runs=(
+	"-m sync"
+	"-m single"
+	"-m group"
+	"-m group -d 100"
+	"-m group -s range"
+)
+
+run_fs() {
+	local c i args out
+
+	if ! which mkfs.$1 > /dev/null 2>&1; then
+		echo "== $1: no mkfs.$1, skipped"
+		return
+	fi
+	truncate -s 1G $work/$1.img
+	mkfs.$1 -q $work/$1.img > /dev/null || return
+	loop=$(losetup -f --show $work/$1.img) || return
+	mkdir -p $work/mnt
+	mount $loop $work/mnt || return
+
+	echo "== $1"
+	printf "%-22s %7s %12s %9s %9s %9s\n" "args" "clients" "appends/s" \
+		"batch" "p50_us" "p99_us"
+	for c in $clients; do
+		for args in "${runs[@]}"; do
+			out=$($bench $args -c $c -t $secs $work/mnt/log)
+			printf "%-22s %7s %12s %9s %9s %9s\n" "$args" $c \
+				"$(echo "$out" | sed -n 's/.*appends_per_sec=\([0-9.]*\).*/\1/p')" \
+				"$(echo "$out" | sed -n 's/.*avg_batch=\([0-9.]*\).*/\1/p')" \
+				"$(echo "$out" | sed -n 's/.*p50_us=\([0-9.]*\).*/\1/p')" \
+				"$(echo "$out" | sed -n 's/.*p99_us=\([0-9.]*\).*/\1/p')"
+		done
+	done
+
+	# ring teardown is async, the log may stay open for a moment
+	for i in 1 2 3 4 5; do
+		umount $work/mnt 2> /dev/null && break
+		sleep 1
+	done
+	losetup -d $loop
+	loop=
+	rm -f $work/$1.img
+}
+
+run_fs ext4
+run_fs xfs
@@ -1278,6 +1278,33 @@ io_uring_recvmsg_payload_length(struct io_uring_recvmsg_out *o,
 	return (unsigned int) (payload_end - payload_start);
 }
 
+/*
+ * Parsed recvmsg multishot completions, see io_uring_recvmsg_parse_batch().
+ * Arrays are supplied by the caller and hold one entry per CQE. Optional
+ * arrays may be NULL, if the caller isn't interested in them.
+ */
+struct io_uring_recvmsg_batch {
+	/* payload, or NULL if the CQE doesn't hold a valid buffer */
+	void		**payload;
+	/* bytes of payload in the buffer */
+	unsigned int	*payload_len;
+	/* optional: source address and its length */
+	void		**name;
+	unsigned int	*namelen;
+	/* optional: recvmsg(2) flags, eg MSG_TRUNC */
+	unsigned int	*flags;
+	/* optional: UDP_GRO segment size, 0 if not coalesced */
+	int		*gro_size;
+	/* optional: SO_TIMESTAMPNS/SO_TIMESTAMPING receive time in nsec, or 0 */
+	__u64		*tstamp;
+};
+
+int io_uring_recvmsg_parse_batch(struct io_uring_cqe **cqes, unsigned nr,
+				 void *buf_base, unsigned int buf_size,
+				 const struct msghdr *msgh,
+				 struct io_uring_recvmsg_batch *batch)
+	LIBURING_NOEXCEPT;
+
 IOURINGINLINE void io_uring_prep_openat2(struct io_uring_sqe *sqe, int dfd,
 					const char *path, const struct open_how *how)
 	LIBURING_NOEXCEPT
@@ -0,0 +1,601 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef LIBURING_CORO_HPP
+#define LIBURING_CORO_HPP
+
+/*
+ * Optional header-only C++20 coroutine layer on top of liburing.
+ *
+ * liburing::ring owns an io_uring. Awaitable operations like
+ * liburing::read() prepare an SQE when the calling coroutine suspends on
+ * them, with the address of the awaitable as user_data. The awaitable lives
+ * in the coroutine frame for as long as the request is in flight, so issuing
+ * a request doesn't allocate. ring::dispatch() walks the CQ ring with
+ * io_uring_cqe_iter and resumes the coroutine each CQE belongs to, and
+ * ring::run_once() submits whatever the coroutines queued, waits and
+ * dispatches. Requests queue up while coroutines run and are submitted
+ * together, as a hand written event loop would.
+ *
+ * liburing::task<T> is a lazily started coroutine that other tasks can
+ * co_await, its frame is the only allocation. Run one with sync_wait(), or
+ * start it detached with spawn() and drive the ring with ring::run().
+ *
+ * A ring and the coroutines using it belong to one thread. The awaitables
+ * handle requests that post a single CQE, not multishot requests or ones
+ * with IOSQE_CQE_SKIP_SUCCESS. Errors are returned as -errno like the C
+ * API, exceptions are only thrown for setup failures and when no SQE can
+ * be had.
+ */
+#if !defined(__cplusplus) || __cplusplus < 202002L
+#error "liburing/coro.hpp needs C++20"
+#endif
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include "liburing.h"
+
+namespace liburing {
+
+class ring;
+
+/*
+ * The state of a request in flight, its address is the user_data. It's
+ * part of the awaitable, and so of the frame of the coroutine awaiting it.
+ */
+struct completion {
+	std::coroutine_handle<> waiter;
+	int res = 0;
+	unsigned int flags = 0;
+};
+
+/*
+ * Lets one coroutine cancel the request another is suspended on, attach it
+ * with with_cancel() on the awaitable. The cancelled request completes
+ * with -ECANCELED, or -EINTR if it was already running, or normally if it
+ * finished before the cancelation got to it.
+ */
+class cancel_token {
+public:
+	cancel_token() noexcept = default;
+	cancel_token(const cancel_token &) = delete;
+	cancel_token &operator=(const cancel_token &) = delete;
+
+	/* whether the request it's attached to is in flight */
+	bool pending() const noexcept { return pending_ != nullptr; }
+
+	inline void cancel();
+
+private:
+	template <typename Derived> friend class basic_op;
+
+	ring *ring_ = nullptr;
+	completion *pending_ = nullptr;
+};
+
+class ring {
+public:
+	explicit ring(unsigned int entries, unsigned int flags = 0)
+	{
+		int ret = io_uring_queue_init(entries, &ring_, flags);
+
+		if (ret < 0)
+			throw std::system_error(-ret, std::system_category(),
+						"io_uring_queue_init");
+	}
+
+	ring(unsigned int entries, struct io_uring_params &p)
+	{
+		int ret = io_uring_queue_init_params(entries, &ring_, &p);
+
+		if (ret < 0)
+			throw std::system_error(-ret, std::system_category(),
+						"io_uring_queue_init_params");
+	}
+
+	~ring() { io_uring_queue_exit(&ring_); }
+
+	/* awaitables point into it, it stays where it was created */
+	ring(const ring &) = delete;
+	ring &operator=(const ring &) = delete;
+
+	struct io_uring *get() noexcept { return &ring_; }
+
+	/* requests issued by awaitables that haven't completed yet */
+	unsigned int inflight() const noexcept { return inflight_; }
+
+	/* an SQE, submitting what's queued first if the SQ ring is full */
+	struct io_uring_sqe *get_sqe()
+	{
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+
+		return sqe ? sqe : get_sqe_slow();
+	}
+
+	int submit() noexcept { return io_uring_submit(&ring_); }
+
+	/*
+	 * Resume the coroutines whose requests have completed, returns the
+	 * number of CQEs seen. CQEs with a zero user_data, like the ones of
+	 * failed cancelations, are skipped. The resumed coroutines must not
+	 * dispatch themselves.
+	 */
+	unsigned int dispatch() noexcept
+	{
+		struct io_uring_cqe_iter it = io_uring_cqe_iter_init(&ring_);
+		unsigned int head = it.head;
+		struct io_uring_cqe *cqe;
+		unsigned int nr = 0;
+
+		while (io_uring_cqe_iter_next(&it, &cqe)) {
+			auto *c = static_cast<completion *>(
+					io_uring_cqe_get_data(cqe));
+
+			nr++;
+			if (!c)
+				continue;
+			c->res = cqe->res;
+			c->flags = cqe->flags;
+			inflight_--;
+			c->waiter.resume();
+		}
+		io_uring_cq_advance(&ring_, it.head - head);
+		return nr;
+	}
+
+	/*
+	 * Submit what's queued, wait for at least 'wait_nr' completions and
+	 * dispatch them. Returns 0, or -errno if submitting failed.
+	 */
+	int run_once(unsigned int wait_nr = 1) noexcept
+	{
+		int ret = io_uring_submit_and_wait(&ring_, wait_nr);
+
+		if (ret < 0 && ret != -EINTR && ret != -ETIME)
+			return ret;
+		dispatch();
+		return 0;
+	}
+
+	/* dispatch until no request is in flight */
+	int run() noexcept
+	{
+		while (inflight_) {
+			int ret = run_once();
+
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+private:
+	template <typename Derived> friend class basic_op;
+
+	/* kept out of line, so the fast path inlines into the awaitables */
+	__attribute__((noinline)) struct io_uring_sqe *get_sqe_slow()
+	{
+		struct io_uring_sqe *sqe;
+		int ret;
+
+		ret = io_uring_submit(&ring_);
+		if (ret < 0)
+			throw std::system_error(-ret, std::system_category(),
+						"io_uring_submit");
+		sqe = io_uring_get_sqe(&ring_);
+		if (!sqe)
+			throw std::system_error(EBUSY, std::system_category(),
+						"io_uring_get_sqe");
+		return sqe;
+	}
+
+	struct io_uring ring_;
+	unsigned int inflight_ = 0;
+};
+
+/*
+ * Cancelation is submitted right away, before the coroutine of a request
+ * that has already completed can be resumed and reuse the same awaitable
+ * address for another one.
+ */
+inline void cancel_token::cancel()
+{
+	struct io_uring_sqe *sqe;
+
+	if (!pending_)
+		return;
+	sqe = ring_->get_sqe();
+	io_uring_prep_cancel64(sqe, reinterpret_cast<std::uintptr_t>(pending_),
+			       0);
+	io_uring_sqe_set_data64(sqe, 0);
+	sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+	ring_->submit();
+}
+
+/*
+ * Awaitable for a single request. 'Derived' provides
+ * prep_sqe(struct io_uring_sqe *), which is called when the awaiting
+ * coroutine suspends. co_await returns the CQE res, and cqe_flags() the
+ * flags, for an awaitable kept in a variable.
+ */
+template <typename Derived>
+class basic_op : private completion {
+public:
+	explicit basic_op(ring &r) noexcept : ring_(r) {}
+
+	Derived &with_cancel(cancel_token &t) noexcept
+	{
+		token_ = &t;
+		return static_cast<Derived &>(*this);
+	}
+
+	/* extra IOSQE_* flags for the SQE, like IOSQE_FIXED_FILE */
+	Derived &with_flags(unsigned int flags) noexcept
+	{
+		sqe_flags_ = flags;
+		return static_cast<Derived &>(*this);
+	}
+
+	unsigned int cqe_flags() const noexcept { return flags; }
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		struct io_uring_sqe *sqe = ring_.get_sqe();
+
+		static_cast<Derived *>(this)->prep_sqe(sqe);
+		sqe->flags |= sqe_flags_;
+		io_uring_sqe_set_data(sqe, static_cast<completion *>(this));
+		waiter = h;
+		ring_.inflight_++;
+		if (token_) {
+			token_->ring_ = &ring_;
+			token_->pending_ = this;
+		}
+	}
+
+	int await_resume() noexcept
+	{
+		if (token_)
+			token_->pending_ = nullptr;
+		return res;
+	}
+
+private:
+	ring &ring_;
+	cancel_token *token_ = nullptr;
+	unsigned int sqe_flags_ = 0;
+};
+
+/* awaitable that prepares its request with a callable taking the SQE */
+template <typename F>
+class prep_op : public basic_op<prep_op<F>> {
+public:
+	prep_op(ring &r, F f) : basic_op<prep_op<F>>(r), f_(std::move(f)) {}
+
+	void prep_sqe(struct io_uring_sqe *sqe) { f_(sqe); }
+
+private:
+	F f_;
+};
+
+template <typename F>
+prep_op<F> prep(ring &r, F f)
+{
+	return prep_op<F>(r, std::move(f));
+}
+
+inline auto nop(ring &r)
+{
+	return prep(r, [](struct io_uring_sqe *sqe) {
+		io_uring_prep_nop(sqe);
+	});
+}
+
+inline auto read(ring &r, int fd, void *buf, unsigned int nbytes,
+		 std::uint64_t offset)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_read(sqe, fd, buf, nbytes, offset);
+	});
+}
+
+inline auto write(ring &r, int fd, const void *buf, unsigned int nbytes,
+		  std::uint64_t offset)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_write(sqe, fd, buf, nbytes, offset);
+	});
+}
+
+inline auto read_fixed(ring &r, int fd, void *buf, unsigned int nbytes,
+		       std::uint64_t offset, int buf_index)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_read_fixed(sqe, fd, buf, nbytes, offset,
+					 buf_index);
+	});
+}
+
+inline auto write_fixed(ring &r, int fd, const void *buf, unsigned int nbytes,
+			std::uint64_t offset, int buf_index)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_write_fixed(sqe, fd, buf, nbytes, offset,
+					  buf_index);
+	});
+}
+
+inline auto fsync(ring &r, int fd, unsigned int fsync_flags = 0)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_fsync(sqe, fd, fsync_flags);
+	});
+}
+
+inline auto openat(ring &r, int dfd, const char *path, int flags,
+		   mode_t mode = 0)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_openat(sqe, dfd, path, flags, mode);
+	});
+}
+
+inline auto close(ring &r, int fd)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_close(sqe, fd);
+	});
+}
+
+inline auto recv(ring &r, int sockfd, void *buf, size_t len, int flags = 0)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_recv(sqe, sockfd, buf, len, flags);
+	});
+}
+
+inline auto send(ring &r, int sockfd, const void *buf, size_t len,
+		 int flags = 0)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_send(sqe, sockfd, buf, len, flags);
+	});
+}
+
+inline auto accept(ring &r, int fd, struct sockaddr *addr = nullptr,
+		   socklen_t *addrlen = nullptr, int flags = 0)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_accept(sqe, fd, addr, addrlen, flags);
+	});
+}
+
+inline auto connect(ring &r, int fd, const struct sockaddr *addr,
+		    socklen_t addrlen)
+{
+	return prep(r, [=](struct io_uring_sqe *sqe) {
+		io_uring_prep_connect(sqe, fd, addr, addrlen);
+	});
+}
+
+/*
+ * Completes with -ETIME once 'timeout' has passed. The timespec is kept in
+ * the awaitable, as the kernel may read it after the SQE was submitted.
+ */
+class timeout_op : public basic_op<timeout_op> {
+public:
+	timeout_op(ring &r, std::chrono::nanoseconds timeout,
+		   unsigned int flags) noexcept
+		: basic_op<timeout_op>(r), flags_(flags)
+	{
+		ts_.tv_sec = timeout.count() / 1000000000;
+		ts_.tv_nsec = timeout.count() % 1000000000;
+	}
+
+	void prep_sqe(struct io_uring_sqe *sqe)
+	{
+		io_uring_prep_timeout(sqe, &ts_, 0, flags_);
+	}
+
+private:
+	struct __kernel_timespec ts_;
+	unsigned int flags_;
+};
+
+inline timeout_op timeout(ring &r, std::chrono::nanoseconds timeout,
+			  unsigned int flags = 0)
+{
+	return timeout_op(r, timeout, flags);
+}
+
+template <typename T = void> class task;
+
+namespace detail {
+
+/* once a task finishes, carry on with whoever awaited it */
+struct final_awaiter {
+	bool await_ready() const noexcept { return false; }
+
+	template <typename P>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+	{
+		std::coroutine_handle<> c = h.promise().continuation;
+
+		return c ? c : std::noop_coroutine();
+	}
+
+	void await_resume() const noexcept {}
+};
+
+struct promise_base {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept
+	{
+		error = std::current_exception();
+	}
+};
+
+template <typename T>
+struct promise : promise_base {
+	std::optional<T> value;
+
+	task<T> get_return_object() noexcept;
+
+	template <typename U>
+	void return_value(U &&v)
+	{
+		value.emplace(std::forward<U>(v));
+	}
+
+	T result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct promise<void> : promise_base {
+	task<void> get_return_object() noexcept;
+
+	void return_void() const noexcept {}
+
+	void result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+} /* namespace detail */
+
+template <typename T>
+class [[nodiscard]] task {
+public:
+	using promise_type = detail::promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit task(handle_type h) noexcept : h_(h) {}
+	task(task &&t) noexcept : h_(std::exchange(t.h_, {})) {}
+	task &operator=(task &&t) noexcept
+	{
+		if (this != &t) {
+			if (h_)
+				h_.destroy();
+			h_ = std::exchange(t.h_, {});
+		}
+		return *this;
+	}
+	~task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	bool done() const noexcept { return h_ && h_.done(); }
+	handle_type handle() const noexcept { return h_; }
+
+	/* start it, and resume the awaiting coroutine when it finishes */
+	auto operator co_await() const noexcept
+	{
+		struct awaiter {
+			handle_type h;
+
+			bool await_ready() const noexcept { return false; }
+			std::coroutine_handle<>
+			await_suspend(std::coroutine_handle<> c) noexcept
+			{
+				h.promise().continuation = c;
+				return h;
+			}
+			T await_resume() { return h.promise().result(); }
+		};
+		return awaiter{h_};
+	}
+
+private:
+	handle_type h_;
+};
+
+namespace detail {
+
+template <typename T>
+inline task<T> promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+	return task<void>(
+		std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/* owns a spawned task, and frees itself once that finishes */
+struct detached {
+	struct promise_type {
+		detached get_return_object() const noexcept { return {}; }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() const noexcept {}
+		void unhandled_exception() const noexcept { std::terminate(); }
+	};
+};
+
+inline detached run_detached(task<void> t)
+{
+	co_await t;
+}
+
+} /* namespace detail */
+
+/*
+ * Run 't' until its first suspension, and leave the rest to whoever drives
+ * the ring. An exception escaping it terminates the program.
+ */
+inline void spawn(task<void> t)
+{
+	detail::run_detached(std::move(t));
+}
+
+/*
+ * Run 't' to completion, driving 'r' while it waits, and return its result
+ * or rethrow its exception. Other coroutines using 'r' keep running too.
+ */
+template <typename T>
+T sync_wait(ring &r, task<T> t)
+{
+	auto h = t.handle();
+
+	h.resume();
+	while (!h.done()) {
+		int ret;
+
+		if (!r.inflight())
+			throw std::logic_error("task waits without a request in flight");
+		ret = r.run_once();
+		if (ret < 0)
+			throw std::system_error(-ret, std::system_category(),
+						"io_uring_submit_and_wait");
+	}
+	return h.promise().result();
+}
+
+} /* namespace liburing */
+
+#endif
@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: MIT */
+#define _POSIX_C_SOURCE 200112L
+
+#include "lib.h"
+#include "liburing.h"
+#include "liburing/io_uring.h"
+
+#include <asm/socket.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP			17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO			104
+#endif
+#ifndef SO_TIMESTAMPNS_OLD
+#define SO_TIMESTAMPNS_OLD	SO_TIMESTAMPNS
+#endif
+#ifndef SO_TIMESTAMPING_OLD
+#define SO_TIMESTAMPING_OLD	SO_TIMESTAMPING
+#endif
+
+#define NSEC_PER_SEC		1000000000ULL
+
+/*
+ * Receive time of a timestamp cmsg, in nsec. The old variants use the
+ * native struct timespec layout, the new ones a 64-bit one. For
+ * SO_TIMESTAMPING, the software stamp comes first and the hardware one
+ * last, use whichever is set. A cmsg too short for its type counts as no
+ * timestamp.
+ */
+static __u64 cmsg_tstamp(const struct cmsghdr *cmsg)
+{
+	const long long *ts64 = (const long long *) CMSG_DATA(cmsg);
+	const long *ts = (const long *) CMSG_DATA(cmsg);
+	int i;
+
+	switch (cmsg->cmsg_type) {
+	case SO_TIMESTAMPNS_OLD:
+		if (cmsg->cmsg_len < CMSG_LEN(2 * sizeof(*ts)))
+			break;
+		return ts[0] * NSEC_PER_SEC + ts[1];
+	case SO_TIMESTAMPING_OLD:
+		if (cmsg->cmsg_len < CMSG_LEN(6 * sizeof(*ts)))
+			break;
+		for (i = 0; i < 3; i++, ts += 2) {
+			if (ts[0] || ts[1])
+				return ts[0] * NSEC_PER_SEC + ts[1];
+		}
+		break;
+#ifdef SO_TIMESTAMPNS_NEW
+	case SO_TIMESTAMPNS_NEW:
+		if (cmsg->cmsg_len < CMSG_LEN(2 * sizeof(*ts64)))
+			break;
+		return ts64[0] * NSEC_PER_SEC + ts64[1];
+	case SO_TIMESTAMPING_NEW:
+		if (cmsg->cmsg_len < CMSG_LEN(6 * sizeof(*ts64)))
+			break;
+		for (i = 0; i < 3; i++, ts64 += 2) {
+			if (ts64[0] || ts64[1])
+				return ts64[0] * NSEC_PER_SEC + ts64[1];
+		}
+		break;
+#endif
+	}
+	return 0;
+}
+
+static void parse_cmsgs(struct io_uring_recvmsg_out *o, struct msghdr *msgh,
+			int *gro_size, __u64 *tstamp)
+{
+	struct cmsghdr *cmsg;
+	__u64 ts = 0;
+	int gro = 0;
+
+	for (cmsg = io_uring_recvmsg_cmsg_firsthdr(o, msgh); cmsg;
+	     cmsg = io_uring_recvmsg_cmsg_nexthdr(o, msgh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO &&
+		    cmsg->cmsg_len >= CMSG_LEN(sizeof(int)))
+			gro = *(const int *) CMSG_DATA(cmsg);
+		else if (cmsg->cmsg_level == SOL_SOCKET && !ts)
+			ts = cmsg_tstamp(cmsg);
+	}
+	if (gro_size)
+		*gro_size = gro;
+	if (tstamp)
+		*tstamp = ts;
+}
+
+/*
+ * Parse 'nr' recvmsg multishot completions in one go. The buffers must be
+ * 'buf_size' bytes each and laid out back to back from 'buf_base' by
+ * buffer ID, and 'msgh' is the msghdr the request was prepared with.
+ *
+ * All completions share the same header layout, so the payload offset is
+ * the same for each of them. The first pass is straight arithmetic with
+ * no data dependent branches, and only CQEs holding a valid buffer get
+ * their header or cmsgs looked at after that. Returns the number of CQEs
+ * that held a valid buffer.
+ */
+int io_uring_recvmsg_parse_batch(struct io_uring_cqe **cqes, unsigned nr,
+				 void *buf_base, unsigned int buf_size,
+				 const struct msghdr *msgh,
+				 struct io_uring_recvmsg_batch *batch)
+{
+	const long skip = sizeof(struct io_uring_recvmsg_out) +
+				msgh->msg_namelen + msgh->msg_controllen;
+	unsigned char *base = buf_base;
+	void **payload = batch->payload;
+	unsigned int *payload_len = batch->payload_len;
+	void **name = batch->name;
+	unsigned int *namelen = batch->namelen;
+	unsigned int *flags = batch->flags;
+	int *gro_size = batch->gro_size;
+	__u64 *tstamp = batch->tstamp;
+	int cmsgs = (gro_size || tstamp) &&
+			msgh->msg_controllen >= sizeof(struct cmsghdr);
+	struct msghdr m = *msgh;
+	int valid = 0;
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		const struct io_uring_cqe *cqe = cqes[i];
+		unsigned long bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		long res = cqe->res;
+		int ok;
+
+		ok = (cqe->flags & IORING_CQE_F_BUFFER) && res >= skip;
+		payload[i] = ok ? base + bid * buf_size + skip : NULL;
+		payload_len[i] = ok ? res - skip : 0;
+		valid += ok;
+	}
+
+	if (!name && !namelen && !flags && !gro_size && !tstamp)
+		return valid;
+
+	for (i = 0; i < nr; i++) {
+		struct io_uring_recvmsg_out *o;
+
+		if (!payload[i]) {
+			if (name)
+				name[i] = NULL;
+			if (namelen)
+				namelen[i] = 0;
+			if (flags)
+				flags[i] = 0;
+			if (gro_size)
+				gro_size[i] = 0;
+			if (tstamp)
+				tstamp[i] = 0;
+			continue;
+		}
+
+		o = (struct io_uring_recvmsg_out *) ((unsigned char *) payload[i] - skip);
+		if (name)
+			name[i] = io_uring_recvmsg_name(o);
+		if (namelen)
+			namelen[i] = o->namelen;
+		if (flags)
+			flags[i] = o->flags;
+		if (cmsgs)
+			parse_cmsgs(o, &m, gro_size ? &gro_size[i] : NULL,
+				    tstamp ? &tstamp[i] : NULL);
+		else {
+			if (gro_size)
+				gro_size[i] = 0;
+			if (tstamp)
+				tstamp[i] = 0;
+		}
+	}
+
+	return valid;
+}
@@ -0,0 +1,326 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Description: test the C++20 coroutine layer in liburing/coro.hpp
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+
+#include "liburing.h"
+#include "liburing/coro.hpp"
+#include "helpers.h"
+
+using namespace std::chrono_literals;
+
+static unsigned long nr_allocs;
+
+/* out of line, or gcc pairs the inlined free() with the builtin new */
+__attribute__((noinline))
+void *operator new(std::size_t size)
+{
+	void *p;
+
+	nr_allocs++;
+	p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+__attribute__((noinline))
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline))
+void operator delete(void *p, std::size_t) noexcept
+{
+	free(p);
+}
+
+static liburing::task<int> nop_sum(liburing::ring &r, int n)
+{
+	int i, sum = 0;
+
+	for (i = 0; i < n; i++)
+		sum += co_await liburing::nop(r);
+	co_return sum + n;
+}
+
+static liburing::task<int> nested(liburing::ring &r)
+{
+	int a = co_await nop_sum(r, 4);
+	int b = co_await nop_sum(r, 8);
+
+	co_return a + b;
+}
+
+static int test_nested(void)
+{
+	liburing::ring r(8);
+	int ret;
+
+	ret = liburing::sync_wait(r, nested(r));
+	if (ret != 12) {
+		fprintf(stderr, "nested tasks returned %d\n", ret);
+		return T_EXIT_FAIL;
+	}
+	if (r.inflight()) {
+		fprintf(stderr, "%u requests left in flight\n", r.inflight());
+		return T_EXIT_FAIL;
+	}
+	return T_EXIT_PASS;
+}
+
+static liburing::task<> nop_loop(liburing::ring &r, int n, int *done)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (co_await liburing::nop(r) < 0)
+			co_return;
+	}
+	(*done)++;
+}
+
+/* more coroutines than SQ entries, get_sqe() has to submit on its own */
+static int test_sq_full(void)
+{
+	liburing::ring r(4);
+	int i, done = 0;
+
+	for (i = 0; i < 32; i++)
+		liburing::spawn(nop_loop(r, 100, &done));
+	if (r.run()) {
+		fprintf(stderr, "run failed\n");
+		return T_EXIT_FAIL;
+	}
+	if (done != 32) {
+		fprintf(stderr, "%d of 32 coroutines finished\n", done);
+		return T_EXIT_FAIL;
+	}
+	return T_EXIT_PASS;
+}
+
+static liburing::task<> pipe_reader(liburing::ring &r, int fd, char *buf,
+				    int *res)
+{
+	*res = co_await liburing::read(r, fd, buf, 16, 0);
+}
+
+static liburing::task<> pipe_writer(liburing::ring &r, int fd, int *res)
+{
+	/* let the reader block on the empty pipe first */
+	co_await liburing::nop(r);
+	*res = co_await liburing::write(r, fd, "hello", 5, 0);
+}
+
+static int test_pipe(void)
+{
+	liburing::ring r(8);
+	int fds[2], rres = 0, wres = 0;
+	char buf[16] = { };
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return T_EXIT_FAIL;
+	}
+	liburing::spawn(pipe_reader(r, fds[0], buf, &rres));
+	liburing::spawn(pipe_writer(r, fds[1], &wres));
+	if (r.run()) {
+		fprintf(stderr, "run failed\n");
+		return T_EXIT_FAIL;
+	}
+	close(fds[0]);
+	close(fds[1]);
+	if (wres != 5 || rres != 5 || memcmp(buf, "hello", 5)) {
+		fprintf(stderr, "pipe read %d, write %d\n", rres, wres);
+		return T_EXIT_FAIL;
+	}
+	return T_EXIT_PASS;
+}
+
+static liburing::task<> cancel_reader(liburing::ring &r, int fd,
+				      liburing::cancel_token &t, int *res)
+{
+	char buf[16];
+
+	*res = co_await liburing::read(r, fd, buf, sizeof(buf), 0)
+			.with_cancel(t);
+}
+
+static liburing::task<> canceler(liburing::ring &r, liburing::cancel_token &t,
+				 bool *was_pending)
+{
+	co_await liburing::nop(r);
+	*was_pending = t.pending();
+	t.cancel();
+}
+
+static int test_cancel(void)
+{
+	liburing::ring r(8);
+	liburing::cancel_token t;
+	bool was_pending = false;
+	int fds[2], res = 0;
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return T_EXIT_FAIL;
+	}
+	liburing::spawn(cancel_reader(r, fds[0], t, &res));
+	liburing::spawn(canceler(r, t, &was_pending));
+	if (r.run()) {
+		fprintf(stderr, "run failed\n");
+		return T_EXIT_FAIL;
+	}
+	close(fds[0]);
+	close(fds[1]);
+	if (!was_pending || t.pending()) {
+		fprintf(stderr, "token pending %d before, %d after\n",
+			was_pending, t.pending());
+		return T_EXIT_FAIL;
+	}
+	if (res != -ECANCELED && res != -EINTR) {
+		fprintf(stderr, "cancelled read returned %d\n", res);
+		return T_EXIT_FAIL;
+	}
+	/* nothing to cancel any more, must be a no-op */
+	t.cancel();
+	return T_EXIT_PASS;
+}
+
+static liburing::task<int> wait_timeout(liburing::ring &r)
+{
+	co_return co_await liburing::timeout(r, 1ms);
+}
+
+static int test_timeout(void)
+{
+	liburing::ring r(8);
+	int ret;
+
+	ret = liburing::sync_wait(r, wait_timeout(r));
+	if (ret != -ETIME) {
+		fprintf(stderr, "timeout returned %d\n", ret);
+		return T_EXIT_FAIL;
+	}
+	return T_EXIT_PASS;
+}
+
+static liburing::task<int> thrower(liburing::ring &r)
+{
+	co_await liburing::nop(r);
+	throw std::runtime_error("expected");
+}
+
+static liburing::task<int> catcher(liburing::ring &r)
+{
+	try {
+		co_await thrower(r);
+	} catch (const std::runtime_error &) {
+		co_return 1;
+	}
+	co_return 0;
+}
+
+static int test_exceptions(void)
+{
+	liburing::ring r(8);
+
+	if (liburing::sync_wait(r, catcher(r)) != 1) {
+		fprintf(stderr, "exception not seen by awaiting task\n");
+		return T_EXIT_FAIL;
+	}
+	try {
+		liburing::sync_wait(r, thrower(r));
+		fprintf(stderr, "exception not rethrown by sync_wait\n");
+		return T_EXIT_FAIL;
+	} catch (const std::runtime_error &) {
+	}
+
+	try {
+		liburing::ring bad(0);
+		fprintf(stderr, "ring with 0 entries set up\n");
+		return T_EXIT_FAIL;
+	} catch (const std::system_error &e) {
+		if (e.code().value() != EINVAL) {
+			fprintf(stderr, "ring setup failed with %d\n",
+				e.code().value());
+			return T_EXIT_FAIL;
+		}
+	}
+	return T_EXIT_PASS;
+}
+
+static liburing::task<unsigned long> count_allocs(liburing::ring &r, int n)
+{
+	unsigned long before;
+	int i;
+
+	before = nr_allocs;
+	for (i = 0; i < n; i++) {
+		co_await liburing::nop(r);
+		co_await liburing::timeout(r, 1us);
+	}
+	co_return nr_allocs - before;
+}
+
+/* awaiting a request must not allocate, only starting a task does */
+static int test_no_alloc(void)
+{
+	liburing::ring r(8);
+	unsigned long allocs;
+
+	allocs = liburing::sync_wait(r, count_allocs(r, 64));
+	if (allocs) {
+		fprintf(stderr, "%lu allocations for 128 requests\n", allocs);
+		return T_EXIT_FAIL;
+	}
+	return T_EXIT_PASS;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		return T_EXIT_SKIP;
+
+	if (test_nested()) {
+		fprintf(stderr, "test_nested failed\n");
+		return T_EXIT_FAIL;
+	}
+	if (test_sq_full()) {
+		fprintf(stderr, "test_sq_full failed\n");
+		return T_EXIT_FAIL;
+	}
+	if (test_pipe()) {
+		fprintf(stderr, "test_pipe failed\n");
+		return T_EXIT_FAIL;
+	}
+	if (test_cancel()) {
+		fprintf(stderr, "test_cancel failed\n");
+		return T_EXIT_FAIL;
+	}
+	if (test_timeout()) {
+		fprintf(stderr, "test_timeout failed\n");
+		return T_EXIT_FAIL;
+	}
+	if (test_exceptions()) {
+		fprintf(stderr, "test_exceptions failed\n");
+		return T_EXIT_FAIL;
+	}
+	if (test_no_alloc()) {
+		fprintf(stderr, "test_no_alloc failed\n");
+		return T_EXIT_FAIL;
+	}
+	return T_EXIT_PASS;
+}
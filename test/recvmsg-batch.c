@@ -0,0 +1,260 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Description: test io_uring_recvmsg_parse_batch() against the per-CQE
+ *		io_uring_recvmsg_* helpers, for recvmsg multishot on a UDP
+ *		socket with timestamps and UDP GRO enabled. Also check that
+ *		CQEs without a buffer, or too short for the headers, are
+ *		flagged as invalid.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include "liburing.h"
+#include "helpers.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP		17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO		104
+#endif
+
+#define BGID		7
+#define NR_BUFS		16
+#define BUF_SIZE	2048
+#define NR_PLAIN	6
+#define GSO_SEG		100
+#define GSO_NR		4
+#define NR_INVALID	2
+#define MAX_CQES	(NR_PLAIN + 1 + NR_INVALID)
+
+static int send_gso(int fd, char fill)
+{
+	char buf[GSO_SEG * GSO_NR];
+	char control[CMSG_SPACE(sizeof(uint16_t))] = { };
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	uint16_t seg = GSO_SEG;
+
+	memset(buf, fill, sizeof(buf));
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(seg));
+	memcpy(CMSG_DATA(cmsg), &seg, sizeof(seg));
+	return sendmsg(fd, &msg, 0);
+}
+
+static int test(void)
+{
+	struct io_uring_cqe *cqes[MAX_CQES], fake[NR_INVALID] = { };
+	void *payload[MAX_CQES], *name[MAX_CQES], *p2[MAX_CQES];
+	unsigned int plen[MAX_CQES], namelen[MAX_CQES], flags[MAX_CQES];
+	unsigned int plen2[MAX_CQES];
+	int gro[MAX_CQES];
+	__u64 tstamp[MAX_CQES];
+	struct io_uring_recvmsg_batch batch = {
+		.payload = payload, .payload_len = plen, .name = name,
+		.namelen = namelen, .flags = flags, .gro_size = gro,
+		.tstamp = tstamp,
+	};
+	struct io_uring_recvmsg_batch min_batch = {
+		.payload = p2, .payload_len = plen2,
+	};
+	char control[CMSG_SPACE(sizeof(struct timespec)) +
+		     CMSG_SPACE(sizeof(int))];
+	struct io_uring_buf_ring *br;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct sockaddr_in sname;
+	struct msghdr msg = { };
+	struct io_uring ring;
+	int ret, i, fds[2], val = 1, nr_recv, nr, have_gso;
+	char *bufs, sbuf[64];
+
+	ret = io_uring_queue_init(16, &ring, 0);
+	if (ret) {
+		fprintf(stderr, "queue_init: %d\n", ret);
+		return T_EXIT_FAIL;
+	}
+
+	bufs = t_malloc(NR_BUFS * BUF_SIZE);
+	br = io_uring_setup_buf_ring(&ring, NR_BUFS, BGID, 0, &ret);
+	if (!br) {
+		if (ret == -EINVAL)
+			return T_EXIT_SKIP;
+		fprintf(stderr, "setup_buf_ring: %d\n", ret);
+		return T_EXIT_FAIL;
+	}
+	for (i = 0; i < NR_BUFS; i++)
+		io_uring_buf_ring_add(br, bufs + i * BUF_SIZE, BUF_SIZE, i,
+				      io_uring_buf_ring_mask(NR_BUFS), i);
+	io_uring_buf_ring_advance(br, NR_BUFS);
+
+	ret = t_create_socket_pair(fds, false);
+	if (ret) {
+		fprintf(stderr, "socket_pair: %d\n", ret);
+		return T_EXIT_FAIL;
+	}
+	if (setsockopt(fds[0], SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(val))) {
+		perror("SO_TIMESTAMPNS");
+		return T_EXIT_FAIL;
+	}
+	have_gso = !setsockopt(fds[0], SOL_UDP, UDP_GRO, &val, sizeof(val));
+
+	msg.msg_name = &sname;
+	msg.msg_namelen = sizeof(sname);
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	sqe = io_uring_get_sqe(&ring);
+	io_uring_prep_recvmsg_multishot(sqe, fds[0], &msg, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BGID;
+	io_uring_submit(&ring);
+
+	for (i = 0; i < NR_PLAIN; i++) {
+		memset(sbuf, 'a' + i, sizeof(sbuf));
+		if (send(fds[1], sbuf, 16 + i, 0) != 16 + i) {
+			perror("send");
+			return T_EXIT_FAIL;
+		}
+	}
+	nr_recv = NR_PLAIN;
+	if (have_gso && send_gso(fds[1], 'z') == GSO_SEG * GSO_NR)
+		nr_recv++;
+	else
+		have_gso = 0;
+
+	ret = io_uring_wait_cqe_nr(&ring, &cqe, nr_recv);
+	if (ret) {
+		fprintf(stderr, "wait_cqe_nr: %d\n", ret);
+		return T_EXIT_FAIL;
+	}
+	nr = io_uring_peek_batch_cqe(&ring, cqes, nr_recv);
+	if (nr != nr_recv) {
+		fprintf(stderr, "got %d CQEs, wanted %d\n", nr, nr_recv);
+		return T_EXIT_FAIL;
+	}
+	if (cqes[0]->res == -EINVAL || cqes[0]->res == -EOPNOTSUPP)
+		return T_EXIT_SKIP;
+
+	/* one CQE without a buffer, one too short for the headers */
+	fake[0].res = 64;
+	fake[1].res = sizeof(struct io_uring_recvmsg_out);
+	fake[1].flags = IORING_CQE_F_BUFFER | (1 << IORING_CQE_BUFFER_SHIFT);
+	for (i = 0; i < NR_INVALID; i++)
+		cqes[nr++] = &fake[i];
+
+	ret = io_uring_recvmsg_parse_batch(cqes, nr, bufs, BUF_SIZE, &msg,
+					   &batch);
+	if (ret != nr_recv) {
+		fprintf(stderr, "parse_batch returned %d, wanted %d\n", ret,
+			nr_recv);
+		return T_EXIT_FAIL;
+	}
+	ret = io_uring_recvmsg_parse_batch(cqes, nr, bufs, BUF_SIZE, &msg,
+					   &min_batch);
+	if (ret != nr_recv) {
+		fprintf(stderr, "min parse_batch returned %d\n", ret);
+		return T_EXIT_FAIL;
+	}
+
+	for (i = 0; i < nr_recv; i++) {
+		struct io_uring_recvmsg_out *o;
+		int bid = cqes[i]->flags >> IORING_CQE_BUFFER_SHIFT;
+		int is_gso = i == NR_PLAIN;
+		int want_len = is_gso ? GSO_SEG * GSO_NR : 16 + i;
+		char fill = is_gso ? 'z' : 'a' + i;
+		char *p = payload[i];
+		int j;
+
+		if (cqes[i]->res < 0) {
+			fprintf(stderr, "cqe %d res %d\n", i, cqes[i]->res);
+			return T_EXIT_FAIL;
+		}
+		o = io_uring_recvmsg_validate(bufs + bid * BUF_SIZE,
+					      cqes[i]->res, &msg);
+		if (!o) {
+			fprintf(stderr, "cqe %d failed validate\n", i);
+			return T_EXIT_FAIL;
+		}
+		if (payload[i] != io_uring_recvmsg_payload(o, &msg) ||
+		    p2[i] != payload[i]) {
+			fprintf(stderr, "cqe %d payload mismatch\n", i);
+			return T_EXIT_FAIL;
+		}
+		if (plen[i] != io_uring_recvmsg_payload_length(o, cqes[i]->res, &msg) ||
+		    plen2[i] != plen[i] || plen[i] != want_len) {
+			fprintf(stderr, "cqe %d length %u, wanted %d\n", i,
+				plen[i], want_len);
+			return T_EXIT_FAIL;
+		}
+		for (j = 0; j < want_len; j++) {
+			if (p[j] != fill) {
+				fprintf(stderr, "cqe %d bad data at %d\n", i, j);
+				return T_EXIT_FAIL;
+			}
+		}
+		if (name[i] != io_uring_recvmsg_name(o) ||
+		    namelen[i] != sizeof(struct sockaddr_in) ||
+		    flags[i] != o->flags) {
+			fprintf(stderr, "cqe %d name/flags mismatch\n", i);
+			return T_EXIT_FAIL;
+		}
+		if (!tstamp[i]) {
+			fprintf(stderr, "cqe %d no timestamp\n", i);
+			return T_EXIT_FAIL;
+		}
+		if (gro[i] != (is_gso ? GSO_SEG : 0)) {
+			fprintf(stderr, "cqe %d gro size %d\n", i, gro[i]);
+			return T_EXIT_FAIL;
+		}
+	}
+
+	for (i = nr_recv; i < nr; i++) {
+		if (payload[i] || plen[i] || name[i] || namelen[i] ||
+		    flags[i] || gro[i] || tstamp[i] || p2[i] || plen2[i]) {
+			fprintf(stderr, "invalid cqe %d not cleared\n", i);
+			return T_EXIT_FAIL;
+		}
+	}
+
+	io_uring_cq_advance(&ring, nr_recv);
+	close(fds[0]);
+	close(fds[1]);
+	io_uring_queue_exit(&ring);
+	free(bufs);
+	return T_EXIT_PASS;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc > 1)
+		return T_EXIT_SKIP;
+
+	ret = test();
+	if (ret == T_EXIT_SKIP)
+		return T_EXIT_SKIP;
+	if (ret) {
+		fprintf(stderr, "test failed\n");
+		return T_EXIT_FAIL;
+	}
+	return T_EXIT_PASS;
+}